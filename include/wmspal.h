@@ -5,6 +5,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+// Long-lived library state shared by every call that carries it (see context.c)
+typedef struct wmspal_context_s wmspal_context_t;
+
+// Batch pipeline stages: fetch, decode, vectorize, attribute, write
+#define BATCH_STAGE_COUNT 5
+
+// Class-image prefilter run between classification and labelling (all 0 = off)
+typedef struct {
+    int mode_passes;    // 3x3 majority passes
+    int open_radius;    // Remove classes narrower than 2r+1 pixels, filling from their surroundings
+    int close_radius;   // Fill unclassified gaps narrower than 2r+1 pixels
+    int min_region;     // Merge components smaller than this into their dominant neighbour
+} denoise_options_t;
 
 typedef struct {
     char* url;
@@ -21,19 +36,54 @@ typedef struct {
     bool attribution;
     bool capabilities;
     bool raw_xml;
+    int tile_cols;      // Tile grid for mosaic runs (0 or 1 = single request)
+    int tile_rows;
+    char* mvt_output;   // Vector tile directory or .mbtiles file instead of GeoJSON
+    int min_zoom;       // Vector tile zoom range, -1 = derive from resolution
+    int max_zoom;
+    char* info_format;      // GetFeatureInfo INFO_FORMAT (text/plain by default)
+    char* dictionary_file;  // Term-to-lithology dictionary for classifying responses
+    wmspal_context_t* context;  // Pooled connections and handles; NULL sets up per call
+    char* batch_manifest;   // One job per line, run through the staged pipeline
+    int stage_workers[BATCH_STAGE_COUNT];   // 0 = stage default
+    int queue_depth;        // Per-stage queue bound, 0 = twice the stage's workers
+    bool serve;             // Resident daemon accepting jobs over HTTP
+    char* listen;           // "host:port" or "unix:/path" (default 127.0.0.1:8080)
+    int serve_workers;      // Daemon job workers, 0 = default
+    char* jobs_dir;         // Daemon job outputs are written here (default: current directory)
+    int cache_ttl;          // Response cache lifetime in seconds, -1 = context default
+    double resolution;      // Target ground resolution in SRS units per pixel; plans the tile grid
+    int tile_overlap;       // Extra pixels fetched around each tile and cropped before vectorizing
+    char* out_srs;          // Reproject vector output to this SRS (needs PROJ)
+    char* metrics_file;     // JSON summary of stage timings and counters
+    char* prometheus_file;  // The same in Prometheus text format
+    char* trace_file;       // Chrome trace-event timeline
+    char* incremental_dir;  // Run manifest and tile state for reprocessing only changed tiles
+    bool make_valid;        // Repair and dissolve output geometry with GEOS
+    int geometry_threads;   // Workers for make_valid, 0 = one per online CPU
+    denoise_options_t denoise;  // Prefilter for antialiasing, label and hatching speckle
+    char* legend;           // Colour-to-class mapping file, or "wms" for the layer's GetLegendGraphic
+    int adaptive_levels;    // Quadtree levels below the tile grid, refined only where classes meet
+    bool wmts;              // Mosaic cached WMTS tiles instead of GetMap (implied by a URL naming WMTS)
+    char* stack_layers;     // Comma-separated layers vectorized together on one grid
+    char* scratch_dir;      // Backing files for large rasters, NULL to keep them on the heap
+    char* time;             // TIME of GetMap and GetFeatureInfo requests
+    char* time_sweep;       // "all" or "START/END": vectorize each TIME step as changes to the previous
 } wms_config_t;
 
+typedef struct {
+    unsigned char r, g, b;
+} color_t;
+
 typedef struct {
     unsigned char* data;
     int width;
     int height;
     int channels;
+    color_t* palette;   // Indexed images (channels == 1): the colour of each index, else NULL
+    int palette_size;
 } image_t;
 
-typedef struct {
-    unsigned char r, g, b;
-} color_t;
-
 typedef struct {
     double x, y;
 } coord_t;
@@ -44,6 +94,12 @@ typedef struct {
     int capacity;
 } polygon_t;
 
+// One scalar column parsed from a GetFeatureInfo response
+typedef struct {
+    char* name;
+    char* value;
+} attribute_t;
+
 typedef struct {
     color_t dominant_color;
     polygon_t* polygons;
@@ -52,8 +108,28 @@ typedef struct {
     char* geological_unit;
     char* age;
     char* lithology;
+    attribute_t* attributes;
+    int attribute_count;
+    coord_t info_point;     // Where feature_info was queried
+    int class_id;           // Index into the colours vectorize_classes was given
 } geological_feature_t;
 
+#define CLASS_NONE 0xFFFF
+
+// Per-pixel colour class indices (CLASS_NONE where no class matched)
+typedef struct {
+    unsigned short* data;
+    int width;
+    int height;
+} class_image_t;
+
+// One 4-connected component and its outer boundary in pixel corner coordinates
+typedef struct {
+    unsigned short class_id;
+    int pixel_count;
+    polygon_t ring;
+} region_t;
+
 typedef struct {
     geological_feature_t* features;
     int feature_count;
@@ -61,24 +137,209 @@ typedef struct {
     char* crs;
 } vectorization_result_t;
 
+// Fixed symbology: legend colours mapped to classes through a dense RGB lookup table
+#define LEGEND_LUT_BITS 6   // Per channel, so the table has 2^18 entries
+
+typedef struct {
+    color_t color;
+    char* label;
+    attribute_t* attributes;    // Further columns from the mapping file
+    int attribute_count;
+} legend_entry_t;
+
+typedef struct {
+    legend_entry_t* entries;
+    color_t* colors;            // Entry colours, as vectorize_classes takes them
+    int count;
+    unsigned short* lut;        // Quantized RGB -> entry index, CLASS_NONE where no entry is close
+} legend_t;
+
+legend_t* legend_load(const wms_config_t* config);
+legend_t* legend_load_file(const char* path);
+legend_t* legend_parse_json(const char* body, size_t size);
+void legend_free(legend_t* legend);
+class_image_t* classify_with_legend(const image_t* img, const legend_t* legend);
+unsigned short legend_class_of(const legend_t* legend, color_t color);
+int legend_attribute_features(vectorization_result_t* result, const legend_t* legend);
+
+// Library entry points. A context is created once, before any worker threads,
+// and may then be shared by concurrent calls until it is freed.
+wmspal_context_t* wmspal_context_create(void);
+void wmspal_context_free(wmspal_context_t* context);
+void wmspal_context_set_cache_ttl(wmspal_context_t* context, double seconds);
+int wmspal_run(const wms_config_t* config);
+int run_batch(const wms_config_t* config);
+int run_server(const wms_config_t* config);
+int parse_stage_workers(const char* spec, int* workers);
+
+// Instrumentation is off until enabled, which must happen before any worker threads start
+void wmspal_metrics_enable(bool trace);
+int wmspal_metrics_write(const char* json_file, const char* prometheus_file, const char* trace_file);
+
+// Map large rasters from unlinked files in dir instead of the heap; also before any worker threads start
+void wmspal_scratch_enable(const char* dir);
+
 int download_wms_tile(const wms_config_t* config);
+bool is_wmts_endpoint(const wms_config_t* config);
+int download_wmts_mosaic(wms_config_t* config, char* bbox, size_t bbox_size);
 int get_wms_capabilities(const wms_config_t* config);
-int georeference_image(const char* input_file, const char* output_file, const char* bbox, const char* srs);
-int vectorize_image(const char* input_file, const char* output_file);
+int georeference_image(wmspal_context_t* context, const char* input_file, const char* output_file,
+                       const char* bbox, const char* srs);
+int reproject_result(wmspal_context_t* context, vectorization_result_t* result, const char* target_srs);
+int postprocess_result(wmspal_context_t* context, vectorization_result_t* result, int threads);
+int vectorize_image(wmspal_context_t* context, const char* input_file, const char* output_file);
 int vectorize_geological_map(const char* input_file, const char* output_file, const wms_config_t* config);
 int apply_attribution(const char* vector_file, const wms_config_t* config);
 
 // Enhanced vectorization functions
-vectorization_result_t* analyze_geological_colors(const char* image_file, const char* bbox, const char* srs);
+vectorization_result_t* analyze_geological_colors(const char* image_file, const char* bbox, const char* srs,
+                                                  const denoise_options_t* denoise, const legend_t* legend);
+vectorization_result_t* vectorize_raster(const image_t* img, double minx, double miny, double maxx, double maxy,
+                                         const char* srs, const denoise_options_t* denoise, const legend_t* legend);
+vectorization_result_t* vectorize_classes(const class_image_t* classes, const color_t* colors, int color_count,
+                                          double minx, double miny, double maxx, double maxy, const char* srs);
+int attribute_features(vectorization_result_t* result, const wms_config_t* config);
+bool attribution_requested(const wms_config_t* config);
 int get_feature_info_at_point(const wms_config_t* config, double x, double y, char** result);
+int get_feature_info_response(const wms_config_t* config, double x, double y, char** result, size_t* size);
 int write_geojson(const vectorization_result_t* result, const char* output_file);
+int write_vector_output(vectorization_result_t* result, const char* output_file, const wms_config_t* config);
+int write_mvt_pyramid(const vectorization_result_t* result, const char* output, const char* layer_name,
+                      int min_zoom, int max_zoom);
+int mvt_auto_max_zoom(const vectorization_result_t* result, int width);
 void free_vectorization_result(vectorization_result_t* result);
 
 // Image processing functions
 image_t* load_png_simple(const char* filename);
+image_t* decode_png(const unsigned char* data, size_t size);
+int write_png(const image_t* img, const char* filename);
 void free_image(image_t* img);
+image_t* crop_image(const image_t* img, int x, int y, int width, int height);
 int detect_edges_simple(image_t* img, unsigned char threshold);
 color_t* extract_unique_colors(image_t* img, int* color_count);
 polygon_t* trace_color_regions(image_t* img, color_t target_color, int* polygon_count);
+class_image_t* classify_image(const image_t* img, const color_t* colors, int color_count);
+class_image_t* classify_indexed_image(const image_t* img, const legend_t* legend, color_t** colors, int* color_count);
+class_image_t* classify_raster(const image_t* img, const legend_t* legend, color_t** colors, int* color_count);
+void free_class_image(class_image_t* classes);
+region_t* trace_regions(const class_image_t* classes, int min_pixels, int* region_count);
+void free_regions(region_t* regions, int region_count);
+int parse_denoise_options(const char* spec, denoise_options_t* options);
+bool denoise_enabled(const denoise_options_t* options);
+int denoise_class_image(class_image_t* classes, const denoise_options_t* options);
+
+// Polygon geometry helpers
+double polygon_area(const polygon_t* polygon);
+bool point_in_polygon(const polygon_t* polygon, double x, double y);
+coord_t polygon_interior_point(const polygon_t* polygon, const polygon_t* const* holes, int hole_count,
+                               double precision, double* clearance);
+
+// Open-addressing hash map from 64-bit keys to ints
+typedef struct {
+    uint64_t* keys;
+    int* values;
+    size_t capacity;   // Always a power of two
+    size_t count;
+} key_map_t;
+
+int key_map_init(key_map_t* map, size_t capacity);
+void key_map_destroy(key_map_t* map);
+void key_map_put(key_map_t* map, uint64_t key, int value);
+bool key_map_get(const key_map_t* map, uint64_t key, int* value);
+bool key_map_take(key_map_t* map, uint64_t key, int* value);
+
+// Pull tokenizer for JSON responses
+#define JSON_MAX_DEPTH 64
+
+typedef enum {
+    JSON_OBJECT_START,
+    JSON_OBJECT_END,
+    JSON_ARRAY_START,
+    JSON_ARRAY_END,
+    JSON_KEY,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL,
+    JSON_END,
+    JSON_ERROR
+} json_token_t;
+
+typedef struct {
+    const char* pos;
+    const char* end;
+    char* text;          // Decoded text of the last KEY, STRING or NUMBER token
+    size_t text_size;
+    size_t text_capacity;
+    int depth;
+    char stack[JSON_MAX_DEPTH];
+    bool expect_key;
+} json_reader_t;
+
+void json_reader_init(json_reader_t* reader, const char* data, size_t size);
+void json_reader_free(json_reader_t* reader);
+json_token_t json_next(json_reader_t* reader);
+int json_skip(json_reader_t* reader, json_token_t first);
+
+// GetFeatureInfo response parsing (JSON, GML and plain text)
+int parse_feature_info(const char* body, size_t size, const char* info_format,
+                       attribute_t** attributes, int* attribute_count);
+void free_attributes(attribute_t* attributes, int count);
+
+// Multi-keyword classifier compiled into a single automaton
+typedef struct keyword_matcher_s keyword_matcher_t;
+
+keyword_matcher_t* matcher_create(void);
+keyword_matcher_t* matcher_create_default(void);
+keyword_matcher_t* matcher_load_dictionary(const char* path);
+int matcher_add(keyword_matcher_t* matcher, const char* term, const char* label);
+int matcher_compile(keyword_matcher_t* matcher);
+int matcher_find(const keyword_matcher_t* matcher, const char* text, size_t length);
+const char* matcher_label(const keyword_matcher_t* matcher, int term);
+void matcher_free(keyword_matcher_t* matcher);
+
+// Seam-aware mosaic: dissolves same-class polygons across adjacent tiles
+typedef struct mosaic_s mosaic_t;
+
+mosaic_t* mosaic_create(double minx, double miny, double maxx, double maxy, const char* crs,
+                        int tile_cols, int tile_rows, int tile_width, int tile_height);
+int mosaic_add_tile(mosaic_t* mosaic, int col, int row, const vectorization_result_t* tile);
+vectorization_result_t* mosaic_finish(mosaic_t* mosaic);
+void mosaic_free(mosaic_t* mosaic);
+int tile_bbox(const wms_config_t* config, int col, int row, char* bbox, size_t bbox_size);
+int vectorize_tiled_map(const wms_config_t* config);
+int vectorize_adaptive_map(const wms_config_t* config);
+int vectorize_layer_stack(const wms_config_t* config);
+image_t* load_grid_raster(const char* const* files, int cols, int rows, int tile_width, int tile_height);
+int vectorize_time_sweep(const wms_config_t* config);
+
+// Layer limits and hints from GetCapabilities (0 or empty where not advertised)
+typedef struct {
+    bool found;
+    int max_width, max_height;      // Service MaxWidth/MaxHeight
+    char** crs;                     // Supported CRS, including those inherited from parent layers
+    int crs_count;
+    double min_scale, max_scale;    // Scale denominators the layer renders at
+    char* paletted_format;          // GetMap PNG format with a palette, e.g. "image/png; mode=8bit"
+    char* time_values;              // TIME dimension extent: values and start/end/period intervals
+} layer_capabilities_t;
+
+int fetch_layer_capabilities(const wms_config_t* config, layer_capabilities_t* capabilities);
+void free_layer_capabilities(layer_capabilities_t* capabilities);
+void choose_image_format(const wms_config_t* config, char* format, size_t format_size);
+int plan_tile_grid(wms_config_t* config, char* bbox, size_t bbox_size);
+
+// Per-tile pixel hashes, polygons and class attributions kept between runs
+typedef struct run_manifest_s run_manifest_t;
+
+run_manifest_t* run_manifest_open(const char* dir, const wms_config_t* config);
+void run_manifest_free(run_manifest_t* manifest);
+uint64_t image_hash(const image_t* img);
+vectorization_result_t* run_manifest_reuse_tile(run_manifest_t* manifest, int col, int row, uint64_t hash,
+                                                const char* srs);
+int run_manifest_store_tile(run_manifest_t* manifest, int col, int row, const vectorization_result_t* tile);
+int run_manifest_reuse_attributes(run_manifest_t* manifest, vectorization_result_t* result, const char* info_format);
+int run_manifest_save(run_manifest_t* manifest, const vectorization_result_t* result);
 
 #endif
\ No newline at end of file
@@ -1,33 +1,14 @@
-#include "../include/wmspal.h"
-#include <curl/curl.h>
+#include "metrics.h"
+#include <math.h>
 
-typedef struct {
-    char* data;
-    size_t size;
-} response_buffer_t;
-
-static size_t write_response_callback(void* contents, size_t size, size_t nmemb, response_buffer_t* buffer) {
-    size_t realsize = size * nmemb;
-    char* ptr = realloc(buffer->data, buffer->size + realsize + 1);
-    
-    if (ptr == NULL) {
-        printf("Not enough memory (realloc returned NULL)\n");
-        return 0;
-    }
-    
-    buffer->data = ptr;
-    memcpy(&(buffer->data[buffer->size]), contents, realsize);
-    buffer->size += realsize;
-    buffer->data[buffer->size] = 0;
-    
-    return realsize;
+int get_feature_info_at_point(const wms_config_t* config, double x, double y, char** result) {
+    return get_feature_info_response(config, x, y, result, NULL);
 }
 
-int get_feature_info_at_point(const wms_config_t* config, double x, double y, char** result) {
-    CURL* curl;
-    CURLcode res;
-    response_buffer_t response = {0};
-    
+// GetFeatureInfo is requested as if by GetMap: for a tile grid the query goes
+// to the tile holding the point, at the tile's own size, so it stays within
+// the server's MaxWidth/MaxHeight like the GetMap requests did
+int get_feature_info_response(const wms_config_t* config, double x, double y, char** result, size_t* size) {
     // Parse bbox to calculate pixel coordinates
     double minx, miny, maxx, maxy;
     if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
@@ -35,54 +16,345 @@ int get_feature_info_at_point(const wms_config_t* config, double x, double y, ch
         return 1;
     }
     
+    const char* bbox = config->bbox;
+    char tile[256];
+    if (config->tile_cols * config->tile_rows > 1) {
+        int col = (int)((x - minx) / (maxx - minx) * config->tile_cols);
+        int row = (int)((maxy - y) / (maxy - miny) * config->tile_rows);
+        col = col < 0 ? 0 : col >= config->tile_cols ? config->tile_cols - 1 : col;
+        row = row < 0 ? 0 : row >= config->tile_rows ? config->tile_rows - 1 : row;
+        if (tile_bbox(config, col, row, tile, sizeof(tile)) != 0 ||
+            sscanf(tile, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
+            return 1;
+        }
+        bbox = tile;
+    }
+    
     // Convert geographic coordinates to pixel coordinates
     int pixel_x = (int)((x - minx) / (maxx - minx) * config->width);
     int pixel_y = (int)((maxy - y) / (maxy - miny) * config->height);
     
-    // Build GetFeatureInfo URL
+    // Build GetFeatureInfo URL; formats such as "text/xml; subtype=gml/3.1.1" need escaping
+    char info_format[256];
+    url_escape(config->info_format ? config->info_format : "text/plain", info_format, sizeof(info_format));
     char url[2048];
     snprintf(url, sizeof(url), 
         "%s?SERVICE=WMS&VERSION=1.1.1&REQUEST=GetFeatureInfo&LAYERS=%s&STYLES=&"
         "BBOX=%s&SRS=%s&WIDTH=%d&HEIGHT=%d&FORMAT=image/png&"
-        "QUERY_LAYERS=%s&INFO_FORMAT=text/plain&X=%d&Y=%d",
-        config->url, config->layer, config->bbox, config->srs, 
-        config->width, config->height, config->layer, pixel_x, pixel_y);
+        "QUERY_LAYERS=%s&INFO_FORMAT=%s&X=%d&Y=%d",
+        config->url, config->layer, bbox, config->srs, 
+        config->width, config->height, config->layer, info_format, pixel_x, pixel_y);
+    if (config->time) {
+        char time[256];
+        url_escape(config->time, time, sizeof(time));
+        size_t used = strlen(url);
+        snprintf(url + used, sizeof(url) - used, "&TIME=%s", time);
+    }
     
-    curl = curl_easy_init();
-    if (!curl) {
-        fprintf(stderr, "Failed to initialize curl for GetFeatureInfo\n");
+    printf("GetFeatureInfo query: (%.6f, %.6f) -> pixel (%d, %d)\n", x, y, pixel_x, pixel_y);
+    metrics_add(METRIC_FEATURE_INFO_QUERIES, 1);
+    size_t response_size = 0;
+    if (wms_http_get(config->context, url, result, &response_size) != 0) {
+        fprintf(stderr, "GetFeatureInfo request failed\n");
         return 1;
     }
+    if (size) *size = response_size;
     
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "WMSPal/1.0");
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    return 0;
+}
+
+#define MAX_SAMPLES_PER_CLASS 5   // Upper bound on queries spent resolving one colour class
+#define CANDIDATES_PER_CLASS 8    // Largest polygons considered as sample sites
+#define MAX_HOLES_PER_SITE 8      // Enclosed regions a sample site is moved out of
+
+// Classify one response: attribute values when the response was structured,
+// otherwise the raw text. The dictionary term listed first wins.
+static const char* classify_feature_info(const keyword_matcher_t* matcher, const char* info, size_t size,
+                                         const attribute_t* attributes, int attribute_count) {
+    int best = -1;
+    if (attribute_count == 0) {
+        best = matcher_find(matcher, info, size);
+    }
+    for (int i = 0; i < attribute_count; i++) {
+        int term = matcher_find(matcher, attributes[i].value, strlen(attributes[i].value));
+        if (term >= 0 && (best < 0 || term < best)) best = term;
+    }
+    return matcher_label(matcher, best);
+}
+
+typedef struct {
+    int polygon;
+    double area;
+    coord_t point;
+    double clearance;
+} sample_site_t;
+
+// Bounds and area of every polygon in the result, computed once so that hole
+// searches reject most polygons without touching their vertices
+typedef struct {
+    const polygon_t* polygon;
+    double minx, miny, maxx, maxy;
+    double area;
+} polygon_extent_t;
+
+typedef struct {
+    char* info;
+    const char* lithology;
+    attribute_t* attributes;
+    int attribute_count;
+    coord_t point;
+} sample_t;
+
+// Per-feature identifiers differ between polygons of the same unit
+static bool is_identifier(const char* name) {
+    size_t len = strlen(name);
+    return strcasecmp(name, "fid") == 0 || strcasecmp(name, "id") == 0 || strcasecmp(name, "objectid") == 0 ||
+           strcasecmp(name, "gml_id") == 0 || strcasecmp(name, "ogc_fid") == 0 ||
+           (len > 3 && strcasecmp(name + len - 3, "_id") == 0);
+}
+
+static bool attributes_agree(const sample_t* a, const sample_t* b) {
+    if (a->attribute_count != b->attribute_count) return false;
+    for (int i = 0; i < a->attribute_count; i++) {
+        if (is_identifier(a->attributes[i].name)) continue;
+        if (strcmp(a->attributes[i].name, b->attributes[i].name) != 0 ||
+            strcmp(a->attributes[i].value, b->attributes[i].value) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Two answers agree when they classify the same; unclassified answers agree
+// when their columns match (identifiers aside), or their text when unstructured
+static bool samples_agree(const sample_t* a, const sample_t* b) {
+    if (a->lithology || b->lithology) return a->lithology == b->lithology;
+    if (a->attribute_count > 0 || b->attribute_count > 0) return attributes_agree(a, b);
+    return strcmp(a->info, b->info) == 0;
+}
+
+static polygon_extent_t* polygon_extents(const vectorization_result_t* result, int* count) {
+    int total = 0;
+    for (int f = 0; f < result->feature_count; f++) total += result->features[f].polygon_count;
+    polygon_extent_t* extents = malloc((total ? total : 1) * sizeof(polygon_extent_t));
+    *count = 0;
+    if (!extents) return NULL;
     
-    printf("GetFeatureInfo query: (%.6f, %.6f) -> pixel (%d, %d)\n", x, y, pixel_x, pixel_y);
-    res = curl_easy_perform(curl);
+    for (int f = 0; f < result->feature_count; f++) {
+        for (int p = 0; p < result->features[f].polygon_count; p++) {
+            const polygon_t* polygon = &result->features[f].polygons[p];
+            if (polygon->count == 0) continue;
+            polygon_extent_t* extent = &extents[(*count)++];
+            extent->polygon = polygon;
+            extent->minx = extent->maxx = polygon->coords[0].x;
+            extent->miny = extent->maxy = polygon->coords[0].y;
+            for (int k = 1; k < polygon->count; k++) {
+                extent->minx = fmin(extent->minx, polygon->coords[k].x);
+                extent->maxx = fmax(extent->maxx, polygon->coords[k].x);
+                extent->miny = fmin(extent->miny, polygon->coords[k].y);
+                extent->maxy = fmax(extent->maxy, polygon->coords[k].y);
+            }
+            extent->area = polygon_area(polygon);
+        }
+    }
+    return extents;
+}
+
+// The largest polygon other than `self` that contains the point and is smaller
+// than `area`. Polygons are outer rings only, so that is the region the point
+// falls in when it lies in a hole of `self`.
+static const polygon_t* enclosing_polygon(const polygon_extent_t* extents, int extent_count, const polygon_t* self,
+                                          double area, coord_t point) {
+    const polygon_t* best = NULL;
+    double best_area = 0;
+    for (int i = 0; i < extent_count; i++) {
+        const polygon_extent_t* extent = &extents[i];
+        if (extent->area >= area || extent->area <= best_area || extent->polygon == self ||
+            point.x < extent->minx || point.x > extent->maxx || point.y < extent->miny || point.y > extent->maxy) {
+            continue;
+        }
+        if (point_in_polygon(extent->polygon, point.x, point.y)) {
+            best = extent->polygon;
+            best_area = extent->area;
+        }
+    }
+    return best;
+}
+
+static int pick_sample_sites(const polygon_extent_t* extents, int extent_count, const geological_feature_t* feature,
+                             double pixel_size, sample_site_t* sites) {
+    // Keep the largest polygons, ordered by area
+    int count = 0;
+    for (int p = 0; p < feature->polygon_count; p++) {
+        double area = polygon_area(&feature->polygons[p]);
+        int pos = count < CANDIDATES_PER_CLASS ? count++ : CANDIDATES_PER_CLASS;
+        while (pos > 0 && sites[pos - 1].area < area) {
+            if (pos < CANDIDATES_PER_CLASS) sites[pos] = sites[pos - 1];
+            pos--;
+        }
+        if (pos < CANDIDATES_PER_CLASS) {
+            sites[pos].polygon = p;
+            sites[pos].area = area;
+        }
+    }
     
-    if (res != CURLE_OK) {
-        fprintf(stderr, "GetFeatureInfo request failed: %s\n", curl_easy_strerror(res));
-        curl_easy_cleanup(curl);
-        if (response.data) free(response.data);
-        return 1;
+    // Sample at interior points that are at least half a pixel away from the outline.
+    // A point that lands in an enclosed region (the hole of a ring-shaped unit)
+    // is searched again with that region as a hole.
+    int usable = 0;
+    for (int i = 0; i < count; i++) {
+        sample_site_t site = sites[i];
+        const polygon_t* polygon = &feature->polygons[site.polygon];
+        const polygon_t* holes[MAX_HOLES_PER_SITE];
+        int hole_count = 0;
+        for (;;) {
+            site.point = polygon_interior_point(polygon, holes, hole_count, pixel_size / 2.0, &site.clearance);
+            if (site.clearance < pixel_size / 2.0) break;
+            const polygon_t* hole = enclosing_polygon(extents, extent_count, polygon, site.area, site.point);
+            if (!hole) break;
+            if (hole_count == MAX_HOLES_PER_SITE) {
+                site.clearance = 0;
+                break;
+            }
+            holes[hole_count++] = hole;
+        }
+        if (site.clearance >= pixel_size / 2.0) sites[usable++] = site;
     }
     
-    long response_code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    // Most clearance first: those points are least sensitive to rounding to the server's pixel grid
+    for (int i = 1; i < usable; i++) {
+        sample_site_t site = sites[i];
+        int j = i;
+        while (j > 0 && sites[j - 1].clearance < site.clearance) {
+            sites[j] = sites[j - 1];
+            j--;
+        }
+        sites[j] = site;
+    }
+    return usable;
+}
+
+// Whether a job labels its features: always with a legend, whose labels cost
+// nothing, and with GetFeatureInfo for --attribution or --vectorize-enhanced
+bool attribution_requested(const wms_config_t* config) {
+    return config->legend || config->attribution || config->vectorize_enhanced;
+}
+
+// Resolve each colour class with as few GetFeatureInfo queries as possible.
+// Queries go to interior points (pole of inaccessibility) rather than vertex
+// averages. A class with one polygon is settled by one answer; otherwise a
+// second site must agree, and further sites are only queried on conflict,
+// until one answer holds a strict majority. With a legend, classes are
+// labelled from it and no query is sent at all.
+int attribute_features(vectorization_result_t* result, const wms_config_t* config) {
+    if (config->legend) {
+        legend_t* legend = context_acquire_legend(config->context, config);
+        if (!legend) return 1;
+        legend_attribute_features(result, legend);
+        context_release_legend(config->context, legend);
+        return 0;
+    }
     
-    if (response_code != 200) {
-        fprintf(stderr, "GetFeatureInfo HTTP error: %ld\n", response_code);
-        curl_easy_cleanup(curl);
-        if (response.data) free(response.data);
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
+        fprintf(stderr, "Invalid bbox format for GetFeatureInfo\n");
         return 1;
     }
+    // A tile grid is config->width by config->height pixels per tile
+    int cols = config->tile_cols > 1 ? config->tile_cols : 1;
+    int rows = config->tile_rows > 1 ? config->tile_rows : 1;
+    double pixel_size = fmax((maxx - minx) / ((double)config->width * cols),
+                             (maxy - miny) / ((double)config->height * rows));
+    int total_queries = 0, conflicts = 0, resolved = 0;
+    double started = metrics_begin();
     
-    *result = response.data;  // Transfer ownership
-    curl_easy_cleanup(curl);
+    // Compile the dictionary once for the whole run (once per context when there is one)
+    keyword_matcher_t* matcher = context_acquire_matcher(config->context, config->dictionary_file);
+    int extent_count = 0;
+    polygon_extent_t* extents = matcher ? polygon_extents(result, &extent_count) : NULL;
+    if (!extents) {
+        context_release_matcher(config->context, matcher);
+        metrics_end(METRIC_FEATURE_INFO, started);
+        return 1;
+    }
+    
+    for (int i = 0; i < result->feature_count; i++) {
+        geological_feature_t* feature = &result->features[i];
+        if (feature->polygon_count == 0 || feature->feature_info) continue;  // Empty or carried over
+        
+        sample_site_t sites[CANDIDATES_PER_CLASS];
+        int site_count = pick_sample_sites(extents, extent_count, feature, pixel_size, sites);
+        if (site_count == 0) {
+            printf("Feature %d: no polygon is wide enough to query reliably\n", i);
+            continue;
+        }
+        
+        int needed = site_count > 1 ? 2 : 1;
+        sample_t samples[MAX_SAMPLES_PER_CLASS];
+        int sample_count = 0, leader = -1, leader_votes = 0;
+        bool conflict = false;
+        
+        for (int s = 0; s < site_count && sample_count < MAX_SAMPLES_PER_CLASS; s++) {
+            char* feature_info = NULL;
+            size_t info_size = 0;
+            total_queries++;
+            if (get_feature_info_response(config, sites[s].point.x, sites[s].point.y, &feature_info, &info_size) != 0 ||
+                !feature_info) {
+                continue;
+            }
+            
+            sample_t* sample = &samples[sample_count++];
+            sample->info = feature_info;
+            parse_feature_info(feature_info, info_size, config->info_format,
+                               &sample->attributes, &sample->attribute_count);
+            sample->lithology = classify_feature_info(matcher, feature_info, info_size,
+                                                      sample->attributes, sample->attribute_count);
+            sample->point = sites[s].point;
+            
+            // Tally votes for the answer of every sample so far
+            leader = -1;
+            leader_votes = 0;
+            for (int a = 0; a < sample_count; a++) {
+                int votes = 0;
+                for (int b = 0; b < sample_count; b++) {
+                    if (samples_agree(&samples[a], &samples[b])) votes++;
+                }
+                if (votes > leader_votes) {
+                    leader = a;
+                    leader_votes = votes;
+                }
+            }
+            if (leader_votes < sample_count) conflict = true;
+            if (leader_votes >= needed && leader_votes * 2 > sample_count) break;
+        }
+        
+        if (leader < 0) continue;
+        if (conflict) conflicts++;
+        if (leader_votes >= needed && leader_votes * 2 > sample_count) resolved++;
+        
+        feature->feature_info = samples[leader].info;
+        feature->attributes = samples[leader].attributes;
+        feature->attribute_count = samples[leader].attribute_count;
+        feature->info_point = samples[leader].point;
+        samples[leader].info = NULL;
+        samples[leader].attributes = NULL;
+        if (samples[leader].lithology) feature->lithology = strdup(samples[leader].lithology);
+        for (int s = 0; s < sample_count; s++) {
+            free(samples[s].info);
+            free_attributes(samples[s].attributes, samples[s].attribute_count);
+        }
+        
+        printf("Feature %d: RGB(%d,%d,%d) at (%.6f, %.6f) -> %s (%d/%d samples agree)\n",
+               i, feature->dominant_color.r, feature->dominant_color.g, feature->dominant_color.b,
+               samples[leader].point.x, samples[leader].point.y,
+               feature->lithology ? feature->lithology : "Unknown", leader_votes, sample_count);
+    }
     
+    printf("GetFeatureInfo plan: %d queries for %d classes (%d resolved with confidence, %d conflicts)\n",
+           total_queries, result->feature_count, resolved, conflicts);
+    free(extents);
+    context_release_matcher(config->context, matcher);
+    metrics_end(METRIC_FEATURE_INFO, started);
     return 0;
 }
 
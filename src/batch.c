@@ -0,0 +1,457 @@
+#include "context.h"
+#include <ctype.h>
+
+// Batch mode: jobs from a manifest flow through a staged pipeline. Every stage
+// has its own workers and a bounded input queue; a full queue blocks the
+// upstream stage, so the number of jobs in memory never exceeds the sum of
+// queue depths and workers no matter how long the manifest is.
+
+#define DEFAULT_QUEUE_FACTOR 2    // Queue depth per consuming worker
+
+static const char* stage_names[BATCH_STAGE_COUNT] = {"fetch", "decode", "vectorize", "attribute", "write"};
+static const int default_workers[BATCH_STAGE_COUNT] = {4, 2, 2, 4, 1};
+
+typedef struct {
+    wms_config_t config;    // String fields point at the owned copies below
+    char* layer;
+    char* bbox;
+    char* srs;
+    char* format;
+    char* output_file;
+    char* mvt_output;
+    char* out_srs;
+    char georef_file[512];
+    image_t* image;
+    vectorization_result_t* result;
+    int line;
+    int failed_stage;       // -1 while the job is healthy
+} batch_job_t;
+
+typedef struct {
+    batch_job_t** items;
+    int capacity, head, count;
+    bool closed;
+    wmspal_mutex_t lock;
+    wmspal_cond_t not_empty, not_full;
+} job_queue_t;
+
+typedef struct batch_s batch_t;
+
+typedef struct {
+    const char* name;
+    int (*run)(batch_job_t* job);
+    int workers;
+    int active_workers;
+    job_queue_t input;
+    batch_t* batch;
+    int index;
+    wmspal_mutex_t lock;    // Guards the counters below
+    double busy;            // Seconds spent working
+    double stalled;         // Seconds blocked on a full downstream queue
+    int processed, failed;
+} batch_stage_t;
+
+struct batch_s {
+    batch_stage_t stages[BATCH_STAGE_COUNT];
+    wmspal_mutex_t lock;
+    int completed, failed;
+};
+
+static int queue_init(job_queue_t* queue, int capacity) {
+    memset(queue, 0, sizeof(job_queue_t));
+    wmspal_mutex_init(&queue->lock);
+    wmspal_cond_init(&queue->not_empty);
+    wmspal_cond_init(&queue->not_full);
+    queue->items = malloc(capacity * sizeof(batch_job_t*));
+    if (!queue->items) return 1;
+    queue->capacity = capacity;
+    return 0;
+}
+
+static void queue_destroy(job_queue_t* queue) {
+    wmspal_cond_destroy(&queue->not_full);
+    wmspal_cond_destroy(&queue->not_empty);
+    wmspal_mutex_destroy(&queue->lock);
+    free(queue->items);
+}
+
+// Blocks while the queue is full; returns the seconds spent waiting
+static double queue_push(job_queue_t* queue, batch_job_t* job) {
+    double waited = 0;
+    wmspal_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        double start = wmspal_now();
+        while (queue->count == queue->capacity) wmspal_cond_wait(&queue->not_full, &queue->lock);
+        waited = wmspal_now() - start;
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    wmspal_cond_signal(&queue->not_empty);
+    wmspal_mutex_unlock(&queue->lock);
+    return waited;
+}
+
+// Blocks until a job is available; NULL once the queue is closed and drained
+static batch_job_t* queue_pop(job_queue_t* queue) {
+    wmspal_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) wmspal_cond_wait(&queue->not_empty, &queue->lock);
+    batch_job_t* job = NULL;
+    if (queue->count > 0) {
+        job = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        wmspal_cond_signal(&queue->not_full);
+    }
+    wmspal_mutex_unlock(&queue->lock);
+    return job;
+}
+
+static void queue_close(job_queue_t* queue) {
+    wmspal_mutex_lock(&queue->lock);
+    queue->closed = true;
+    wmspal_cond_broadcast(&queue->not_empty);
+    wmspal_mutex_unlock(&queue->lock);
+}
+
+static void free_job(batch_job_t* job) {
+    if (!job) return;
+    free(job->layer);
+    free(job->bbox);
+    free(job->srs);
+    free(job->format);
+    free(job->output_file);
+    free(job->mvt_output);
+    free(job->out_srs);
+    free_image(job->image);
+    free_vectorization_result(job->result);
+    free(job);
+}
+
+// Stage bodies. A nonzero return marks the job failed; later stages pass it through.
+static int stage_fetch(batch_job_t* job) {
+    return download_wms_tile(&job->config);
+}
+
+static int stage_decode(batch_job_t* job) {
+    if (georeference_image(job->config.context, job->config.output_file, job->georef_file,
+                           job->config.bbox, job->config.srs) != 0) {
+        return 1;
+    }
+    job->image = load_png_simple(job->georef_file);
+    if (!job->image) {
+        fprintf(stderr, "Failed to load image: %s\n", job->georef_file);
+        return 1;
+    }
+    return 0;
+}
+
+static int stage_vectorize(batch_job_t* job) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(job->config.bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) return 1;
+    legend_t* legend = context_acquire_legend(job->config.context, &job->config);
+    if (job->config.legend && !legend) return 1;
+    job->result = vectorize_raster(job->image, minx, miny, maxx, maxy, job->config.srs, &job->config.denoise, legend);
+    context_release_legend(job->config.context, legend);
+    free_image(job->image);
+    job->image = NULL;
+    return job->result ? 0 : 1;
+}
+
+static int stage_attribute(batch_job_t* job) {
+    if (!attribution_requested(&job->config)) return 0;
+    return attribute_features(job->result, &job->config);
+}
+
+static int stage_write(batch_job_t* job) {
+    return write_vector_output(job->result, job->config.output_file, &job->config);
+}
+
+static void finish_job(batch_t* batch, batch_job_t* job) {
+    wmspal_mutex_lock(&batch->lock);
+    if (job->failed_stage >= 0) {
+        batch->failed++;
+        fprintf(stderr, "Batch job at line %d failed in %s stage\n", job->line, stage_names[job->failed_stage]);
+    } else {
+        batch->completed++;
+    }
+    wmspal_mutex_unlock(&batch->lock);
+    free_job(job);
+}
+
+static void* stage_worker(void* arg) {
+    batch_stage_t* stage = arg;
+    batch_t* batch = stage->batch;
+    batch_stage_t* next = stage->index + 1 < BATCH_STAGE_COUNT ? &batch->stages[stage->index + 1] : NULL;
+    batch_job_t* job;
+    
+    while ((job = queue_pop(&stage->input)) != NULL) {
+        double busy = 0;
+        bool ran = job->failed_stage < 0, failed = false;
+        if (ran) {
+            double start = wmspal_now();
+            if (stage->run(job) != 0) {
+                job->failed_stage = stage->index;
+                failed = true;
+            }
+            busy = wmspal_now() - start;
+        }
+        
+        double stalled = 0;
+        if (next) {
+            stalled = queue_push(&next->input, job);
+        } else {
+            finish_job(batch, job);
+        }
+        
+        wmspal_mutex_lock(&stage->lock);
+        stage->busy += busy;
+        stage->stalled += stalled;
+        if (ran) stage->processed++;
+        if (failed) stage->failed++;
+        wmspal_mutex_unlock(&stage->lock);
+    }
+    
+    // The last worker out closes the next stage's queue
+    wmspal_mutex_lock(&stage->lock);
+    bool last = --stage->active_workers == 0;
+    wmspal_mutex_unlock(&stage->lock);
+    if (last && next) queue_close(&next->input);
+    return NULL;
+}
+
+// "fetch=8,vectorize=4" -> per-stage worker counts; stages not named keep their value
+int parse_stage_workers(const char* spec, int* workers) {
+    const char* p = spec;
+    while (*p) {
+        const char* eq = strchr(p, '=');
+        if (!eq) return 1;
+        int stage = -1;
+        for (int i = 0; i < BATCH_STAGE_COUNT; i++) {
+            if (strlen(stage_names[i]) == (size_t)(eq - p) && strncmp(p, stage_names[i], eq - p) == 0) stage = i;
+        }
+        char* end;
+        long count = strtol(eq + 1, &end, 10);
+        if (stage < 0 || end == eq + 1 || count < 1 || count > 256) return 1;
+        workers[stage] = (int)count;
+        if (*end == ',') end++;
+        else if (*end != '\0') return 1;
+        p = end;
+    }
+    return 0;
+}
+
+static char* trim(char* text) {
+    while (isspace((unsigned char)*text)) text++;
+    char* end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) *--end = '\0';
+    return text;
+}
+
+// One job per line as whitespace-separated key=value pairs, e.g.
+//   layer=geology bbox=-3,50,-2,51 srs=EPSG:4326 size=512x512 output=out/sheet_01.png
+// Keys that are left out fall back to the command-line options.
+static batch_job_t* parse_job(const wms_config_t* defaults, char* line, int line_number, int job_index) {
+    batch_job_t* job = calloc(1, sizeof(batch_job_t));
+    if (!job) return NULL;
+    job->config = *defaults;
+    job->line = line_number;
+    job->failed_stage = -1;
+    
+    char* p = line;
+    while (*p) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') break;
+        char* token = p;
+        while (*p && *p != ' ' && *p != '\t') p++;
+        if (*p) *p++ = '\0';
+        
+        char* value = strchr(token, '=');
+        if (!value) {
+            fprintf(stderr, "Manifest line %d: expected key=value, got '%s'\n", line_number, token);
+            free_job(job);
+            return NULL;
+        }
+        *value++ = '\0';
+        
+        if (strcmp(token, "layer") == 0) {
+            free(job->layer);
+            job->layer = strdup(value);
+        } else if (strcmp(token, "bbox") == 0) {
+            free(job->bbox);
+            job->bbox = strdup(value);
+        } else if (strcmp(token, "srs") == 0) {
+            free(job->srs);
+            job->srs = strdup(value);
+        } else if (strcmp(token, "format") == 0) {
+            free(job->format);
+            job->format = strdup(value);
+        } else if (strcmp(token, "output") == 0) {
+            free(job->output_file);
+            job->output_file = strdup(value);
+        } else if (strcmp(token, "mvt") == 0) {
+            free(job->mvt_output);
+            job->mvt_output = strdup(value);
+        } else if (strcmp(token, "out_srs") == 0) {
+            free(job->out_srs);
+            job->out_srs = strdup(value);
+        } else if (strcmp(token, "width") == 0) {
+            job->config.width = atoi(value);
+        } else if (strcmp(token, "height") == 0) {
+            job->config.height = atoi(value);
+        } else if (strcmp(token, "size") == 0) {
+            if (sscanf(value, "%dx%d", &job->config.width, &job->config.height) != 2) job->config.width = 0;
+        } else {
+            fprintf(stderr, "Manifest line %d: unknown key '%s'\n", line_number, token);
+            free_job(job);
+            return NULL;
+        }
+    }
+    
+    if (job->layer) job->config.layer = job->layer;
+    if (job->bbox) job->config.bbox = job->bbox;
+    if (job->srs) job->config.srs = job->srs;
+    if (job->format) job->config.format = job->format;
+    if (job->out_srs) job->config.out_srs = job->out_srs;
+    if (!job->output_file && defaults->output_file) {
+        char name[512];
+        snprintf(name, sizeof(name), "%s_%d.png", defaults->output_file, job_index);
+        job->output_file = strdup(name);
+    }
+    job->config.output_file = job->output_file;
+    // Jobs must not share a vector tile target; --mvt is numbered like -o
+    if (!job->mvt_output && defaults->mvt_output) {
+        const char* mvt = defaults->mvt_output;
+        size_t len = strlen(mvt);
+        bool mbtiles = len > 8 && strcmp(mvt + len - 8, ".mbtiles") == 0;
+        char name[512];
+        snprintf(name, sizeof(name), "%.*s_%d%s", (int)(mbtiles ? len - 8 : len), mvt, job_index,
+                 mbtiles ? mvt + len - 8 : "");
+        job->mvt_output = strdup(name);
+    }
+    job->config.mvt_output = job->mvt_output;
+    
+    if (!job->config.layer || !job->config.bbox || !job->config.output_file ||
+        job->config.width <= 0 || job->config.height <= 0) {
+        fprintf(stderr, "Manifest line %d: layer, bbox, output and a positive size are required\n", line_number);
+        free_job(job);
+        return NULL;
+    }
+    snprintf(job->georef_file, sizeof(job->georef_file), "%s_georef.tif", job->config.output_file);
+    return job;
+}
+
+int run_batch(const wms_config_t* config) {
+    FILE* manifest = fopen(config->batch_manifest, "r");
+    if (!manifest) {
+        fprintf(stderr, "Failed to open batch manifest: %s\n", config->batch_manifest);
+        return 1;
+    }
+    
+    batch_t* batch = calloc(1, sizeof(batch_t));
+    if (!batch) {
+        fclose(manifest);
+        return 1;
+    }
+    wmspal_mutex_init(&batch->lock);
+    
+    static int (*const runners[BATCH_STAGE_COUNT])(batch_job_t*) = {
+        stage_fetch, stage_decode, stage_vectorize, stage_attribute, stage_write
+    };
+    int total_workers = 0, in_flight = 0;
+    bool ready = true;
+    for (int i = 0; i < BATCH_STAGE_COUNT; i++) {
+        batch_stage_t* stage = &batch->stages[i];
+        stage->name = stage_names[i];
+        stage->run = runners[i];
+        stage->workers = config->stage_workers[i] > 0 ? config->stage_workers[i] : default_workers[i];
+        stage->active_workers = stage->workers;
+        stage->batch = batch;
+        stage->index = i;
+        wmspal_mutex_init(&stage->lock);
+        int depth = config->queue_depth > 0 ? config->queue_depth : stage->workers * DEFAULT_QUEUE_FACTOR;
+        if (queue_init(&stage->input, depth) != 0) ready = false;
+        total_workers += stage->workers;
+        in_flight += depth + stage->workers;
+    }
+    
+    printf("Batch pipeline: %s, at most %d jobs in flight\n", config->batch_manifest, in_flight);
+    for (int i = 0; i < BATCH_STAGE_COUNT; i++) {
+        printf("  %-10s %d workers, queue depth %d\n", stage_names[i], batch->stages[i].workers,
+               batch->stages[i].input.capacity);
+    }
+    
+    wmspal_thread_t* threads = malloc(total_workers * sizeof(wmspal_thread_t));
+    int started = 0;
+    double start = wmspal_now();
+    if (!threads) ready = false;
+    for (int i = 0; i < BATCH_STAGE_COUNT && ready; i++) {
+        for (int w = 0; w < batch->stages[i].workers; w++) {
+            if (wmspal_thread_start(&threads[started], stage_worker, &batch->stages[i]) != 0) {
+                fprintf(stderr, "Failed to start %s worker\n", stage_names[i]);
+                batch->stages[i].active_workers--;
+                continue;
+            }
+            started++;
+        }
+        if (batch->stages[i].active_workers == 0) ready = false;
+    }
+    if (!ready) {
+        // Let whatever did start drain out of empty, closed queues
+        for (int i = 0; i < BATCH_STAGE_COUNT; i++) queue_close(&batch->stages[i].input);
+    }
+    
+    // Feed the first stage; a full fetch queue stalls reading the manifest
+    char line[4096];
+    int line_number = 0, job_count = 0, rejected = 0;
+    double feed_stalled = 0;
+    while (ready && fgets(line, sizeof(line), manifest)) {
+        line_number++;
+        char* text = trim(line);
+        if (*text == '\0' || *text == '#') continue;
+        
+        batch_job_t* job = parse_job(config, text, line_number, job_count);
+        if (!job) {
+            rejected++;
+            continue;
+        }
+        job_count++;
+        feed_stalled += queue_push(&batch->stages[0].input, job);
+    }
+    fclose(manifest);
+    queue_close(&batch->stages[0].input);
+    
+    for (int i = 0; i < started; i++) wmspal_thread_join(threads[i]);
+    double wall = wmspal_now() - start;
+    free(threads);
+    
+    printf("\nBatch complete: %d jobs in %.2f s (%d succeeded, %d failed, %d manifest lines rejected)\n",
+           job_count, wall, batch->completed, batch->failed, rejected);
+    printf("Manifest reader blocked on backpressure for %.2f s\n", feed_stalled);
+    printf("  %-10s %7s %6s %6s %9s %11s %12s\n", "stage", "workers", "jobs", "failed", "busy (s)",
+           "utilization", "stalled (s)");
+    int bottleneck = 0;
+    double bottleneck_utilization = -1;
+    for (int i = 0; i < BATCH_STAGE_COUNT; i++) {
+        batch_stage_t* stage = &batch->stages[i];
+        double utilization = wall > 0 ? stage->busy / (stage->workers * wall) : 0;
+        printf("  %-10s %7d %6d %6d %9.2f %10.1f%% %12.2f\n", stage->name, stage->workers, stage->processed,
+               stage->failed, stage->busy, utilization * 100.0, stage->stalled);
+        if (utilization > bottleneck_utilization) {
+            bottleneck_utilization = utilization;
+            bottleneck = i;
+        }
+    }
+    if (job_count > 0) {
+        printf("Bottleneck: %s stage (%.1f%% utilized); consider more --stage-workers there\n",
+               stage_names[bottleneck], bottleneck_utilization * 100.0);
+    }
+    
+    int status = batch->failed > 0 || rejected > 0 || !ready ? 1 : 0;
+    for (int i = 0; i < BATCH_STAGE_COUNT; i++) {
+        queue_destroy(&batch->stages[i].input);
+        wmspal_mutex_destroy(&batch->stages[i].lock);
+    }
+    wmspal_mutex_destroy(&batch->lock);
+    free(batch);
+    return status;
+}
\ No newline at end of file
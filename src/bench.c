@@ -0,0 +1,539 @@
+#include "../include/wmspal.h"
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Microbenchmarks for the raster and geometry hot paths, run on synthetic
+// geological maps so they need no network or input files. Each image size
+// runs in its own child process, so the peak RSS reported for it is its own.
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_CLASSES 50
+#define BENCH_MIN_PALETTE_DISTANCE 60.0   // Twice the classifier tolerance
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV
+} bench_format_t;
+
+typedef struct {
+    int sizes[BENCH_MAX_SIZES];
+    int size_count;
+    int classes;
+    double noise;           // Fraction of pixels replaced by random colours
+    bool antialias;         // Blend pixels on class boundaries
+    int repeat;             // Best of this many runs per stage
+    unsigned int seed;
+    bench_format_t format;
+    const char* scratch_dir;
+    bool verbose;           // Keep the library's progress output
+    denoise_options_t denoise;
+} bench_options_t;
+
+typedef struct {
+    const char* stage;
+    double seconds;
+    uint64_t pixels;
+    uint64_t vertices;
+} bench_result_t;
+
+static FILE* out;
+static bool first_record = true;
+
+static double now(void) {
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static uint64_t peak_rss_bytes(void) {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static uint32_t next_random(uint32_t* state) {
+    // xorshift32: deterministic across platforms for a given seed
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static double color_distance(color_t a, color_t b) {
+    double dr = a.r - b.r, dg = a.g - b.g, db = a.b - b.b;
+    return sqrt(dr * dr + dg * dg + db * db);
+}
+
+// Well-separated colours from a 6-level RGB lattice, in seed-dependent order
+static int make_palette(color_t* palette, int classes, uint32_t* state) {
+    color_t lattice[216];
+    for (int i = 0; i < 216; i++) {
+        lattice[i].r = (unsigned char)(i / 36 * 51);
+        lattice[i].g = (unsigned char)(i / 6 % 6 * 51);
+        lattice[i].b = (unsigned char)(i % 6 * 51);
+    }
+    for (int i = 215; i > 0; i--) {
+        int j = next_random(state) % (i + 1);
+        color_t t = lattice[i];
+        lattice[i] = lattice[j];
+        lattice[j] = t;
+    }
+    
+    int count = 0;
+    for (int i = 0; i < 216 && count < classes; i++) {
+        bool separated = true;
+        for (int c = 0; c < count && separated; c++) {
+            separated = color_distance(lattice[i], palette[c]) >= BENCH_MIN_PALETTE_DISTANCE;
+        }
+        if (separated) palette[count++] = lattice[i];
+    }
+    return count;
+}
+
+// Folded strata: bands of classes bent by two sine waves, so every class forms
+// several long, irregular regions as on a real geological map
+static image_t* make_raster(int size, const bench_options_t* options, uint32_t* state) {
+    color_t palette[BENCH_MAX_CLASSES];
+    int classes = make_palette(palette, options->classes, state);
+    
+    image_t* img = calloc(1, sizeof(image_t));
+    if (!img) return NULL;
+    img->width = img->height = size;
+    img->channels = 3;
+    img->data = malloc((size_t)size * size * 3);
+    unsigned short* class_of = malloc((size_t)size * sizeof(unsigned short) * 2);
+    if (!img->data || !class_of) {
+        free(class_of);
+        free_image(img);
+        return NULL;
+    }
+    
+    double band = (double)size / (classes * 3);
+    double phase = (next_random(state) % 1000) / 1000.0 * 2 * M_PI;
+    unsigned short* previous_row = class_of;
+    unsigned short* row_classes = class_of + size;
+    
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            double u = (double)x / size;
+            double fold = y + size * (0.08 * sin(2 * M_PI * 1.5 * u + phase) + 0.03 * sin(2 * M_PI * 7 * u));
+            int stratum = (int)floor(fold / band);
+            unsigned short c = (unsigned short)(((stratum % classes) + classes) % classes);
+            row_classes[x] = c;
+            
+            unsigned char* p = &img->data[((size_t)y * size + x) * 3];
+            color_t color = palette[c];
+            bool edge = (x > 0 && row_classes[x - 1] != c) || (y > 0 && previous_row[x] != c);
+            if (options->antialias && edge) {
+                // Half-way colour, as a renderer's antialiasing would produce
+                color_t other = x > 0 && row_classes[x - 1] != c ? palette[row_classes[x - 1]] : palette[previous_row[x]];
+                color.r = (unsigned char)((color.r + other.r) / 2);
+                color.g = (unsigned char)((color.g + other.g) / 2);
+                color.b = (unsigned char)((color.b + other.b) / 2);
+            }
+            if (options->noise > 0 && next_random(state) < options->noise * 4294967295.0) {
+                uint32_t r = next_random(state);
+                color.r = (unsigned char)r;
+                color.g = (unsigned char)(r >> 8);
+                color.b = (unsigned char)(r >> 16);
+            }
+            p[0] = color.r;
+            p[1] = color.g;
+            p[2] = color.b;
+        }
+        unsigned short* t = previous_row;
+        previous_row = row_classes;
+        row_classes = t;
+    }
+    
+    free(class_of);
+    return img;
+}
+
+static uint64_t count_vertices(const vectorization_result_t* result) {
+    uint64_t vertices = 0;
+    for (int f = 0; f < result->feature_count; f++) {
+        for (int p = 0; p < result->features[f].polygon_count; p++) vertices += result->features[f].polygons[p].count;
+    }
+    return vertices;
+}
+
+static void report(const bench_options_t* options, int size, const bench_result_t* result, uint64_t rss) {
+    double pixels_per_s = result->pixels && result->seconds > 0 ? result->pixels / result->seconds : 0;
+    double vertices_per_s = result->vertices && result->seconds > 0 ? result->vertices / result->seconds : 0;
+    
+    switch (options->format) {
+        case FORMAT_JSON:
+            fprintf(out, "%s  {\"size\": %d, \"classes\": %d, \"noise\": %g, \"antialias\": %s, \"stage\": \"%s\", "
+                    "\"seconds\": %.6f, \"pixels\": %llu, \"vertices\": %llu, \"pixels_per_s\": %.0f, "
+                    "\"vertices_per_s\": %.0f, \"peak_rss_bytes\": %llu}",
+                    first_record ? "" : ",\n", size, options->classes, options->noise,
+                    options->antialias ? "true" : "false", result->stage, result->seconds,
+                    (unsigned long long)result->pixels, (unsigned long long)result->vertices,
+                    pixels_per_s, vertices_per_s, (unsigned long long)rss);
+            break;
+        case FORMAT_CSV:
+            fprintf(out, "%d,%d,%g,%d,%s,%.6f,%llu,%llu,%.0f,%.0f,%llu\n", size, options->classes, options->noise,
+                    options->antialias, result->stage, result->seconds, (unsigned long long)result->pixels,
+                    (unsigned long long)result->vertices, pixels_per_s, vertices_per_s, (unsigned long long)rss);
+            break;
+        default:
+            fprintf(out, "%6d  %-22s %10.3f ms %10.1f Mpx/s %10.2f Mvert/s %8.1f MiB\n", size, result->stage,
+                    result->seconds * 1000, pixels_per_s / 1e6, vertices_per_s / 1e6, rss / 1048576.0);
+            break;
+    }
+    first_record = false;
+    fflush(out);
+}
+
+// Run every stage at one size, keeping the fastest of options->repeat runs
+static int bench_size(const bench_options_t* options, int size) {
+    uint32_t state = options->seed ? options->seed : 1;
+    image_t* img = make_raster(size, options, &state);
+    if (!img) {
+        fprintf(stderr, "Out of memory generating a %dx%d raster\n", size, size);
+        return 1;
+    }
+    uint64_t pixels = (uint64_t)size * size;
+    double bbox[4] = {-5.0, 50.0, 0.0, 55.0};
+    
+    enum { EXTRACT, CLASSIFY, CLASSIFY_LEGEND, CLASSIFY_INDEXED, DENOISE, TRACE_REGIONS, TRACE_COLOR, VECTORIZE, WRITE, STAGES };
+    bench_result_t results[STAGES] = {
+        {"extract_unique_colors", HUGE_VAL, pixels, 0},
+        {"classify_image", HUGE_VAL, pixels, 0},
+        {"classify_with_legend", HUGE_VAL, pixels, 0},
+        {"classify_indexed_image", HUGE_VAL, pixels, 0},
+        {"denoise_class_image", HUGE_VAL, pixels, 0},
+        {"trace_regions", HUGE_VAL, pixels, 0},
+        {"trace_color_regions", HUGE_VAL, pixels, 0},
+        {"vectorize_raster", HUGE_VAL, pixels, 0},
+        {"write_geojson", HUGE_VAL, 0, 0}
+    };
+    char geojson_file[1024];
+    snprintf(geojson_file, sizeof(geojson_file), "%s/wmspal_bench_%d.geojson", options->scratch_dir, size);
+    
+    // A legend listing the palette, as a mapping file would for a known symbology
+    legend_t* legend = NULL;
+    int palette_count = 0;
+    color_t* palette = extract_unique_colors(img, &palette_count);
+    char legend_file[1024];
+    snprintf(legend_file, sizeof(legend_file), "%s/wmspal_bench_%d.legend", options->scratch_dir, size);
+    FILE* file = palette ? fopen(legend_file, "w") : NULL;
+    if (file) {
+        for (int c = 0; c < palette_count; c++) {
+            fprintf(file, "#%02x%02x%02x = Class %d\n", palette[c].r, palette[c].g, palette[c].b, c);
+        }
+        fclose(file);
+        legend = legend_load_file(legend_file);
+        remove(legend_file);
+    }
+    
+    // The same map as a PNG8 server would send it: palette indices plus the palette
+    image_t* indexed = NULL;
+    class_image_t* palette_classes = palette && palette_count < 256 ? classify_image(img, palette, palette_count) : NULL;
+    if (palette_classes) indexed = calloc(1, sizeof(image_t));
+    if (indexed) {
+        indexed->width = indexed->height = size;
+        indexed->channels = 1;
+        indexed->data = malloc((size_t)pixels);
+        indexed->palette = calloc(palette_count + 1, sizeof(color_t));
+        indexed->palette_size = palette_count + 1;
+        if (indexed->data && indexed->palette) {
+            memcpy(indexed->palette, palette, palette_count * sizeof(color_t));
+            for (uint64_t i = 0; i < pixels; i++) {
+                unsigned short id = palette_classes->data[i];
+                indexed->data[i] = (unsigned char)(id == CLASS_NONE ? palette_count : id);
+            }
+        } else {
+            free_image(indexed);
+            indexed = NULL;
+        }
+    }
+    free_class_image(palette_classes);
+    free(palette);
+    
+    int status = 0;
+    for (int run = 0; run < options->repeat && status == 0; run++) {
+        double t = now();
+        int color_count = 0;
+        color_t* colors = extract_unique_colors(img, &color_count);
+        results[EXTRACT].seconds = fmin(results[EXTRACT].seconds, now() - t);
+        
+        t = now();
+        class_image_t* classes = classify_image(img, colors, color_count);
+        results[CLASSIFY].seconds = fmin(results[CLASSIFY].seconds, now() - t);
+        
+        t = now();
+        class_image_t* legend_classes = classify_with_legend(img, legend);
+        results[CLASSIFY_LEGEND].seconds = fmin(results[CLASSIFY_LEGEND].seconds, now() - t);
+        free_class_image(legend_classes);
+        
+        if (indexed) {
+            t = now();
+            color_t* indexed_colors = NULL;
+            int indexed_count = 0;
+            class_image_t* indexed_classes = classify_indexed_image(indexed, NULL, &indexed_colors, &indexed_count);
+            results[CLASSIFY_INDEXED].seconds = fmin(results[CLASSIFY_INDEXED].seconds, now() - t);
+            free_class_image(indexed_classes);
+            free(indexed_colors);
+        }
+        
+        t = now();
+        if (classes) denoise_class_image(classes, &options->denoise);
+        results[DENOISE].seconds = fmin(results[DENOISE].seconds, now() - t);
+        
+        t = now();
+        int region_count = 0;
+        region_t* regions = classes ? trace_regions(classes, 10, &region_count) : NULL;
+        results[TRACE_REGIONS].seconds = fmin(results[TRACE_REGIONS].seconds, now() - t);
+        results[TRACE_REGIONS].vertices = 0;
+        for (int i = 0; i < region_count; i++) results[TRACE_REGIONS].vertices += regions[i].ring.count;
+        free_regions(regions, region_count);
+        free_class_image(classes);
+        
+        // Single-colour tracing as older callers use it: one pass per palette colour
+        t = now();
+        uint64_t traced = 0;
+        for (int c = 0; c < color_count; c++) {
+            int polygon_count = 0;
+            polygon_t* polygons = trace_color_regions(img, colors[c], &polygon_count);
+            for (int i = 0; i < polygon_count; i++) {
+                traced += polygons[i].count;
+                free(polygons[i].coords);
+            }
+            free(polygons);
+        }
+        results[TRACE_COLOR].seconds = fmin(results[TRACE_COLOR].seconds, now() - t);
+        results[TRACE_COLOR].vertices = traced;
+        free(colors);
+        
+        // What analyze_geological_colors does once the image is decoded
+        t = now();
+        vectorization_result_t* result = vectorize_raster(img, bbox[0], bbox[1], bbox[2], bbox[3], "EPSG:4326",
+                                                          &options->denoise, NULL);
+        results[VECTORIZE].seconds = fmin(results[VECTORIZE].seconds, now() - t);
+        if (!result) {
+            status = 1;
+            break;
+        }
+        results[VECTORIZE].vertices = count_vertices(result);
+        
+        t = now();
+        if (write_geojson(result, geojson_file) != 0) status = 1;
+        results[WRITE].seconds = fmin(results[WRITE].seconds, now() - t);
+        results[WRITE].vertices = results[VECTORIZE].vertices;
+        free_vectorization_result(result);
+        remove(geojson_file);
+    }
+    free_image(img);
+    free_image(indexed);
+    legend_free(legend);
+    
+    if (status == 0) {
+        uint64_t rss = peak_rss_bytes();
+        for (int i = 0; i < STAGES; i++) {
+            if (i == DENOISE && !denoise_enabled(&options->denoise)) continue;
+            if (i == CLASSIFY_LEGEND && !legend) continue;
+            if (i == CLASSIFY_INDEXED && results[i].seconds == HUGE_VAL) continue;
+            report(options, size, &results[i], rss);
+        }
+    }
+    return status;
+}
+
+static void print_usage(const char* program_name) {
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("Benchmark the raster and geometry hot paths on synthetic geological maps\n\n");
+    printf("Options:\n");
+    printf("      --sizes LIST      Square raster sizes in pixels (default: 256,1024,4096; up to 16384)\n");
+    printf("      --classes N       Colour classes, 1 to %d (default: 8)\n", BENCH_MAX_CLASSES);
+    printf("      --noise P         Fraction of pixels replaced by random colours (default: 0)\n");
+    printf("      --antialias       Blend boundary pixels as a renderer would\n");
+    printf("      --repeat N        Keep the fastest of N runs per stage (default: 3)\n");
+    printf("      --seed N          Generator seed (default: 1)\n");
+    printf("      --format FMT      text, json or csv (default: text)\n");
+    printf("      --scratch DIR     Directory for temporary GeoJSON files (default: .)\n");
+    printf("      --denoise SPEC    Prefilter the class image, e.g. mode=1,open=1,close=1,mmu=16\n");
+    printf("      --verbose         Keep the library's progress output\n");
+    printf("      --help            Show this help message\n");
+}
+
+static int parse_sizes(const char* spec, bench_options_t* options) {
+    options->size_count = 0;
+    const char* p = spec;
+    while (*p) {
+        char* end;
+        long size = strtol(p, &end, 10);
+        if (end == p || size < 16 || size > 16384 || options->size_count >= BENCH_MAX_SIZES) return 1;
+        options->sizes[options->size_count++] = (int)size;
+        p = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return 1;
+    }
+    return options->size_count > 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options_t options = {
+        .sizes = {256, 1024, 4096},
+        .size_count = 3,
+        .classes = 8,
+        .repeat = 3,
+        .seed = 1,
+        .format = FORMAT_TEXT,
+        .scratch_dir = "."
+    };
+    
+    static struct option long_options[] = {
+        {"sizes", required_argument, 0, 1001},
+        {"classes", required_argument, 0, 1002},
+        {"noise", required_argument, 0, 1003},
+        {"antialias", no_argument, 0, 1004},
+        {"repeat", required_argument, 0, 1005},
+        {"seed", required_argument, 0, 1006},
+        {"format", required_argument, 0, 1007},
+        {"scratch", required_argument, 0, 1008},
+        {"verbose", no_argument, 0, 1009},
+        {"denoise", required_argument, 0, 1010},
+        {"help", no_argument, 0, 0},
+        {0, 0, 0, 0}
+    };
+    
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 1001:
+                if (parse_sizes(optarg, &options) != 0) {
+                    fprintf(stderr, "Error: --sizes expects a comma-separated list of sizes from 16 to 16384\n");
+                    return 1;
+                }
+                break;
+            case 1002:
+                options.classes = atoi(optarg);
+                if (options.classes < 1 || options.classes > BENCH_MAX_CLASSES) {
+                    fprintf(stderr, "Error: --classes must be between 1 and %d\n", BENCH_MAX_CLASSES);
+                    return 1;
+                }
+                break;
+            case 1003:
+                options.noise = atof(optarg);
+                if (options.noise < 0 || options.noise > 1) {
+                    fprintf(stderr, "Error: --noise must be between 0 and 1\n");
+                    return 1;
+                }
+                break;
+            case 1004:
+                options.antialias = true;
+                break;
+            case 1005:
+                options.repeat = atoi(optarg);
+                if (options.repeat < 1) {
+                    fprintf(stderr, "Error: --repeat must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 1006:
+                options.seed = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 1007:
+                if (strcmp(optarg, "json") == 0) options.format = FORMAT_JSON;
+                else if (strcmp(optarg, "csv") == 0) options.format = FORMAT_CSV;
+                else if (strcmp(optarg, "text") == 0) options.format = FORMAT_TEXT;
+                else {
+                    fprintf(stderr, "Error: --format must be text, json or csv\n");
+                    return 1;
+                }
+                break;
+            case 1008:
+                options.scratch_dir = optarg;
+                break;
+            case 1009:
+                options.verbose = true;
+                break;
+            case 1010:
+                if (parse_denoise_options(optarg, &options.denoise) != 0) {
+                    fprintf(stderr, "Error: --denoise expects e.g. mode=1,open=1,close=1,mmu=16\n");
+                    return 1;
+                }
+                break;
+            case 0:
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    
+    // Results go to the real stdout; the library's progress lines are discarded
+    out = stdout;
+#ifndef _WIN32
+    if (!options.verbose) {
+        fflush(stdout);
+        int results_fd = dup(STDOUT_FILENO);
+        FILE* results = results_fd >= 0 ? fdopen(results_fd, "w") : NULL;
+        if (results && freopen("/dev/null", "w", stdout)) out = results;
+    }
+#endif
+    
+    if (options.format == FORMAT_JSON) {
+        fprintf(out, "{\"benchmark\": \"wmspal\", \"repeat\": %d, \"seed\": %u, \"results\": [\n",
+                options.repeat, options.seed);
+    } else if (options.format == FORMAT_CSV) {
+        fprintf(out, "size,classes,noise,antialias,stage,seconds,pixels,vertices,pixels_per_s,vertices_per_s,"
+                "peak_rss_bytes\n");
+    } else {
+        fprintf(out, "%d classes, noise %g, antialias %s, best of %d\n", options.classes, options.noise,
+                options.antialias ? "on" : "off", options.repeat);
+        fprintf(out, "%6s  %-22s %13s %16s %18s %12s\n", "size", "stage", "time", "pixels/s", "vertices/s", "peak RSS");
+    }
+    fflush(out);
+    
+    int status = 0;
+    for (int i = 0; i < options.size_count && status == 0; i++) {
+#ifndef _WIN32
+        // A child per size keeps peak RSS and allocator state separate
+        pid_t child = fork();
+        if (child == 0) {
+            first_record = i == 0;
+            int child_status = bench_size(&options, options.sizes[i]);
+            fflush(out);
+            _exit(child_status);
+        }
+        int wait_status = 0;
+        if (child < 0 || waitpid(child, &wait_status, 0) < 0 || !WIFEXITED(wait_status) ||
+            WEXITSTATUS(wait_status) != 0) {
+            fprintf(stderr, "Benchmark at %d px failed\n", options.sizes[i]);
+            status = 1;
+        }
+        first_record = false;
+#else
+        status = bench_size(&options, options.sizes[i]);
+#endif
+    }
+    
+    if (options.format == FORMAT_JSON) fprintf(out, "\n]}\n");
+    fflush(out);
+    return status;
+}
\ No newline at end of file
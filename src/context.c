@@ -0,0 +1,623 @@
+#include "context.h"
+#include <stdarg.h>
+#include <time.h>
+
+// Long-lived library state. A context owns everything that is expensive to set
+// up per call: a CURL share (DNS, TLS sessions and connections) with a pool of
+// easy handles, pooled GEOS and PROJ handles for reentrant use from several
+// threads, a WKT cache per SRS, idle coordinate transformations per
+// source/target pair, a bounded cache of GetMap/GetFeatureInfo/
+// GetCapabilities responses, compiled classification dictionaries and
+// legend lookup tables.
+
+typedef struct {
+    void** items;
+    int count, capacity;
+} handle_pool_t;
+
+typedef struct cache_entry_s {
+    char* key;
+    void* value;
+    struct cache_entry_s* next;
+} cache_entry_t;
+
+#define TRANSFORM_CACHE_MAX 64     // Idle transformations kept across all SRS pairs
+#define RESPONSE_CACHE_ENTRIES 4096
+#define RESPONSE_CACHE_BYTES (64u * 1024 * 1024)
+#define RESPONSE_CACHE_TTL 300.0   // Seconds a response is reused unless the server allows less
+
+// Bounded FIFO cache of HTTP response bodies keyed by request URL
+typedef struct {
+    char* url;
+    char* data;
+    size_t size;
+    double expires;     // wmspal_now() after which the entry is stale
+} cached_response_t;
+
+typedef struct {
+    cached_response_t entries[RESPONSE_CACHE_ENTRIES];   // Ring, oldest at head
+    int head, count;
+    size_t bytes;
+    key_map_t index;                                      // URL hash -> ring slot
+    int hits, misses;
+    double ttl;                                           // Longest lifetime of an entry, 0 = off
+} response_cache_t;
+
+struct wmspal_context_s {
+    wmspal_mutex_t lock;                            // Guards the pools and caches below
+    wmspal_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+    CURLSH* share;
+    handle_pool_t curl_pool;
+    response_cache_t* responses;
+    cache_entry_t* matchers;
+    cache_entry_t* legends;                         // Keyed by mapping file, or by WMS URL and layer
+#ifdef HAVE_GEOS
+    handle_pool_t geos_pool;
+#endif
+#ifdef HAVE_PROJ
+    handle_pool_t proj_pool;
+    cache_entry_t* wkt_cache;
+    srs_transform_t* transforms;    // Idle transformations, most recently released first
+    int transform_count;
+#endif
+};
+
+static void* pool_take(wmspal_context_t* context, handle_pool_t* pool) {
+    void* item = NULL;
+    wmspal_mutex_lock(&context->lock);
+    if (pool->count > 0) item = pool->items[--pool->count];
+    wmspal_mutex_unlock(&context->lock);
+    return item;
+}
+
+// Returns false when the handle could not be kept and must be destroyed by the caller
+static bool pool_put(wmspal_context_t* context, handle_pool_t* pool, void* item) {
+    bool kept = true;
+    wmspal_mutex_lock(&context->lock);
+    if (pool->count >= pool->capacity) {
+        int capacity = pool->capacity ? pool->capacity * 2 : 8;
+        void** items = realloc(pool->items, capacity * sizeof(void*));
+        if (items) {
+            pool->items = items;
+            pool->capacity = capacity;
+        }
+    }
+    if (pool->count < pool->capacity) {
+        pool->items[pool->count++] = item;
+    } else {
+        kept = false;
+    }
+    wmspal_mutex_unlock(&context->lock);
+    return kept;
+}
+
+#ifdef _WIN32
+typedef struct {
+    void* (*run)(void*);
+    void* arg;
+} thread_start_t;
+
+static DWORD WINAPI thread_trampoline(LPVOID param) {
+    thread_start_t start = *(thread_start_t*)param;
+    free(param);
+    start.run(start.arg);
+    return 0;
+}
+
+int wmspal_thread_start(wmspal_thread_t* thread, void* (*run)(void*), void* arg) {
+    thread_start_t* start = malloc(sizeof(thread_start_t));
+    if (!start) return 1;
+    start->run = run;
+    start->arg = arg;
+    *thread = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    if (!*thread) {
+        free(start);
+        return 1;
+    }
+    return 0;
+}
+
+void wmspal_thread_join(wmspal_thread_t thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+double wmspal_now(void) {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+#else
+int wmspal_thread_start(wmspal_thread_t* thread, void* (*run)(void*), void* arg) {
+    return pthread_create(thread, NULL, run, arg) == 0 ? 0 : 1;
+}
+
+void wmspal_thread_join(wmspal_thread_t thread) {
+    pthread_join(thread, NULL);
+}
+
+double wmspal_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+static void share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* user) {
+    (void)handle;
+    (void)access;
+    wmspal_context_t* context = user;
+    wmspal_mutex_lock(&context->share_locks[data]);
+}
+
+static void share_unlock(CURL* handle, curl_lock_data data, void* user) {
+    (void)handle;
+    wmspal_context_t* context = user;
+    wmspal_mutex_unlock(&context->share_locks[data]);
+}
+
+wmspal_context_t* wmspal_context_create(void) {
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        fprintf(stderr, "Failed to initialize curl\n");
+        return NULL;
+    }
+    
+    wmspal_context_t* context = calloc(1, sizeof(wmspal_context_t));
+    if (!context) {
+        curl_global_cleanup();
+        return NULL;
+    }
+    wmspal_mutex_init(&context->lock);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) wmspal_mutex_init(&context->share_locks[i]);
+    
+    context->share = curl_share_init();
+    if (context->share) {
+        curl_share_setopt(context->share, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(context->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(context->share, CURLSHOPT_USERDATA, context);
+        curl_share_setopt(context->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(context->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(context->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    context->responses = calloc(1, sizeof(response_cache_t));
+    if (context->responses && key_map_init(&context->responses->index, RESPONSE_CACHE_ENTRIES * 2) != 0) {
+        free(context->responses);
+        context->responses = NULL;
+    }
+    if (context->responses) context->responses->ttl = RESPONSE_CACHE_TTL;
+    return context;
+}
+
+void wmspal_context_set_cache_ttl(wmspal_context_t* context, double seconds) {
+    if (!context || !context->responses) return;
+    wmspal_mutex_lock(&context->lock);
+    context->responses->ttl = seconds > 0 ? seconds : 0;
+    wmspal_mutex_unlock(&context->lock);
+}
+
+void wmspal_context_free(wmspal_context_t* context) {
+    if (!context) return;
+    
+    // Easy handles must go before the share they are attached to
+    for (int i = 0; i < context->curl_pool.count; i++) curl_easy_cleanup(context->curl_pool.items[i]);
+    free(context->curl_pool.items);
+    if (context->share) curl_share_cleanup(context->share);
+
+    if (context->responses) {
+        response_cache_t* cache = context->responses;
+        for (int i = 0; i < cache->count; i++) {
+            cached_response_t* entry = &cache->entries[(cache->head + i) % RESPONSE_CACHE_ENTRIES];
+            free(entry->url);
+            free(entry->data);
+        }
+        key_map_destroy(&cache->index);
+        free(cache);
+    }
+    
+    for (cache_entry_t* entry = context->matchers; entry; ) {
+        cache_entry_t* next = entry->next;
+        matcher_free(entry->value);
+        free(entry->key);
+        free(entry);
+        entry = next;
+    }
+    for (cache_entry_t* entry = context->legends; entry; ) {
+        cache_entry_t* next = entry->next;
+        legend_free(entry->value);
+        free(entry->key);
+        free(entry);
+        entry = next;
+    }
+
+#ifdef HAVE_GEOS
+    for (int i = 0; i < context->geos_pool.count; i++) GEOS_finish_r(context->geos_pool.items[i]);
+    free(context->geos_pool.items);
+#endif
+
+#ifdef HAVE_PROJ
+    for (int i = 0; i < context->proj_pool.count; i++) proj_context_destroy(context->proj_pool.items[i]);
+    free(context->proj_pool.items);
+    for (cache_entry_t* entry = context->wkt_cache; entry; ) {
+        cache_entry_t* next = entry->next;
+        free(entry->value);
+        free(entry->key);
+        free(entry);
+        entry = next;
+    }
+    for (srs_transform_t* transform = context->transforms; transform; ) {
+        srs_transform_t* next = transform->next;
+        transform->next = NULL;
+        context_release_transform(NULL, transform);
+        transform = next;
+    }
+#endif
+    
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) wmspal_mutex_destroy(&context->share_locks[i]);
+    wmspal_mutex_destroy(&context->lock);
+    free(context);
+    curl_global_cleanup();
+}
+
+CURL* context_acquire_curl(wmspal_context_t* context) {
+    CURL* curl = context ? pool_take(context, &context->curl_pool) : NULL;
+    if (!curl) curl = curl_easy_init();
+    if (!curl) return NULL;
+    
+    if (context && context->share) curl_easy_setopt(curl, CURLOPT_SHARE, context->share);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "WMSPal/1.0");
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    return curl;
+}
+
+void context_release_curl(wmspal_context_t* context, CURL* curl) {
+    if (!curl) return;
+    if (!context) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+    // Reset clears per-request options but keeps live connections and the share
+    curl_easy_reset(curl);
+    if (!pool_put(context, &context->curl_pool, curl)) curl_easy_cleanup(curl);
+}
+
+static uint64_t url_hash(const char* url) {
+    // FNV-1a, with the top bit cleared so it never equals the map's empty key
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char* p = (const unsigned char*)url; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash & ~(1ULL << 63);
+}
+
+// Copies a cached response body (NUL-terminated) into *data for the caller to free.
+// Stale entries miss; they stay in the ring until FIFO eviction reaches them.
+bool context_cache_get(wmspal_context_t* context, const char* url, char** data, size_t* size) {
+    if (!context || !context->responses) return false;
+    response_cache_t* cache = context->responses;
+    bool hit = false;
+    int slot;
+
+    wmspal_mutex_lock(&context->lock);
+    if (key_map_get(&cache->index, url_hash(url), &slot) && strcmp(cache->entries[slot].url, url) == 0 &&
+        cache->entries[slot].expires > wmspal_now()) {
+        cached_response_t* entry = &cache->entries[slot];
+        *data = malloc(entry->size + 1);
+        if (*data) {
+            memcpy(*data, entry->data, entry->size);
+            (*data)[entry->size] = '\0';
+            *size = entry->size;
+            hit = true;
+        }
+    }
+    if (hit) cache->hits++; else cache->misses++;
+    wmspal_mutex_unlock(&context->lock);
+    return hit;
+}
+
+static void cache_evict_oldest(response_cache_t* cache) {
+    cached_response_t* entry = &cache->entries[cache->head];
+    int slot;
+    if (key_map_get(&cache->index, url_hash(entry->url), &slot) && slot == cache->head) {
+        key_map_take(&cache->index, url_hash(entry->url), &slot);
+    }
+    cache->bytes -= entry->size;
+    free(entry->url);
+    free(entry->data);
+    entry->url = NULL;
+    entry->data = NULL;
+    cache->head = (cache->head + 1) % RESPONSE_CACHE_ENTRIES;
+    cache->count--;
+}
+
+// max_age is the lifetime the server allows (Cache-Control or Expires), or
+// negative when it states none; the context's TTL caps it either way
+void context_cache_put(wmspal_context_t* context, const char* url, const char* data, size_t size, double max_age) {
+    if (!context || !context->responses || size > RESPONSE_CACHE_BYTES / 16) return;
+    double lifetime = context->responses->ttl;
+    if (max_age >= 0 && max_age < lifetime) lifetime = max_age;
+    if (lifetime <= 0) return;
+    char* url_copy = strdup(url);
+    char* data_copy = malloc(size ? size : 1);
+    if (!url_copy || !data_copy) {
+        free(url_copy);
+        free(data_copy);
+        return;
+    }
+    memcpy(data_copy, data, size);
+
+    response_cache_t* cache = context->responses;
+    wmspal_mutex_lock(&context->lock);
+    while (cache->count > 0 && (cache->count == RESPONSE_CACHE_ENTRIES || cache->bytes + size > RESPONSE_CACHE_BYTES)) {
+        cache_evict_oldest(cache);
+    }
+    int slot = (cache->head + cache->count) % RESPONSE_CACHE_ENTRIES;
+    cache->entries[slot].url = url_copy;
+    cache->entries[slot].data = data_copy;
+    cache->entries[slot].size = size;
+    cache->entries[slot].expires = wmspal_now() + lifetime;
+    cache->bytes += size;
+    cache->count++;
+    key_map_put(&cache->index, url_hash(url), slot);
+    wmspal_mutex_unlock(&context->lock);
+}
+
+void context_cache_stats(wmspal_context_t* context, int* entries, size_t* bytes, int* hits, int* misses) {
+    *entries = 0;
+    *bytes = 0;
+    *hits = 0;
+    *misses = 0;
+    if (!context || !context->responses) return;
+    wmspal_mutex_lock(&context->lock);
+    *entries = context->responses->count;
+    *bytes = context->responses->bytes;
+    *hits = context->responses->hits;
+    *misses = context->responses->misses;
+    wmspal_mutex_unlock(&context->lock);
+}
+
+// Dictionaries are compiled once per context and shared read-only afterwards
+keyword_matcher_t* context_acquire_matcher(wmspal_context_t* context, const char* dictionary_file) {
+    if (!context) return dictionary_file ? matcher_load_dictionary(dictionary_file) : matcher_create_default();
+    
+    const char* key = dictionary_file ? dictionary_file : "";
+    wmspal_mutex_lock(&context->lock);
+    for (cache_entry_t* entry = context->matchers; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) {
+            wmspal_mutex_unlock(&context->lock);
+            return entry->value;
+        }
+    }
+    wmspal_mutex_unlock(&context->lock);
+    
+    keyword_matcher_t* matcher = dictionary_file ? matcher_load_dictionary(dictionary_file) : matcher_create_default();
+    if (!matcher) return NULL;
+    
+    cache_entry_t* entry = malloc(sizeof(cache_entry_t));
+    if (!entry) {
+        matcher_free(matcher);
+        return NULL;
+    }
+    entry->key = strdup(key);
+    entry->value = matcher;
+    
+    // Another thread may have compiled the same dictionary meanwhile
+    wmspal_mutex_lock(&context->lock);
+    for (cache_entry_t* other = context->matchers; other; other = other->next) {
+        if (strcmp(other->key, key) == 0) {
+            wmspal_mutex_unlock(&context->lock);
+            matcher_free(matcher);
+            free(entry->key);
+            free(entry);
+            return other->value;
+        }
+    }
+    entry->next = context->matchers;
+    context->matchers = entry;
+    wmspal_mutex_unlock(&context->lock);
+    return matcher;
+}
+
+void context_release_matcher(wmspal_context_t* context, keyword_matcher_t* matcher) {
+    if (!context) matcher_free(matcher);
+}
+
+// Legends are loaded (and their lookup tables built) once per context
+legend_t* context_acquire_legend(wmspal_context_t* context, const wms_config_t* config) {
+    if (!config->legend) return NULL;
+    if (!context) return legend_load(config);
+    
+    char key[2048];
+    if (strcmp(config->legend, "wms") == 0) {
+        snprintf(key, sizeof(key), "wms:%s|%s", config->url ? config->url : "", config->layer ? config->layer : "");
+    } else {
+        snprintf(key, sizeof(key), "file:%s", config->legend);
+    }
+    wmspal_mutex_lock(&context->lock);
+    for (cache_entry_t* entry = context->legends; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) {
+            wmspal_mutex_unlock(&context->lock);
+            return entry->value;
+        }
+    }
+    wmspal_mutex_unlock(&context->lock);
+    
+    legend_t* legend = legend_load(config);
+    if (!legend) return NULL;
+    
+    cache_entry_t* entry = malloc(sizeof(cache_entry_t));
+    if (!entry) {
+        legend_free(legend);
+        return NULL;
+    }
+    entry->key = strdup(key);
+    entry->value = legend;
+    
+    // Another thread may have loaded the same legend meanwhile
+    wmspal_mutex_lock(&context->lock);
+    for (cache_entry_t* other = context->legends; other; other = other->next) {
+        if (strcmp(other->key, key) == 0) {
+            wmspal_mutex_unlock(&context->lock);
+            legend_free(legend);
+            free(entry->key);
+            free(entry);
+            return other->value;
+        }
+    }
+    entry->next = context->legends;
+    context->legends = entry;
+    wmspal_mutex_unlock(&context->lock);
+    return legend;
+}
+
+void context_release_legend(wmspal_context_t* context, legend_t* legend) {
+    if (!context) legend_free(legend);
+}
+
+#ifdef HAVE_GEOS
+static void geos_notice(const char* fmt, ...) {
+    (void)fmt;
+}
+
+static void geos_error(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "GEOS error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+GEOSContextHandle_t context_acquire_geos(wmspal_context_t* context) {
+    GEOSContextHandle_t handle = context ? pool_take(context, &context->geos_pool) : NULL;
+    if (!handle) handle = GEOS_init_r();
+    if (handle) {
+        GEOSContext_setNoticeHandler_r(handle, geos_notice);
+        GEOSContext_setErrorHandler_r(handle, geos_error);
+    }
+    return handle;
+}
+
+void context_release_geos(wmspal_context_t* context, GEOSContextHandle_t handle) {
+    if (!handle) return;
+    if (!context || !pool_put(context, &context->geos_pool, handle)) GEOS_finish_r(handle);
+}
+#endif
+
+#ifdef HAVE_PROJ
+PJ_CONTEXT* context_acquire_proj(wmspal_context_t* context) {
+    PJ_CONTEXT* proj = context ? pool_take(context, &context->proj_pool) : NULL;
+    return proj ? proj : proj_context_create();
+}
+
+void context_release_proj(wmspal_context_t* context, PJ_CONTEXT* proj) {
+    if (!proj) return;
+    if (!context || !pool_put(context, &context->proj_pool, proj)) proj_context_destroy(proj);
+}
+
+// WKT for an SRS string, resolved through the PROJ database once per context.
+// Returns a copy the caller frees, or NULL when PROJ does not know the SRS.
+char* context_srs_wkt(wmspal_context_t* context, const char* srs) {
+    if (context) {
+        wmspal_mutex_lock(&context->lock);
+        for (cache_entry_t* entry = context->wkt_cache; entry; entry = entry->next) {
+            if (strcmp(entry->key, srs) == 0) {
+                char* wkt = strdup(entry->value);
+                wmspal_mutex_unlock(&context->lock);
+                return wkt;
+            }
+        }
+        wmspal_mutex_unlock(&context->lock);
+    }
+    
+    PJ_CONTEXT* proj = context_acquire_proj(context);
+    if (!proj) return NULL;
+    char* wkt = NULL;
+    PJ* crs = proj_create(proj, srs);
+    if (crs) {
+        const char* text = proj_as_wkt(proj, crs, PJ_WKT1_GDAL, NULL);
+        if (text) wkt = strdup(text);
+        proj_destroy(crs);
+    }
+    context_release_proj(context, proj);
+    
+    if (wkt && context) {
+        cache_entry_t* entry = malloc(sizeof(cache_entry_t));
+        if (entry) {
+            entry->key = strdup(srs);
+            entry->value = strdup(wkt);
+            wmspal_mutex_lock(&context->lock);
+            entry->next = context->wkt_cache;
+            context->wkt_cache = entry;
+            wmspal_mutex_unlock(&context->lock);
+        }
+    }
+    return wkt;
+}
+
+// A transformation from source to target SRS with traditional GIS axis order
+// (east, north), whatever the CRS definitions say. Each one carries its own
+// PROJ context, so a leased transformation is used by one thread at a time.
+srs_transform_t* context_acquire_transform(wmspal_context_t* context, const char* source, const char* target) {
+    if (context) {
+        wmspal_mutex_lock(&context->lock);
+        for (srs_transform_t** link = &context->transforms; *link; link = &(*link)->next) {
+            srs_transform_t* transform = *link;
+            if (strcmp(transform->source, source) == 0 && strcmp(transform->target, target) == 0) {
+                *link = transform->next;
+                transform->next = NULL;
+                context->transform_count--;
+                wmspal_mutex_unlock(&context->lock);
+                return transform;
+            }
+        }
+        wmspal_mutex_unlock(&context->lock);
+    }
+    
+    PJ_CONTEXT* proj = proj_context_create();
+    if (!proj) return NULL;
+    PJ* pj = proj_create_crs_to_crs(proj, source, target, NULL);
+    PJ* normalized = pj ? proj_normalize_for_visualization(proj, pj) : NULL;
+    if (pj) proj_destroy(pj);
+    if (!normalized) {
+        fprintf(stderr, "PROJ cannot transform %s to %s: %s\n", source, target,
+                proj_context_errno_string(proj, proj_context_errno(proj)));
+        proj_context_destroy(proj);
+        return NULL;
+    }
+    
+    srs_transform_t* transform = calloc(1, sizeof(srs_transform_t));
+    if (!transform) {
+        proj_destroy(normalized);
+        proj_context_destroy(proj);
+        return NULL;
+    }
+    transform->source = strdup(source);
+    transform->target = strdup(target);
+    transform->proj = proj;
+    transform->pj = normalized;
+    return transform;
+}
+
+void context_release_transform(wmspal_context_t* context, srs_transform_t* transform) {
+    if (!transform) return;
+    if (context) {
+        wmspal_mutex_lock(&context->lock);
+        if (context->transform_count < TRANSFORM_CACHE_MAX) {
+            transform->next = context->transforms;
+            context->transforms = transform;
+            context->transform_count++;
+            transform = NULL;
+        }
+        wmspal_mutex_unlock(&context->lock);
+        if (!transform) return;
+    }
+    proj_destroy(transform->pj);
+    proj_context_destroy(transform->proj);
+    free(transform->source);
+    free(transform->target);
+    free(transform);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,130 @@
+#ifndef WMSPAL_CONTEXT_H
+#define WMSPAL_CONTEXT_H
+
+// Library-internal view of wmspal_context_t. Every resource is leased: acquire
+// takes an idle handle from the context's pool (or creates one), release hands
+// it back for the next caller. With a NULL context the lease is a plain
+// create/destroy pair, so code paths work the same with or without one.
+
+#include "../include/wmspal.h"
+#include <curl/curl.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION wmspal_mutex_t;
+#define wmspal_mutex_init(m) InitializeCriticalSection(m)
+#define wmspal_mutex_destroy(m) DeleteCriticalSection(m)
+#define wmspal_mutex_lock(m) EnterCriticalSection(m)
+#define wmspal_mutex_unlock(m) LeaveCriticalSection(m)
+typedef CONDITION_VARIABLE wmspal_cond_t;
+#define wmspal_cond_init(c) InitializeConditionVariable(c)
+#define wmspal_cond_destroy(c) ((void)(c))
+#define wmspal_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define wmspal_cond_signal(c) WakeConditionVariable(c)
+#define wmspal_cond_broadcast(c) WakeAllConditionVariable(c)
+typedef HANDLE wmspal_thread_t;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t wmspal_mutex_t;
+#define wmspal_mutex_init(m) pthread_mutex_init(m, NULL)
+#define wmspal_mutex_destroy(m) pthread_mutex_destroy(m)
+#define wmspal_mutex_lock(m) pthread_mutex_lock(m)
+#define wmspal_mutex_unlock(m) pthread_mutex_unlock(m)
+typedef pthread_cond_t wmspal_cond_t;
+#define wmspal_cond_init(c) pthread_cond_init(c, NULL)
+#define wmspal_cond_destroy(c) pthread_cond_destroy(c)
+#define wmspal_cond_wait(c, m) pthread_cond_wait(c, m)
+#define wmspal_cond_signal(c) pthread_cond_signal(c)
+#define wmspal_cond_broadcast(c) pthread_cond_broadcast(c)
+typedef pthread_t wmspal_thread_t;
+#endif
+
+int wmspal_thread_start(wmspal_thread_t* thread, void* (*run)(void*), void* arg);
+void wmspal_thread_join(wmspal_thread_t thread);
+double wmspal_now(void);    // Monotonic seconds
+
+#ifdef HAVE_GEOS
+#include <geos_c.h>
+#endif
+
+#ifdef HAVE_PROJ
+#include <proj.h>
+#endif
+
+CURL* context_acquire_curl(wmspal_context_t* context);
+void context_release_curl(wmspal_context_t* context, CURL* curl);
+
+int wms_http_get(wmspal_context_t* context, const char* url, char** data, size_t* size);
+void url_escape(const char* text, char* out, size_t out_size);
+
+// Capabilities parsing shared by the WMS planner and the WMTS backend
+#define OGC_PIXEL_SIZE 0.00028          // Standard rendering pixel size in metres
+#define METRES_PER_DEGREE 111319.49
+
+const char* xml_element_text(const char* gt, const char* end, size_t* len);
+bool xml_tag_is(const char* name, size_t name_len, const char* expected);
+bool srs_is_geographic(const char* srs);
+bool format_is_paletted_png(const char* text, size_t len);
+
+// Raster buffers; mapped from the scratch directory when one is enabled and
+// the buffer is large (see scratch.c), so they must be freed with raster_free
+void* raster_alloc(size_t bytes);
+void raster_free(void* data);
+
+// Horizontal runs of one class; 4-connected components are unions of runs
+typedef struct {
+    int start, end;                     // Pixel columns [start, end)
+    int row;
+    unsigned short id;
+} class_run_t;
+
+typedef struct {
+    class_run_t* runs;                  // In raster order
+    int count;
+    int* row_first;                     // First run of each row, plus the total
+    int* parent;                        // Component of each run: its first run in raster order
+} class_runs_t;
+
+int label_class_runs(const unsigned short* data, int width, int height, class_runs_t* labels);
+void free_class_runs(class_runs_t* labels);
+
+// Columns shared by two runs in adjacent rows
+static inline int class_run_overlap(const class_run_t* first, const class_run_t* second) {
+    int end = first->end < second->end ? first->end : second->end;
+    int start = first->start > second->start ? first->start : second->start;
+    return end - start;
+}
+
+bool context_cache_get(wmspal_context_t* context, const char* url, char** data, size_t* size);
+void context_cache_put(wmspal_context_t* context, const char* url, const char* data, size_t size, double max_age);
+void context_cache_stats(wmspal_context_t* context, int* entries, size_t* bytes, int* hits, int* misses);
+
+keyword_matcher_t* context_acquire_matcher(wmspal_context_t* context, const char* dictionary_file);
+void context_release_matcher(wmspal_context_t* context, keyword_matcher_t* matcher);
+
+legend_t* context_acquire_legend(wmspal_context_t* context, const wms_config_t* config);
+void context_release_legend(wmspal_context_t* context, legend_t* legend);
+
+#ifdef HAVE_GEOS
+GEOSContextHandle_t context_acquire_geos(wmspal_context_t* context);
+void context_release_geos(wmspal_context_t* context, GEOSContextHandle_t handle);
+#endif
+
+#ifdef HAVE_PROJ
+PJ_CONTEXT* context_acquire_proj(wmspal_context_t* context);
+void context_release_proj(wmspal_context_t* context, PJ_CONTEXT* proj);
+char* context_srs_wkt(wmspal_context_t* context, const char* srs);
+
+typedef struct srs_transform_s {
+    char* source;
+    char* target;
+    PJ_CONTEXT* proj;
+    PJ* pj;
+    struct srs_transform_s* next;
+} srs_transform_t;
+
+srs_transform_t* context_acquire_transform(wmspal_context_t* context, const char* source, const char* target);
+void context_release_transform(wmspal_context_t* context, srs_transform_t* transform);
+#endif
+
+#endif
\ No newline at end of file
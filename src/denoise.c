@@ -0,0 +1,406 @@
+#include "metrics.h"
+
+// Prefilter for the class-index image. Rendered maps carry antialiased
+// edges, labels and hatching that classify into slivers and speckle; every
+// one of them would otherwise be traced, queried and written. All passes are
+// row-major over 16-bit class ids, and the vertical passes compare whole rows
+// rather than walking columns, so the inner loops are branch-free compares
+// and selects that the compiler can vectorize.
+
+#define CLASS_ERODED 0xFFFE             // Removed by opening, waiting to be refilled
+#define DENOISE_MAX_RADIUS 16
+
+static const char* const denoise_names[] = {"mode", "open", "close", "mmu"};
+
+// "mode=2,open=1,close=1,mmu=32"; a bare name means 1
+int parse_denoise_options(const char* spec, denoise_options_t* options) {
+    memset(options, 0, sizeof(*options));
+    int* fields[] = {&options->mode_passes, &options->open_radius, &options->close_radius, &options->min_region};
+    
+    const char* p = spec;
+    while (*p) {
+        size_t len = strcspn(p, "=,");
+        int field = -1;
+        for (int i = 0; i < 4; i++) {
+            if (strlen(denoise_names[i]) == len && strncmp(p, denoise_names[i], len) == 0) field = i;
+        }
+        if (field < 0) return 1;
+        
+        long value = 1;
+        const char* end = p + len;
+        if (*end == '=') {
+            char* number_end;
+            value = strtol(end + 1, &number_end, 10);
+            if (number_end == end + 1) return 1;
+            end = number_end;
+        }
+        long limit = field == 3 ? 1000000 : DENOISE_MAX_RADIUS;
+        if (value < 0 || value > limit) return 1;
+        *fields[field] = (int)value;
+        
+        if (*end == ',') end++;
+        else if (*end != '\0') return 1;
+        p = end;
+    }
+    return 0;
+}
+
+bool denoise_enabled(const denoise_options_t* options) {
+    return options && (options->mode_passes > 0 || options->open_radius > 0 || options->close_radius > 0 ||
+                       options->min_region > 0);
+}
+
+// 3-tap majority: a pixel takes its neighbours' class when they agree, which
+// is the majority of three whenever one exists
+static void mode_rows(const unsigned short* src, unsigned short* dst, int width, int height) {
+    for (int y = 0; y < height; y++) {
+        const unsigned short* s = src + (size_t)y * width;
+        unsigned short* d = dst + (size_t)y * width;
+        d[0] = s[0];
+        for (int x = 1; x < width - 1; x++) {
+            unsigned short left = s[x - 1], mid = s[x], right = s[x + 1];
+            d[x] = left == right ? left : mid;
+        }
+        if (width > 1) d[width - 1] = s[width - 1];
+    }
+}
+
+static void mode_columns(const unsigned short* src, unsigned short* dst, int width, int height) {
+    memcpy(dst, src, (size_t)width * sizeof(unsigned short));
+    for (int y = 1; y < height - 1; y++) {
+        const unsigned short* up = src + (size_t)(y - 1) * width;
+        const unsigned short* mid = src + (size_t)y * width;
+        const unsigned short* down = src + (size_t)(y + 1) * width;
+        unsigned short* d = dst + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            unsigned short above = up[x], centre = mid[x], below = down[x];
+            d[x] = above == below ? above : centre;
+        }
+    }
+    if (height > 1) {
+        size_t last = (size_t)(height - 1) * width;
+        memcpy(dst + last, src + last, (size_t)width * sizeof(unsigned short));
+    }
+}
+
+// Mark every pixel whose row (or column) neighbours within radius are not all
+// of its class. Two separable passes give the square window; the image edge
+// does not count as a boundary.
+static void erode_rows(const unsigned short* src, unsigned short* dst, int width, int height, int radius) {
+    for (int y = 0; y < height; y++) {
+        const unsigned short* s = src + (size_t)y * width;
+        unsigned short* d = dst + (size_t)y * width;
+        memcpy(d, s, (size_t)width * sizeof(unsigned short));
+        for (int k = 1; k <= radius && k < width; k++) {
+            // Only one side exists within k of the edges; the interior loop has no bounds checks.
+            // In rows narrower than 2k some pixels have neither, and like at the column edges
+            // the missing neighbour is the pixel itself
+            for (int x = 0; x < k && x + k < width; x++) {
+                if (s[x + k] != s[x]) d[x] = CLASS_ERODED;
+            }
+            for (int x = k; x < width - k; x++) {
+                unsigned short left = s[x - k], mid = s[x], right = s[x + k];
+                d[x] = left == mid && right == mid ? d[x] : CLASS_ERODED;
+            }
+            for (int x = width - k > k ? width - k : k; x < width; x++) {
+                if (s[x - k] != s[x]) d[x] = CLASS_ERODED;
+            }
+        }
+    }
+}
+
+static void erode_columns(const unsigned short* src, unsigned short* dst, int width, int height, int radius) {
+    memcpy(dst, src, (size_t)width * height * sizeof(unsigned short));
+    for (int y = 0; y < height; y++) {
+        const unsigned short* mid = src + (size_t)y * width;
+        unsigned short* d = dst + (size_t)y * width;
+        for (int k = 1; k <= radius; k++) {
+            const unsigned short* up = src + (size_t)(y >= k ? y - k : y) * width;
+            const unsigned short* down = src + (size_t)(y + k < height ? y + k : y) * width;
+            for (int x = 0; x < width; x++) {
+                unsigned short above = up[x], centre = mid[x], below = down[x], current = d[x];
+                d[x] = above == centre && below == centre ? current : CLASS_ERODED;
+            }
+        }
+    }
+}
+
+static inline bool is_class(unsigned short id) {
+    return id < CLASS_ERODED;               // CLASS_NONE and CLASS_ERODED are the two largest ids
+}
+
+// A `target` pixel takes the class of its first neighbour that has one
+static inline unsigned short grow_pixel(unsigned short first, unsigned short mid, unsigned short second,
+                                        unsigned short target) {
+    unsigned short fill = is_class(first) ? first : second;
+    return (mid == target) & is_class(fill) ? fill : mid;
+}
+
+// One step of growth: `target` pixels take the class of a row neighbour,
+// then of a column neighbour. Reads and writes go to different buffers, so
+// each step grows every region by exactly one pixel. At the raster edge the
+// missing neighbour is the pixel itself, which is never a class when it is a
+// target. Returns whether any pixel was filled.
+static bool grow_step(unsigned short* data, unsigned short* scratch, int width, int height,
+                        unsigned short target) {
+    unsigned short changed = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned short* s = data + (size_t)y * width;
+        unsigned short* d = scratch + (size_t)y * width;
+        d[0] = grow_pixel(s[0], s[0], s[width > 1 ? 1 : 0], target);
+        changed |= d[0] != s[0];
+        for (int x = 1; x < width - 1; x++) {
+            unsigned short mid = s[x], value = grow_pixel(s[x - 1], mid, s[x + 1], target);
+            d[x] = value;
+            changed |= value != mid;
+        }
+        if (width > 1) {
+            d[width - 1] = grow_pixel(s[width - 2], s[width - 1], s[width - 1], target);
+            changed |= d[width - 1] != s[width - 1];
+        }
+    }
+    for (int y = 0; y < height; y++) {
+        const unsigned short* up = scratch + (size_t)(y > 0 ? y - 1 : y) * width;
+        const unsigned short* mid = scratch + (size_t)y * width;
+        const unsigned short* down = scratch + (size_t)(y + 1 < height ? y + 1 : y) * width;
+        unsigned short* d = data + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            unsigned short centre = mid[x], value = grow_pixel(up[x], centre, down[x], target);
+            d[x] = value;
+            changed |= value != centre;
+        }
+    }
+    return changed != 0;
+}
+
+// Opening: classes narrower than 2r+1 pixels are eroded away and the gap is
+// grown over by whatever survives around it. Pixels nothing reaches keep
+// their class.
+static void open_classes(unsigned short* data, unsigned short* scratch, int width, int height, int radius) {
+    size_t pixel_count = (size_t)width * height;
+    unsigned short* original = raster_alloc(pixel_count * sizeof(unsigned short));
+    if (!original) return;
+    memcpy(original, data, pixel_count * sizeof(unsigned short));
+    
+    erode_rows(data, scratch, width, height, radius);
+    erode_columns(scratch, data, width, height, radius);
+    // Unclassified pixels are left as they are
+    for (size_t i = 0; i < pixel_count; i++) data[i] = original[i] == CLASS_NONE ? CLASS_NONE : data[i];
+    
+    for (int step = 0; step < 2 * radius + 1; step++) {
+        if (!grow_step(data, scratch, width, height, CLASS_ERODED)) break;
+    }
+    for (size_t i = 0; i < pixel_count; i++) data[i] = data[i] == CLASS_ERODED ? original[i] : data[i];
+    raster_free(original);
+}
+
+// Separable max filter of a byte mask
+static void spread_mask(unsigned char* mask, unsigned char* scratch, int width, int height, int radius) {
+    for (int y = 0; y < height; y++) {
+        const unsigned char* s = mask + (size_t)y * width;
+        unsigned char* d = scratch + (size_t)y * width;
+        memcpy(d, s, width);
+        for (int k = 1; k <= radius; k++) {
+            for (int x = k; x < width; x++) d[x] |= s[x - k];
+            for (int x = 0; x < width - k; x++) d[x] |= s[x + k];
+        }
+    }
+    memcpy(mask, scratch, (size_t)width * height);
+    for (int y = 0; y < height; y++) {
+        unsigned char* d = mask + (size_t)y * width;
+        for (int k = 1; k <= radius; k++) {
+            if (y >= k) {
+                const unsigned char* up = scratch + (size_t)(y - k) * width;
+                for (int x = 0; x < width; x++) d[x] |= up[x];
+            }
+            if (y + k < height) {
+                const unsigned char* down = scratch + (size_t)(y + k) * width;
+                for (int x = 0; x < width; x++) d[x] |= down[x];
+            }
+        }
+    }
+}
+
+// Closing of the classified area: unclassified gaps narrower than 2r+1
+// pixels (antialiased edges, thin label strokes) are filled from both sides,
+// while wider unclassified areas keep their outline.
+static void close_classes(unsigned short* data, unsigned short* scratch, int width, int height, int radius) {
+    size_t pixel_count = (size_t)width * height;
+    unsigned char* was_none = raster_alloc(pixel_count);
+    unsigned char* near_none = raster_alloc(pixel_count);
+    unsigned char* mask_scratch = raster_alloc(pixel_count);
+    if (!was_none || !near_none || !mask_scratch) {
+        raster_free(was_none); raster_free(near_none); raster_free(mask_scratch);
+        return;
+    }
+    
+    for (size_t i = 0; i < pixel_count; i++) was_none[i] = data[i] == CLASS_NONE;
+    for (int step = 0; step < radius; step++) {
+        if (!grow_step(data, scratch, width, height, CLASS_NONE)) break;
+    }
+    
+    // Erode the grown area back: a filled pixel stays only if no unclassified pixel is within radius
+    for (size_t i = 0; i < pixel_count; i++) near_none[i] = data[i] == CLASS_NONE;
+    spread_mask(near_none, mask_scratch, width, height, radius);
+    for (size_t i = 0; i < pixel_count; i++) data[i] = was_none[i] && near_none[i] ? CLASS_NONE : data[i];
+    
+    raster_free(was_none);
+    raster_free(near_none);
+    raster_free(mask_scratch);
+}
+
+// Add the boundary `run` shares with `neighbour` to its component's count
+static void add_shared(key_map_t* shared, const class_run_t* runs, const int* parent, const int* small_index,
+                       int run, int neighbour, int length) {
+    int index = small_index[parent[run]];
+    if (index < 0 || runs[neighbour].id == CLASS_NONE) return;
+    uint64_t key = (uint64_t)index << 16 | runs[neighbour].id;
+    int count = 0;
+    key_map_get(shared, key, &count);
+    key_map_put(shared, key, count + length);
+}
+
+// Minimum mapping unit: components smaller than min_pixels take the class
+// they share the longest boundary with. Pieces on the raster edge are kept,
+// since they may continue in a neighbouring tile. Components are labelled
+// on row runs with union-find, so the work scales with the number of runs
+// rather than pixels.
+static int merge_small_regions(unsigned short* data, int width, int height, int min_pixels) {
+    class_runs_t labels;
+    if (label_class_runs(data, width, height, &labels) != 0) return 0;
+    const class_run_t* runs = labels.runs;
+    const int* row_first = labels.row_first;
+    const int* parent = labels.parent;
+    size_t run_count = labels.count;
+    
+    int* size = calloc(run_count, sizeof(int));
+    int* small_index = malloc(run_count * sizeof(int));
+    unsigned char* on_border = calloc(run_count, 1);
+    if (!size || !small_index || !on_border) {
+        free_class_runs(&labels); free(size); free(small_index); free(on_border);
+        return 0;
+    }
+    
+    for (size_t r = 0; r < run_count; r++) {
+        int root = parent[r];
+        size[root] += runs[r].end - runs[r].start;
+        if (runs[r].row == 0 || runs[r].row == height - 1 || runs[r].start == 0 || runs[r].end == width) {
+            on_border[root] = 1;
+        }
+    }
+    
+    // Number the small interior components and count the boundary each one shares with every class
+    int small_count = 0;
+    for (size_t r = 0; r < run_count; r++) {
+        small_index[r] = parent[r] == (int)r && size[r] < min_pixels && !on_border[r] ? small_count++ : -1;
+    }
+    key_map_t shared;
+    if (small_count == 0 || key_map_init(&shared, 1024) != 0) {
+        free_class_runs(&labels); free(size); free(small_index); free(on_border);
+        return 0;
+    }
+    
+    for (int y = 0; y < height; y++) {
+        for (int r = row_first[y] + 1; r < row_first[y + 1]; r++) {
+            add_shared(&shared, runs, parent, small_index, r, r - 1, 1);
+            add_shared(&shared, runs, parent, small_index, r - 1, r, 1);
+        }
+    }
+    for (int y = 1; y < height; y++) {
+        for (int a = row_first[y - 1], b = row_first[y]; a < row_first[y] && b < row_first[y + 1];) {
+            int overlap = class_run_overlap(&runs[a], &runs[b]);
+            if (runs[a].id != runs[b].id && overlap > 0) {
+                add_shared(&shared, runs, parent, small_index, a, b, overlap);
+                add_shared(&shared, runs, parent, small_index, b, a, overlap);
+            }
+            if (runs[a].end < runs[b].end) a++;
+            else b++;
+        }
+    }
+    
+    int* best_class = malloc((size_t)small_count * sizeof(int));
+    int* best_length = calloc((size_t)small_count, sizeof(int));
+    int merged = 0;
+    if (best_class && best_length) {
+        for (size_t slot = 0; slot < shared.capacity; slot++) {
+            if (shared.keys[slot] == UINT64_MAX) continue;
+            int index = (int)(shared.keys[slot] >> 16), id = (int)(shared.keys[slot] & 0xFFFF);
+            int length = shared.values[slot];
+            if (length > best_length[index] || (length == best_length[index] && id < best_class[index])) {
+                best_class[index] = id;
+                best_length[index] = length;
+            }
+        }
+        // Components surrounded only by unclassified pixels keep their class
+        for (size_t r = 0; r < run_count; r++) {
+            int index = small_index[parent[r]];
+            if (index < 0 || best_length[index] == 0) continue;
+            unsigned short* row = data + (size_t)runs[r].row * width;
+            for (int x = runs[r].start; x < runs[r].end; x++) row[x] = (unsigned short)best_class[index];
+        }
+        for (int index = 0; index < small_count; index++) merged += best_length[index] > 0;
+    }
+    
+    key_map_destroy(&shared);
+    free(best_class); free(best_length);
+    free_class_runs(&labels); free(size); free(small_index); free(on_border);
+    return merged;
+}
+
+// Run the enabled filters in order: close, mode, open, minimum mapping unit
+int denoise_class_image(class_image_t* classes, const denoise_options_t* options) {
+    if (!classes || !classes->data) return 1;
+    if (!denoise_enabled(options)) return 0;
+    
+    double started = metrics_begin();
+    int width = classes->width, height = classes->height;
+    size_t pixel_count = (size_t)width * height;
+    unsigned short* scratch = raster_alloc(pixel_count * sizeof(unsigned short));
+    if (!scratch) return 1;
+    
+    if (options->close_radius > 0) close_classes(classes->data, scratch, width, height, options->close_radius);
+    for (int pass = 0; pass < options->mode_passes; pass++) {
+        mode_rows(classes->data, scratch, width, height);
+        mode_columns(scratch, classes->data, width, height);
+    }
+    if (options->open_radius > 0) open_classes(classes->data, scratch, width, height, options->open_radius);
+    int merged = 0;
+    if (options->min_region > 0) merged = merge_small_regions(classes->data, width, height, options->min_region);
+    
+    raster_free(scratch);
+    metrics_end(METRIC_DENOISE, started);
+    if (merged > 0) printf("Denoise: merged %d regions below %d pixels\n", merged, options->min_region);
+    return 0;
+}
+
+// Replace the image with an edge map: 255 where the largest channel
+// difference to the right or lower neighbour exceeds the threshold, else 0
+int detect_edges_simple(image_t* img, unsigned char threshold) {
+    if (!img || !img->data) return 1;
+    int width = img->width, height = img->height, channels = img->channels;
+    unsigned char* edges = malloc((size_t)width * height);
+    if (!edges) return 1;
+    
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = img->data + (size_t)y * width * channels;
+        const unsigned char* below = y + 1 < height ? row + (size_t)width * channels : row;
+        for (int x = 0; x < width; x++) {
+            const unsigned char* p = row + (size_t)x * channels;
+            const unsigned char* right = x + 1 < width ? p + channels : p;
+            const unsigned char* down = below + (size_t)x * channels;
+            int strongest = 0;
+            for (int c = 0; c < channels; c++) {
+                int dx = abs(p[c] - right[c]), dy = abs(p[c] - down[c]);
+                if (dx > strongest) strongest = dx;
+                if (dy > strongest) strongest = dy;
+            }
+            edges[(size_t)y * width + x] = strongest > threshold ? 255 : 0;
+        }
+    }
+    
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        memset(img->data + i * channels, edges[i], channels);
+    }
+    free(edges);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include "../include/wmspal.h"
+#include <ctype.h>
+
+// Structured GetFeatureInfo parsing. Responses are scanned once, front to
+// back, and the first feature's scalar properties become attribute columns;
+// geometry and nested values are skipped without being materialized.
+
+static void add_attribute(attribute_t** attributes, int* count, int* capacity,
+                          const char* name, size_t name_len, const char* value, size_t value_len) {
+    if (*count >= *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *attributes = realloc(*attributes, *capacity * sizeof(attribute_t));
+    }
+    attribute_t* attribute = &(*attributes)[(*count)++];
+    attribute->name = strndup(name, name_len);
+    attribute->value = strndup(value, value_len);
+}
+
+void free_attributes(attribute_t* attributes, int count) {
+    if (!attributes) return;
+    for (int i = 0; i < count; i++) {
+        free(attributes[i].name);
+        free(attributes[i].value);
+    }
+    free(attributes);
+}
+
+// GeoJSON: properties of the first feature (GeoServer, QGIS Server, MapServer OGR output)
+static int parse_json(const char* body, size_t size, attribute_t** attributes, int* count) {
+    json_reader_t reader;
+    json_reader_init(&reader, body, size);
+    int capacity = 0;
+    bool done = false;
+    
+    while (!done) {
+        json_token_t token = json_next(&reader);
+        if (token == JSON_END || token == JSON_ERROR) break;
+        if (token != JSON_KEY) continue;
+        
+        if (strcmp(reader.text, "crs") == 0 || strcmp(reader.text, "geometry") == 0) {
+            if (json_skip(&reader, json_next(&reader)) != 0) break;
+            continue;
+        }
+        if (strcmp(reader.text, "properties") != 0) continue;
+        
+        token = json_next(&reader);
+        if (token != JSON_OBJECT_START) {
+            json_skip(&reader, token);
+            continue;
+        }
+        
+        for (;;) {
+            token = json_next(&reader);
+            if (token != JSON_KEY) break;
+            char* name = strdup(reader.text);
+            
+            token = json_next(&reader);
+            if (token == JSON_STRING || token == JSON_NUMBER) {
+                add_attribute(attributes, count, &capacity, name, strlen(name), reader.text, reader.text_size);
+            } else if (token == JSON_TRUE || token == JSON_FALSE) {
+                const char* value = token == JSON_TRUE ? "true" : "false";
+                add_attribute(attributes, count, &capacity, name, strlen(name), value, strlen(value));
+            } else if (json_skip(&reader, token) != 0) {
+                free(name);
+                break;
+            }
+            free(name);
+        }
+        done = true;
+    }
+    
+    json_reader_free(&reader);
+    return 0;
+}
+
+static void decode_entities(char* text) {
+    static const struct { const char* entity; char c; } entities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}
+    };
+    char* out = text;
+    for (char* p = text; *p; ) {
+        bool replaced = false;
+        if (*p == '&') {
+            for (size_t i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+                size_t len = strlen(entities[i].entity);
+                if (strncmp(p, entities[i].entity, len) == 0) {
+                    *out++ = entities[i].c;
+                    p += len;
+                    replaced = true;
+                    break;
+                }
+            }
+        }
+        if (!replaced) *out++ = *p++;
+    }
+    *out = '\0';
+}
+
+static void add_xml_attribute(attribute_t** attributes, int* count, int* capacity,
+                              const char* name, size_t name_len, const char* text, size_t text_len) {
+    // Unwrap CDATA and trim surrounding whitespace
+    if (text_len >= 12 && strncmp(text, "<![CDATA[", 9) == 0 && strncmp(text + text_len - 3, "]]>", 3) == 0) {
+        text += 9;
+        text_len -= 12;
+    }
+    while (text_len > 0 && isspace((unsigned char)*text)) { text++; text_len--; }
+    while (text_len > 0 && isspace((unsigned char)text[text_len - 1])) text_len--;
+    
+    add_attribute(attributes, count, capacity, name, name_len, text, text_len);
+    decode_entities((*attributes)[*count - 1].value);
+}
+
+typedef struct {
+    const char* name;
+    size_t name_len;
+    const char* content;    // First byte after the start tag
+    bool has_children;
+} xml_open_t;
+
+#define XML_MAX_DEPTH 64
+
+// GML: leaf elements of the first element that has any, which covers
+// featureMember wrappers as well as MapServer's <layer_feature> layout. ESRI's
+// <FIELDS name="value" .../> form carries the columns as XML attributes.
+static int parse_gml(const char* body, size_t size, attribute_t** attributes, int* count) {
+    xml_open_t stack[XML_MAX_DEPTH];
+    int depth = 0, capacity = 0;
+    int feature_depth = -1;    // Depth of the element whose leaves are being collected
+    const char* p = body;
+    const char* end = body + size;
+    
+    while (p < end) {
+        const char* lt = memchr(p, '<', end - p);
+        if (!lt) break;
+        p = lt + 1;
+        if (p >= end) break;
+        
+        if (*p == '!' || *p == '?') {
+            // Comment, CDATA, DOCTYPE or processing instruction
+            const char* close = NULL;
+            if (end - p >= 3 && strncmp(p, "!--", 3) == 0) {
+                for (const char* q = p + 3; q + 2 < end && !close; q++) {
+                    if (q[0] == '-' && q[1] == '-' && q[2] == '>') close = q + 2;
+                }
+            } else if (end - p >= 8 && strncmp(p, "![CDATA[", 8) == 0) {
+                for (const char* q = p + 8; q + 2 < end && !close; q++) {
+                    if (q[0] == ']' && q[1] == ']' && q[2] == '>') close = q + 2;
+                }
+            } else {
+                close = memchr(p, '>', end - p);
+            }
+            if (!close) break;
+            p = close + 1;
+            continue;
+        }
+        
+        bool closing = *p == '/';
+        if (closing) p++;
+        const char* name = p;
+        while (p < end && !isspace((unsigned char)*p) && *p != '>' && *p != '/') p++;
+        size_t name_len = p - name;
+        const char* gt = memchr(p, '>', end - p);
+        if (!gt) break;
+        bool self_closing = gt > p && gt[-1] == '/';
+        
+        if (closing) {
+            if (depth == 0) break;
+            xml_open_t* open = &stack[--depth];
+            bool gml = open->name_len > 4 && strncmp(open->name, "gml:", 4) == 0;
+            
+            if (!open->has_children && !gml && depth > 0) {
+                if (feature_depth < 0) feature_depth = depth - 1;
+                if (feature_depth == depth - 1) {
+                    // Column names drop the namespace prefix
+                    const char* colon = memchr(open->name, ':', open->name_len);
+                    const char* local = colon ? colon + 1 : open->name;
+                    size_t local_len = open->name_len - (local - open->name);
+                    add_xml_attribute(attributes, count, &capacity, local, local_len,
+                                      open->content, lt - open->content);
+                }
+            }
+            if (feature_depth >= 0 && depth <= feature_depth) break;    // First feature is complete
+            p = gt + 1;
+            continue;
+        }
+        
+        if (depth > 0) stack[depth - 1].has_children = true;
+        
+        if (self_closing && name_len == 6 && strncasecmp(name, "FIELDS", 6) == 0) {
+            // ESRI: <FIELDS OBJECTID="1" NAME="Chalk"/>
+            const char* q = p;
+            while (q < gt) {
+                while (q < gt && isspace((unsigned char)*q)) q++;
+                const char* attr = q;
+                while (q < gt && *q != '=' && !isspace((unsigned char)*q)) q++;
+                size_t attr_len = q - attr;
+                while (q < gt && *q != '"' && *q != '\'') q++;
+                if (q >= gt || attr_len == 0) break;
+                char quote = *q++;
+                const char* value = q;
+                while (q < gt && *q != quote) q++;
+                add_xml_attribute(attributes, count, &capacity, attr, attr_len, value, q - value);
+                q++;
+            }
+            break;
+        }
+        
+        if (!self_closing) {
+            if (depth >= XML_MAX_DEPTH) break;
+            stack[depth].name = name;
+            stack[depth].name_len = name_len;
+            stack[depth].content = gt + 1;
+            stack[depth].has_children = false;
+            depth++;
+        }
+        p = gt + 1;
+    }
+    return 0;
+}
+
+// Plain text: "name = value" lines of the first feature (GeoServer and MapServer layouts)
+static int parse_text(const char* body, size_t size, attribute_t** attributes, int* count) {
+    int capacity = 0;
+    const char* p = body;
+    const char* end = body + size;
+    
+    while (p < end) {
+        const char* eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        const char* line = p;
+        const char* line_end = eol;
+        p = eol + 1;
+        
+        while (line < line_end && isspace((unsigned char)*line)) line++;
+        while (line_end > line && isspace((unsigned char)line_end[-1])) line_end--;
+        if (line == line_end) continue;
+        
+        // A separator or a new feature header after some columns ends the first feature
+        if (*count > 0 && (*line == '-' || strncmp(line, "Feature ", 8) == 0)) break;
+        
+        const char* eq = NULL;
+        for (const char* q = line; q + 2 < line_end; q++) {
+            if (q[0] == ' ' && q[1] == '=' && q[2] == ' ') { eq = q; break; }
+        }
+        if (!eq) continue;
+        
+        const char* value = eq + 3;
+        size_t value_len = line_end - value;
+        if (value_len >= 2 && value[0] == '\'' && value[value_len - 1] == '\'') {
+            value++;
+            value_len -= 2;
+        }
+        if (value_len >= 9 && strncmp(value, "[GEOMETRY", 9) == 0) continue;
+        
+        add_attribute(attributes, count, &capacity, line, eq - line, value, value_len);
+    }
+    return 0;
+}
+
+int parse_feature_info(const char* body, size_t size, const char* info_format,
+                       attribute_t** attributes, int* attribute_count) {
+    *attributes = NULL;
+    *attribute_count = 0;
+    if (!body) return 1;
+    if (!info_format) info_format = "text/plain";
+    
+    if (strstr(info_format, "json")) return parse_json(body, size, attributes, attribute_count);
+    if (strstr(info_format, "gml") || strstr(info_format, "xml")) return parse_gml(body, size, attributes, attribute_count);
+    if (strstr(info_format, "text/plain")) return parse_text(body, size, attributes, attribute_count);
+    return 0;
+}
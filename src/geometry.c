@@ -0,0 +1,152 @@
+#include "../include/wmspal.h"
+#include <math.h>
+#include <float.h>
+
+#define MAX_INTERIOR_CELLS 20000
+
+double polygon_area(const polygon_t* polygon) {
+    double area = 0;
+    for (int i = 0; i < polygon->count; i++) {
+        int j = (i + 1) % polygon->count;
+        area += polygon->coords[i].x * polygon->coords[j].y - polygon->coords[j].x * polygon->coords[i].y;
+    }
+    return fabs(area) / 2.0;
+}
+
+bool point_in_polygon(const polygon_t* polygon, double x, double y) {
+    bool inside = false;
+    for (int i = 0, j = polygon->count - 1; i < polygon->count; j = i++) {
+        const coord_t* a = &polygon->coords[i];
+        const coord_t* b = &polygon->coords[j];
+        if ((a->y > y) != (b->y > y) && x < (b->x - a->x) * (y - a->y) / (b->y - a->y) + a->x) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+static double ring_distance_sq(const polygon_t* ring, double x, double y, double min_sq) {
+    for (int i = 0, j = ring->count - 1; i < ring->count; j = i++) {
+        const coord_t* a = &ring->coords[j];
+        const coord_t* b = &ring->coords[i];
+        double dx = b->x - a->x, dy = b->y - a->y;
+        double len = dx*dx + dy*dy;
+        double t = len > 0 ? ((x - a->x) * dx + (y - a->y) * dy) / len : 0;
+        if (t < 0) t = 0; else if (t > 1) t = 1;
+        double ex = a->x + t * dx - x, ey = a->y + t * dy - y;
+        if (ex*ex + ey*ey < min_sq) min_sq = ex*ex + ey*ey;
+    }
+    return min_sq;
+}
+
+typedef struct {
+    const polygon_t* outline;
+    const polygon_t* const* holes;
+    int hole_count;
+} interior_shape_t;
+
+// Distance from a point to the outline and holes, positive inside and negative outside
+static double signed_distance(const interior_shape_t* shape, double x, double y) {
+    double min_sq = ring_distance_sq(shape->outline, x, y, DBL_MAX);
+    bool inside = point_in_polygon(shape->outline, x, y);
+    for (int h = 0; h < shape->hole_count; h++) {
+        min_sq = ring_distance_sq(shape->holes[h], x, y, min_sq);
+        if (inside && point_in_polygon(shape->holes[h], x, y)) inside = false;
+    }
+    double d = sqrt(min_sq);
+    return inside ? d : -d;
+}
+
+typedef struct {
+    double x, y;       // Cell centre
+    double half;       // Half the cell size
+    double distance;   // Signed distance of the centre to the outline
+    double potential;  // Best distance any point in the cell could reach
+} interior_cell_t;
+
+static interior_cell_t make_cell(const interior_shape_t* shape, double x, double y, double half) {
+    interior_cell_t cell = {x, y, half, signed_distance(shape, x, y), 0};
+    cell.potential = cell.distance + half * M_SQRT2;
+    return cell;
+}
+
+// Max-heap on potential distance
+static void heap_push(interior_cell_t* heap, int* count, interior_cell_t cell) {
+    int i = (*count)++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent].potential >= cell.potential) break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = cell;
+}
+
+static interior_cell_t heap_pop(interior_cell_t* heap, int* count) {
+    interior_cell_t top = heap[0];
+    interior_cell_t last = heap[--(*count)];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && heap[child + 1].potential > heap[child].potential) child++;
+        if (heap[child].potential <= last.potential) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*count > 0) heap[i] = last;
+    return top;
+}
+
+// Pole of inaccessibility: the interior point farthest from the outline, found by
+// quadtree search to within `precision`. Unlike the vertex average it always
+// lies inside, even for concave or ring-shaped units. Traced polygons are
+// outer rings only, so the regions they enclose are passed as `holes`.
+coord_t polygon_interior_point(const polygon_t* polygon, const polygon_t* const* holes, int hole_count,
+                               double precision, double* clearance) {
+    coord_t best_point = {0, 0};
+    if (clearance) *clearance = 0;
+    if (!polygon || polygon->count == 0) return best_point;
+    
+    double minx = polygon->coords[0].x, maxx = minx, miny = polygon->coords[0].y, maxy = miny;
+    for (int i = 1; i < polygon->count; i++) {
+        minx = fmin(minx, polygon->coords[i].x); maxx = fmax(maxx, polygon->coords[i].x);
+        miny = fmin(miny, polygon->coords[i].y); maxy = fmax(maxy, polygon->coords[i].y);
+    }
+    double size = fmin(maxx - minx, maxy - miny);
+    best_point = polygon->coords[0];
+    if (size <= 0 || polygon->count < 3) return best_point;
+    if (precision <= 0) precision = size / 100.0;
+    
+    interior_cell_t* heap = malloc(MAX_INTERIOR_CELLS * sizeof(interior_cell_t));
+    if (!heap) return best_point;
+    int count = 0;
+    interior_shape_t shape = {polygon, holes, hole_count};
+    
+    double half = size / 2.0;
+    for (double x = minx; x < maxx && count < MAX_INTERIOR_CELLS; x += size) {
+        for (double y = miny; y < maxy && count < MAX_INTERIOR_CELLS; y += size) {
+            heap_push(heap, &count, make_cell(&shape, x + half, y + half, half));
+        }
+    }
+    
+    interior_cell_t best = make_cell(&shape, (minx + maxx) / 2.0, (miny + maxy) / 2.0, 0);
+    while (count > 0) {
+        interior_cell_t cell = heap_pop(heap, &count);
+        if (cell.distance > best.distance) best = cell;
+        if (cell.potential - best.distance <= precision) continue;
+        if (count + 4 > MAX_INTERIOR_CELLS) break;
+        
+        double h = cell.half / 2.0;
+        heap_push(heap, &count, make_cell(&shape, cell.x - h, cell.y - h, h));
+        heap_push(heap, &count, make_cell(&shape, cell.x + h, cell.y - h, h));
+        heap_push(heap, &count, make_cell(&shape, cell.x - h, cell.y + h, h));
+        heap_push(heap, &count, make_cell(&shape, cell.x + h, cell.y + h, h));
+    }
+    free(heap);
+    
+    best_point.x = best.x;
+    best_point.y = best.y;
+    if (clearance) *clearance = best.distance;
+    return best_point;
+}
@@ -1,10 +1,32 @@
-#include "../include/wmspal.h"
+#include "metrics.h"
+#include <math.h>
 
-#ifdef HAVE_PROJ
-#include <proj.h>
-#endif
+static int copy_file(const char* input_file, const char* output_file) {
+    FILE* in = fopen(input_file, "rb");
+    if (!in) return 1;
+    FILE* out = fopen(output_file, "wb");
+    if (!out) {
+        fclose(in);
+        return 1;
+    }
+    
+    char buffer[65536];
+    size_t n;
+    int status = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) {
+            status = 1;
+            break;
+        }
+    }
+    if (ferror(in)) status = 1;
+    fclose(in);
+    if (fclose(out) != 0) status = 1;
+    return status;
+}
 
-int georeference_image(const char* input_file, const char* output_file, const char* bbox, const char* srs) {
+static int write_georeference(wmspal_context_t* context, const char* input_file, const char* output_file,
+                              const char* bbox, const char* srs) {
     printf("Creating georeferencing metadata for %s\n", input_file);
     
     char metadata_file[512];
@@ -41,24 +63,17 @@ int georeference_image(const char* input_file, const char* output_file, const ch
     if (proj_file) {
 #ifdef HAVE_PROJ
         // Use PROJ to get proper WKT format
-        PJ_CONTEXT *ctx = proj_context_create();
-        PJ *P = proj_create(ctx, srs);
-        
-        if (P) {
-            const char *wkt = proj_as_wkt(ctx, P, PJ_WKT1_GDAL, NULL);
-            if (wkt) {
-                fprintf(proj_file, "%s\n", wkt);
-                printf("Created projection file with PROJ WKT: %s\n", prj_file);
-            } else {
-                fprintf(proj_file, "%s\n", srs);
-                printf("Created projection file with basic SRS: %s\n", prj_file);
-            }
-            proj_destroy(P);
+        char* wkt = context_srs_wkt(context, srs);
+        if (wkt) {
+            fprintf(proj_file, "%s\n", wkt);
+            printf("Created projection file with PROJ WKT: %s\n", prj_file);
+            free(wkt);
         } else {
             fprintf(proj_file, "%s\n", srs);
+            printf("Created projection file with basic SRS: %s\n", prj_file);
         }
-        proj_context_destroy(ctx);
 #else
+        (void)context;
         fprintf(proj_file, "%s\n", srs);
         printf("Created projection file (basic): %s\n", prj_file);
 #endif
@@ -68,15 +83,99 @@ int georeference_image(const char* input_file, const char* output_file, const ch
     printf("Created world file: %s\n", metadata_file);
     
     // Copy original image to output location
-    char copy_cmd[1024];
-    snprintf(copy_cmd, sizeof(copy_cmd), "cp \"%s\" \"%s\"", input_file, output_file);
-    int result = system(copy_cmd);
-    
-    if (result == 0) {
+    if (copy_file(input_file, output_file) == 0) {
         printf("Image copied to: %s\n", output_file);
         return 0;
     } else {
         fprintf(stderr, "Failed to copy image file\n");
         return 1;
     }
+}
+
+int georeference_image(wmspal_context_t* context, const char* input_file, const char* output_file,
+                       const char* bbox, const char* srs) {
+    double started = metrics_begin();
+    int status = write_georeference(context, input_file, output_file, bbox, srs);
+    metrics_end(METRIC_GEOREFERENCE, started);
+    return status;
+}
+
+// Reproject every ring of result in place to target_srs. Each ring goes through
+// PROJ in one strided batch call over its coord_t array; the transformation
+// itself is leased from the context, so it is set up once per SRS pair.
+int reproject_result(wmspal_context_t* context, vectorization_result_t* result, const char* target_srs) {
+    if (!result || !target_srs || !result->crs || strcasecmp(result->crs, target_srs) == 0) return 0;
+
+#ifdef HAVE_PROJ
+    double started = wmspal_now();
+    srs_transform_t* transform = context_acquire_transform(context, result->crs, target_srs);
+    if (!transform) return 1;
+    
+    double minx = HUGE_VAL, miny = HUGE_VAL, maxx = -HUGE_VAL, maxy = -HUGE_VAL;
+    size_t vertices = 0, failed = 0;
+    for (int f = 0; f < result->feature_count; f++) {
+        geological_feature_t* feature = &result->features[f];
+        for (int p = 0; p < feature->polygon_count; p++) {
+            polygon_t* ring = &feature->polygons[p];
+            if (ring->count == 0) continue;
+            
+            size_t count = (size_t)ring->count;
+            proj_trans_generic(transform->pj, PJ_FWD,
+                               &ring->coords[0].x, sizeof(coord_t), count,
+                               &ring->coords[0].y, sizeof(coord_t), count,
+                               NULL, 0, 0, NULL, 0, 0);
+            for (size_t k = 0; k < count; k++) {
+                const coord_t* c = &ring->coords[k];
+                if (!isfinite(c->x) || !isfinite(c->y)) {
+                    failed++;
+                    continue;
+                }
+                if (c->x < minx) minx = c->x;
+                if (c->x > maxx) maxx = c->x;
+                if (c->y < miny) miny = c->y;
+                if (c->y > maxy) maxy = c->y;
+            }
+            vertices += count;
+        }
+    }
+    
+    if (vertices == 0) {
+        // No geometry: carry the bbox corners across instead
+        double xs[4] = {result->minx, result->maxx, result->maxx, result->minx};
+        double ys[4] = {result->miny, result->miny, result->maxy, result->maxy};
+        proj_trans_generic(transform->pj, PJ_FWD, xs, sizeof(double), 4, ys, sizeof(double), 4,
+                           NULL, 0, 0, NULL, 0, 0);
+        for (int k = 0; k < 4; k++) {
+            if (!isfinite(xs[k]) || !isfinite(ys[k])) continue;
+            if (xs[k] < minx) minx = xs[k];
+            if (xs[k] > maxx) maxx = xs[k];
+            if (ys[k] < miny) miny = ys[k];
+            if (ys[k] > maxy) maxy = ys[k];
+        }
+    }
+    context_release_transform(context, transform);
+    
+    if (failed > 0) {
+        fprintf(stderr, "%zu of %zu vertices could not be transformed from %s to %s\n",
+                failed, vertices, result->crs, target_srs);
+        return 1;
+    }
+    
+    if (minx <= maxx && miny <= maxy) {
+        result->minx = minx;
+        result->miny = miny;
+        result->maxx = maxx;
+        result->maxy = maxy;
+    }
+    double seconds = wmspal_now() - started;
+    metrics_span(METRIC_REPROJECT, started, seconds);
+    printf("Reprojected %zu vertices from %s to %s in %.3f s\n", vertices, result->crs, target_srs, seconds);
+    free(result->crs);
+    result->crs = strdup(target_srs);
+    return 0;
+#else
+    (void)context;
+    fprintf(stderr, "Reprojecting to %s needs a build with PROJ\n", target_srs);
+    return 1;
+#endif
 }
\ No newline at end of file
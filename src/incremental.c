@@ -0,0 +1,476 @@
+#include "../include/wmspal.h"
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+// Run manifest for incremental tiled runs. The state directory remembers a
+// content hash of every tile's decoded pixels together with the parameters
+// that shaped it, the tile's vectorized polygons, and the GetFeatureInfo
+// answer chosen for each colour class with the point it was queried at. On
+// a rerun, tiles whose pixels hash the same are loaded instead of being
+// vectorized, and a class keeps its attribution as long as the tile holding
+// its query point is unchanged.
+//
+// Tile and class files carry the generation of the run that wrote them and
+// are never overwritten in place: a run writes generation N + 1 next to the
+// files of generation N that the manifest still points at, and only removes
+// those once the new manifest has replaced the old one. An interrupted run
+// therefore leaves the previous manifest and everything it refers to intact.
+
+#define RUN_MANIFEST_VERSION 2
+#define TILE_FILE_MAGIC "WMSPALT1"
+
+typedef struct {
+    color_t color;
+    coord_t point;
+    char* lithology;
+    unsigned generation;          // Of its class file
+} cached_class_t;
+
+struct run_manifest_s {
+    char* dir;
+    uint64_t params;              // Everything besides the pixels that shapes tile geometry
+    uint64_t attribute_params;    // INFO_FORMAT and dictionary
+    int cols, rows;
+    double minx, miny, maxx, maxy;
+    uint64_t* previous;           // Pixel hash per tile from the last run, 0 = unknown
+    uint64_t* current;
+    unsigned char* changed;
+    unsigned generation;          // Of the last completed run; this run writes generation + 1
+    unsigned* previous_generation;    // Per tile, of the polygons the last manifest points at
+    unsigned* current_generation;     // Per tile, of the polygons this run's manifest will point at
+    cached_class_t* classes;      // Attributions from the last run
+    int class_count;
+    bool attributes_valid;
+    int tiles_reused, tiles_changed;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_string(uint64_t hash, const char* text) {
+    // Include the terminator so adjacent fields cannot run into each other
+    return text ? fnv1a(hash, text, strlen(text) + 1) : fnv1a(hash, "", 1);
+}
+
+uint64_t image_hash(const image_t* img) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int shape[3] = {img->width, img->height, img->channels};
+    hash = fnv1a(hash, shape, sizeof(shape));
+    hash = fnv1a(hash, img->data, (size_t)img->width * img->height * img->channels);
+    if (img->palette) hash = fnv1a(hash, img->palette, (size_t)img->palette_size * sizeof(color_t));
+    return hash ? hash : 1;
+}
+
+static void state_path(const run_manifest_t* manifest, char* path, size_t path_size, const char* name) {
+    snprintf(path, path_size, "%s/%s", manifest->dir, name);
+}
+
+static void tile_path(const run_manifest_t* manifest, int col, int row, unsigned generation, char* path,
+                      size_t path_size) {
+    snprintf(path, path_size, "%s/tile_r%d_c%d_g%u.bin", manifest->dir, row, col, generation);
+}
+
+static void class_path(const run_manifest_t* manifest, color_t color, unsigned generation, char* path,
+                       size_t path_size) {
+    snprintf(path, path_size, "%s/class_%02x%02x%02x_g%u.info", manifest->dir, color.r, color.g, color.b,
+             generation);
+}
+
+static void free_cached_classes(run_manifest_t* manifest) {
+    for (int i = 0; i < manifest->class_count; i++) free(manifest->classes[i].lithology);
+    free(manifest->classes);
+    manifest->classes = NULL;
+    manifest->class_count = 0;
+}
+
+static void load_manifest(run_manifest_t* manifest) {
+    char path[1024];
+    state_path(manifest, path, sizeof(path), "manifest");
+    FILE* file = fopen(path, "r");
+    if (!file) return;
+    
+    char line[1024];
+    int version = 0, cols = 0, rows = 0;
+    unsigned long long params = 0, attribute_params = 0;
+    int capacity = 0;
+    
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        int row, col, r, g, b, n = 0;
+        unsigned long long hash;
+        unsigned generation;
+        double x, y;
+        
+        if (sscanf(line, "wmspal-run %d", &version) == 1 ||
+            sscanf(line, "generation %u", &manifest->generation) == 1 ||
+            sscanf(line, "params %llx", &params) == 1 ||
+            sscanf(line, "attribution %llx", &attribute_params) == 1 ||
+            sscanf(line, "grid %d %d", &cols, &rows) == 2) {
+            continue;
+        }
+        if (sscanf(line, "tile %d %d %llx %u", &row, &col, &hash, &generation) == 4) {
+            if (cols == manifest->cols && rows == manifest->rows && col >= 0 && col < cols && row >= 0 && row < rows) {
+                manifest->previous[(size_t)row * cols + col] = hash;
+                manifest->previous_generation[(size_t)row * cols + col] = generation;
+            }
+        } else if (sscanf(line, "class %u %d %d %d %lf %lf %n", &generation, &r, &g, &b, &x, &y, &n) == 6 &&
+                   n > 0) {
+            if (manifest->class_count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                manifest->classes = realloc(manifest->classes, capacity * sizeof(cached_class_t));
+            }
+            cached_class_t* cached = &manifest->classes[manifest->class_count++];
+            cached->color = (color_t){(unsigned char)r, (unsigned char)g, (unsigned char)b};
+            cached->point = (coord_t){x, y};
+            cached->lithology = strcmp(line + n, "-") == 0 ? NULL : strdup(line + n);
+            cached->generation = generation;
+        }
+    }
+    fclose(file);
+    
+    if (version != RUN_MANIFEST_VERSION || params != manifest->params || cols != manifest->cols ||
+        rows != manifest->rows) {
+        // Nothing is reused, but the old files are still known so they can be
+        // removed once this run's manifest replaces theirs
+        printf("Run manifest is from different parameters; every tile will be processed\n");
+        memset(manifest->previous, 0, (size_t)manifest->cols * manifest->rows * sizeof(uint64_t));
+        return;
+    }
+    manifest->attributes_valid = attribute_params == manifest->attribute_params;
+    if (!manifest->attributes_valid) {
+        printf("GetFeatureInfo settings changed; every class will be queried again\n");
+    }
+}
+
+// Open (creating if needed) the state directory for a tiled job. Only
+// parameters that change a tile's geometry for the same pixels go into the
+// parameter hash; output options such as --out-srs or --mvt do not.
+run_manifest_t* run_manifest_open(const char* dir, const wms_config_t* config) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
+        fprintf(stderr, "Invalid bbox format\n");
+        return NULL;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create state directory: %s\n", dir);
+        return NULL;
+    }
+    
+    run_manifest_t* manifest = calloc(1, sizeof(run_manifest_t));
+    if (!manifest) return NULL;
+    manifest->dir = strdup(dir);
+    manifest->cols = config->tile_cols;
+    manifest->rows = config->tile_rows;
+    manifest->minx = minx; manifest->miny = miny;
+    manifest->maxx = maxx; manifest->maxy = maxy;
+    
+    size_t tiles = (size_t)manifest->cols * manifest->rows;
+    manifest->previous = calloc(tiles, sizeof(uint64_t));
+    manifest->current = calloc(tiles, sizeof(uint64_t));
+    manifest->changed = calloc(tiles, 1);
+    manifest->previous_generation = calloc(tiles, sizeof(unsigned));
+    manifest->current_generation = calloc(tiles, sizeof(unsigned));
+    if (!manifest->dir || !manifest->previous || !manifest->current || !manifest->changed ||
+        !manifest->previous_generation || !manifest->current_generation) {
+        run_manifest_free(manifest);
+        return NULL;
+    }
+    
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = hash_string(hash, config->url);
+    hash = hash_string(hash, config->layer);
+    hash = hash_string(hash, config->srs);
+    hash = hash_string(hash, config->format);
+    hash = hash_string(hash, config->bbox);
+    hash = hash_string(hash, config->legend);
+    hash = fnv1a(hash, &config->denoise, sizeof(config->denoise));
+    int shape[5] = {config->width, config->height, config->tile_cols, config->tile_rows, config->tile_overlap};
+    manifest->params = fnv1a(hash, shape, sizeof(shape));
+    
+    hash = 0xcbf29ce484222325ULL;
+    hash = hash_string(hash, config->info_format);
+    hash = hash_string(hash, config->legend);
+    manifest->attribute_params = hash_string(hash, config->dictionary_file);
+    
+    load_manifest(manifest);
+    return manifest;
+}
+
+void run_manifest_free(run_manifest_t* manifest) {
+    if (!manifest) return;
+    free_cached_classes(manifest);
+    free(manifest->previous);
+    free(manifest->current);
+    free(manifest->changed);
+    free(manifest->previous_generation);
+    free(manifest->current_generation);
+    free(manifest->dir);
+    free(manifest);
+}
+
+static bool read_int(FILE* file, int* value) {
+    int32_t v;
+    if (fread(&v, sizeof(v), 1, file) != 1) return false;
+    *value = v;
+    return true;
+}
+
+static bool write_int(FILE* file, int value) {
+    int32_t v = value;
+    return fwrite(&v, sizeof(v), 1, file) == 1;
+}
+
+// Polygons stored for an unchanged tile, or NULL when they are missing or unreadable
+static vectorization_result_t* load_tile(const run_manifest_t* manifest, int col, int row, const char* srs) {
+    char path[1024];
+    tile_path(manifest, col, row, manifest->previous_generation[(size_t)row * manifest->cols + col], path,
+              sizeof(path));
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    
+    char magic[8];
+    int feature_count;
+    vectorization_result_t* result = calloc(1, sizeof(vectorization_result_t));
+    bool ok = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, TILE_FILE_MAGIC, 8) == 0 &&
+              read_int(file, &feature_count) && feature_count >= 0;
+    if (ok && feature_count > 0) {
+        result->features = calloc(feature_count, sizeof(geological_feature_t));
+        ok = result->features != NULL;
+    }
+    
+    for (int f = 0; ok && f < feature_count; f++) {
+        geological_feature_t* feature = &result->features[f];
+        unsigned char rgb[3];
+        int polygon_count;
+        ok = fread(rgb, 3, 1, file) == 1 && read_int(file, &polygon_count) && polygon_count >= 0;
+        if (!ok) break;
+        result->feature_count++;
+        feature->dominant_color = (color_t){rgb[0], rgb[1], rgb[2]};
+        feature->polygons = calloc(polygon_count ? polygon_count : 1, sizeof(polygon_t));
+        
+        for (int p = 0; ok && p < polygon_count; p++) {
+            polygon_t* polygon = &feature->polygons[p];
+            ok = read_int(file, &polygon->count) && polygon->count >= 0;
+            if (!ok) break;
+            polygon->coords = malloc((polygon->count ? polygon->count : 1) * sizeof(coord_t));
+            polygon->capacity = polygon->count;
+            feature->polygon_count++;
+            ok = polygon->coords && fread(polygon->coords, sizeof(coord_t), polygon->count, file) == (size_t)polygon->count;
+        }
+    }
+    fclose(file);
+    
+    if (!ok) {
+        free_vectorization_result(result);
+        return NULL;
+    }
+    result->crs = strdup(srs);
+    return result;
+}
+
+int run_manifest_store_tile(run_manifest_t* manifest, int col, int row, const vectorization_result_t* tile) {
+    char path[1024];
+    tile_path(manifest, col, row, manifest->generation + 1, path, sizeof(path));
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to write tile state: %s\n", path);
+        return 1;
+    }
+    
+    bool ok = fwrite(TILE_FILE_MAGIC, 8, 1, file) == 1 && write_int(file, tile->feature_count);
+    for (int f = 0; ok && f < tile->feature_count; f++) {
+        const geological_feature_t* feature = &tile->features[f];
+        unsigned char rgb[3] = {feature->dominant_color.r, feature->dominant_color.g, feature->dominant_color.b};
+        ok = fwrite(rgb, 3, 1, file) == 1 && write_int(file, feature->polygon_count);
+        for (int p = 0; ok && p < feature->polygon_count; p++) {
+            const polygon_t* polygon = &feature->polygons[p];
+            ok = write_int(file, polygon->count) &&
+                 fwrite(polygon->coords, sizeof(coord_t), polygon->count, file) == (size_t)polygon->count;
+        }
+    }
+    if (fclose(file) != 0) ok = false;
+    
+    if (!ok) {
+        fprintf(stderr, "Failed to write tile state: %s\n", path);
+        remove(path);
+        return 1;
+    }
+    manifest->current_generation[(size_t)row * manifest->cols + col] = manifest->generation + 1;
+    return 0;
+}
+
+// Record the tile's pixel hash and return its stored polygons when it is
+// unchanged since the last run; NULL means it has to be vectorized
+vectorization_result_t* run_manifest_reuse_tile(run_manifest_t* manifest, int col, int row, uint64_t hash,
+                                                const char* srs) {
+    size_t index = (size_t)row * manifest->cols + col;
+    manifest->current[index] = hash;
+    
+    vectorization_result_t* tile = NULL;
+    if (manifest->previous[index] == hash) tile = load_tile(manifest, col, row, srs);
+    if (tile) {
+        manifest->current_generation[index] = manifest->previous_generation[index];
+        manifest->tiles_reused++;
+    } else {
+        manifest->changed[index] = 1;
+        manifest->tiles_changed++;
+    }
+    return tile;
+}
+
+static bool point_in_changed_tile(const run_manifest_t* manifest, coord_t point) {
+    if (point.x < manifest->minx || point.x > manifest->maxx || point.y < manifest->miny || point.y > manifest->maxy) {
+        return true;
+    }
+    int col = (int)((point.x - manifest->minx) / (manifest->maxx - manifest->minx) * manifest->cols);
+    int row = (int)((manifest->maxy - point.y) / (manifest->maxy - manifest->miny) * manifest->rows);
+    if (col >= manifest->cols) col = manifest->cols - 1;
+    if (row >= manifest->rows) row = manifest->rows - 1;
+    return manifest->changed[(size_t)row * manifest->cols + col] != 0;
+}
+
+static char* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = length >= 0 ? malloc(length + 1) : NULL;
+    if (data && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (!data) return NULL;
+    data[length] = '\0';
+    *size = length;
+    return data;
+}
+
+// Carry over the previous answer for every class whose query point lies in
+// an unchanged tile. attribute_features() then only queries the rest.
+int run_manifest_reuse_attributes(run_manifest_t* manifest, vectorization_result_t* result, const char* info_format) {
+    if (!manifest->attributes_valid) return 0;
+    
+    int reused = 0;
+    for (int f = 0; f < result->feature_count; f++) {
+        geological_feature_t* feature = &result->features[f];
+        if (feature->polygon_count == 0 || feature->feature_info) continue;
+        
+        const cached_class_t* cached = NULL;
+        for (int c = 0; c < manifest->class_count && !cached; c++) {
+            const color_t* color = &manifest->classes[c].color;
+            if (color->r == feature->dominant_color.r && color->g == feature->dominant_color.g &&
+                color->b == feature->dominant_color.b) {
+                cached = &manifest->classes[c];
+            }
+        }
+        if (!cached || point_in_changed_tile(manifest, cached->point)) continue;
+        
+        char path[1024];
+        size_t size = 0;
+        class_path(manifest, cached->color, cached->generation, path, sizeof(path));
+        char* info = read_file(path, &size);
+        if (!info) continue;
+        
+        feature->feature_info = info;
+        parse_feature_info(info, size, info_format, &feature->attributes, &feature->attribute_count);
+        if (cached->lithology) feature->lithology = strdup(cached->lithology);
+        feature->info_point = cached->point;
+        reused++;
+    }
+    
+    printf("Reused attribution for %d of %d classes\n", reused, result->feature_count);
+    return reused;
+}
+
+// Files of the last generation that the new manifest no longer points at
+static void remove_superseded_files(const run_manifest_t* manifest) {
+    char path[1024];
+    for (int row = 0; row < manifest->rows; row++) {
+        for (int col = 0; col < manifest->cols; col++) {
+            size_t index = (size_t)row * manifest->cols + col;
+            unsigned generation = manifest->previous_generation[index];
+            if (generation != 0 && generation != manifest->current_generation[index]) {
+                tile_path(manifest, col, row, generation, path, sizeof(path));
+                remove(path);
+            }
+        }
+    }
+    for (int c = 0; c < manifest->class_count; c++) {
+        class_path(manifest, manifest->classes[c].color, manifest->classes[c].generation, path, sizeof(path));
+        remove(path);
+    }
+}
+
+// Write the manifest for the run that just finished. It is replaced
+// atomically, and this run's tile and class files were written under a new
+// generation, so an interrupted run leaves the previous state usable.
+int run_manifest_save(run_manifest_t* manifest, const vectorization_result_t* result) {
+    char path[1024], temp_path[1024 + 4];
+    state_path(manifest, path, sizeof(path), "manifest");
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    unsigned generation = manifest->generation + 1;
+    
+    FILE* file = fopen(temp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to write run manifest: %s\n", temp_path);
+        return 1;
+    }
+    fprintf(file, "wmspal-run %d\n", RUN_MANIFEST_VERSION);
+    fprintf(file, "generation %u\n", generation);
+    fprintf(file, "params %016llx\n", (unsigned long long)manifest->params);
+    fprintf(file, "attribution %016llx\n", (unsigned long long)manifest->attribute_params);
+    fprintf(file, "grid %d %d\n", manifest->cols, manifest->rows);
+    for (int row = 0; row < manifest->rows; row++) {
+        for (int col = 0; col < manifest->cols; col++) {
+            size_t index = (size_t)row * manifest->cols + col;
+            uint64_t hash = manifest->current[index];
+            if (hash && manifest->current_generation[index]) {
+                fprintf(file, "tile %d %d %016llx %u\n", row, col, (unsigned long long)hash,
+                        manifest->current_generation[index]);
+            }
+        }
+    }
+    
+    int status = 0;
+    for (int f = 0; f < result->feature_count; f++) {
+        const geological_feature_t* feature = &result->features[f];
+        if (!feature->feature_info) continue;
+        
+        char info_path[1024];
+        class_path(manifest, feature->dominant_color, generation, info_path, sizeof(info_path));
+        FILE* info = fopen(info_path, "wb");
+        if (!info || fputs(feature->feature_info, info) == EOF) status = 1;
+        if (info && fclose(info) != 0) status = 1;
+        if (status != 0) {
+            fprintf(stderr, "Failed to write class state: %s\n", info_path);
+            break;
+        }
+        fprintf(file, "class %u %d %d %d %.17g %.17g %s\n", generation,
+                feature->dominant_color.r, feature->dominant_color.g, feature->dominant_color.b,
+                feature->info_point.x, feature->info_point.y, feature->lithology ? feature->lithology : "-");
+    }
+    
+    if (fclose(file) != 0) status = 1;
+    if (status != 0 || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Failed to write run manifest: %s\n", path);
+        remove(temp_path);
+        return 1;
+    }
+    remove_superseded_files(manifest);
+    
+    printf("Incremental run: %d tiles changed, %d reused\n", manifest->tiles_changed, manifest->tiles_reused);
+    return 0;
+}
\ No newline at end of file
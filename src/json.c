@@ -0,0 +1,178 @@
+#include "../include/wmspal.h"
+
+// Minimal pull tokenizer for JSON. It walks the buffer once and hands out one
+// token at a time without building a document tree; string tokens are decoded
+// (escapes, \u sequences to UTF-8) into the reader's scratch buffer.
+
+void json_reader_init(json_reader_t* reader, const char* data, size_t size) {
+    memset(reader, 0, sizeof(json_reader_t));
+    reader->pos = data;
+    reader->end = data + size;
+}
+
+void json_reader_free(json_reader_t* reader) {
+    free(reader->text);
+    reader->text = NULL;
+    reader->text_capacity = 0;
+}
+
+static void text_append(json_reader_t* reader, char c) {
+    if (reader->text_size + 2 > reader->text_capacity) {
+        reader->text_capacity = reader->text_capacity ? reader->text_capacity * 2 : 64;
+        reader->text = realloc(reader->text, reader->text_capacity);
+    }
+    reader->text[reader->text_size++] = c;
+    reader->text[reader->text_size] = '\0';
+}
+
+static void text_append_utf8(json_reader_t* reader, unsigned int cp) {
+    if (cp < 0x80) {
+        text_append(reader, (char)cp);
+    } else if (cp < 0x800) {
+        text_append(reader, (char)(0xC0 | (cp >> 6)));
+        text_append(reader, (char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        text_append(reader, (char)(0xE0 | (cp >> 12)));
+        text_append(reader, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        text_append(reader, (char)(0x80 | (cp & 0x3F)));
+    } else {
+        text_append(reader, (char)(0xF0 | (cp >> 18)));
+        text_append(reader, (char)(0x80 | ((cp >> 12) & 0x3F)));
+        text_append(reader, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        text_append(reader, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static int hex4(const char* p, const char* end, unsigned int* value) {
+    if (end - p < 4) return 1;
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9') *value |= c - '0';
+        else if (c >= 'a' && c <= 'f') *value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') *value |= c - 'A' + 10;
+        else return 1;
+    }
+    return 0;
+}
+
+static int read_string(json_reader_t* reader) {
+    reader->pos++;    // Opening quote
+    while (reader->pos < reader->end && *reader->pos != '"') {
+        char c = *reader->pos++;
+        if (c != '\\') {
+            text_append(reader, c);
+            continue;
+        }
+        if (reader->pos >= reader->end) return 1;
+        c = *reader->pos++;
+        switch (c) {
+            case 'b': text_append(reader, '\b'); break;
+            case 'f': text_append(reader, '\f'); break;
+            case 'n': text_append(reader, '\n'); break;
+            case 'r': text_append(reader, '\r'); break;
+            case 't': text_append(reader, '\t'); break;
+            case 'u': {
+                unsigned int cp;
+                if (hex4(reader->pos, reader->end, &cp) != 0) return 1;
+                reader->pos += 4;
+                // Combine UTF-16 surrogate pairs
+                if (cp >= 0xD800 && cp < 0xDC00 && reader->end - reader->pos >= 6 &&
+                    reader->pos[0] == '\\' && reader->pos[1] == 'u') {
+                    unsigned int low;
+                    if (hex4(reader->pos + 2, reader->end, &low) == 0 && low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        reader->pos += 6;
+                    }
+                }
+                text_append_utf8(reader, cp);
+                break;
+            }
+            default: text_append(reader, c); break;
+        }
+    }
+    if (reader->pos >= reader->end) return 1;
+    reader->pos++;    // Closing quote
+    return 0;
+}
+
+json_token_t json_next(json_reader_t* reader) {
+    if (!reader->text) {
+        reader->text_capacity = 64;
+        reader->text = malloc(reader->text_capacity);
+    }
+    reader->text_size = 0;
+    reader->text[0] = '\0';
+    
+    for (;;) {
+        while (reader->pos < reader->end &&
+               (*reader->pos == ' ' || *reader->pos == '\t' || *reader->pos == '\n' || *reader->pos == '\r' ||
+                *reader->pos == ':')) {
+            reader->pos++;
+        }
+        if (reader->pos >= reader->end) return reader->depth == 0 ? JSON_END : JSON_ERROR;
+        if (*reader->pos != ',') break;
+        reader->pos++;
+        if (reader->depth > 0 && reader->stack[reader->depth - 1] == '{') reader->expect_key = true;
+    }
+    
+    char c = *reader->pos;
+    switch (c) {
+        case '{':
+        case '[':
+            if (reader->depth >= JSON_MAX_DEPTH) return JSON_ERROR;
+            reader->stack[reader->depth++] = c;
+            reader->expect_key = c == '{';
+            reader->pos++;
+            return c == '{' ? JSON_OBJECT_START : JSON_ARRAY_START;
+        case '}':
+        case ']':
+            if (reader->depth == 0) return JSON_ERROR;
+            reader->depth--;
+            reader->expect_key = false;
+            reader->pos++;
+            return c == '}' ? JSON_OBJECT_END : JSON_ARRAY_END;
+        case '"': {
+            bool key = reader->expect_key;
+            if (read_string(reader) != 0) return JSON_ERROR;
+            reader->expect_key = false;
+            return key ? JSON_KEY : JSON_STRING;
+        }
+        default:
+            break;
+    }
+    
+    if (reader->end - reader->pos >= 4 && strncmp(reader->pos, "true", 4) == 0) {
+        reader->pos += 4;
+        return JSON_TRUE;
+    }
+    if (reader->end - reader->pos >= 5 && strncmp(reader->pos, "false", 5) == 0) {
+        reader->pos += 5;
+        return JSON_FALSE;
+    }
+    if (reader->end - reader->pos >= 4 && strncmp(reader->pos, "null", 4) == 0) {
+        reader->pos += 4;
+        return JSON_NULL;
+    }
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        while (reader->pos < reader->end &&
+               ((*reader->pos && strchr("+-.eE", *reader->pos)) || (*reader->pos >= '0' && *reader->pos <= '9'))) {
+            text_append(reader, *reader->pos++);
+        }
+        return JSON_NUMBER;
+    }
+    return JSON_ERROR;
+}
+
+// Skip the rest of a value whose first token has just been read
+int json_skip(json_reader_t* reader, json_token_t first) {
+    if (first != JSON_OBJECT_START && first != JSON_ARRAY_START) return first == JSON_ERROR ? 1 : 0;
+    
+    int target = reader->depth - 1;
+    while (reader->depth > target) {
+        json_token_t token = json_next(reader);
+        if (token == JSON_ERROR || token == JSON_END) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "../include/wmspal.h"
+
+// Open-addressing hash map from 64-bit keys to ints (linear probing)
+
+#define EMPTY_KEY UINT64_MAX
+
+static uint64_t hash_key(uint64_t key) {
+    // splitmix64 finalizer
+    key ^= key >> 30; key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27; key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+int key_map_init(key_map_t* map, size_t capacity) {
+    map->capacity = capacity;
+    map->count = 0;
+    map->keys = malloc(capacity * sizeof(uint64_t));
+    map->values = malloc(capacity * sizeof(int));
+    if (!map->keys || !map->values) {
+        free(map->keys); free(map->values);
+        map->keys = NULL; map->values = NULL;
+        return 1;
+    }
+    memset(map->keys, 0xFF, capacity * sizeof(uint64_t));
+    return 0;
+}
+
+void key_map_destroy(key_map_t* map) {
+    free(map->keys);
+    free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+    map->count = 0;
+}
+
+static void key_map_grow(key_map_t* map) {
+    key_map_t old = *map;
+    if (key_map_init(map, old.capacity * 2) != 0) {
+        *map = old;
+        return;
+    }
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.keys[i] != EMPTY_KEY) key_map_put(map, old.keys[i], old.values[i]);
+    }
+    key_map_destroy(&old);
+}
+
+void key_map_put(key_map_t* map, uint64_t key, int value) {
+    if ((map->count + 1) * 2 > map->capacity) key_map_grow(map);
+    
+    size_t mask = map->capacity - 1;
+    size_t i = hash_key(key) & mask;
+    while (map->keys[i] != EMPTY_KEY && map->keys[i] != key) i = (i + 1) & mask;
+    if (map->keys[i] == EMPTY_KEY) map->count++;
+    map->keys[i] = key;
+    map->values[i] = value;
+}
+
+bool key_map_get(const key_map_t* map, uint64_t key, int* value) {
+    size_t mask = map->capacity - 1;
+    size_t i = hash_key(key) & mask;
+    while (map->keys[i] != EMPTY_KEY) {
+        if (map->keys[i] == key) {
+            *value = map->values[i];
+            return true;
+        }
+        i = (i + 1) & mask;
+    }
+    return false;
+}
+
+// Remove a key, returning its value; uses backward-shift deletion so no tombstones build up
+bool key_map_take(key_map_t* map, uint64_t key, int* value) {
+    size_t mask = map->capacity - 1;
+    size_t i = hash_key(key) & mask;
+    while (map->keys[i] != key) {
+        if (map->keys[i] == EMPTY_KEY) return false;
+        i = (i + 1) & mask;
+    }
+    if (value) *value = map->values[i];
+    
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (map->keys[j] == EMPTY_KEY) break;
+        size_t home = hash_key(map->keys[j]) & mask;
+        // Move the entry back unless its home slot lies cyclically in (i, j]
+        bool in_range = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!in_range) {
+            map->keys[i] = map->keys[j];
+            map->values[i] = map->values[j];
+            i = j;
+        }
+    }
+    map->keys[i] = EMPTY_KEY;
+    map->count--;
+    return true;
+}
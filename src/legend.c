@@ -0,0 +1,317 @@
+#include "context.h"
+#include <ctype.h>
+#include <math.h>
+
+// Fixed symbology. When a layer's legend lists the fill colour of every
+// class, classes come from the legend instead of clustering: each quantized
+// RGB value is mapped to its nearest legend colour once, when the legend is
+// loaded, so classifying a pixel is one table load. Labels and attributes
+// come from the legend too, so no GetFeatureInfo request is made.
+
+#define LEGEND_TOLERANCE 30.0   // Max RGB distance to a legend colour, as for clustered classes
+#define LEGEND_LUT_SIZE (1u << (3 * LEGEND_LUT_BITS))
+#define LEGEND_LUT_SHIFT (8 - LEGEND_LUT_BITS)
+
+static inline unsigned lut_index(unsigned r, unsigned g, unsigned b) {
+    return (r >> LEGEND_LUT_SHIFT) << (2 * LEGEND_LUT_BITS) | (g >> LEGEND_LUT_SHIFT) << LEGEND_LUT_BITS |
+           b >> LEGEND_LUT_SHIFT;
+}
+
+void legend_free(legend_t* legend) {
+    if (!legend) return;
+    for (int i = 0; i < legend->count; i++) {
+        free(legend->entries[i].label);
+        free_attributes(legend->entries[i].attributes, legend->entries[i].attribute_count);
+    }
+    free(legend->entries);
+    free(legend->colors);
+    free(legend->lut);
+    free(legend);
+}
+
+// Append an entry; a colour already listed keeps its first label
+static int legend_add(legend_t* legend, int* capacity, color_t color, const char* label) {
+    for (int i = 0; i < legend->count; i++) {
+        const color_t* other = &legend->entries[i].color;
+        if (other->r == color.r && other->g == color.g && other->b == color.b) return 1;
+    }
+    if (legend->count >= CLASS_NONE - 1) return 1;
+    if (legend->count >= *capacity) {
+        int grown = *capacity ? *capacity * 2 : 16;
+        legend_entry_t* entries = realloc(legend->entries, grown * sizeof(legend_entry_t));
+        if (!entries) return 1;
+        legend->entries = entries;
+        *capacity = grown;
+    }
+    legend_entry_t* entry = &legend->entries[legend->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->color = color;
+    entry->label = strdup(label);
+    return 0;
+}
+
+// Every cell of the table takes the nearest entry within tolerance of the
+// cell's centre. Each entry only visits the cells of its tolerance cube, so
+// building costs entries x cube size rather than entries x table size.
+static int legend_build_lut(legend_t* legend) {
+    legend->lut = malloc(LEGEND_LUT_SIZE * sizeof(unsigned short));
+    float* nearest = malloc(LEGEND_LUT_SIZE * sizeof(float));
+    legend->colors = malloc((size_t)legend->count * sizeof(color_t));
+    if (!legend->lut || !nearest || !legend->colors) {
+        free(nearest);
+        return 1;
+    }
+    for (size_t i = 0; i < LEGEND_LUT_SIZE; i++) {
+        legend->lut[i] = CLASS_NONE;
+        nearest[i] = (float)LEGEND_TOLERANCE;
+    }
+    
+    int cells = 1 << LEGEND_LUT_BITS, step = 1 << LEGEND_LUT_SHIFT;
+    int reach = (int)ceil(LEGEND_TOLERANCE / step) + 1;
+    for (int e = 0; e < legend->count; e++) {
+        color_t color = legend->entries[e].color;
+        legend->colors[e] = color;
+        int centre[3] = {color.r / step, color.g / step, color.b / step};
+        int low[3], high[3];
+        for (int c = 0; c < 3; c++) {
+            low[c] = centre[c] - reach < 0 ? 0 : centre[c] - reach;
+            high[c] = centre[c] + reach >= cells ? cells - 1 : centre[c] + reach;
+        }
+        for (int r = low[0]; r <= high[0]; r++) {
+            double dr = r * step + step / 2.0 - color.r;
+            for (int g = low[1]; g <= high[1]; g++) {
+                double dg = g * step + step / 2.0 - color.g;
+                for (int b = low[2]; b <= high[2]; b++) {
+                    double db = b * step + step / 2.0 - color.b;
+                    float distance = (float)sqrt(dr * dr + dg * dg + db * db);
+                    unsigned cell = (unsigned)r << (2 * LEGEND_LUT_BITS) | (unsigned)g << LEGEND_LUT_BITS | b;
+                    if (distance < nearest[cell]) {
+                        nearest[cell] = distance;
+                        legend->lut[cell] = (unsigned short)e;
+                    }
+                }
+            }
+        }
+    }
+    free(nearest);
+    return 0;
+}
+
+static bool parse_color(const char* text, color_t* color) {
+    unsigned r, g, b;
+    char tail;
+    if (text[0] == '#' && strlen(text) == 7 && sscanf(text + 1, "%2x%2x%2x", &r, &g, &b) == 3) {
+        *color = (color_t){(unsigned char)r, (unsigned char)g, (unsigned char)b};
+        return true;
+    }
+    if (sscanf(text, "%u,%u,%u%c", &r, &g, &b, &tail) == 3 && r < 256 && g < 256 && b < 256) {
+        *color = (color_t){(unsigned char)r, (unsigned char)g, (unsigned char)b};
+        return true;
+    }
+    return false;
+}
+
+static char* trim(char* text) {
+    while (isspace((unsigned char)*text)) text++;
+    for (char* end = text + strlen(text); end > text && isspace((unsigned char)end[-1]); ) *--end = '\0';
+    return text;
+}
+
+// Mapping files hold one "#rrggbb = Label" (or "r,g,b = Label") per line,
+// optionally followed by "; name=value" attribute columns. Blank lines and
+// lines starting with '#' and a space are ignored.
+legend_t* legend_load_file(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open legend file: %s\n", path);
+        return NULL;
+    }
+    
+    legend_t* legend = calloc(1, sizeof(legend_t));
+    int capacity = 0, line_number = 0;
+    char line[1024];
+    while (legend && fgets(line, sizeof(line), file)) {
+        line_number++;
+        char* text = trim(line);
+        if (*text == '\0' || (text[0] == '#' && (text[1] == '\0' || isspace((unsigned char)text[1])))) continue;
+        
+        char* label = strchr(text, '=');
+        color_t color;
+        if (!label || (*label = '\0', !parse_color(trim(text), &color))) {
+            fprintf(stderr, "Legend line %d: expected '#rrggbb = Label'\n", line_number);
+            continue;
+        }
+        char* columns = strchr(++label, ';');
+        if (columns) *columns++ = '\0';
+        label = trim(label);
+        if (legend_add(legend, &capacity, color, label) != 0) continue;
+        
+        legend_entry_t* entry = &legend->entries[legend->count - 1];
+        int attribute_capacity = 0;
+        for (char* column = columns, *next; column; column = next) {
+            next = strchr(column, ';');
+            if (next) *next++ = '\0';
+            char* value = strchr(column, '=');
+            if (!value) continue;
+            *value++ = '\0';
+            char* name = trim(column);
+            value = trim(value);
+            if (*name == '\0') continue;
+            if (entry->attribute_count >= attribute_capacity) {
+                attribute_capacity = attribute_capacity ? attribute_capacity * 2 : 4;
+                entry->attributes = realloc(entry->attributes, attribute_capacity * sizeof(attribute_t));
+            }
+            entry->attributes[entry->attribute_count].name = strdup(name);
+            entry->attributes[entry->attribute_count].value = strdup(value);
+            entry->attribute_count++;
+        }
+    }
+    fclose(file);
+    
+    if (!legend || legend->count == 0 || legend_build_lut(legend) != 0) {
+        fprintf(stderr, "Legend file has no usable entries: %s\n", path);
+        legend_free(legend);
+        return NULL;
+    }
+    printf("Loaded legend: %s (%d classes)\n", path, legend->count);
+    return legend;
+}
+
+// GetLegendGraphic in JSON (GeoServer): every rule with a "#rrggbb" fill in
+// one of its symbolizers becomes an entry, labelled by its title or name
+legend_t* legend_parse_json(const char* body, size_t size) {
+    legend_t* legend = calloc(1, sizeof(legend_t));
+    if (!legend) return NULL;
+    int capacity = 0;
+    
+    json_reader_t reader;
+    json_reader_init(&reader, body, size);
+    json_token_t token;
+    while ((token = json_next(&reader)) != JSON_END && token != JSON_ERROR) {
+        if (token != JSON_KEY || strcmp(reader.text, "rules") != 0) continue;
+        if (json_next(&reader) != JSON_ARRAY_START) break;
+        
+        while ((token = json_next(&reader)) == JSON_OBJECT_START) {
+            int rule_depth = reader.depth;
+            char title[256] = "", name[256] = "";
+            color_t fill;
+            bool have_fill = false;
+            
+            while (reader.depth >= rule_depth) {
+                token = json_next(&reader);
+                if (token == JSON_END || token == JSON_ERROR) break;
+                if (token != JSON_KEY) continue;
+                bool at_rule = reader.depth == rule_depth;
+                char key[16];
+                snprintf(key, sizeof(key), "%s", reader.text);
+                
+                // Objects and arrays are walked into, since fills sit inside the symbolizers
+                token = json_next(&reader);
+                if (token != JSON_STRING) continue;
+                if (at_rule && strcmp(key, "title") == 0) snprintf(title, sizeof(title), "%s", reader.text);
+                else if (at_rule && strcmp(key, "name") == 0) snprintf(name, sizeof(name), "%s", reader.text);
+                else if (!have_fill && strcmp(key, "fill") == 0) have_fill = parse_color(reader.text, &fill);
+            }
+            if (token == JSON_END || token == JSON_ERROR) break;
+            if (have_fill) legend_add(legend, &capacity, fill, title[0] ? title : name);
+        }
+        break;
+    }
+    json_reader_free(&reader);
+    
+    if (legend->count == 0 || legend_build_lut(legend) != 0) {
+        legend_free(legend);
+        return NULL;
+    }
+    return legend;
+}
+
+static legend_t* legend_fetch(const wms_config_t* config) {
+    if (!config->url || !config->layer) {
+        fprintf(stderr, "A legend from the server needs the WMS URL and layer\n");
+        return NULL;
+    }
+    char url[2048];
+    snprintf(url, sizeof(url), "%s?SERVICE=WMS&VERSION=1.1.1&REQUEST=GetLegendGraphic&LAYER=%s&FORMAT=application/json",
+             config->url, config->layer);
+    
+    printf("Fetching legend: %s\n", url);
+    char* body = NULL;
+    size_t size = 0;
+    if (wms_http_get(config->context, url, &body, &size) != 0) {
+        fprintf(stderr, "GetLegendGraphic request failed\n");
+        return NULL;
+    }
+    legend_t* legend = legend_parse_json(body, size);
+    free(body);
+    if (!legend) {
+        fprintf(stderr, "Legend for layer %s lists no fill colours\n", config->layer);
+        return NULL;
+    }
+    printf("Loaded legend for layer %s (%d classes)\n", config->layer, legend->count);
+    return legend;
+}
+
+// config->legend is a mapping file, or "wms" for the layer's GetLegendGraphic
+legend_t* legend_load(const wms_config_t* config) {
+    if (!config->legend) return NULL;
+    return strcmp(config->legend, "wms") == 0 ? legend_fetch(config) : legend_load_file(config->legend);
+}
+
+unsigned short legend_class_of(const legend_t* legend, color_t color) {
+    return legend->lut[lut_index(color.r, color.g, color.b)];
+}
+
+// One table load per pixel
+class_image_t* classify_with_legend(const image_t* img, const legend_t* legend) {
+    if (!img || !img->data || !legend || !legend->lut) return NULL;
+    
+    class_image_t* classes = malloc(sizeof(class_image_t));
+    if (!classes) return NULL;
+    classes->width = img->width;
+    classes->height = img->height;
+    classes->data = raster_alloc((size_t)img->width * img->height * sizeof(unsigned short));
+    if (!classes->data) {
+        free(classes);
+        return NULL;
+    }
+    
+    const unsigned short* lut = legend->lut;
+    const unsigned char* p = img->data;
+    int channels = img->channels;
+    size_t pixel_count = (size_t)img->width * img->height;
+    for (size_t i = 0; i < pixel_count; i++, p += channels) {
+        classes->data[i] = lut[lut_index(p[0], p[1], p[2])];
+    }
+    return classes;
+}
+
+// Label every feature whose colour is a legend entry
+int legend_attribute_features(vectorization_result_t* result, const legend_t* legend) {
+    int labelled = 0;
+    for (int i = 0; i < result->feature_count; i++) {
+        geological_feature_t* feature = &result->features[i];
+        if (feature->lithology) continue;
+        
+        const color_t color = feature->dominant_color;
+        const legend_entry_t* entry = NULL;
+        for (int e = 0; e < legend->count && !entry; e++) {
+            const color_t* candidate = &legend->entries[e].color;
+            if (candidate->r == color.r && candidate->g == color.g && candidate->b == color.b) entry = &legend->entries[e];
+        }
+        if (!entry) continue;
+        
+        feature->lithology = strdup(entry->label);
+        if (entry->attribute_count > 0) {
+            feature->attributes = malloc(entry->attribute_count * sizeof(attribute_t));
+            for (int a = 0; a < entry->attribute_count; a++) {
+                feature->attributes[a].name = strdup(entry->attributes[a].name);
+                feature->attributes[a].value = strdup(entry->attributes[a].value);
+            }
+            feature->attribute_count = entry->attribute_count;
+        }
+        labelled++;
+    }
+    printf("Legend: labelled %d of %d features without GetFeatureInfo\n", labelled, result->feature_count);
+    return 0;
+}
\ No newline at end of file
@@ -3,19 +3,54 @@
 
 void print_usage(const char* program_name) {
     printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("       %s serve [--listen ADDR] [--serve-workers N] [--jobs-dir DIR] [OPTIONS used as job defaults]\n",
+           program_name);
     printf("WMS tile downloader and processor\n\n");
     printf("Options:\n");
     printf("  -u, --url URL         WMS service URL\n");
     printf("  -l, --layer LAYER     Layer name to download\n");
+    printf("      --stack LAYERS    Vectorize comma-separated layers (up to 4) together on one grid; polygons\n");
+    printf("                        carry every layer's class\n");
     printf("  -b, --bbox BBOX       Bounding box (minx,miny,maxx,maxy)\n");
     printf("  -s, --srs SRS         Spatial reference system (default: EPSG:4326)\n");
     printf("  -w, --width WIDTH     Image width in pixels (default: 256)\n");
     printf("  -h, --height HEIGHT   Image height in pixels (default: 256)\n");
-    printf("  -f, --format FORMAT   Image format (default: image/png)\n");
+    printf("  -f, --format FORMAT   Image format (default: paletted PNG if offered, else image/png)\n");
+    printf("      --wmts            Mosaic cached WMTS tiles instead of GetMap (implied when the URL names WMTS)\n");
     printf("  -o, --output FILE     Output file name\n");
     printf("  -v, --vectorize       Vectorize the georeferenced image\n");
     printf("      --vectorize-enhanced  Enhanced vectorization with color analysis and GetFeatureInfo\n");
-    printf("      --vectorize-geological  Enhanced geological vectorization with GetFeatureInfo\n");
+    printf("      --vectorize-geological  Enhanced geological vectorization (GetFeatureInfo with -a)\n");
+    printf("      --tile-grid CxR   Fetch the bbox as C columns by R rows of tiles and dissolve across seams\n");
+    printf("      --resolution R    Target ground resolution (SRS units per pixel); plans size and tile grid from capabilities\n");
+    printf("      --overlap N       Extra pixels fetched around each tile and cropped before vectorizing (default: 0)\n");
+    printf("      --adaptive LEVELS Fetch each tile coarse first and request up to LEVELS finer quadtree levels\n");
+    printf("                        only where class boundaries are found\n");
+    printf("      --time-sweep RANGE  Vectorize each TIME step of the layer (\"all\" or START/END), storing the\n");
+    printf("                        first in full and later ones as polygons of the pixels that changed\n");
+    printf("      --incremental DIR Keep per-tile hashes and results in DIR; reruns only reprocess changed tiles\n");
+    printf("      --out-srs SRS     Reproject vector output to SRS, e.g. EPSG:3857 (needs PROJ)\n");
+    printf("      --denoise SPEC    Clean the classified raster before tracing, e.g. mode=1,open=1,close=1,mmu=16\n");
+    printf("      --make-valid      Repair invalid polygons and dissolve same-class fragments (needs GEOS)\n");
+    printf("      --geometry-threads N  Workers for --make-valid (default: one per CPU)\n");
+    printf("      --mvt PATH        Write a vector tile pyramid (directory or .mbtiles) instead of GeoJSON\n");
+    printf("      --zoom MIN-MAX    Vector tile zoom range (default: 0 to the source resolution)\n");
+    printf("      --info-format FMT GetFeatureInfo format: text/plain, application/json, application/vnd.ogc.gml\n");
+    printf("      --dictionary FILE Term-to-lithology dictionary for classifying GetFeatureInfo responses\n");
+    printf("      --legend SOURCE   Classify by a fixed legend instead of GetFeatureInfo: a \"#rrggbb = Label\" file,\n");
+    printf("                        or 'wms' for the layer's GetLegendGraphic (JSON)\n");
+    printf("      --batch FILE      Run every job in a manifest (one key=value line per job) as a pipeline\n");
+    printf("      --stage-workers SPEC  Batch workers per stage, e.g. fetch=8,vectorize=4\n");
+    printf("                        (stages: fetch, decode, vectorize, attribute, write)\n");
+    printf("      --queue-depth N   Batch queue bound per stage (default: twice its workers)\n");
+    printf("      --listen ADDR     Serve mode address: host:port or unix:/path (default: 127.0.0.1:8080)\n");
+    printf("      --serve-workers N Serve mode job workers (default: 4)\n");
+    printf("      --jobs-dir DIR    Serve mode directory for job outputs (default: current directory)\n");
+    printf("      --cache-ttl SECONDS  Longest reuse of a cached WMS response (default: 300, 0 = no cache)\n");
+    printf("      --metrics FILE    Write stage timings, request, cache and size counters as JSON\n");
+    printf("      --prometheus FILE Write the same metrics in Prometheus text format\n");
+    printf("      --trace FILE      Write a Chrome trace-event timeline (chrome://tracing, Perfetto)\n");
+    printf("      --scratch-dir DIR Map large rasters from temporary files in DIR instead of holding them in RAM\n");
     printf("  -a, --attribution     Apply attribution using GetFeatureInfo\n");
     printf("  -c, --capabilities    Get WMS capabilities (requires --url)\n");
     printf("      --raw-xml         Show raw XML capabilities response\n");
@@ -26,8 +61,10 @@ int main(int argc, char* argv[]) {
     wms_config_t config = {0};
     config.width = 256;
     config.height = 256;
-    config.format = "image/png";
     config.srs = "EPSG:4326";
+    config.min_zoom = -1;
+    config.max_zoom = -1;
+    config.cache_ttl = -1;
     
     static struct option long_options[] = {
         {"url", required_argument, 0, 'u'},
@@ -44,10 +81,46 @@ int main(int argc, char* argv[]) {
         {"vectorize-enhanced", no_argument, 0, 1004},
         {"vectorize-geological", no_argument, 0, 1003},
         {"raw-xml", no_argument, 0, 1002},
+        {"tile-grid", required_argument, 0, 1005},
+        {"mvt", required_argument, 0, 1006},
+        {"zoom", required_argument, 0, 1007},
+        {"info-format", required_argument, 0, 1008},
+        {"dictionary", required_argument, 0, 1009},
+        {"batch", required_argument, 0, 1010},
+        {"stage-workers", required_argument, 0, 1011},
+        {"queue-depth", required_argument, 0, 1012},
+        {"listen", required_argument, 0, 1013},
+        {"serve-workers", required_argument, 0, 1014},
+        {"resolution", required_argument, 0, 1015},
+        {"overlap", required_argument, 0, 1016},
+        {"out-srs", required_argument, 0, 1017},
+        {"metrics", required_argument, 0, 1018},
+        {"prometheus", required_argument, 0, 1019},
+        {"trace", required_argument, 0, 1020},
+        {"incremental", required_argument, 0, 1021},
+        {"make-valid", no_argument, 0, 1022},
+        {"geometry-threads", required_argument, 0, 1023},
+        {"denoise", required_argument, 0, 1024},
+        {"legend", required_argument, 0, 1025},
+        {"adaptive", required_argument, 0, 1026},
+        {"wmts", no_argument, 0, 1027},
+        {"stack", required_argument, 0, 1028},
+        {"scratch-dir", required_argument, 0, 1029},
+        {"time-sweep", required_argument, 0, 1030},
+        {"jobs-dir", required_argument, 0, 1031},
+        {"cache-ttl", required_argument, 0, 1032},
         {"help", no_argument, 0, 0},
         {0, 0, 0, 0}
     };
     
+    // "wmspal serve ..." runs the resident daemon; the remaining options become job defaults
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        config.serve = true;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    
     int option_index = 0;
     int c;
     
@@ -95,6 +168,132 @@ int main(int argc, char* argv[]) {
             case 1004:
                 config.vectorize_enhanced = true;
                 break;
+            case 1005:
+                if (sscanf(optarg, "%dx%d", &config.tile_cols, &config.tile_rows) != 2 ||
+                    config.tile_cols <= 0 || config.tile_rows <= 0) {
+                    fprintf(stderr, "Error: --tile-grid expects COLSxROWS, e.g. 4x3\n");
+                    return 1;
+                }
+                break;
+            case 1006:
+                config.mvt_output = optarg;
+                break;
+            case 1007:
+                if (sscanf(optarg, "%d-%d", &config.min_zoom, &config.max_zoom) != 2 ||
+                    config.min_zoom < 0 || config.max_zoom < config.min_zoom) {
+                    fprintf(stderr, "Error: --zoom expects MIN-MAX, e.g. 4-14\n");
+                    return 1;
+                }
+                break;
+            case 1008:
+                config.info_format = optarg;
+                break;
+            case 1009:
+                config.dictionary_file = optarg;
+                break;
+            case 1010:
+                config.batch_manifest = optarg;
+                break;
+            case 1011:
+                if (parse_stage_workers(optarg, config.stage_workers) != 0) {
+                    fprintf(stderr, "Error: --stage-workers expects STAGE=N[,STAGE=N...], e.g. fetch=8,vectorize=4\n");
+                    return 1;
+                }
+                break;
+            case 1012:
+                config.queue_depth = atoi(optarg);
+                if (config.queue_depth < 1) {
+                    fprintf(stderr, "Error: --queue-depth must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 1013:
+                config.listen = optarg;
+                break;
+            case 1014:
+                config.serve_workers = atoi(optarg);
+                if (config.serve_workers < 1) {
+                    fprintf(stderr, "Error: --serve-workers must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 1015:
+                config.resolution = atof(optarg);
+                if (config.resolution <= 0) {
+                    fprintf(stderr, "Error: --resolution must be positive\n");
+                    return 1;
+                }
+                break;
+            case 1016:
+                config.tile_overlap = atoi(optarg);
+                if (config.tile_overlap < 0) {
+                    fprintf(stderr, "Error: --overlap cannot be negative\n");
+                    return 1;
+                }
+                break;
+            case 1017:
+                config.out_srs = optarg;
+                break;
+            case 1018:
+                config.metrics_file = optarg;
+                break;
+            case 1019:
+                config.prometheus_file = optarg;
+                break;
+            case 1020:
+                config.trace_file = optarg;
+                break;
+            case 1021:
+                config.incremental_dir = optarg;
+                break;
+            case 1022:
+                config.make_valid = true;
+                break;
+            case 1023:
+                config.geometry_threads = atoi(optarg);
+                if (config.geometry_threads < 0) {
+                    fprintf(stderr, "Error: --geometry-threads cannot be negative\n");
+                    return 1;
+                }
+                break;
+            case 1024:
+                if (parse_denoise_options(optarg, &config.denoise) != 0) {
+                    fprintf(stderr, "Error: --denoise expects e.g. mode=1,open=1,close=1,mmu=16\n");
+                    return 1;
+                }
+                break;
+            case 1025:
+                config.legend = optarg;
+                break;
+            case 1026:
+                config.adaptive_levels = atoi(optarg);
+                if (config.adaptive_levels < 1 || config.adaptive_levels > 10) {
+                    fprintf(stderr, "Error: --adaptive expects 1 to 10 levels\n");
+                    return 1;
+                }
+                break;
+            case 1027:
+                config.wmts = true;
+                break;
+            case 1028:
+                config.stack_layers = optarg;
+                break;
+            case 1029:
+                config.scratch_dir = optarg;
+                break;
+            case 1030:
+                config.time_sweep = optarg;
+                break;
+            case 1031:
+                config.jobs_dir = optarg;
+                break;
+            case 1032:
+                config.cache_ttl = atoi(optarg);
+                if (config.cache_ttl < 0) {
+                    fprintf(stderr, "Error: --cache-ttl cannot be negative\n");
+                    return 1;
+                }
+                break;
             case 0:
                 if (strcmp(long_options[option_index].name, "help") == 0) {
                     print_usage(argv[0]);
@@ -107,70 +306,24 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    if (config.capabilities) {
-        if (!config.url) {
-            fprintf(stderr, "Error: URL is required for GetCapabilities\n");
-            print_usage(argv[0]);
-            return 1;
-        }
-        
-        printf("Fetching WMS capabilities...\n");
-        if (get_wms_capabilities(&config) != 0) {
-            fprintf(stderr, "Error fetching WMS capabilities\n");
-            return 1;
-        }
-        return 0;
-    }
-    
-    if (!config.url || !config.layer || !config.bbox || !config.output_file) {
-        fprintf(stderr, "Error: URL, layer, bbox, and output file are required\n");
-        print_usage(argv[0]);
+    config.context = wmspal_context_create();
+    if (!config.context) {
+        fprintf(stderr, "Error initializing wmspal\n");
         return 1;
     }
     
-    printf("Downloading WMS tile...\n");
-    if (download_wms_tile(&config) != 0) {
-        fprintf(stderr, "Error downloading WMS tile\n");
-        return 1;
+    if (config.metrics_file || config.prometheus_file || config.trace_file) {
+        wmspal_metrics_enable(config.trace_file != NULL);
     }
+    if (config.scratch_dir) wmspal_scratch_enable(config.scratch_dir);
+    if (config.cache_ttl >= 0) wmspal_context_set_cache_ttl(config.context, config.cache_ttl);
     
-    char georef_file[512];
-    snprintf(georef_file, sizeof(georef_file), "%s_georef.tif", config.output_file);
-    
-    printf("Georeferencing image...\n");
-    if (georeference_image(config.output_file, georef_file, config.bbox, config.srs) != 0) {
-        fprintf(stderr, "Error georeferencing image\n");
-        return 1;
-    }
-    
-    if (config.vectorize || config.vectorize_enhanced || config.vectorize_geological) {
-        char vector_file[512];
-        snprintf(vector_file, sizeof(vector_file), "%s_vector.shp", config.output_file);
-        
-        if (config.vectorize_geological || config.vectorize_enhanced) {
-            const char* workflow_type = config.vectorize_geological ? "geological" : "enhanced";
-            printf("Enhanced %s vectorization...\n", workflow_type);
-            if (vectorize_geological_map(georef_file, config.output_file, &config) != 0) {
-                fprintf(stderr, "Error in %s vectorization\n", workflow_type);
-                return 1;
-            }
-        } else {
-            printf("Vectorizing image...\n");
-            if (vectorize_image(georef_file, vector_file) != 0) {
-                fprintf(stderr, "Error vectorizing image\n");
-                return 1;
-            }
-        }
-        
-        if (config.attribution && !config.vectorize_geological && !config.vectorize_enhanced) {
-            printf("Applying attribution...\n");
-            if (apply_attribution(vector_file, &config) != 0) {
-                fprintf(stderr, "Error applying attribution\n");
-                return 1;
-            }
-        }
+    int status = wmspal_run(&config);
+    if (wmspal_metrics_write(config.metrics_file, config.prometheus_file, config.trace_file) != 0 && status == 0) {
+        status = 1;
     }
+    wmspal_context_free(config.context);
     
-    printf("Processing complete!\n");
-    return 0;
+    if (status == 2) print_usage(argv[0]);
+    return status == 0 ? 0 : 1;
 }
\ No newline at end of file
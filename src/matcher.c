@@ -0,0 +1,222 @@
+#include "../include/wmspal.h"
+#include <ctype.h>
+
+// Aho-Corasick keyword matcher. All dictionary terms are compiled into one
+// DFA over a compacted, case-folded alphabet, so classifying a response is a
+// single pass over its bytes regardless of how many terms the dictionary has.
+// When several terms occur, the one listed first in the dictionary wins.
+
+struct keyword_matcher_s {
+    char** terms;
+    char** labels;
+    int term_count, term_capacity;
+    
+    unsigned char alphabet[256];   // Folded byte -> symbol, 0 for bytes in no term
+    int symbol_count;
+    int* delta;                    // state * symbol_count + symbol -> next state
+    int* match;                    // Best (lowest) term index ending at each state, -1 if none
+    int state_count;
+};
+
+static const char* default_dictionary[][2] = {
+    {"sandstone", "Sandstone"},
+    {"limestone", "Limestone"},
+    {"shale", "Shale"},
+    {"water", "Water"},
+    {"forest", "Forest"},
+    {"urban", "Urban"},
+    {"agricultural", "Agricultural"},
+};
+
+keyword_matcher_t* matcher_create(void) {
+    return calloc(1, sizeof(keyword_matcher_t));
+}
+
+void matcher_free(keyword_matcher_t* matcher) {
+    if (!matcher) return;
+    for (int i = 0; i < matcher->term_count; i++) {
+        free(matcher->terms[i]);
+        free(matcher->labels[i]);
+    }
+    free(matcher->terms);
+    free(matcher->labels);
+    free(matcher->delta);
+    free(matcher->match);
+    free(matcher);
+}
+
+int matcher_add(keyword_matcher_t* matcher, const char* term, const char* label) {
+    if (!matcher || !term || !*term || matcher->delta) return 1;
+    
+    if (matcher->term_count >= matcher->term_capacity) {
+        matcher->term_capacity = matcher->term_capacity ? matcher->term_capacity * 2 : 16;
+        matcher->terms = realloc(matcher->terms, matcher->term_capacity * sizeof(char*));
+        matcher->labels = realloc(matcher->labels, matcher->term_capacity * sizeof(char*));
+    }
+    
+    char* folded = strdup(term);
+    for (char* p = folded; *p; p++) *p = (char)tolower((unsigned char)*p);
+    matcher->terms[matcher->term_count] = folded;
+    matcher->labels[matcher->term_count] = strdup(label ? label : term);
+    matcher->term_count++;
+    return 0;
+}
+
+int matcher_compile(keyword_matcher_t* matcher) {
+    if (!matcher || matcher->term_count == 0) return 1;
+    
+    // Compact the alphabet to the bytes that actually occur in terms
+    memset(matcher->alphabet, 0, sizeof(matcher->alphabet));
+    matcher->symbol_count = 1;
+    int max_states = 1;
+    for (int t = 0; t < matcher->term_count; t++) {
+        for (const unsigned char* p = (const unsigned char*)matcher->terms[t]; *p; p++) {
+            if (matcher->alphabet[*p] == 0) matcher->alphabet[*p] = (unsigned char)matcher->symbol_count++;
+            max_states++;
+        }
+    }
+    // Input is folded through the same table, so upper-case bytes share symbols
+    for (int c = 'A'; c <= 'Z'; c++) matcher->alphabet[c] = matcher->alphabet[tolower(c)];
+    
+    int symbols = matcher->symbol_count;
+    int* delta = malloc((size_t)max_states * symbols * sizeof(int));
+    int* match = malloc(max_states * sizeof(int));
+    int* fail = malloc(max_states * sizeof(int));
+    int* queue = malloc(max_states * sizeof(int));
+    if (!delta || !match || !fail || !queue) {
+        free(delta); free(match); free(fail); free(queue);
+        return 1;
+    }
+    memset(delta, 0xFF, (size_t)max_states * symbols * sizeof(int));
+    match[0] = -1;
+    
+    // Build the trie
+    int states = 1;
+    for (int t = 0; t < matcher->term_count; t++) {
+        int s = 0;
+        for (const unsigned char* p = (const unsigned char*)matcher->terms[t]; *p; p++) {
+            int sym = matcher->alphabet[*p];
+            if (delta[s * symbols + sym] < 0) {
+                match[states] = -1;
+                delta[s * symbols + sym] = states++;
+            }
+            s = delta[s * symbols + sym];
+        }
+        if (match[s] < 0 || t < match[s]) match[s] = t;
+    }
+    
+    // Breadth-first pass: fill failure links and turn the trie into a full DFA
+    int head = 0, tail = 0;
+    for (int sym = 0; sym < symbols; sym++) {
+        int next = delta[sym];
+        if (next < 0) {
+            delta[sym] = 0;
+        } else {
+            fail[next] = 0;
+            queue[tail++] = next;
+        }
+    }
+    while (head < tail) {
+        int s = queue[head++];
+        int f = fail[s];
+        if (match[f] >= 0 && (match[s] < 0 || match[f] < match[s])) match[s] = match[f];
+        
+        for (int sym = 0; sym < symbols; sym++) {
+            int next = delta[s * symbols + sym];
+            if (next < 0) {
+                delta[s * symbols + sym] = delta[f * symbols + sym];
+            } else {
+                fail[next] = delta[f * symbols + sym];
+                queue[tail++] = next;
+            }
+        }
+    }
+    
+    free(fail);
+    free(queue);
+    free(matcher->delta);
+    free(matcher->match);
+    matcher->delta = delta;
+    matcher->match = match;
+    matcher->state_count = states;
+    return 0;
+}
+
+keyword_matcher_t* matcher_create_default(void) {
+    keyword_matcher_t* matcher = matcher_create();
+    if (!matcher) return NULL;
+    for (size_t i = 0; i < sizeof(default_dictionary) / sizeof(default_dictionary[0]); i++) {
+        matcher_add(matcher, default_dictionary[i][0], default_dictionary[i][1]);
+    }
+    if (matcher_compile(matcher) != 0) {
+        matcher_free(matcher);
+        return NULL;
+    }
+    return matcher;
+}
+
+// Dictionary files hold one "term = Label" per line; a bare term is its own
+// label, and blank lines or lines starting with '#' are ignored
+keyword_matcher_t* matcher_load_dictionary(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open classification dictionary: %s\n", path);
+        return NULL;
+    }
+    
+    keyword_matcher_t* matcher = matcher_create();
+    char line[1024];
+    while (matcher && fgets(line, sizeof(line), file)) {
+        char* term = line;
+        while (isspace((unsigned char)*term)) term++;
+        if (*term == '\0' || *term == '#') continue;
+        
+        char* label = strchr(term, '=');
+        if (!label) label = strchr(term, '\t');
+        if (label) *label++ = '\0';
+        
+        // Trim both fields
+        for (char* end = term + strlen(term); end > term && isspace((unsigned char)end[-1]); ) *--end = '\0';
+        if (label) {
+            while (isspace((unsigned char)*label)) label++;
+            for (char* end = label + strlen(label); end > label && isspace((unsigned char)end[-1]); ) *--end = '\0';
+            if (*label == '\0') label = NULL;
+        }
+        if (*term) matcher_add(matcher, term, label);
+    }
+    fclose(file);
+    
+    if (!matcher || matcher_compile(matcher) != 0) {
+        fprintf(stderr, "Classification dictionary has no terms: %s\n", path);
+        matcher_free(matcher);
+        return NULL;
+    }
+    printf("Loaded classification dictionary: %s (%d terms, %d states)\n",
+           path, matcher->term_count, matcher->state_count);
+    return matcher;
+}
+
+int matcher_find(const keyword_matcher_t* matcher, const char* text, size_t length) {
+    if (!matcher || !matcher->delta || !text) return -1;
+    
+    const unsigned char* p = (const unsigned char*)text;
+    const int* delta = matcher->delta;
+    const int* match = matcher->match;
+    int symbols = matcher->symbol_count;
+    int s = 0, best = -1;
+    
+    for (size_t i = 0; i < length; i++) {
+        s = delta[s * symbols + matcher->alphabet[p[i]]];
+        int m = match[s];
+        if (m >= 0 && (best < 0 || m < best)) {
+            best = m;
+            if (best == 0) break;    // Nothing can outrank the first term
+        }
+    }
+    return best;
+}
+
+const char* matcher_label(const keyword_matcher_t* matcher, int term) {
+    if (!matcher || term < 0 || term >= matcher->term_count) return NULL;
+    return matcher->labels[term];
+}
@@ -0,0 +1,297 @@
+#include "metrics.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#ifdef _MSC_VER
+#define WMSPAL_THREAD_LOCAL __declspec(thread)
+#else
+#define WMSPAL_THREAD_LOCAL _Thread_local
+#endif
+
+// Process-wide instrumentation: per-stage call counts and time, counters, an
+// HTTP latency histogram and, optionally, a Chrome trace-event log. Stages are
+// coarse (one request, one tile, one file) so a single lock per record is cheap.
+
+#define TRACE_MAX_EVENTS 1000000     // Later events are dropped and counted
+
+static const char* stage_names[METRIC_STAGE_COUNT] = {
+    "http_request", "dns", "connect", "tls", "server_wait", "transfer", "decode", "georeference",
+    "classify", "denoise", "label", "feature_info", "postprocess", "reproject", "write"
+};
+
+static const char* stage_categories[METRIC_STAGE_COUNT] = {
+    "network", "network", "network", "network", "network", "network", "raster", "raster",
+    "raster", "raster", "raster", "attribution", "vector", "vector", "vector"
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} counter_info[METRIC_COUNTER_COUNT] = {
+    {"requests_total", "HTTP requests sent to the WMS"},
+    {"request_errors_total", "HTTP requests that failed or returned a non-200 status"},
+    {"downloaded_bytes_total", "Response bytes received from the WMS"},
+    {"cache_hits_total", "Requests answered from the response cache"},
+    {"cache_misses_total", "Requests that went to the network"},
+    {"feature_info_queries_total", "GetFeatureInfo queries issued"},
+    {"pixels_total", "Raster pixels classified"},
+    {"vertices_total", "Polygon vertices produced"},
+    {"features_total", "Vector features produced"}
+};
+
+static const double latency_buckets[] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+#define LATENCY_BUCKETS (sizeof(latency_buckets) / sizeof(latency_buckets[0]))
+
+typedef struct {
+    metric_stage_t stage;
+    int thread;
+    double start, duration;
+} trace_event_t;
+
+typedef struct {
+    bool enabled, tracing;
+    wmspal_mutex_t lock;
+    double started;
+    struct {
+        uint64_t calls;
+        double seconds, max_seconds;
+    } stages[METRIC_STAGE_COUNT];
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    uint64_t latency_counts[LATENCY_BUCKETS + 1];   // Last bucket is +Inf
+    double latency_sum;
+    trace_event_t* events;
+    size_t event_count, event_capacity, events_dropped;
+    int thread_count;
+} metrics_t;
+
+static metrics_t metrics;
+static WMSPAL_THREAD_LOCAL int trace_thread;        // 1-based id for trace rows, 0 until first use
+
+// Call before starting any threads; enabling twice only turns tracing on
+void wmspal_metrics_enable(bool trace) {
+    if (!metrics.enabled) {
+        wmspal_mutex_init(&metrics.lock);
+        metrics.started = wmspal_now();
+        metrics.enabled = true;
+    }
+    if (trace) metrics.tracing = true;
+}
+
+bool metrics_active(void) {
+    return metrics.enabled;
+}
+
+double metrics_begin(void) {
+    return metrics.enabled ? wmspal_now() : 0;
+}
+
+void metrics_span(metric_stage_t stage, double started, double seconds) {
+    if (!metrics.enabled) return;
+    
+    wmspal_mutex_lock(&metrics.lock);
+    metrics.stages[stage].calls++;
+    metrics.stages[stage].seconds += seconds;
+    if (seconds > metrics.stages[stage].max_seconds) metrics.stages[stage].max_seconds = seconds;
+    
+    if (metrics.tracing) {
+        if (trace_thread == 0) trace_thread = ++metrics.thread_count;
+        if (metrics.event_count == metrics.event_capacity && metrics.event_capacity < TRACE_MAX_EVENTS) {
+            size_t capacity = metrics.event_capacity ? metrics.event_capacity * 2 : 4096;
+            if (capacity > TRACE_MAX_EVENTS) capacity = TRACE_MAX_EVENTS;
+            trace_event_t* events = realloc(metrics.events, capacity * sizeof(trace_event_t));
+            if (events) {
+                metrics.events = events;
+                metrics.event_capacity = capacity;
+            }
+        }
+        if (metrics.event_count < metrics.event_capacity) {
+            trace_event_t* event = &metrics.events[metrics.event_count++];
+            event->stage = stage;
+            event->thread = trace_thread;
+            event->start = started;
+            event->duration = seconds;
+        } else {
+            metrics.events_dropped++;
+        }
+    }
+    wmspal_mutex_unlock(&metrics.lock);
+}
+
+void metrics_end(metric_stage_t stage, double started) {
+    if (!metrics.enabled) return;
+    metrics_span(stage, started, wmspal_now() - started);
+}
+
+void metrics_add(metric_counter_t counter, uint64_t amount) {
+    if (!metrics.enabled) return;
+    wmspal_mutex_lock(&metrics.lock);
+    metrics.counters[counter] += amount;
+    wmspal_mutex_unlock(&metrics.lock);
+}
+
+void metrics_observe_request(double seconds) {
+    if (!metrics.enabled) return;
+    size_t bucket = 0;
+    while (bucket < LATENCY_BUCKETS && seconds > latency_buckets[bucket]) bucket++;
+    
+    wmspal_mutex_lock(&metrics.lock);
+    metrics.latency_counts[bucket]++;
+    metrics.latency_sum += seconds;
+    wmspal_mutex_unlock(&metrics.lock);
+}
+
+static uint64_t peak_rss_bytes(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Caller holds the lock
+static void write_json_summary(FILE* file) {
+    uint64_t hits = metrics.counters[METRIC_CACHE_HITS];
+    uint64_t lookups = hits + metrics.counters[METRIC_CACHE_MISSES];
+    uint64_t requests = metrics.counters[METRIC_REQUESTS];
+    
+    fprintf(file, "{\n");
+    fprintf(file, "  \"wall_seconds\": %.6f,\n", wmspal_now() - metrics.started);
+    fprintf(file, "  \"peak_rss_bytes\": %llu,\n", (unsigned long long)peak_rss_bytes());
+    fprintf(file, "  \"cache_hit_rate\": %.4f,\n", lookups ? (double)hits / lookups : 0.0);
+    fprintf(file, "  \"mean_request_seconds\": %.6f,\n", requests ? metrics.latency_sum / requests : 0.0);
+    
+    fprintf(file, "  \"stages\": {\n");
+    for (int i = 0; i < METRIC_STAGE_COUNT; i++) {
+        fprintf(file, "    \"%s\": {\"calls\": %llu, \"seconds\": %.6f, \"max_seconds\": %.6f}%s\n",
+                stage_names[i], (unsigned long long)metrics.stages[i].calls, metrics.stages[i].seconds,
+                metrics.stages[i].max_seconds, i + 1 < METRIC_STAGE_COUNT ? "," : "");
+    }
+    fprintf(file, "  },\n");
+    
+    fprintf(file, "  \"counters\": {\n");
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(file, "    \"%s\": %llu%s\n", counter_info[i].name, (unsigned long long)metrics.counters[i],
+                i + 1 < METRIC_COUNTER_COUNT ? "," : "");
+    }
+    fprintf(file, "  },\n");
+    
+    fprintf(file, "  \"request_latency_buckets\": {");
+    for (size_t i = 0; i <= LATENCY_BUCKETS; i++) {
+        if (i < LATENCY_BUCKETS) {
+            fprintf(file, "\"%g\": %llu, ", latency_buckets[i], (unsigned long long)metrics.latency_counts[i]);
+        } else {
+            fprintf(file, "\"+Inf\": %llu", (unsigned long long)metrics.latency_counts[i]);
+        }
+    }
+    fprintf(file, "}\n");
+    fprintf(file, "}\n");
+}
+
+// Caller holds the lock
+static void write_prometheus_locked(FILE* file) {
+    fprintf(file, "# HELP wmspal_stage_seconds_total Time spent in each pipeline stage\n");
+    fprintf(file, "# TYPE wmspal_stage_seconds_total counter\n");
+    for (int i = 0; i < METRIC_STAGE_COUNT; i++) {
+        fprintf(file, "wmspal_stage_seconds_total{stage=\"%s\"} %.6f\n", stage_names[i], metrics.stages[i].seconds);
+    }
+    fprintf(file, "# HELP wmspal_stage_calls_total Times each pipeline stage ran\n");
+    fprintf(file, "# TYPE wmspal_stage_calls_total counter\n");
+    for (int i = 0; i < METRIC_STAGE_COUNT; i++) {
+        fprintf(file, "wmspal_stage_calls_total{stage=\"%s\"} %llu\n", stage_names[i],
+                (unsigned long long)metrics.stages[i].calls);
+    }
+    
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(file, "# HELP wmspal_%s %s\n", counter_info[i].name, counter_info[i].help);
+        fprintf(file, "# TYPE wmspal_%s counter\n", counter_info[i].name);
+        fprintf(file, "wmspal_%s %llu\n", counter_info[i].name, (unsigned long long)metrics.counters[i]);
+    }
+    
+    fprintf(file, "# HELP wmspal_request_duration_seconds WMS request latency, cache misses only\n");
+    fprintf(file, "# TYPE wmspal_request_duration_seconds histogram\n");
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= LATENCY_BUCKETS; i++) {
+        cumulative += metrics.latency_counts[i];
+        if (i < LATENCY_BUCKETS) {
+            fprintf(file, "wmspal_request_duration_seconds_bucket{le=\"%g\"} %llu\n", latency_buckets[i],
+                    (unsigned long long)cumulative);
+        } else {
+            fprintf(file, "wmspal_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+        }
+    }
+    fprintf(file, "wmspal_request_duration_seconds_sum %.6f\n", metrics.latency_sum);
+    fprintf(file, "wmspal_request_duration_seconds_count %llu\n", (unsigned long long)cumulative);
+    
+    fprintf(file, "# HELP wmspal_peak_rss_bytes Peak resident set size of the process\n");
+    fprintf(file, "# TYPE wmspal_peak_rss_bytes gauge\n");
+    fprintf(file, "wmspal_peak_rss_bytes %llu\n", (unsigned long long)peak_rss_bytes());
+}
+
+void metrics_write_prometheus(FILE* file) {
+    if (!metrics.enabled) return;
+    wmspal_mutex_lock(&metrics.lock);
+    write_prometheus_locked(file);
+    wmspal_mutex_unlock(&metrics.lock);
+}
+
+// Chrome trace-event format (chrome://tracing, Perfetto): one complete event per span
+static void write_trace(FILE* file) {
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"wmspal\"}}");
+    for (int t = 1; t <= metrics.thread_count; t++) {
+        fprintf(file, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"name\": \"thread %d\"}}", t, t);
+    }
+    for (size_t i = 0; i < metrics.event_count; i++) {
+        const trace_event_t* event = &metrics.events[i];
+        fprintf(file, ",\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                "\"ts\": %.3f, \"dur\": %.3f}",
+                stage_names[event->stage], stage_categories[event->stage], event->thread,
+                (event->start - metrics.started) * 1e6, event->duration * 1e6);
+    }
+    fprintf(file, "\n]}\n");
+}
+
+static int write_file(const char* path, void (*writer)(FILE*)) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to create metrics file: %s\n", path);
+        return 1;
+    }
+    writer(file);
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Failed to write metrics file: %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// Write whichever of the JSON summary, Prometheus text and trace files are named
+int wmspal_metrics_write(const char* json_file, const char* prometheus_file, const char* trace_file) {
+    if (!metrics.enabled) return 0;
+    
+    int status = 0;
+    wmspal_mutex_lock(&metrics.lock);
+    if (json_file) status |= write_file(json_file, write_json_summary);
+    if (prometheus_file) status |= write_file(prometheus_file, write_prometheus_locked);
+    if (trace_file && metrics.tracing) {
+        status |= write_file(trace_file, write_trace);
+        if (metrics.events_dropped > 0) {
+            fprintf(stderr, "Trace truncated: %zu events dropped\n", metrics.events_dropped);
+        }
+    }
+    wmspal_mutex_unlock(&metrics.lock);
+    return status;
+}
\ No newline at end of file
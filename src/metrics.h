@@ -0,0 +1,49 @@
+#ifndef WMSPAL_METRICS_H
+#define WMSPAL_METRICS_H
+
+// Library-internal instrumentation. Everything is a no-op until
+// wmspal_metrics_enable() is called, so the hooks can stay in hot paths.
+
+#include "context.h"
+
+typedef enum {
+    METRIC_HTTP_REQUEST,    // Whole GET, cache misses only
+    METRIC_DNS,             // Phases of the request as reported by curl
+    METRIC_CONNECT,
+    METRIC_TLS,
+    METRIC_SERVER_WAIT,
+    METRIC_TRANSFER,
+    METRIC_DECODE,
+    METRIC_GEOREFERENCE,
+    METRIC_CLASSIFY,
+    METRIC_DENOISE,
+    METRIC_LABEL,
+    METRIC_FEATURE_INFO,
+    METRIC_POSTPROCESS,
+    METRIC_REPROJECT,
+    METRIC_WRITE,
+    METRIC_STAGE_COUNT
+} metric_stage_t;
+
+typedef enum {
+    METRIC_REQUESTS,
+    METRIC_REQUEST_ERRORS,
+    METRIC_BYTES_DOWNLOADED,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_FEATURE_INFO_QUERIES,
+    METRIC_PIXELS,
+    METRIC_VERTICES,
+    METRIC_FEATURES,
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+bool metrics_active(void);
+double metrics_begin(void);
+void metrics_end(metric_stage_t stage, double started);
+void metrics_span(metric_stage_t stage, double started, double seconds);
+void metrics_add(metric_counter_t counter, uint64_t amount);
+void metrics_observe_request(double seconds);
+void metrics_write_prometheus(FILE* file);
+
+#endif
\ No newline at end of file
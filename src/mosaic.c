@@ -0,0 +1,1009 @@
+#include "context.h"
+#include <limits.h>
+#include <math.h>
+
+// Tiles are vectorized independently, so a unit that crosses a tile edge comes
+// out as several polygons cut along the seam. The mosaic keeps the unit-length
+// boundary edges that lie on not-yet-matched seams in a hash table; when the
+// neighbouring tile arrives, touching polygons of the same class are joined
+// with union-find. A group is dissolved and emitted as soon as none of its
+// members has an open seam edge left, so the working set of traced rings and
+// seam edges is bounded by the seam frontier. Emitted rings are still
+// collected in one result, since attribution, --make-valid and the writers
+// need every feature of a class together; the finished output therefore
+// stays in memory until it is written, and peak memory grows with it.
+
+#define MOSAIC_COLOR_TOLERANCE 30.0
+
+// Undirected unit edge on a seam: (x, y) is its lower-left/top end in global pixel corners
+#define SEAM_KEY(x, y, vertical) \
+    (((uint64_t)(uint32_t)(x) << 33) | ((uint64_t)(uint32_t)(y) << 1) | (uint64_t)(vertical))
+// Directed unit edge starting at (x, y), dir 0..3 = E, S, W, N
+#define EDGE_KEY(x, y, dir) \
+    (((uint64_t)(uint32_t)(x) << 34) | ((uint64_t)(uint32_t)(y) << 2) | (uint64_t)(dir))
+#define VERTEX_KEY(x, y) (((uint64_t)(uint32_t)(x) << 32) | (uint64_t)(uint32_t)(y))
+
+typedef struct {
+    int* xy;           // Ring vertices as x,y pairs in global pixel corners
+    int count;         // Vertex count, -1 for a free slot
+    int class_id;
+    int parent;        // Union-find parent, self for group roots
+    int next;          // Next member of the group, -1 at the end
+    int tail;          // Last member of the group (roots only)
+    int open_edges;    // Unresolved seam edges of the whole group (roots only)
+    int members;       // Group size (roots only)
+} mosaic_poly_t;
+
+struct mosaic_s {
+    double minx, miny, maxx, maxy;
+    char* crs;
+    int tile_cols, tile_rows;
+    int tile_width, tile_height;
+    int width, height;             // Global raster size in pixels
+    unsigned char* processed;      // One flag per tile
+    
+    key_map_t seams;               // Open seam edge -> polygon slot
+    mosaic_poly_t* polys;
+    int poly_count, poly_capacity;
+    int* free_slots;
+    int free_count, free_capacity;
+    int* pending;                  // Groups whose open edge count dropped this tile
+    int pending_count, pending_capacity;
+    
+    color_t* classes;              // Global palette, tiles are matched by colour
+    int class_count, class_capacity;
+    vectorization_result_t* output;
+    int* feature_of_class;
+    int* feature_capacity;
+    
+    int tiles_added;
+    int seam_merges;
+    int live_polys, peak_live_polys;
+    size_t peak_open_edges;
+};
+
+mosaic_t* mosaic_create(double minx, double miny, double maxx, double maxy, const char* crs,
+                        int tile_cols, int tile_rows, int tile_width, int tile_height) {
+    if (tile_cols <= 0 || tile_rows <= 0 || tile_width <= 0 || tile_height <= 0 ||
+        maxx <= minx || maxy <= miny) {
+        fprintf(stderr, "Invalid mosaic grid\n");
+        return NULL;
+    }
+    
+    mosaic_t* mosaic = calloc(1, sizeof(mosaic_t));
+    if (!mosaic) return NULL;
+    
+    mosaic->minx = minx; mosaic->miny = miny;
+    mosaic->maxx = maxx; mosaic->maxy = maxy;
+    mosaic->crs = strdup(crs);
+    mosaic->tile_cols = tile_cols;
+    mosaic->tile_rows = tile_rows;
+    mosaic->tile_width = tile_width;
+    mosaic->tile_height = tile_height;
+    mosaic->width = tile_cols * tile_width;
+    mosaic->height = tile_rows * tile_height;
+    mosaic->processed = calloc((size_t)tile_cols * tile_rows, 1);
+    
+    mosaic->output = calloc(1, sizeof(vectorization_result_t));
+    mosaic->output->minx = minx; mosaic->output->miny = miny;
+    mosaic->output->maxx = maxx; mosaic->output->maxy = maxy;
+    mosaic->output->crs = strdup(crs);
+    
+    if (!mosaic->processed || key_map_init(&mosaic->seams, 1024) != 0) {
+        mosaic_free(mosaic);
+        return NULL;
+    }
+    return mosaic;
+}
+
+void mosaic_free(mosaic_t* mosaic) {
+    if (!mosaic) return;
+    
+    for (int i = 0; i < mosaic->poly_count; i++) {
+        if (mosaic->polys[i].count >= 0) free(mosaic->polys[i].xy);
+    }
+    free(mosaic->polys);
+    free(mosaic->free_slots);
+    free(mosaic->pending);
+    free(mosaic->classes);
+    free(mosaic->feature_of_class);
+    free(mosaic->feature_capacity);
+    free(mosaic->processed);
+    key_map_destroy(&mosaic->seams);
+    if (mosaic->output) free_vectorization_result(mosaic->output);
+    if (mosaic->crs) free(mosaic->crs);
+    free(mosaic);
+}
+
+static int mosaic_class_id(mosaic_t* mosaic, color_t color) {
+    int best = -1;
+    double best_dist = MOSAIC_COLOR_TOLERANCE * MOSAIC_COLOR_TOLERANCE;
+    for (int i = 0; i < mosaic->class_count; i++) {
+        double dr = color.r - mosaic->classes[i].r;
+        double dg = color.g - mosaic->classes[i].g;
+        double db = color.b - mosaic->classes[i].b;
+        double d = dr*dr + dg*dg + db*db;
+        if (d < best_dist) {
+            best_dist = d;
+            best = i;
+        }
+    }
+    if (best >= 0) return best;
+    
+    if (mosaic->class_count >= mosaic->class_capacity) {
+        mosaic->class_capacity = mosaic->class_capacity ? mosaic->class_capacity * 2 : 16;
+        mosaic->classes = realloc(mosaic->classes, mosaic->class_capacity * sizeof(color_t));
+        mosaic->feature_of_class = realloc(mosaic->feature_of_class, mosaic->class_capacity * sizeof(int));
+    }
+    mosaic->classes[mosaic->class_count] = color;
+    mosaic->feature_of_class[mosaic->class_count] = -1;
+    return mosaic->class_count++;
+}
+
+static int alloc_poly(mosaic_t* mosaic) {
+    int slot;
+    if (mosaic->free_count > 0) {
+        slot = mosaic->free_slots[--mosaic->free_count];
+    } else {
+        if (mosaic->poly_count >= mosaic->poly_capacity) {
+            mosaic->poly_capacity = mosaic->poly_capacity ? mosaic->poly_capacity * 2 : 64;
+            mosaic->polys = realloc(mosaic->polys, mosaic->poly_capacity * sizeof(mosaic_poly_t));
+        }
+        slot = mosaic->poly_count++;
+    }
+    
+    mosaic_poly_t* poly = &mosaic->polys[slot];
+    memset(poly, 0, sizeof(mosaic_poly_t));
+    poly->parent = slot;
+    poly->next = -1;
+    poly->tail = slot;
+    poly->members = 1;
+    
+    if (++mosaic->live_polys > mosaic->peak_live_polys) mosaic->peak_live_polys = mosaic->live_polys;
+    return slot;
+}
+
+static void release_poly(mosaic_t* mosaic, int slot) {
+    free(mosaic->polys[slot].xy);
+    mosaic->polys[slot].xy = NULL;
+    mosaic->polys[slot].count = -1;
+    
+    if (mosaic->free_count >= mosaic->free_capacity) {
+        mosaic->free_capacity = mosaic->free_capacity ? mosaic->free_capacity * 2 : 64;
+        mosaic->free_slots = realloc(mosaic->free_slots, mosaic->free_capacity * sizeof(int));
+    }
+    mosaic->free_slots[mosaic->free_count++] = slot;
+    mosaic->live_polys--;
+}
+
+static int find_root(mosaic_t* mosaic, int slot) {
+    while (mosaic->polys[slot].parent != slot) {
+        mosaic->polys[slot].parent = mosaic->polys[mosaic->polys[slot].parent].parent;
+        slot = mosaic->polys[slot].parent;
+    }
+    return slot;
+}
+
+static void union_groups(mosaic_t* mosaic, int a, int b) {
+    int ra = find_root(mosaic, a);
+    int rb = find_root(mosaic, b);
+    if (ra == rb) return;
+    
+    // Attach the smaller group below the larger one and splice the member lists
+    if (mosaic->polys[ra].members < mosaic->polys[rb].members) {
+        int t = ra; ra = rb; rb = t;
+    }
+    mosaic_poly_t* root = &mosaic->polys[ra];
+    mosaic_poly_t* other = &mosaic->polys[rb];
+    other->parent = ra;
+    mosaic->polys[root->tail].next = rb;
+    root->tail = other->tail;
+    root->members += other->members;
+    root->open_edges += other->open_edges;
+    mosaic->seam_merges++;
+}
+
+static void push_pending(mosaic_t* mosaic, int slot) {
+    if (mosaic->pending_count >= mosaic->pending_capacity) {
+        mosaic->pending_capacity = mosaic->pending_capacity ? mosaic->pending_capacity * 2 : 64;
+        mosaic->pending = realloc(mosaic->pending, mosaic->pending_capacity * sizeof(int));
+    }
+    mosaic->pending[mosaic->pending_count++] = slot;
+}
+
+static coord_t mosaic_to_geo(const mosaic_t* mosaic, int x, int y) {
+    coord_t geo;
+    geo.x = mosaic->minx + ((double)x / mosaic->width) * (mosaic->maxx - mosaic->minx);
+    geo.y = mosaic->maxy - ((double)y / mosaic->height) * (mosaic->maxy - mosaic->miny);
+    return geo;
+}
+
+static void emit_ring(mosaic_t* mosaic, int class_id, const int* xy, int count) {
+    vectorization_result_t* out = mosaic->output;
+    int f = mosaic->feature_of_class[class_id];
+    
+    if (f < 0) {
+        out->features = realloc(out->features, (out->feature_count + 1) * sizeof(geological_feature_t));
+        mosaic->feature_capacity = realloc(mosaic->feature_capacity, (out->feature_count + 1) * sizeof(int));
+        f = out->feature_count++;
+        memset(&out->features[f], 0, sizeof(geological_feature_t));
+        out->features[f].dominant_color = mosaic->classes[class_id];
+        mosaic->feature_capacity[f] = 0;
+        mosaic->feature_of_class[class_id] = f;
+    }
+    
+    geological_feature_t* feature = &out->features[f];
+    if (feature->polygon_count >= mosaic->feature_capacity[f]) {
+        mosaic->feature_capacity[f] = mosaic->feature_capacity[f] ? mosaic->feature_capacity[f] * 2 : 4;
+        feature->polygons = realloc(feature->polygons, mosaic->feature_capacity[f] * sizeof(polygon_t));
+    }
+    
+    polygon_t* polygon = &feature->polygons[feature->polygon_count++];
+    polygon->count = count;
+    polygon->capacity = count;
+    polygon->coords = malloc(count * sizeof(coord_t));
+    for (int i = 0; i < count; i++) {
+        polygon->coords[i] = mosaic_to_geo(mosaic, xy[2*i], xy[2*i + 1]);
+    }
+}
+
+typedef struct {
+    int ax, ay, bx, by;
+    int next_out;      // Next edge leaving the same vertex
+    bool live;
+} dissolve_edge_t;
+
+static int direction_of(const dissolve_edge_t* e) {
+    if (e->bx > e->ax) return 0;
+    if (e->by > e->ay) return 1;
+    if (e->bx < e->ax) return 2;
+    return 3;
+}
+
+static void add_edge(dissolve_edge_t** edges, int* count, int* capacity, int ax, int ay, int bx, int by) {
+    if (*count >= *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        *edges = realloc(*edges, *capacity * sizeof(dissolve_edge_t));
+    }
+    dissolve_edge_t* e = &(*edges)[(*count)++];
+    e->ax = ax; e->ay = ay; e->bx = bx; e->by = by;
+    e->next_out = -1;
+    e->live = true;
+}
+
+// Merge the rings of one group: shared seam edges cancel, the rest is relinked
+// into rings. Only outer rings are kept, matching single-tile tracing.
+static void dissolve_group(mosaic_t* mosaic, int root) {
+    dissolve_edge_t* edges = NULL;
+    int edge_count = 0, edge_capacity = 0;
+    key_map_t seam_edges;
+    if (key_map_init(&seam_edges, 256) != 0) return;
+    
+    for (int m = root; m >= 0; m = mosaic->polys[m].next) {
+        const mosaic_poly_t* poly = &mosaic->polys[m];
+        for (int i = 0; i < poly->count; i++) {
+            int j = (i + 1) % poly->count;
+            int ax = poly->xy[2*i], ay = poly->xy[2*i + 1];
+            int bx = poly->xy[2*j], by = poly->xy[2*j + 1];
+            
+            bool on_seam = (ax == bx && ax % mosaic->tile_width == 0) ||
+                           (ay == by && ay % mosaic->tile_height == 0);
+            if (!on_seam) {
+                add_edge(&edges, &edge_count, &edge_capacity, ax, ay, bx, by);
+                continue;
+            }
+            
+            // Split seam segments into unit edges so opposite halves cancel exactly
+            int len = abs(bx - ax) + abs(by - ay);
+            int sx = (bx > ax) - (bx < ax), sy = (by > ay) - (by < ay);
+            int dir = sx > 0 ? 0 : sy > 0 ? 1 : sx < 0 ? 2 : 3;
+            for (int u = 0; u < len; u++) {
+                int ux = ax + u * sx, uy = ay + u * sy;
+                int match;
+                if (key_map_take(&seam_edges, EDGE_KEY(ux + sx, uy + sy, (dir + 2) % 4), &match)) {
+                    edges[match].live = false;
+                } else {
+                    key_map_put(&seam_edges, EDGE_KEY(ux, uy, dir), edge_count);
+                    add_edge(&edges, &edge_count, &edge_capacity, ux, uy, ux + sx, uy + sy);
+                }
+            }
+        }
+    }
+    key_map_destroy(&seam_edges);
+    
+    // Index outgoing edges by start vertex
+    key_map_t heads;
+    if (key_map_init(&heads, 256) != 0) {
+        free(edges);
+        return;
+    }
+    for (int i = 0; i < edge_count; i++) {
+        if (!edges[i].live) continue;
+        int head;
+        uint64_t key = VERTEX_KEY(edges[i].ax, edges[i].ay);
+        edges[i].next_out = key_map_get(&heads, key, &head) ? head : -1;
+        key_map_put(&heads, key, i);
+    }
+    
+    int* ring = NULL;
+    int ring_capacity = 0;
+    
+    for (int start = 0; start < edge_count; start++) {
+        if (!edges[start].live) continue;
+        
+        int ring_count = 0;
+        int e = start;
+        int sx = edges[start].ax, sy = edges[start].ay;
+        int prev_dir = -1;
+        
+        while (e >= 0) {
+            dissolve_edge_t* edge = &edges[e];
+            edge->live = false;
+            int dir = direction_of(edge);
+            
+            // Keep only corners where the direction changes
+            if (dir != prev_dir) {
+                if (ring_count + 1 > ring_capacity) {
+                    ring_capacity = ring_capacity ? ring_capacity * 2 : 64;
+                    ring = realloc(ring, ring_capacity * 2 * sizeof(int));
+                }
+                ring[2*ring_count] = edge->ax;
+                ring[2*ring_count + 1] = edge->ay;
+                ring_count++;
+            }
+            prev_dir = dir;
+            
+            if (edge->bx == sx && edge->by == sy) break;
+            
+            // At the next vertex prefer a right turn, then straight, then left,
+            // which splits diagonal pinches the same way the tracer does
+            int head = -1;
+            key_map_get(&heads, VERTEX_KEY(edge->bx, edge->by), &head);
+            int next = -1;
+            for (int turn = 1; turn >= -1 && next < 0; turn--) {
+                int want = (dir + turn + 4) % 4;
+                for (int c = head; c >= 0; c = edges[c].next_out) {
+                    if (edges[c].live && direction_of(&edges[c]) == want) {
+                        next = c;
+                        break;
+                    }
+                }
+            }
+            e = next;
+        }
+        
+        // Drop the start vertex if the ring closes in a straight line through it
+        if (ring_count > 2 && prev_dir == direction_of(&edges[start])) {
+            memmove(ring, ring + 2, (ring_count - 1) * 2 * sizeof(int));
+            ring_count--;
+        }
+        if (ring_count < 3) continue;
+        
+        // Screen-clockwise rings (positive area with y down) are outer boundaries
+        long long area = 0;
+        for (int i = 0; i < ring_count; i++) {
+            int j = (i + 1) % ring_count;
+            area += (long long)ring[2*i] * ring[2*j + 1] - (long long)ring[2*j] * ring[2*i + 1];
+        }
+        if (area > 0) emit_ring(mosaic, mosaic->polys[root].class_id, ring, ring_count);
+    }
+    
+    free(ring);
+    key_map_destroy(&heads);
+    free(edges);
+}
+
+static void finalize_group(mosaic_t* mosaic, int root) {
+    mosaic_poly_t* poly = &mosaic->polys[root];
+    if (poly->members == 1) {
+        emit_ring(mosaic, poly->class_id, poly->xy, poly->count);
+    } else {
+        dissolve_group(mosaic, root);
+    }
+    
+    int m = root;
+    while (m >= 0) {
+        int next = mosaic->polys[m].next;
+        release_poly(mosaic, m);
+        m = next;
+    }
+}
+
+static bool tile_processed(const mosaic_t* mosaic, int col, int row) {
+    return mosaic->processed[(size_t)row * mosaic->tile_cols + col] != 0;
+}
+
+// A seam edge of polygon `slot` facing tile (ncol, nrow)
+static void resolve_seam_edge(mosaic_t* mosaic, int slot, uint64_t key, int ncol, int nrow) {
+    if (!tile_processed(mosaic, ncol, nrow)) {
+        key_map_put(&mosaic->seams, key, slot);
+        mosaic->polys[find_root(mosaic, slot)].open_edges++;
+        return;
+    }
+    
+    int other;
+    if (!key_map_take(&mosaic->seams, key, &other)) return;  // Neighbour had no polygon here
+    
+    int other_root = find_root(mosaic, other);
+    mosaic->polys[other_root].open_edges--;
+    if (mosaic->polys[other].class_id == mosaic->polys[slot].class_id) {
+        union_groups(mosaic, slot, other);
+    }
+    push_pending(mosaic, other);
+}
+
+// Drop entries left on a border shared with an already processed neighbour
+static void expire_border(mosaic_t* mosaic, int fixed, int from, int to, bool vertical) {
+    for (int u = from; u < to; u++) {
+        uint64_t key = vertical ? SEAM_KEY(fixed, u, 1) : SEAM_KEY(u, fixed, 0);
+        int other;
+        if (key_map_take(&mosaic->seams, key, &other)) {
+            mosaic->polys[find_root(mosaic, other)].open_edges--;
+            push_pending(mosaic, other);
+        }
+    }
+}
+
+int mosaic_add_tile(mosaic_t* mosaic, int col, int row, const vectorization_result_t* tile) {
+    if (!mosaic || !tile) return 1;
+    if (col < 0 || row < 0 || col >= mosaic->tile_cols || row >= mosaic->tile_rows) {
+        fprintf(stderr, "Tile (%d, %d) is outside the mosaic grid\n", col, row);
+        return 1;
+    }
+    if (tile_processed(mosaic, col, row)) {
+        fprintf(stderr, "Tile (%d, %d) was already added to the mosaic\n", col, row);
+        return 1;
+    }
+    
+    int x0 = col * mosaic->tile_width, x1 = x0 + mosaic->tile_width;
+    int y0 = row * mosaic->tile_height, y1 = y0 + mosaic->tile_height;
+    int new_count = 0;
+    int* new_slots = NULL;
+    int polygon_total = 0;
+    for (int f = 0; f < tile->feature_count; f++) polygon_total += tile->features[f].polygon_count;
+    if (polygon_total > 0) new_slots = malloc(polygon_total * sizeof(int));
+    
+    // Snap tile rings back onto the global pixel-corner grid
+    double sx = mosaic->width / (mosaic->maxx - mosaic->minx);
+    double sy = mosaic->height / (mosaic->maxy - mosaic->miny);
+    for (int f = 0; f < tile->feature_count; f++) {
+        const geological_feature_t* feature = &tile->features[f];
+        int class_id = mosaic_class_id(mosaic, feature->dominant_color);
+        
+        for (int p = 0; p < feature->polygon_count; p++) {
+            const polygon_t* polygon = &feature->polygons[p];
+            if (polygon->count < 3) continue;
+            
+            int slot = alloc_poly(mosaic);
+            mosaic_poly_t* poly = &mosaic->polys[slot];
+            poly->class_id = class_id;
+            poly->xy = malloc(polygon->count * 2 * sizeof(int));
+            for (int k = 0; k < polygon->count; k++) {
+                poly->xy[2*k] = (int)lround((polygon->coords[k].x - mosaic->minx) * sx);
+                poly->xy[2*k + 1] = (int)lround((mosaic->maxy - polygon->coords[k].y) * sy);
+            }
+            poly->count = polygon->count;
+            new_slots[new_count++] = slot;
+        }
+    }
+    
+    mosaic->pending_count = 0;
+    for (int n = 0; n < new_count; n++) {
+        int slot = new_slots[n];
+        const int* xy = mosaic->polys[slot].xy;
+        for (int i = 0; i < mosaic->polys[slot].count; i++) {
+            int j = (i + 1) % mosaic->polys[slot].count;
+            int ax = xy[2*i], ay = xy[2*i + 1], bx = xy[2*j], by = xy[2*j + 1];
+            
+            if (ax == bx && ay != by) {
+                int ncol = ax == x0 ? col - 1 : ax == x1 ? col + 1 : -1;
+                if (ncol < 0 || ncol >= mosaic->tile_cols) continue;
+                int lo = ay < by ? ay : by, hi = ay < by ? by : ay;
+                for (int u = lo; u < hi; u++) resolve_seam_edge(mosaic, slot, SEAM_KEY(ax, u, 1), ncol, row);
+            } else if (ay == by && ax != bx) {
+                int nrow = ay == y0 ? row - 1 : ay == y1 ? row + 1 : -1;
+                if (nrow < 0 || nrow >= mosaic->tile_rows) continue;
+                int lo = ax < bx ? ax : bx, hi = ax < bx ? bx : ax;
+                for (int u = lo; u < hi; u++) resolve_seam_edge(mosaic, slot, SEAM_KEY(u, ay, 0), col, nrow);
+            }
+        }
+    }
+    
+    if (col > 0 && tile_processed(mosaic, col - 1, row)) expire_border(mosaic, x0, y0, y1, true);
+    if (col + 1 < mosaic->tile_cols && tile_processed(mosaic, col + 1, row)) expire_border(mosaic, x1, y0, y1, true);
+    if (row > 0 && tile_processed(mosaic, col, row - 1)) expire_border(mosaic, y0, x0, x1, false);
+    if (row + 1 < mosaic->tile_rows && tile_processed(mosaic, col, row + 1)) expire_border(mosaic, y1, x0, x1, false);
+    mosaic->processed[(size_t)row * mosaic->tile_cols + col] = 1;
+    mosaic->tiles_added++;
+    
+    if (mosaic->seams.count > mosaic->peak_open_edges) mosaic->peak_open_edges = mosaic->seams.count;
+    
+    // Emit every group that can no longer grow
+    for (int n = 0; n < new_count; n++) push_pending(mosaic, new_slots[n]);
+    for (int n = 0; n < mosaic->pending_count; n++) {
+        int slot = mosaic->pending[n];
+        if (mosaic->polys[slot].count < 0) continue;  // Already emitted with its group
+        int root = find_root(mosaic, slot);
+        if (mosaic->polys[root].open_edges == 0) finalize_group(mosaic, root);
+    }
+    mosaic->pending_count = 0;
+    
+    free(new_slots);
+    return 0;
+}
+
+vectorization_result_t* mosaic_finish(mosaic_t* mosaic) {
+    if (!mosaic) return NULL;
+    
+    // Tiles that were never added leave groups open; flush them as they are
+    for (int i = 0; i < mosaic->poly_count; i++) {
+        if (mosaic->polys[i].count >= 0 && mosaic->polys[i].parent == i) finalize_group(mosaic, i);
+    }
+    key_map_destroy(&mosaic->seams);
+    key_map_init(&mosaic->seams, 16);
+    
+    vectorization_result_t* result = mosaic->output;
+    mosaic->output = NULL;
+    
+    printf("Mosaic complete: %d tiles, %d seam merges, %d features\n",
+           mosaic->tiles_added, mosaic->seam_merges, result->feature_count);
+    printf("Peak seam frontier: %zu open edges, %d resident polygons\n",
+           mosaic->peak_open_edges, mosaic->peak_live_polys);
+    return result;
+}
+
+int tile_bbox(const wms_config_t* config, int col, int row, char* bbox, size_t bbox_size) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
+        fprintf(stderr, "Invalid bbox format\n");
+        return 1;
+    }
+    
+    // Row 0 is the top of the map, matching image row order
+    double tile_w = (maxx - minx) / config->tile_cols;
+    double tile_h = (maxy - miny) / config->tile_rows;
+    double tminx = minx + col * tile_w;
+    double tmaxy = maxy - row * tile_h;
+    double tmaxx = col + 1 == config->tile_cols ? maxx : tminx + tile_w;
+    double tminy = row + 1 == config->tile_rows ? miny : tmaxy - tile_h;
+    
+    snprintf(bbox, bbox_size, "%.10f,%.10f,%.10f,%.10f", tminx, tminy, tmaxx, tmaxy);
+    return 0;
+}
+
+// A grid of tile files (row-major, row 0 at the top) as one raster. A lone
+// tile keeps its palette; tiles of a grid are pasted as RGB since their
+// palettes need not agree. Every tile must be tile_width x tile_height, so
+// rasters loaded on the same grid align pixel for pixel.
+image_t* load_grid_raster(const char* const* files, int cols, int rows, int tile_width, int tile_height) {
+    if (cols * rows == 1) {
+        image_t* tile = load_png_simple(files[0]);
+        if (!tile || tile->width != tile_width || tile->height != tile_height) {
+            fprintf(stderr, "Failed to load %s as a %dx%d tile\n", files[0], tile_width, tile_height);
+            free_image(tile);
+            return NULL;
+        }
+        return tile;
+    }
+    
+    image_t* raster = calloc(1, sizeof(image_t));
+    if (!raster) return NULL;
+    raster->width = tile_width * cols;
+    raster->height = tile_height * rows;
+    raster->channels = 3;
+    raster->data = raster_alloc((size_t)raster->width * raster->height * 3);
+    if (!raster->data) {
+        free_image(raster);
+        return NULL;
+    }
+    
+    for (int i = 0; i < cols * rows; i++) {
+        image_t* tile = load_png_simple(files[i]);
+        if (!tile || tile->width != tile_width || tile->height != tile_height) {
+            fprintf(stderr, "Failed to load %s as a %dx%d tile\n", files[i], tile_width, tile_height);
+            free_image(tile);
+            free_image(raster);
+            return NULL;
+        }
+        
+        int ox = (i % cols) * tile_width, oy = (i / cols) * tile_height;
+        for (int y = 0; y < tile_height; y++) {
+            unsigned char* out = raster->data + ((size_t)(oy + y) * raster->width + ox) * 3;
+            const unsigned char* in = tile->data + (size_t)y * tile_width * tile->channels;
+            if (tile->channels == 3) {
+                memcpy(out, in, (size_t)tile_width * 3);
+                continue;
+            }
+            for (int x = 0; x < tile_width; x++) {
+                color_t c = in[x] < tile->palette_size ? tile->palette[in[x]] : (color_t){0, 0, 0};
+                out[x * 3] = c.r;
+                out[x * 3 + 1] = c.g;
+                out[x * 3 + 2] = c.b;
+            }
+        }
+        free_image(tile);
+    }
+    return raster;
+}
+
+// Tiles are requested with tile_overlap extra pixels on every side, so labels,
+// symbols and antialiasing that the server clips at the image edge fall in
+// the margin rather than on the seam
+static int tile_request_bbox(const wms_config_t* config, const char* bbox, char* request, size_t request_size) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) return 1;
+    double margin_x = (maxx - minx) / config->width * config->tile_overlap;
+    double margin_y = (maxy - miny) / config->height * config->tile_overlap;
+    snprintf(request, request_size, "%.10f,%.10f,%.10f,%.10f",
+             minx - margin_x, miny - margin_y, maxx + margin_x, maxy + margin_y);
+    return 0;
+}
+
+// Decoded tile pixels with the overlap margin cropped off
+static image_t* load_tile_core(const wms_config_t* config, const char* image_file) {
+    image_t* img = load_png_simple(image_file);
+    if (!img) {
+        fprintf(stderr, "Failed to load image: %s\n", image_file);
+        return NULL;
+    }
+    if (config->tile_overlap <= 0) return img;
+    
+    // Scale the margin in case the server returned a different size than requested
+    int request_width = config->width + 2 * config->tile_overlap;
+    int request_height = config->height + 2 * config->tile_overlap;
+    int margin_x = (int)lround((double)config->tile_overlap * img->width / request_width);
+    int margin_y = (int)lround((double)config->tile_overlap * img->height / request_height);
+    image_t* core = crop_image(img, margin_x, margin_y, img->width - 2 * margin_x, img->height - 2 * margin_y);
+    free_image(img);
+    return core;
+}
+
+// Vectorize exactly the tile's own pixels, so the mosaic never sees the
+// overlap. In incremental runs a tile whose pixels hash the same as last
+// time comes back from the state directory instead.
+static vectorization_result_t* vectorize_tile_core(const wms_config_t* config, run_manifest_t* manifest,
+                                                   int col, int row, const char* image_file, const char* bbox) {
+    legend_t* legend = context_acquire_legend(config->context, config);
+    if (config->legend && !legend) return NULL;
+    if (config->tile_overlap <= 0 && !manifest) {
+        vectorization_result_t* result = analyze_geological_colors(image_file, bbox, config->srs, &config->denoise, legend);
+        context_release_legend(config->context, legend);
+        return result;
+    }
+    
+    double minx, miny, maxx, maxy;
+    image_t* core = NULL;
+    if (sscanf(bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4 || !(core = load_tile_core(config, image_file))) {
+        context_release_legend(config->context, legend);
+        return NULL;
+    }
+    
+    if (manifest) {
+        vectorization_result_t* stored = run_manifest_reuse_tile(manifest, col, row, image_hash(core), config->srs);
+        if (stored) {
+            printf("Tile row %d, col %d unchanged, reusing %d stored features\n", row, col, stored->feature_count);
+            free_image(core);
+            context_release_legend(config->context, legend);
+            return stored;
+        }
+    }
+    
+    vectorization_result_t* result = vectorize_raster(core, minx, miny, maxx, maxy, config->srs, &config->denoise, legend);
+    free_image(core);
+    context_release_legend(config->context, legend);
+    if (result && manifest && run_manifest_store_tile(manifest, col, row, result) != 0) {
+        free_vectorization_result(result);
+        return NULL;
+    }
+    return result;
+}
+
+// Download and vectorize a grid of tiles, dissolving polygons across seams
+int vectorize_tiled_map(const wms_config_t* config) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
+        fprintf(stderr, "Invalid bbox format\n");
+        return 1;
+    }
+    
+    mosaic_t* mosaic = mosaic_create(minx, miny, maxx, maxy, config->srs,
+                                     config->tile_cols, config->tile_rows, config->width, config->height);
+    if (!mosaic) return 1;
+    
+    // Unchanged tiles are still replayed through the mosaic, which only costs
+    // seam bookkeeping; only their vectorization and attribution are skipped
+    run_manifest_t* manifest = NULL;
+    if (config->incremental_dir) {
+        manifest = run_manifest_open(config->incremental_dir, config);
+        if (!manifest) {
+            mosaic_free(mosaic);
+            return 1;
+        }
+    }
+    
+    printf("Processing %dx%d tile grid...\n", config->tile_cols, config->tile_rows);
+    
+    for (int row = 0; row < config->tile_rows; row++) {
+        for (int col = 0; col < config->tile_cols; col++) {
+            char bbox[256], tile_file[512], georef_file[600];
+            if (tile_bbox(config, col, row, bbox, sizeof(bbox)) != 0) {
+                mosaic_free(mosaic);
+                run_manifest_free(manifest);
+                return 1;
+            }
+            snprintf(tile_file, sizeof(tile_file), "%s_r%d_c%d.png", config->output_file, row, col);
+            snprintf(georef_file, sizeof(georef_file), "%s_georef.tif", tile_file);
+            
+            char request_bbox[256];
+            if (tile_request_bbox(config, bbox, request_bbox, sizeof(request_bbox)) != 0) {
+                mosaic_free(mosaic);
+                run_manifest_free(manifest);
+                return 1;
+            }
+            
+            wms_config_t tile_config = *config;
+            tile_config.bbox = request_bbox;
+            tile_config.output_file = tile_file;
+            tile_config.width = config->width + 2 * config->tile_overlap;
+            tile_config.height = config->height + 2 * config->tile_overlap;
+            
+            printf("Tile row %d, col %d: %s\n", row, col, bbox);
+            if (download_wms_tile(&tile_config) != 0 ||
+                georeference_image(config->context, tile_file, georef_file, request_bbox, config->srs) != 0) {
+                fprintf(stderr, "Error fetching tile row %d, col %d\n", row, col);
+                mosaic_free(mosaic);
+                run_manifest_free(manifest);
+                return 1;
+            }
+            
+            vectorization_result_t* tile = vectorize_tile_core(config, manifest, col, row, georef_file, bbox);
+            if (!tile || mosaic_add_tile(mosaic, col, row, tile) != 0) {
+                fprintf(stderr, "Error vectorizing tile row %d, col %d\n", row, col);
+                free_vectorization_result(tile);
+                mosaic_free(mosaic);
+                run_manifest_free(manifest);
+                return 1;
+            }
+            free_vectorization_result(tile);
+        }
+    }
+    
+    vectorization_result_t* result = mosaic_finish(mosaic);
+    mosaic_free(mosaic);
+    
+    // GetFeatureInfo goes to the tile holding each query point
+    if (attribution_requested(config)) {
+        if (manifest) run_manifest_reuse_attributes(manifest, result, config->info_format);
+        attribute_features(result, config);
+    }
+    
+    // The manifest is only advanced once the output it describes exists
+    int status = write_vector_output(result, config->output_file, config);
+    if (status == 0 && manifest) status = run_manifest_save(manifest, result);
+    free_vectorization_result(result);
+    run_manifest_free(manifest);
+    if (status != 0) return 1;
+    
+    printf("Tiled geological vectorization complete\n");
+    return 0;
+}
+
+
+// Coarse-to-fine fetching. Each grid tile is first requested whole, then split
+// into four requests of the same pixel size wherever classes meet in it, down
+// to adaptive_levels below the grid. Quadrants of a single class are filled
+// from the coarser level without being requested, so the interior of large
+// units costs neither GetMap bytes nor vectorization. Boundaries thinner than
+// a coarse pixel can be missed, as can changes on servers that generalise
+// their rendering by scale.
+
+#define ADAPTIVE_MAX_LEVELS 10
+#define UNIFORM_TILE_SIZE 4     // Token raster for filled tiles, above MIN_REGION_PIXELS
+
+typedef struct {
+    const wms_config_t* config;     // Grid of quadtree roots, at least 1x1
+    mosaic_t* mosaic;               // Finest-level grid
+    const legend_t* legend;
+    int levels;
+    int requests;
+    int fetched_tiles;              // Finest-level tiles downloaded and vectorized
+    int filled_tiles;               // Finest-level tiles filled from a coarser level
+} adaptive_fetch_t;
+
+static int cell_bbox(const adaptive_fetch_t* fetch, int level, int col, int row, char* bbox, size_t bbox_size) {
+    wms_config_t level_config = *fetch->config;
+    level_config.tile_cols = fetch->config->tile_cols << level;
+    level_config.tile_rows = fetch->config->tile_rows << level;
+    return tile_bbox(&level_config, col, row, bbox, bbox_size);
+}
+
+// Download one cell at the request size and georeference it
+static int fetch_cell(adaptive_fetch_t* fetch, int level, int col, int row,
+                      char* bbox, size_t bbox_size, char* georef_file, size_t georef_size) {
+    const wms_config_t* config = fetch->config;
+    char request_bbox[256], tile_file[512];
+    if (cell_bbox(fetch, level, col, row, bbox, bbox_size) != 0 ||
+        tile_request_bbox(config, bbox, request_bbox, sizeof(request_bbox)) != 0) {
+        return 1;
+    }
+    snprintf(tile_file, sizeof(tile_file), "%s_q%d_r%d_c%d.png", config->output_file, level, row, col);
+    snprintf(georef_file, georef_size, "%s_georef.tif", tile_file);
+    
+    wms_config_t tile_config = *config;
+    tile_config.bbox = request_bbox;
+    tile_config.output_file = tile_file;
+    tile_config.width = config->width + 2 * config->tile_overlap;
+    tile_config.height = config->height + 2 * config->tile_overlap;
+    
+    printf("Level %d, row %d, col %d: %s\n", level, row, col, bbox);
+    fetch->requests++;
+    if (download_wms_tile(&tile_config) != 0 ||
+        georeference_image(config->context, tile_file, georef_file, request_bbox, config->srs) != 0) {
+        fprintf(stderr, "Error fetching level %d cell row %d, col %d\n", level, row, col);
+        return 1;
+    }
+    return 0;
+}
+
+// Class shared by a quadrant and the ring of pixels around it, or -1 when a
+// boundary runs through it. The ring catches boundaries that follow the
+// quadrant edge at the coarse level.
+static int uniform_class(const class_image_t* classes, int x0, int y0, int x1, int y1) {
+    if (x0 > 0) x0--;
+    if (y0 > 0) y0--;
+    if (x1 < classes->width) x1++;
+    if (y1 < classes->height) y1++;
+    if (x0 >= x1 || y0 >= y1) return -1;
+    
+    unsigned short first = classes->data[(size_t)y0 * classes->width + x0];
+    for (int y = y0; y < y1; y++) {
+        const unsigned short* line = classes->data + (size_t)y * classes->width;
+        for (int x = x0; x < x1; x++) {
+            if (line[x] != first) return -1;
+        }
+    }
+    return first;
+}
+
+// A finest-level tile of one class, traced from a token raster so that its
+// ring runs the same way round as those of vectorized tiles
+static vectorization_result_t* uniform_tile(unsigned short class_id, color_t color, const char* bbox, const char* srs) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) return NULL;
+    
+    unsigned short data[UNIFORM_TILE_SIZE * UNIFORM_TILE_SIZE];
+    for (int i = 0; i < UNIFORM_TILE_SIZE * UNIFORM_TILE_SIZE; i++) data[i] = class_id == CLASS_NONE ? CLASS_NONE : 0;
+    class_image_t classes = {data, UNIFORM_TILE_SIZE, UNIFORM_TILE_SIZE};
+    return vectorize_classes(&classes, &color, 1, minx, miny, maxx, maxy, srs);
+}
+
+// Cover the finest-level tiles under a cell with a single class
+static int fill_cell(adaptive_fetch_t* fetch, int level, int col, int row, unsigned short class_id, color_t color) {
+    int span = 1 << (fetch->levels - level);
+    for (int r = row * span; r < (row + 1) * span; r++) {
+        for (int c = col * span; c < (col + 1) * span; c++) {
+            char bbox[256];
+            if (cell_bbox(fetch, fetch->levels, c, r, bbox, sizeof(bbox)) != 0) return 1;
+            vectorization_result_t* tile = uniform_tile(class_id, color, bbox, fetch->config->srs);
+            int status = !tile || mosaic_add_tile(fetch->mosaic, c, r, tile) != 0;
+            free_vectorization_result(tile);
+            if (status != 0) return 1;
+            fetch->filled_tiles++;
+        }
+    }
+    return 0;
+}
+
+static int adaptive_cell(adaptive_fetch_t* fetch, int level, int col, int row) {
+    const wms_config_t* config = fetch->config;
+    char bbox[256], georef_file[600];
+    if (fetch_cell(fetch, level, col, row, bbox, sizeof(bbox), georef_file, sizeof(georef_file)) != 0) return 1;
+    
+    if (level == fetch->levels) {
+        vectorization_result_t* tile = vectorize_tile_core(config, NULL, col, row, georef_file, bbox);
+        int status = !tile || mosaic_add_tile(fetch->mosaic, col, row, tile) != 0;
+        if (status != 0) fprintf(stderr, "Error vectorizing tile row %d, col %d\n", row, col);
+        free_vectorization_result(tile);
+        fetch->fetched_tiles++;
+        return status;
+    }
+    
+    // Classify the cell as vectorization would, denoising included, so speckle
+    // does not force a refinement
+    image_t* core = load_tile_core(config, georef_file);
+    if (!core) return 1;
+    color_t* colors;
+    int color_count;
+    class_image_t* classes = classify_raster(core, fetch->legend, &colors, &color_count);
+    free_image(core);
+    if (!classes || denoise_class_image(classes, &config->denoise) != 0) {
+        free_class_image(classes);
+        free(colors);
+        return 1;
+    }
+    
+    int uniform[4];
+    color_t fill[4] = {{0}};
+    for (int q = 0; q < 4; q++) {
+        int qx = q & 1, qy = q >> 1;
+        uniform[q] = uniform_class(classes, classes->width * qx / 2, classes->height * qy / 2,
+                                   classes->width * (qx + 1) / 2, classes->height * (qy + 1) / 2);
+        if (uniform[q] >= 0 && uniform[q] != CLASS_NONE) {
+            fill[q] = fetch->legend ? fetch->legend->colors[uniform[q]] : colors[uniform[q]];
+        }
+    }
+    free_class_image(classes);
+    free(colors);
+    
+    for (int q = 0; q < 4; q++) {
+        int child_col = col * 2 + (q & 1), child_row = row * 2 + (q >> 1);
+        int status = uniform[q] >= 0 ? fill_cell(fetch, level + 1, child_col, child_row, (unsigned short)uniform[q], fill[q])
+                                     : adaptive_cell(fetch, level + 1, child_col, child_row);
+        if (status != 0) return 1;
+    }
+    return 0;
+}
+
+int vectorize_adaptive_map(const wms_config_t* config) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
+        fprintf(stderr, "Invalid bbox format\n");
+        return 1;
+    }
+    
+    wms_config_t grid = *config;
+    if (grid.tile_cols < 1) grid.tile_cols = 1;
+    if (grid.tile_rows < 1) grid.tile_rows = 1;
+    int levels = config->adaptive_levels;
+    int finest_cols = grid.tile_cols << levels, finest_rows = grid.tile_rows << levels;
+    if (levels < 1 || levels > ADAPTIVE_MAX_LEVELS ||
+        (double)config->width * finest_cols > INT_MAX / 2 || (double)config->height * finest_rows > INT_MAX / 2) {
+        fprintf(stderr, "Adaptive levels must be 1 to %d and keep the finest raster below 2^30 pixels a side\n",
+                ADAPTIVE_MAX_LEVELS);
+        return 1;
+    }
+    
+    mosaic_t* mosaic = mosaic_create(minx, miny, maxx, maxy, config->srs,
+                                     finest_cols, finest_rows, config->width, config->height);
+    if (!mosaic) return 1;
+    legend_t* legend = context_acquire_legend(config->context, config);
+    if (config->legend && !legend) {
+        mosaic_free(mosaic);
+        return 1;
+    }
+    
+    printf("Adaptive fetch of a %dx%d grid, up to %d levels deep (%dx%d tiles at full resolution)...\n",
+           grid.tile_cols, grid.tile_rows, levels, finest_cols, finest_rows);
+    
+    adaptive_fetch_t fetch = {&grid, mosaic, legend, levels, 0, 0, 0};
+    int status = 0;
+    for (int row = 0; row < grid.tile_rows && status == 0; row++) {
+        for (int col = 0; col < grid.tile_cols && status == 0; col++) {
+            status = adaptive_cell(&fetch, 0, col, row);
+        }
+    }
+    context_release_legend(config->context, legend);
+    if (status != 0) {
+        mosaic_free(mosaic);
+        return 1;
+    }
+    
+    vectorization_result_t* result = mosaic_finish(mosaic);
+    mosaic_free(mosaic);
+    int finest_total = finest_cols * finest_rows;
+    printf("Adaptive fetch: %d GetMap requests instead of %d; %d of %d full-resolution tiles downloaded, "
+           "%d filled from coarser levels\n",
+           fetch.requests, finest_total, fetch.fetched_tiles, finest_total, fetch.filled_tiles);
+    
+    // Attribution and output treat the job as the full-resolution grid
+    wms_config_t job_config = grid;
+    job_config.tile_cols = finest_cols;
+    job_config.tile_rows = finest_rows;
+    if (attribution_requested(config)) attribute_features(result, &job_config);
+    status = write_vector_output(result, config->output_file, &job_config);
+    free_vectorization_result(result);
+    if (status != 0) return 1;
+    
+    printf("Adaptive geological vectorization complete\n");
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,746 @@
+#include "../include/wmspal.h"
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+// Mapbox Vector Tile pyramid writer. Geometry is projected to Web Mercator
+// once, then for each zoom it is simplified to the tile grid resolution,
+// clipped per tile and encoded straight into protobuf without going through
+// an intermediate text format.
+
+#define MVT_EXTENT 4096
+#define MVT_BUFFER 64                  // Clip margin in tile units
+#define MVT_LAYER_VERSION 2
+#define MERCATOR_RADIUS 6378137.0
+#define MERCATOR_HALF_WORLD 20037508.342789244
+#define MAX_MERCATOR_LAT 85.0511287798
+
+// Growable byte buffer for protobuf output
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} pbf_buffer_t;
+
+// Encoded geometry of one source feature within one tile
+typedef struct {
+    int feature;
+    unsigned int* geometry;
+    int count, capacity;
+    int cursor_x, cursor_y;    // MVT commands are relative to the previous point
+} mvt_entry_t;
+
+typedef struct {
+    int x, y;
+    mvt_entry_t* entries;
+    int entry_count, entry_capacity;
+} mvt_tile_t;
+
+typedef struct {
+    double* xy;
+    int count, capacity;
+} mvt_ring_t;
+
+static void pbf_reserve(pbf_buffer_t* buf, size_t extra) {
+    if (buf->size + extra <= buf->capacity) return;
+    size_t capacity = buf->capacity ? buf->capacity : 256;
+    while (capacity < buf->size + extra) capacity *= 2;
+    buf->data = realloc(buf->data, capacity);
+    buf->capacity = capacity;
+}
+
+static void pbf_varint(pbf_buffer_t* buf, uint64_t value) {
+    pbf_reserve(buf, 10);
+    while (value >= 0x80) {
+        buf->data[buf->size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf->data[buf->size++] = (unsigned char)value;
+}
+
+static void pbf_key(pbf_buffer_t* buf, int field, int wire_type) {
+    pbf_varint(buf, ((uint64_t)field << 3) | wire_type);
+}
+
+static void pbf_bytes(pbf_buffer_t* buf, int field, const void* data, size_t size) {
+    pbf_key(buf, field, 2);
+    pbf_varint(buf, size);
+    pbf_reserve(buf, size);
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static void pbf_string(pbf_buffer_t* buf, int field, const char* value) {
+    pbf_bytes(buf, field, value, strlen(value));
+}
+
+static void pbf_packed(pbf_buffer_t* buf, int field, const unsigned int* values, int count) {
+    pbf_buffer_t packed = {0};
+    for (int i = 0; i < count; i++) pbf_varint(&packed, values[i]);
+    pbf_bytes(buf, field, packed.data, packed.size);
+    free(packed.data);
+}
+
+static unsigned int zigzag(int value) {
+    return ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+}
+
+// Only geographic and Web Mercator inputs can be tiled without a reprojection step
+static bool crs_is_geographic(const char* crs) {
+    return strcmp(crs, "EPSG:4326") == 0 || strcmp(crs, "CRS:84") == 0;
+}
+
+static bool crs_is_mercator(const char* crs) {
+    return strcmp(crs, "EPSG:3857") == 0 || strcmp(crs, "EPSG:900913") == 0 ||
+           strcmp(crs, "EPSG:102100") == 0;
+}
+
+static void to_mercator(bool geographic, double x, double y, double* mx, double* my) {
+    if (!geographic) {
+        *mx = x;
+        *my = y;
+        return;
+    }
+    if (y > MAX_MERCATOR_LAT) y = MAX_MERCATOR_LAT;
+    if (y < -MAX_MERCATOR_LAT) y = -MAX_MERCATOR_LAT;
+    *mx = MERCATOR_RADIUS * x * M_PI / 180.0;
+    *my = MERCATOR_RADIUS * log(tan(M_PI / 4.0 + y * M_PI / 360.0));
+}
+
+static void from_mercator(double mx, double my, double* lon, double* lat) {
+    *lon = mx / MERCATOR_RADIUS * 180.0 / M_PI;
+    *lat = (2.0 * atan(exp(my / MERCATOR_RADIUS)) - M_PI / 2.0) * 180.0 / M_PI;
+}
+
+static void ring_push(mvt_ring_t* ring, double x, double y) {
+    if (ring->count >= ring->capacity) {
+        ring->capacity = ring->capacity ? ring->capacity * 2 : 64;
+        ring->xy = realloc(ring->xy, ring->capacity * 2 * sizeof(double));
+    }
+    ring->xy[2*ring->count] = x;
+    ring->xy[2*ring->count + 1] = y;
+    ring->count++;
+}
+
+static double segment_distance_sq(const double* p, const double* a, const double* b) {
+    double dx = b[0] - a[0], dy = b[1] - a[1];
+    double len = dx*dx + dy*dy;
+    double t = len > 0 ? ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / len : 0;
+    if (t < 0) t = 0; else if (t > 1) t = 1;
+    double ex = a[0] + t * dx - p[0], ey = a[1] + t * dy - p[1];
+    return ex*ex + ey*ey;
+}
+
+// Douglas-Peucker over a closed ring, anchored at the first vertex and the one farthest from it
+static void simplify_ring(const mvt_ring_t* in, double tolerance, mvt_ring_t* out) {
+    out->count = 0;
+    int n = in->count;
+    if (n < 4) {
+        for (int i = 0; i < n; i++) ring_push(out, in->xy[2*i], in->xy[2*i + 1]);
+        return;
+    }
+    
+    int far = 0;
+    double far_dist = -1;
+    for (int i = 1; i < n; i++) {
+        double dx = in->xy[2*i] - in->xy[0], dy = in->xy[2*i + 1] - in->xy[1];
+        if (dx*dx + dy*dy > far_dist) { far_dist = dx*dx + dy*dy; far = i; }
+    }
+    
+    unsigned char* keep = calloc(n + 1, 1);
+    int* stack = malloc(2 * (n + 1) * sizeof(int));
+    int top = 0;
+    keep[0] = keep[far] = keep[n] = 1;
+    stack[top++] = 0; stack[top++] = far;
+    stack[top++] = far; stack[top++] = n;
+    
+    double tol_sq = tolerance * tolerance;
+    while (top > 0) {
+        int last = stack[--top], first = stack[--top];
+        const double* a = &in->xy[2*first];
+        const double* b = &in->xy[2*(last % n)];
+        int index = -1;
+        double max_dist = tol_sq;
+        for (int i = first + 1; i < last; i++) {
+            double d = segment_distance_sq(&in->xy[2*i], a, b);
+            if (d > max_dist) { max_dist = d; index = i; }
+        }
+        if (index >= 0) {
+            keep[index] = 1;
+            stack[top++] = first; stack[top++] = index;
+            stack[top++] = index; stack[top++] = last;
+        }
+    }
+    
+    for (int i = 0; i < n; i++) {
+        if (keep[i]) ring_push(out, in->xy[2*i], in->xy[2*i + 1]);
+    }
+    free(stack);
+    free(keep);
+}
+
+// Sutherland-Hodgman clip of a ring against one half-plane (axis 0 = x, 1 = y)
+static void clip_edge(const mvt_ring_t* in, mvt_ring_t* out, int axis, double limit, bool keep_above) {
+    out->count = 0;
+    if (in->count == 0) return;
+    
+    const double* prev = &in->xy[2*(in->count - 1)];
+    bool prev_in = keep_above ? prev[axis] >= limit : prev[axis] <= limit;
+    for (int i = 0; i < in->count; i++) {
+        const double* cur = &in->xy[2*i];
+        bool cur_in = keep_above ? cur[axis] >= limit : cur[axis] <= limit;
+        if (cur_in != prev_in) {
+            double t = (limit - prev[axis]) / (cur[axis] - prev[axis]);
+            double ix = prev[0] + t * (cur[0] - prev[0]);
+            double iy = prev[1] + t * (cur[1] - prev[1]);
+            if (axis == 0) ix = limit; else iy = limit;
+            ring_push(out, ix, iy);
+        }
+        if (cur_in) ring_push(out, cur[0], cur[1]);
+        prev = cur;
+        prev_in = cur_in;
+    }
+}
+
+static void clip_ring(const mvt_ring_t* ring, double minx, double miny, double maxx, double maxy,
+                      mvt_ring_t* out, mvt_ring_t* scratch) {
+    clip_edge(ring, scratch, 0, minx, true);
+    clip_edge(scratch, out, 0, maxx, false);
+    clip_edge(out, scratch, 1, miny, true);
+    clip_edge(scratch, out, 1, maxy, false);
+}
+
+static mvt_entry_t* tile_entry(mvt_tile_t* tile, int feature) {
+    // Features are processed one at a time, so the current one is always last
+    if (tile->entry_count > 0 && tile->entries[tile->entry_count - 1].feature == feature) {
+        return &tile->entries[tile->entry_count - 1];
+    }
+    if (tile->entry_count >= tile->entry_capacity) {
+        tile->entry_capacity = tile->entry_capacity ? tile->entry_capacity * 2 : 4;
+        tile->entries = realloc(tile->entries, tile->entry_capacity * sizeof(mvt_entry_t));
+    }
+    mvt_entry_t* entry = &tile->entries[tile->entry_count++];
+    memset(entry, 0, sizeof(mvt_entry_t));
+    entry->feature = feature;
+    return entry;
+}
+
+static void entry_push(mvt_entry_t* entry, unsigned int value) {
+    if (entry->count >= entry->capacity) {
+        entry->capacity = entry->capacity ? entry->capacity * 2 : 64;
+        entry->geometry = realloc(entry->geometry, entry->capacity * sizeof(unsigned int));
+    }
+    entry->geometry[entry->count++] = value;
+}
+
+// Quantize a clipped ring to tile coordinates and append it as MoveTo/LineTo/ClosePath
+static void encode_ring(mvt_entry_t* entry, const mvt_ring_t* ring, double tile_minx, double tile_maxy,
+                        double scale, int* points) {
+    int n = 0;
+    for (int i = 0; i < ring->count; i++) {
+        int x = (int)lround((ring->xy[2*i] - tile_minx) * scale);
+        int y = (int)lround((tile_maxy - ring->xy[2*i + 1]) * scale);
+        if (n > 0 && points[2*(n-1)] == x && points[2*(n-1) + 1] == y) continue;
+        points[2*n] = x;
+        points[2*n + 1] = y;
+        n++;
+    }
+    while (n > 1 && points[0] == points[2*(n-1)] && points[1] == points[2*(n-1) + 1]) n--;
+    if (n < 3) return;
+    
+    long long area = 0;
+    for (int i = 0; i < n; i++) {
+        int j = (i + 1) % n;
+        area += (long long)points[2*i] * points[2*j + 1] - (long long)points[2*j] * points[2*i + 1];
+    }
+    if (area == 0) return;
+    if (area < 0) {
+        // Exterior rings must have positive area in tile coordinates (clockwise, y down)
+        for (int i = 0, j = n - 1; i < j; i++, j--) {
+            int tx = points[2*i], ty = points[2*i + 1];
+            points[2*i] = points[2*j]; points[2*i + 1] = points[2*j + 1];
+            points[2*j] = tx; points[2*j + 1] = ty;
+        }
+    }
+    
+    entry_push(entry, (1 << 3) | 1);    // MoveTo, one point
+    entry_push(entry, zigzag(points[0] - entry->cursor_x));
+    entry_push(entry, zigzag(points[1] - entry->cursor_y));
+    entry_push(entry, ((unsigned int)(n - 1) << 3) | 2);    // LineTo
+    for (int i = 1; i < n; i++) {
+        entry_push(entry, zigzag(points[2*i] - points[2*(i-1)]));
+        entry_push(entry, zigzag(points[2*i + 1] - points[2*(i-1) + 1]));
+    }
+    entry_push(entry, (1 << 3) | 7);    // ClosePath
+    entry->cursor_x = points[2*(n-1)];
+    entry->cursor_y = points[2*(n-1) + 1];
+}
+
+// Layer-local key/value tables; values are always strings or unsigned ints here
+typedef struct {
+    const char* keys[8];
+    int key_count;
+    pbf_buffer_t values;        // Encoded Value messages, appended as they are first seen
+    char** value_text;
+    bool* value_numeric;
+    int value_count, value_capacity;
+    key_map_t value_index;      // Value hash -> first value with that hash
+} mvt_tags_t;
+
+static int tag_key(mvt_tags_t* tags, const char* key) {
+    for (int i = 0; i < tags->key_count; i++) {
+        if (strcmp(tags->keys[i], key) == 0) return i;
+    }
+    tags->keys[tags->key_count] = key;
+    return tags->key_count++;
+}
+
+static uint64_t value_hash(const char* text, bool numeric) {
+    // FNV-1a over the type and text, with the top bit cleared so it never equals the map's empty key
+    uint64_t hash = (0xcbf29ce484222325ULL ^ (numeric ? 1 : 0)) * 0x100000001b3ULL;
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash & ~(1ULL << 63);
+}
+
+// Every feature carries a distinct feature_id, so values are found through a
+// hash index rather than a scan; only a hash collision falls back to the scan
+static int tag_value(mvt_tags_t* tags, const char* text, bool numeric) {
+    uint64_t hash = value_hash(text, numeric);
+    int found;
+    bool indexed = tags->value_index.keys && key_map_get(&tags->value_index, hash, &found);
+    if (indexed) {
+        if (tags->value_numeric[found] == numeric && strcmp(tags->value_text[found], text) == 0) return found;
+        for (int i = 0; i < tags->value_count; i++) {
+            if (tags->value_numeric[i] == numeric && strcmp(tags->value_text[i], text) == 0) return i;
+        }
+    }
+    
+    if (tags->value_count >= tags->value_capacity) {
+        tags->value_capacity = tags->value_capacity ? tags->value_capacity * 2 : 16;
+        tags->value_text = realloc(tags->value_text, tags->value_capacity * sizeof(char*));
+        tags->value_numeric = realloc(tags->value_numeric, tags->value_capacity * sizeof(bool));
+    }
+    tags->value_text[tags->value_count] = strdup(text);
+    tags->value_numeric[tags->value_count] = numeric;
+    
+    pbf_buffer_t value = {0};
+    if (numeric) {
+        pbf_key(&value, 5, 0);
+        pbf_varint(&value, strtoull(text, NULL, 10));
+    } else {
+        pbf_string(&value, 1, text);
+    }
+    pbf_bytes(&tags->values, 4, value.data, value.size);
+    free(value.data);
+    if (!indexed && (tags->value_index.keys || key_map_init(&tags->value_index, 64) == 0)) {
+        key_map_put(&tags->value_index, hash, tags->value_count);
+    }
+    return tags->value_count++;
+}
+
+static void add_tag(mvt_tags_t* tags, unsigned int* out, int* count, const char* key, const char* value,
+                    bool numeric) {
+    out[(*count)++] = tag_key(tags, key);
+    out[(*count)++] = tag_value(tags, value, numeric);
+}
+
+static void encode_tile(const vectorization_result_t* result, const mvt_tile_t* tile, const char* layer_name,
+                        pbf_buffer_t* out) {
+    mvt_tags_t tags = {0};
+    pbf_buffer_t features = {0};
+    
+    for (int i = 0; i < tile->entry_count; i++) {
+        const mvt_entry_t* entry = &tile->entries[i];
+        const geological_feature_t* feature = &result->features[entry->feature];
+        if (entry->count == 0) continue;
+        
+        unsigned int tag_list[16];
+        int tag_count = 0;
+        char text[64];
+        snprintf(text, sizeof(text), "%d", entry->feature);
+        add_tag(&tags, tag_list, &tag_count, "feature_id", text, true);
+        snprintf(text, sizeof(text), "rgb(%d,%d,%d)",
+                 feature->dominant_color.r, feature->dominant_color.g, feature->dominant_color.b);
+        add_tag(&tags, tag_list, &tag_count, "dominant_color", text, false);
+        if (feature->lithology) add_tag(&tags, tag_list, &tag_count, "classification", feature->lithology, false);
+        if (feature->age) add_tag(&tags, tag_list, &tag_count, "temporal_info", feature->age, false);
+        if (feature->geological_unit) add_tag(&tags, tag_list, &tag_count, "unit_name", feature->geological_unit, false);
+        
+        pbf_buffer_t message = {0};
+        pbf_key(&message, 1, 0);
+        pbf_varint(&message, (uint64_t)entry->feature);
+        pbf_packed(&message, 2, tag_list, tag_count);
+        pbf_key(&message, 3, 0);
+        pbf_varint(&message, 3);    // POLYGON
+        pbf_packed(&message, 4, entry->geometry, entry->count);
+        pbf_bytes(&features, 2, message.data, message.size);
+        free(message.data);
+    }
+    
+    pbf_buffer_t layer = {0};
+    pbf_key(&layer, 15, 0);
+    pbf_varint(&layer, MVT_LAYER_VERSION);
+    pbf_string(&layer, 1, layer_name);
+    if (features.size > 0) {
+        pbf_reserve(&layer, features.size);
+        memcpy(layer.data + layer.size, features.data, features.size);
+        layer.size += features.size;
+    }
+    for (int i = 0; i < tags.key_count; i++) pbf_string(&layer, 3, tags.keys[i]);
+    if (tags.values.size > 0) {
+        pbf_reserve(&layer, tags.values.size);
+        memcpy(layer.data + layer.size, tags.values.data, tags.values.size);
+        layer.size += tags.values.size;
+    }
+    pbf_key(&layer, 5, 0);
+    pbf_varint(&layer, MVT_EXTENT);
+    
+    out->size = 0;
+    pbf_bytes(out, 3, layer.data, layer.size);
+    
+    free(layer.data);
+    free(features.data);
+    free(tags.values.data);
+    for (int i = 0; i < tags.value_count; i++) free(tags.value_text[i]);
+    free(tags.value_text);
+    free(tags.value_numeric);
+    key_map_destroy(&tags.value_index);
+}
+
+#ifdef HAVE_ZLIB
+// MBTiles readers expect gzip-compressed vector tiles
+static int gzip_tile(const pbf_buffer_t* in, pbf_buffer_t* out) {
+    z_stream stream = {0};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return 1;
+    
+    out->size = 0;
+    pbf_reserve(out, deflateBound(&stream, in->size) + 32);
+    stream.next_in = in->data;
+    stream.avail_in = (uInt)in->size;
+    stream.next_out = out->data;
+    stream.avail_out = (uInt)out->capacity;
+    int status = deflate(&stream, Z_FINISH);
+    out->size = stream.total_out;
+    deflateEnd(&stream);
+    return status == Z_STREAM_END ? 0 : 1;
+}
+#endif
+
+static int make_dir(const char* path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create directory: %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char* output;
+    bool mbtiles;
+#ifdef HAVE_SQLITE3
+    sqlite3* db;
+    sqlite3_stmt* insert;
+#endif
+    pbf_buffer_t compressed;
+    int tiles_written;
+    size_t bytes_written;
+} mvt_sink_t;
+
+static int sink_write(mvt_sink_t* sink, int z, int x, int y, const pbf_buffer_t* tile) {
+    sink->tiles_written++;
+    sink->bytes_written += tile->size;
+
+#ifdef HAVE_SQLITE3
+    if (sink->mbtiles) {
+        const pbf_buffer_t* data = tile;
+#ifdef HAVE_ZLIB
+        if (gzip_tile(tile, &sink->compressed) == 0) data = &sink->compressed;
+#endif
+        sqlite3_reset(sink->insert);
+        sqlite3_bind_int(sink->insert, 1, z);
+        sqlite3_bind_int(sink->insert, 2, x);
+        sqlite3_bind_int(sink->insert, 3, (1 << z) - 1 - y);    // MBTiles rows follow TMS (y up)
+        sqlite3_bind_blob(sink->insert, 4, data->data, (int)data->size, SQLITE_STATIC);
+        if (sqlite3_step(sink->insert) != SQLITE_DONE) {
+            fprintf(stderr, "Failed to insert tile %d/%d/%d: %s\n", z, x, y, sqlite3_errmsg(sink->db));
+            return 1;
+        }
+        return 0;
+    }
+#endif
+    
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%d/%d", sink->output, z, x);
+    char parent[1024];
+    snprintf(parent, sizeof(parent), "%s/%d", sink->output, z);
+    if (make_dir(parent) != 0 || make_dir(path) != 0) return 1;
+    
+    snprintf(path, sizeof(path), "%s/%d/%d/%d.pbf", sink->output, z, x, y);
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to create tile file: %s\n", path);
+        return 1;
+    }
+    fwrite(tile->data, 1, tile->size, file);
+    fclose(file);
+    return 0;
+}
+
+static int sink_open(mvt_sink_t* sink, const char* output,
+                     const char* layer_name, int min_zoom, int max_zoom, const double* mercator_bbox) {
+    memset(sink, 0, sizeof(mvt_sink_t));
+    sink->output = output;
+    size_t len = strlen(output);
+    sink->mbtiles = len > 8 && strcmp(output + len - 8, ".mbtiles") == 0;
+    
+    if (!sink->mbtiles) return make_dir(output);
+
+#ifdef HAVE_SQLITE3
+    remove(output);
+    if (sqlite3_open(output, &sink->db) != SQLITE_OK) {
+        fprintf(stderr, "Failed to create MBTiles file: %s\n", output);
+        sqlite3_close(sink->db);
+        return 1;
+    }
+    sqlite3_exec(sink->db,
+        "PRAGMA synchronous=OFF;"
+        "CREATE TABLE metadata (name text, value text);"
+        "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);"
+        "CREATE UNIQUE INDEX tile_index ON tiles (zoom_level, tile_column, tile_row);"
+        "BEGIN;", NULL, NULL, NULL);
+    
+    double west, south, east, north;
+    from_mercator(mercator_bbox[0], mercator_bbox[1], &west, &south);
+    from_mercator(mercator_bbox[2], mercator_bbox[3], &east, &north);
+    
+    char bounds[128], center[128], minz[16], maxz[16], json[512];
+    snprintf(bounds, sizeof(bounds), "%.6f,%.6f,%.6f,%.6f", west, south, east, north);
+    snprintf(center, sizeof(center), "%.6f,%.6f,%d", (west + east) / 2, (south + north) / 2, min_zoom);
+    snprintf(minz, sizeof(minz), "%d", min_zoom);
+    snprintf(maxz, sizeof(maxz), "%d", max_zoom);
+    snprintf(json, sizeof(json),
+        "{\"vector_layers\":[{\"id\":\"%s\",\"minzoom\":%d,\"maxzoom\":%d,\"fields\":{"
+        "\"feature_id\":\"Number\",\"dominant_color\":\"String\",\"classification\":\"String\","
+        "\"temporal_info\":\"String\",\"unit_name\":\"String\"}}]}",
+        layer_name, min_zoom, max_zoom);
+    
+    const char* metadata[][2] = {
+        {"name", layer_name}, {"format", "pbf"}, {"type", "overlay"}, {"version", "1"},
+        {"description", "Generated by WMSPal"}, {"bounds", bounds}, {"center", center},
+        {"minzoom", minz}, {"maxzoom", maxz}, {"json", json}
+    };
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(sink->db, "INSERT INTO metadata (name, value) VALUES (?, ?)", -1, &stmt, NULL);
+    for (size_t i = 0; i < sizeof(metadata) / sizeof(metadata[0]); i++) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, metadata[i][0], -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, metadata[i][1], -1, SQLITE_STATIC);
+        sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    
+    if (sqlite3_prepare_v2(sink->db,
+            "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)",
+            -1, &sink->insert, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare MBTiles insert: %s\n", sqlite3_errmsg(sink->db));
+        sqlite3_close(sink->db);
+        return 1;
+    }
+    return 0;
+#else
+    (void)layer_name; (void)min_zoom; (void)max_zoom; (void)mercator_bbox;
+    fprintf(stderr, "MBTiles output requires SQLite support; write to a directory instead\n");
+    return 1;
+#endif
+}
+
+static int sink_close(mvt_sink_t* sink, bool ok) {
+    int status = ok ? 0 : 1;
+#ifdef HAVE_SQLITE3
+    if (sink->mbtiles && sink->db) {
+        sqlite3_finalize(sink->insert);
+        if (sqlite3_exec(sink->db, ok ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL) != SQLITE_OK) status = 1;
+        sqlite3_close(sink->db);
+    }
+#endif
+    free(sink->compressed.data);
+    return status;
+}
+
+static void free_tiles(mvt_tile_t* tiles, int tile_count) {
+    for (int t = 0; t < tile_count; t++) {
+        for (int e = 0; e < tiles[t].entry_count; e++) free(tiles[t].entries[e].geometry);
+        free(tiles[t].entries);
+    }
+    free(tiles);
+}
+
+int mvt_auto_max_zoom(const vectorization_result_t* result, int width) {
+    if (!result || width <= 0) return 14;
+    bool geographic = crs_is_geographic(result->crs);
+    double x0, y0, x1, y1;
+    to_mercator(geographic, result->minx, result->miny, &x0, &y0);
+    to_mercator(geographic, result->maxx, result->maxy, &x1, &y1);
+    
+    // Deepest zoom whose 256px tiles are still no finer than the source pixels
+    double source_resolution = (x1 - x0) / width;
+    int zoom = 0;
+    while (zoom < 22 && 2.0 * MERCATOR_HALF_WORLD / (256.0 * (1 << (zoom + 1))) >= source_resolution) zoom++;
+    return zoom;
+}
+
+int write_mvt_pyramid(const vectorization_result_t* result, const char* output, const char* layer_name,
+                      int min_zoom, int max_zoom) {
+    if (!result || !output) return 1;
+    if (min_zoom < 0 || max_zoom > 24 || min_zoom > max_zoom) {
+        fprintf(stderr, "Invalid zoom range %d-%d\n", min_zoom, max_zoom);
+        return 1;
+    }
+    
+    bool geographic = crs_is_geographic(result->crs);
+    if (!geographic && !crs_is_mercator(result->crs)) {
+        fprintf(stderr, "Vector tiles need EPSG:4326 or EPSG:3857 input, got %s\n", result->crs);
+        return 1;
+    }
+    
+    // Project every ring to Web Mercator once
+    int ring_total = 0;
+    for (int f = 0; f < result->feature_count; f++) ring_total += result->features[f].polygon_count;
+    mvt_ring_t* projected = calloc(ring_total > 0 ? ring_total : 1, sizeof(mvt_ring_t));
+    for (int f = 0, r = 0; f < result->feature_count; f++) {
+        const geological_feature_t* feature = &result->features[f];
+        for (int p = 0; p < feature->polygon_count; p++, r++) {
+            const polygon_t* polygon = &feature->polygons[p];
+            for (int k = 0; k < polygon->count; k++) {
+                double mx, my;
+                to_mercator(geographic, polygon->coords[k].x, polygon->coords[k].y, &mx, &my);
+                ring_push(&projected[r], mx, my);
+            }
+        }
+    }
+    
+    double bbox[4];
+    to_mercator(geographic, result->minx, result->miny, &bbox[0], &bbox[1]);
+    to_mercator(geographic, result->maxx, result->maxy, &bbox[2], &bbox[3]);
+    
+    mvt_sink_t sink;
+    if (sink_open(&sink, output, layer_name, min_zoom, max_zoom, bbox) != 0) {
+        for (int r = 0; r < ring_total; r++) free(projected[r].xy);
+        free(projected);
+        return 1;
+    }
+    
+    printf("Writing vector tiles z%d-z%d to %s\n", min_zoom, max_zoom, output);
+    
+    mvt_ring_t simplified = {0}, clipped = {0}, scratch = {0};
+    int* points = NULL;
+    int points_capacity = 0;
+    pbf_buffer_t encoded = {0};
+    bool ok = true;
+    
+    for (int z = min_zoom; z <= max_zoom && ok; z++) {
+        int tiles_per_side = 1 << z;
+        double tile_size = 2.0 * MERCATOR_HALF_WORLD / tiles_per_side;
+        double unit = tile_size / MVT_EXTENT;
+        double margin = MVT_BUFFER * unit;
+        
+        key_map_t index;
+        key_map_init(&index, 256);
+        mvt_tile_t* tiles = NULL;
+        int tile_count = 0, tile_capacity = 0;
+        
+        for (int f = 0, r = 0; f < result->feature_count; f++) {
+            for (int p = 0; p < result->features[f].polygon_count; p++, r++) {
+                simplify_ring(&projected[r], unit, &simplified);
+                if (simplified.count < 3) continue;
+                
+                double rminx = simplified.xy[0], rmaxx = rminx, rminy = simplified.xy[1], rmaxy = rminy;
+                for (int k = 1; k < simplified.count; k++) {
+                    double x = simplified.xy[2*k], y = simplified.xy[2*k + 1];
+                    rminx = fmin(rminx, x); rmaxx = fmax(rmaxx, x);
+                    rminy = fmin(rminy, y); rmaxy = fmax(rmaxy, y);
+                }
+                if (rmaxx - rminx < unit && rmaxy - rminy < unit) continue;    // Sub-pixel at this zoom
+                
+                int tx0 = (int)floor((rminx - margin + MERCATOR_HALF_WORLD) / tile_size);
+                int tx1 = (int)floor((rmaxx + margin + MERCATOR_HALF_WORLD) / tile_size);
+                int ty0 = (int)floor((MERCATOR_HALF_WORLD - rmaxy - margin) / tile_size);
+                int ty1 = (int)floor((MERCATOR_HALF_WORLD - rminy + margin) / tile_size);
+                tx0 = tx0 < 0 ? 0 : tx0;
+                ty0 = ty0 < 0 ? 0 : ty0;
+                tx1 = tx1 >= tiles_per_side ? tiles_per_side - 1 : tx1;
+                ty1 = ty1 >= tiles_per_side ? tiles_per_side - 1 : ty1;
+                
+                for (int ty = ty0; ty <= ty1; ty++) {
+                    for (int tx = tx0; tx <= tx1; tx++) {
+                        double tile_minx = -MERCATOR_HALF_WORLD + tx * tile_size;
+                        double tile_maxy = MERCATOR_HALF_WORLD - ty * tile_size;
+                        clip_ring(&simplified, tile_minx - margin, tile_maxy - tile_size - margin,
+                                  tile_minx + tile_size + margin, tile_maxy + margin, &clipped, &scratch);
+                        if (clipped.count < 3) continue;
+                        if (clipped.count > points_capacity) {
+                            points_capacity = 2 * clipped.count;
+                            points = realloc(points, points_capacity * 2 * sizeof(int));
+                        }
+                        
+                        int slot;
+                        uint64_t key = ((uint64_t)tx << 32) | (uint32_t)ty;
+                        if (!key_map_get(&index, key, &slot)) {
+                            if (tile_count >= tile_capacity) {
+                                tile_capacity = tile_capacity ? tile_capacity * 2 : 64;
+                                tiles = realloc(tiles, tile_capacity * sizeof(mvt_tile_t));
+                            }
+                            slot = tile_count++;
+                            memset(&tiles[slot], 0, sizeof(mvt_tile_t));
+                            tiles[slot].x = tx;
+                            tiles[slot].y = ty;
+                            key_map_put(&index, key, slot);
+                        }
+                        
+                        encode_ring(tile_entry(&tiles[slot], f), &clipped, tile_minx, tile_maxy,
+                                    MVT_EXTENT / tile_size, points);
+                    }
+                }
+            }
+        }
+        
+        for (int t = 0; t < tile_count && ok; t++) {
+            encode_tile(result, &tiles[t], layer_name, &encoded);
+            if (sink_write(&sink, z, tiles[t].x, tiles[t].y, &encoded) != 0) ok = false;
+        }
+        printf("Zoom %d: %d tiles\n", z, tile_count);
+        
+        free_tiles(tiles, tile_count);
+        key_map_destroy(&index);
+    }
+    
+    int status = sink_close(&sink, ok);
+    if (status == 0) {
+        printf("Vector tiles written: %s (%d tiles, %zu bytes)\n", output, sink.tiles_written, sink.bytes_written);
+    }
+    
+    free(encoded.data);
+    free(points);
+    free(simplified.xy);
+    free(clipped.xy);
+    free(scratch.xy);
+    for (int r = 0; r < ring_total; r++) free(projected[r].xy);
+    free(projected);
+    return status;
+}
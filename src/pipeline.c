@@ -0,0 +1,200 @@
+#include "../include/wmspal.h"
+
+// Run the job described by config: GetCapabilities, the resident daemon, a
+// batch manifest, a tiled mosaic (planned from a target resolution if one is
+// given, and refined coarse-to-fine with adaptive_levels), a stack of layers
+// vectorized together, a sweep over the layer's TIME steps, or a single
+// GetMap (or WMTS tile mosaic) followed by georeferencing and optional
+// vectorization/attribution.
+// Returns 0 on success, 1 on failure and 2 when required options are missing.
+int wmspal_run(const wms_config_t* config) {
+    if (config->capabilities) {
+        if (!config->url) {
+            fprintf(stderr, "Error: URL is required for GetCapabilities\n");
+            return 2;
+        }
+        
+        printf("Fetching WMS capabilities...\n");
+        if (get_wms_capabilities(config) != 0) {
+            fprintf(stderr, "Error fetching WMS capabilities\n");
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (config->serve) return run_server(config);
+    
+    if (config->batch_manifest) {
+        if (!config->url) {
+            fprintf(stderr, "Error: URL is required for batch mode\n");
+            return 2;
+        }
+        return run_batch(config);
+    }
+    
+    if (!config->url || !(config->layer || config->stack_layers) || !config->bbox || !config->output_file) {
+        fprintf(stderr, "Error: URL, layer, bbox, and output file are required\n");
+        return 2;
+    }
+    
+    if (config->stack_layers && !config->layer) {
+        // Format choice and planning read the capabilities of the first layer in the stack
+        wms_config_t first = *config;
+        char layer[256];
+        snprintf(layer, sizeof(layer), "%.*s", (int)strcspn(config->stack_layers, ","), config->stack_layers);
+        first.layer = layer;
+        return wmspal_run(&first);
+    }
+    
+    // Cached WMTS tiles replace the GetMap request; the mosaic is already one image
+    bool wmts = is_wmts_endpoint(config);
+    if (wmts && (config->tile_cols * config->tile_rows > 1 || config->adaptive_levels > 0 || config->incremental_dir)) {
+        fprintf(stderr, "Error: --tile-grid, --adaptive and --incremental apply to WMS GetMap only\n");
+        return 2;
+    }
+    
+    if (!config->format && !wmts) {
+        // Ask the server once rather than per tile
+        wms_config_t resolved = *config;
+        char format[128];
+        choose_image_format(config, format, sizeof(format));
+        printf("Image format: %s\n", format);
+        resolved.format = format;
+        return wmspal_run(&resolved);
+    }
+    
+    if (config->resolution > 0 && !wmts) {
+        // Plan the request size and tile grid, then run the planned job
+        wms_config_t planned = *config;
+        char bbox[256];
+        // With --adaptive the grid is planned for the coarsest level, so the finest reaches the target
+        if (config->adaptive_levels > 0) planned.resolution = config->resolution * (1 << config->adaptive_levels);
+        printf("Planning tile grid from capabilities...\n");
+        if (plan_tile_grid(&planned, bbox, sizeof(bbox)) != 0) {
+            fprintf(stderr, "Error planning tile grid\n");
+            return 1;
+        }
+        planned.resolution = 0;
+        return wmspal_run(&planned);
+    }
+    
+    if (config->stack_layers) {
+        if (config->time_sweep) {
+            fprintf(stderr, "Error: --stack cannot be combined with --time-sweep\n");
+            return 2;
+        }
+        if (wmts || config->adaptive_levels > 0 || config->incremental_dir) {
+            fprintf(stderr, "Error: --stack cannot be combined with --wmts, --adaptive or --incremental\n");
+            return 2;
+        }
+        printf("Layer stack vectorization...\n");
+        if (vectorize_layer_stack(config) != 0) {
+            fprintf(stderr, "Error in layer stack vectorization\n");
+            return 1;
+        }
+        printf("Processing complete!\n");
+        return 0;
+    }
+    
+    if (config->time_sweep) {
+        if (wmts || config->adaptive_levels > 0 || config->incremental_dir) {
+            fprintf(stderr, "Error: --time-sweep cannot be combined with --wmts, --adaptive or --incremental\n");
+            return 2;
+        }
+        printf("Time sweep vectorization...\n");
+        if (vectorize_time_sweep(config) != 0) {
+            fprintf(stderr, "Error in time sweep vectorization\n");
+            return 1;
+        }
+        printf("Processing complete!\n");
+        return 0;
+    }
+    
+    if (config->adaptive_levels > 0) {
+        if (config->incremental_dir) {
+            fprintf(stderr, "Error: --adaptive cannot be combined with --incremental\n");
+            return 2;
+        }
+        printf("Adaptive geological vectorization...\n");
+        if (vectorize_adaptive_map(config) != 0) {
+            fprintf(stderr, "Error in adaptive vectorization\n");
+            return 1;
+        }
+        printf("Processing complete!\n");
+        return 0;
+    }
+    
+    if (config->tile_cols * config->tile_rows > 1 || config->incremental_dir) {
+        // Incremental runs keep their state per tile, so a single request is a 1x1 grid.
+        // Without seams there is nothing for an overlap to protect.
+        wms_config_t tiled = *config;
+        if (tiled.tile_cols < 1) tiled.tile_cols = 1;
+        if (tiled.tile_rows < 1) tiled.tile_rows = 1;
+        if (tiled.tile_cols * tiled.tile_rows == 1) tiled.tile_overlap = 0;
+        printf("Tiled geological vectorization...\n");
+        if (vectorize_tiled_map(&tiled) != 0) {
+            fprintf(stderr, "Error in tiled vectorization\n");
+            return 1;
+        }
+        printf("Processing complete!\n");
+        return 0;
+    }
+    
+    wms_config_t fetched = *config;
+    char fetched_bbox[256];
+    if (wmts) {
+        // The mosaic snaps the bbox and size to the tile matrix's pixel grid
+        printf("Fetching WMTS tiles...\n");
+        if (download_wmts_mosaic(&fetched, fetched_bbox, sizeof(fetched_bbox)) != 0) {
+            fprintf(stderr, "Error fetching WMTS tiles\n");
+            return 1;
+        }
+        config = &fetched;
+    } else {
+        printf("Downloading WMS tile...\n");
+        if (download_wms_tile(config) != 0) {
+            fprintf(stderr, "Error downloading WMS tile\n");
+            return 1;
+        }
+    }
+    
+    char georef_file[512];
+    snprintf(georef_file, sizeof(georef_file), "%s_georef.tif", config->output_file);
+    
+    printf("Georeferencing image...\n");
+    if (georeference_image(config->context, config->output_file, georef_file, config->bbox, config->srs) != 0) {
+        fprintf(stderr, "Error georeferencing image\n");
+        return 1;
+    }
+    
+    if (config->vectorize || config->vectorize_enhanced || config->vectorize_geological) {
+        char vector_file[512];
+        snprintf(vector_file, sizeof(vector_file), "%s_vector.shp", config->output_file);
+        
+        if (config->vectorize_geological || config->vectorize_enhanced) {
+            const char* workflow_type = config->vectorize_geological ? "geological" : "enhanced";
+            printf("Enhanced %s vectorization...\n", workflow_type);
+            if (vectorize_geological_map(georef_file, config->output_file, config) != 0) {
+                fprintf(stderr, "Error in %s vectorization\n", workflow_type);
+                return 1;
+            }
+        } else {
+            printf("Vectorizing image...\n");
+            if (vectorize_image(config->context, georef_file, vector_file) != 0) {
+                fprintf(stderr, "Error vectorizing image\n");
+                return 1;
+            }
+        }
+        
+        if (config->attribution && !config->vectorize_geological && !config->vectorize_enhanced) {
+            printf("Applying attribution...\n");
+            if (apply_attribution(vector_file, config) != 0) {
+                fprintf(stderr, "Error applying attribution\n");
+                return 1;
+            }
+        }
+    }
+    
+    printf("Processing complete!\n");
+    return 0;
+}
\ No newline at end of file
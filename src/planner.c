@@ -0,0 +1,313 @@
+#include "context.h"
+#include <ctype.h>
+#include <math.h>
+
+// Tile grid planning from GetCapabilities. Given a target ground resolution,
+// the planner picks the fewest requests that stay within the server's
+// MaxWidth/MaxHeight (less the seam overlap), keeps pixels square by growing
+// the bbox to a whole number of equal tiles, and checks the layer's CRS list
+// and scale range before anything is downloaded.
+
+#define PLANNER_DEFAULT_MAX_SIZE 4096   // Tile edge limit when the service advertises none
+#define PLANNER_MIN_TILE 64             // Smallest useful tile core after overlap
+#define PLANNER_MAX_LAYER_DEPTH 32
+
+typedef struct {
+    int crs_start;          // First CRS of this layer in the shared list
+    bool named;             // Name already seen (later Names belong to children)
+    bool target;
+    double min_scale, max_scale;
+    const char* time;       // TIME dimension values, inherited like the scale range
+    size_t time_len;
+} layer_frame_t;
+
+static void add_crs(layer_capabilities_t* capabilities, int* capacity, const char* text, size_t len) {
+    if (capabilities->crs_count >= *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        capabilities->crs = realloc(capabilities->crs, *capacity * sizeof(char*));
+    }
+    capabilities->crs[capabilities->crs_count++] = strndup(text, len);
+}
+
+// Content of the element whose start tag ends at gt, trimmed
+const char* xml_element_text(const char* gt, const char* end, size_t* len) {
+    const char* text = gt + 1;
+    const char* close = memchr(text, '<', end - text);
+    if (!close) close = end;
+    while (text < close && isspace((unsigned char)*text)) text++;
+    while (close > text && isspace((unsigned char)close[-1])) close--;
+    *len = close - text;
+    return text;
+}
+
+// Value of attribute name inside a start tag [p, gt), or 0 when absent
+static double tag_attribute(const char* p, const char* gt, const char* name) {
+    size_t name_len = strlen(name);
+    for (const char* q = p; q + name_len + 2 < gt; q++) {
+        if (isspace((unsigned char)q[-1]) && strncmp(q, name, name_len) == 0 && q[name_len] == '=') {
+            return atof(q + name_len + 2);
+        }
+    }
+    return 0;
+}
+
+// Dimension (WMS 1.3.0) and Extent (1.1.1) elements describing the TIME dimension
+static bool is_time_dimension(const char* p, const char* gt) {
+    for (const char* q = p; q + 11 < gt; q++) {
+        if (isspace((unsigned char)q[-1]) && strncmp(q, "name=", 5) == 0) {
+            return strncasecmp(q + 6, "time", 4) == 0 && (q[10] == '"' || q[10] == '\'');
+        }
+    }
+    return false;
+}
+
+bool xml_tag_is(const char* name, size_t name_len, const char* expected) {
+    // Ignore any namespace prefix
+    const char* colon = memchr(name, ':', name_len);
+    if (colon) {
+        name_len -= colon + 1 - name;
+        name = colon + 1;
+    }
+    return name_len == strlen(expected) && strncmp(name, expected, name_len) == 0;
+}
+
+// PNG variants servers use for indexed output: "image/png; mode=8bit", "image/png8", ...
+bool format_is_paletted_png(const char* text, size_t len) {
+    if (len < 9 || strncasecmp(text, "image/png", 9) != 0) return false;
+    if (len > 9 && text[9] == '8') return true;
+    for (size_t i = 9; i + 4 <= len; i++) {
+        if (strncasecmp(text + i, "8bit", 4) == 0) return true;
+    }
+    return false;
+}
+
+static void parse_layer_capabilities(const char* xml, size_t size, const char* layer,
+                                     layer_capabilities_t* capabilities) {
+    layer_frame_t stack[PLANNER_MAX_LAYER_DEPTH];
+    int depth = 0, capacity = 0;
+    bool in_get_map = false;
+    const char* p = xml;
+    const char* end = xml + size;
+    
+    while (p < end) {
+        const char* lt = memchr(p, '<', end - p);
+        if (!lt || lt + 1 >= end) break;
+        p = lt + 1;
+        
+        if (*p == '!' || *p == '?') {
+            const char* close = end - p >= 3 && strncmp(p, "!--", 3) == 0 ? strstr(p, "-->") : memchr(p, '>', end - p);
+            if (!close) break;
+            p = close + 1;
+            continue;
+        }
+        
+        bool closing = *p == '/';
+        if (closing) p++;
+        const char* name = p;
+        while (p < end && !isspace((unsigned char)*p) && *p != '>' && *p != '/') p++;
+        size_t name_len = p - name;
+        const char* gt = memchr(p, '>', end - p);
+        if (!gt) break;
+        layer_frame_t* frame = depth > 0 ? &stack[depth - 1] : NULL;
+        
+        if (xml_tag_is(name, name_len, "GetMap")) {
+            in_get_map = !closing;
+        } else if (xml_tag_is(name, name_len, "Layer")) {
+            if (closing) {
+                if (depth == 0) break;
+                if (frame->target) {
+                    capabilities->found = true;
+                    capabilities->min_scale = frame->min_scale;
+                    capabilities->max_scale = frame->max_scale;
+                    if (frame->time_len > 0) capabilities->time_values = strndup(frame->time, frame->time_len);
+                    // Keep the layer's own and inherited CRS; the rest of the document is not needed
+                    break;
+                }
+                for (int i = frame->crs_start; i < capabilities->crs_count; i++) free(capabilities->crs[i]);
+                capabilities->crs_count = frame->crs_start;
+                depth--;
+            } else if (depth < PLANNER_MAX_LAYER_DEPTH) {
+                // Scale range and CRS are inherited from the parent layer
+                layer_frame_t child = {capabilities->crs_count, false, false, 0, 0, NULL, 0};
+                if (frame) {
+                    child.min_scale = frame->min_scale;
+                    child.max_scale = frame->max_scale;
+                    child.time = frame->time;
+                    child.time_len = frame->time_len;
+                }
+                stack[depth++] = child;
+            }
+        } else if (!closing) {
+            size_t len;
+            const char* text = xml_element_text(gt, end, &len);
+            
+            if (in_get_map && xml_tag_is(name, name_len, "Format")) {
+                if (!capabilities->paletted_format && format_is_paletted_png(text, len)) {
+                    capabilities->paletted_format = strndup(text, len);
+                }
+            } else if (xml_tag_is(name, name_len, "MaxWidth")) {
+                capabilities->max_width = atoi(text);
+            } else if (xml_tag_is(name, name_len, "MaxHeight")) {
+                capabilities->max_height = atoi(text);
+            } else if (frame && xml_tag_is(name, name_len, "Name") && !frame->named) {
+                frame->named = true;
+                frame->target = len == strlen(layer) && strncmp(text, layer, len) == 0;
+            } else if (frame && (xml_tag_is(name, name_len, "CRS") || xml_tag_is(name, name_len, "SRS"))) {
+                // WMS 1.1.0 allowed several space-separated codes in one element
+                const char* q = text;
+                const char* text_end = text + len;
+                while (q < text_end) {
+                    const char* code = q;
+                    while (q < text_end && !isspace((unsigned char)*q)) q++;
+                    if (q > code) add_crs(capabilities, &capacity, code, q - code);
+                    while (q < text_end && isspace((unsigned char)*q)) q++;
+                }
+            } else if (frame && xml_tag_is(name, name_len, "MinScaleDenominator")) {
+                frame->min_scale = atof(text);
+            } else if (frame && xml_tag_is(name, name_len, "MaxScaleDenominator")) {
+                frame->max_scale = atof(text);
+            } else if (frame && (xml_tag_is(name, name_len, "Dimension") || xml_tag_is(name, name_len, "Extent")) &&
+                       gt[-1] != '/' && len > 0 && is_time_dimension(p, gt)) {
+                frame->time = text;
+                frame->time_len = len;
+            } else if (frame && xml_tag_is(name, name_len, "ScaleHint")) {
+                // WMS 1.1.1: diagonal pixel size in metres
+                frame->min_scale = tag_attribute(p, gt, "min") / sqrt(2.0) / OGC_PIXEL_SIZE;
+                frame->max_scale = tag_attribute(p, gt, "max") / sqrt(2.0) / OGC_PIXEL_SIZE;
+            }
+        }
+        p = gt + 1;
+    }
+    
+    if (!capabilities->found) {
+        for (int i = 0; i < capabilities->crs_count; i++) free(capabilities->crs[i]);
+        capabilities->crs_count = 0;
+    }
+}
+
+int fetch_layer_capabilities(const wms_config_t* config, layer_capabilities_t* capabilities) {
+    memset(capabilities, 0, sizeof(*capabilities));
+    
+    char url[2048];
+    snprintf(url, sizeof(url), "%s?SERVICE=WMS&VERSION=1.3.0&REQUEST=GetCapabilities", config->url);
+    
+    char* xml;
+    size_t size;
+    if (wms_http_get(config->context, url, &xml, &size) != 0) return 1;
+    parse_layer_capabilities(xml, size, config->layer, capabilities);
+    free(xml);
+    return 0;
+}
+
+void free_layer_capabilities(layer_capabilities_t* capabilities) {
+    for (int i = 0; i < capabilities->crs_count; i++) free(capabilities->crs[i]);
+    free(capabilities->crs);
+    free(capabilities->paletted_format);
+    free(capabilities->time_values);
+    memset(capabilities, 0, sizeof(*capabilities));
+}
+
+// Paletted PNG when the server offers one: a third of the decoded memory and
+// the palette doubles as the class list. Plain PNG otherwise.
+void choose_image_format(const wms_config_t* config, char* format, size_t format_size) {
+    layer_capabilities_t capabilities;
+    snprintf(format, format_size, "image/png");
+    if (fetch_layer_capabilities(config, &capabilities) != 0) return;
+    if (capabilities.paletted_format) snprintf(format, format_size, "%s", capabilities.paletted_format);
+    free_layer_capabilities(&capabilities);
+}
+
+bool srs_is_geographic(const char* srs) {
+    return strcasecmp(srs, "EPSG:4326") == 0 || strcasecmp(srs, "CRS:84") == 0 ||
+           strcasecmp(srs, "EPSG:4258") == 0 || strcasecmp(srs, "EPSG:4269") == 0;
+}
+
+// Replace the size, tile grid and bbox in config with a plan for config->resolution.
+// The bbox string is written to the caller's buffer and may grow by less than one
+// tile to the east and south so every pixel is square.
+int plan_tile_grid(wms_config_t* config, char* bbox, size_t bbox_size) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4 || maxx <= minx || maxy <= miny) {
+        fprintf(stderr, "Invalid bbox format\n");
+        return 1;
+    }
+    
+    layer_capabilities_t capabilities;
+    if (fetch_layer_capabilities(config, &capabilities) != 0) {
+        fprintf(stderr, "Error fetching capabilities for tile planning\n");
+        return 1;
+    }
+    if (!capabilities.found) {
+        fprintf(stderr, "Layer %s is not listed in the service capabilities\n", config->layer);
+        free_layer_capabilities(&capabilities);
+        return 1;
+    }
+    
+    bool crs_supported = capabilities.crs_count == 0;
+    for (int i = 0; i < capabilities.crs_count && !crs_supported; i++) {
+        crs_supported = strcasecmp(capabilities.crs[i], config->srs) == 0;
+    }
+    if (!crs_supported) {
+        fprintf(stderr, "Layer %s does not support %s; advertised:", config->layer, config->srs);
+        for (int i = 0; i < capabilities.crs_count; i++) fprintf(stderr, " %s", capabilities.crs[i]);
+        fprintf(stderr, "\n");
+        free_layer_capabilities(&capabilities);
+        return 1;
+    }
+    
+    int max_width = capabilities.max_width > 0 ? capabilities.max_width : PLANNER_DEFAULT_MAX_SIZE;
+    int max_height = capabilities.max_height > 0 ? capabilities.max_height : PLANNER_DEFAULT_MAX_SIZE;
+    int overlap = config->tile_overlap;
+    int core_width = max_width - 2 * overlap;
+    int core_height = max_height - 2 * overlap;
+    if (core_width < PLANNER_MIN_TILE || core_height < PLANNER_MIN_TILE) {
+        fprintf(stderr, "Overlap of %d pixels leaves no room within the %dx%d request limit\n",
+                overlap, max_width, max_height);
+        free_layer_capabilities(&capabilities);
+        return 1;
+    }
+    
+    // Fewest requests that cover the bbox, then equal tiles that share the pixels out.
+    // A single request has no seams, so it needs no overlap and may use the whole limit.
+    double resolution = config->resolution;
+    long pixels_x = (long)ceil((maxx - minx) / resolution - 1e-9);
+    long pixels_y = (long)ceil((maxy - miny) / resolution - 1e-9);
+    if (pixels_x < 1) pixels_x = 1;
+    if (pixels_y < 1) pixels_y = 1;
+    if (pixels_x <= max_width && pixels_y <= max_height) {
+        overlap = 0;
+        core_width = max_width;
+        core_height = max_height;
+    }
+    int cols = (int)((pixels_x + core_width - 1) / core_width);
+    int rows = (int)((pixels_y + core_height - 1) / core_height);
+    int tile_width = (int)((pixels_x + cols - 1) / cols);
+    int tile_height = (int)((pixels_y + rows - 1) / rows);
+    
+    maxx = minx + (double)tile_width * cols * resolution;
+    miny = maxy - (double)tile_height * rows * resolution;
+    
+    double metres = resolution * (srs_is_geographic(config->srs) ? METRES_PER_DEGREE : 1.0);
+    double scale = metres / OGC_PIXEL_SIZE;
+    if ((capabilities.min_scale > 0 && scale < capabilities.min_scale) ||
+        (capabilities.max_scale > 0 && scale > capabilities.max_scale)) {
+        fprintf(stderr, "Warning: scale 1:%.0f is outside the layer's range 1:%.0f to 1:%.0f; tiles may be blank\n",
+                scale, capabilities.min_scale, capabilities.max_scale);
+    }
+    
+    snprintf(bbox, bbox_size, "%.10f,%.10f,%.10f,%.10f", minx, miny, maxx, maxy);
+    config->bbox = bbox;
+    config->width = tile_width;
+    config->height = tile_height;
+    config->tile_cols = cols;
+    config->tile_rows = rows;
+    config->tile_overlap = overlap;
+    
+    printf("Tile plan: %dx%d tiles of %dx%d pixels (+%d overlap), %d requests within the %dx%d limit\n",
+           cols, rows, tile_width, tile_height, overlap, cols * rows, max_width, max_height);
+    printf("  Resolution %g %s/pixel (about 1:%.0f), bbox %s\n",
+           resolution, srs_is_geographic(config->srs) ? "degrees" : "units", scale, bbox);
+    
+    free_layer_capabilities(&capabilities);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,351 @@
+#include "metrics.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// PNG decoding. Truecolour and greyscale images become 8-bit RGB (alpha is
+// dropped, 16-bit samples keep their high byte). Paletted images, which is
+// what servers return for PNG8 or "image/png; mode=8bit", keep one palette
+// index per pixel together with the palette, so classification can work on
+// at most 256 palette entries instead of on every pixel.
+
+#define PNG_MAX_PIXELS (1u << 28)
+
+typedef struct {
+    int width, height;
+    int bit_depth, color_type, interlace;
+    int samples;            // Per pixel in the encoded rows
+} png_header_t;
+
+static uint32_t read_u32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Undo the row filter in place; prior is the previous unfiltered row or NULL
+static int unfilter_row(unsigned char* row, const unsigned char* prior, size_t length, int bpp, int filter) {
+    switch (filter) {
+        case 0:
+            break;
+        case 1:
+            for (size_t i = bpp; i < length; i++) row[i] += row[i - bpp];
+            break;
+        case 2:
+            if (prior) for (size_t i = 0; i < length; i++) row[i] += prior[i];
+            break;
+        case 3:
+            for (size_t i = 0; i < length; i++) {
+                int left = i >= (size_t)bpp ? row[i - bpp] : 0;
+                int up = prior ? prior[i] : 0;
+                row[i] += (unsigned char)((left + up) / 2);
+            }
+            break;
+        case 4:
+            for (size_t i = 0; i < length; i++) {
+                int left = i >= (size_t)bpp ? row[i - bpp] : 0;
+                int up = prior ? prior[i] : 0;
+                int corner = prior && i >= (size_t)bpp ? prior[i - bpp] : 0;
+                row[i] += (unsigned char)paeth(left, up, corner);
+            }
+            break;
+        default:
+            return 1;
+    }
+    return 0;
+}
+
+// Sample x of an unfiltered row, scaled to 8 bits
+static unsigned char sample_at(const unsigned char* row, const png_header_t* header, int x, int sample) {
+    int depth = header->bit_depth;
+    if (depth == 8) return row[(size_t)x * header->samples + sample];
+    if (depth == 16) return row[((size_t)x * header->samples + sample) * 2];
+    
+    // Sub-byte depths only occur with one sample per pixel
+    int per_byte = 8 / depth;
+    int shift = 8 - depth * (x % per_byte + 1);
+    int value = (row[x / per_byte] >> shift) & ((1 << depth) - 1);
+    return header->color_type == 3 ? (unsigned char)value : (unsigned char)(value * 255 / ((1 << depth) - 1));
+}
+
+// Write width pixels of an unfiltered row to out, step pixels apart
+static void convert_row(const unsigned char* row, const png_header_t* header, int width,
+                        unsigned char* out, int channels, int step) {
+    for (int x = 0; x < width; x++, out += (size_t)channels * step) {
+        switch (header->color_type) {
+            case 3:
+                out[0] = sample_at(row, header, x, 0);
+                break;
+            case 0:
+            case 4:
+                out[0] = out[1] = out[2] = sample_at(row, header, x, 0);
+                break;
+            default:
+                out[0] = sample_at(row, header, x, 0);
+                out[1] = sample_at(row, header, x, 1);
+                out[2] = sample_at(row, header, x, 2);
+                break;
+        }
+    }
+}
+
+#ifdef HAVE_ZLIB
+static unsigned char* inflate_all(const unsigned char* data, size_t size, size_t expected) {
+    unsigned char* out = malloc(expected ? expected : 1);
+    if (!out) return NULL;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    stream.next_in = (unsigned char*)data;
+    stream.avail_in = (uInt)size;
+    stream.next_out = out;
+    stream.avail_out = (uInt)expected;
+    int status = inflate(&stream, Z_FINISH);
+    bool complete = (status == Z_STREAM_END || status == Z_BUF_ERROR || status == Z_OK) && stream.total_out == expected;
+    inflateEnd(&stream);
+    if (!complete) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+// Unfilter one (sub-)image of raw filtered rows and convert its pixels into
+// img, placing pixel (x, y) at (x0 + x * dx, y0 + y * dy)
+static int decode_pass(const unsigned char* raw, size_t* offset, size_t raw_size, const png_header_t* header,
+                       int width, int height, image_t* img, int x0, int y0, int dx, int dy) {
+    if (width == 0 || height == 0) return 0;
+    int bits = header->samples * header->bit_depth;
+    size_t row_bytes = ((size_t)width * bits + 7) / 8;
+    int bpp = bits < 8 ? 1 : bits / 8;
+    unsigned char* rows = malloc(row_bytes * 2);
+    if (!rows) return 1;
+    
+    unsigned char* prior = NULL;
+    unsigned char* current = rows;
+    for (int y = 0; y < height; y++) {
+        if (*offset + 1 + row_bytes > raw_size) {
+            free(rows);
+            return 1;
+        }
+        int filter = raw[(*offset)++];
+        memcpy(current, raw + *offset, row_bytes);
+        *offset += row_bytes;
+        if (unfilter_row(current, prior, row_bytes, bpp, filter) != 0) {
+            free(rows);
+            return 1;
+        }
+        unsigned char* out = img->data + ((size_t)(y0 + y * dy) * img->width + x0) * img->channels;
+        convert_row(current, header, width, out, img->channels, dx);
+        prior = current;
+        current = current == rows ? rows + row_bytes : rows;
+    }
+    free(rows);
+    return 0;
+}
+
+// Size in bytes of the filtered rows of a width x height (sub-)image
+static size_t raw_size_of(const png_header_t* header, int width, int height) {
+    if (width == 0 || height == 0) return 0;
+    size_t row_bytes = ((size_t)width * header->samples * header->bit_depth + 7) / 8;
+    return (row_bytes + 1) * height;
+}
+
+image_t* decode_png(const unsigned char* data, size_t size) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (size < 8 || memcmp(data, signature, 8) != 0) {
+        fprintf(stderr, "Not a PNG image\n");
+        return NULL;
+    }
+    
+    png_header_t header = {0};
+    color_t palette[256];
+    int palette_size = 0;
+    unsigned char* idat = NULL;
+    size_t idat_size = 0, idat_capacity = 0;
+    bool have_header = false;
+    
+    // Collect the header, palette and concatenated image data
+    size_t pos = 8;
+    while (pos + 12 <= size) {
+        uint32_t length = read_u32(data + pos);
+        const unsigned char* type = data + pos + 4;
+        const unsigned char* body = data + pos + 8;
+        if (length > size - pos - 12) break;
+        
+        if (memcmp(type, "IHDR", 4) == 0 && length >= 13) {
+            header.width = (int)read_u32(body);
+            header.height = (int)read_u32(body + 4);
+            header.bit_depth = body[8];
+            header.color_type = body[9];
+            header.interlace = body[12];
+            have_header = true;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            palette_size = (int)(length / 3) > 256 ? 256 : (int)(length / 3);
+            for (int i = 0; i < palette_size; i++) {
+                palette[i] = (color_t){body[i * 3], body[i * 3 + 1], body[i * 3 + 2]};
+            }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (idat_size + length > idat_capacity) {
+                idat_capacity = (idat_size + length) * 2;
+                unsigned char* grown = realloc(idat, idat_capacity);
+                if (!grown) break;
+                idat = grown;
+            }
+            memcpy(idat + idat_size, body, length);
+            idat_size += length;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+        pos += 12 + (size_t)length;
+    }
+    
+    static const int samples_of_type[7] = {1, 0, 3, 1, 2, 0, 4};
+    int type = header.color_type;
+    header.samples = type >= 0 && type <= 6 ? samples_of_type[type] : 0;
+    int depth = header.bit_depth;
+    bool depth_ok = depth == 8 || (depth == 16 && type != 3) || ((depth == 1 || depth == 2 || depth == 4) && (type == 0 || type == 3));
+    if (!have_header || header.samples == 0 || !depth_ok || header.width <= 0 || header.height <= 0 ||
+        (uint64_t)header.width * header.height > PNG_MAX_PIXELS || header.interlace > 1 ||
+        (type == 3 && palette_size == 0) || idat_size == 0) {
+        fprintf(stderr, "Unsupported or damaged PNG\n");
+        free(idat);
+        return NULL;
+    }
+    
+    // Adam7 passes: origin and spacing of each pass's pixels; a plain image is one pass
+    static const int adam7[7][4] = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+                                    {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
+    static const int progressive[4] = {0, 0, 1, 1};
+    int passes = header.interlace ? 7 : 1;
+    int pass_width[7], pass_height[7];
+    size_t expected = 0;
+    for (int p = 0; p < passes; p++) {
+        const int* a = header.interlace ? adam7[p] : progressive;
+        pass_width[p] = header.width > a[0] ? (header.width - a[0] + a[2] - 1) / a[2] : 0;
+        pass_height[p] = header.height > a[1] ? (header.height - a[1] + a[3] - 1) / a[3] : 0;
+        expected += raw_size_of(&header, pass_width[p], pass_height[p]);
+    }
+
+#ifdef HAVE_ZLIB
+    unsigned char* raw = inflate_all(idat, idat_size, expected);
+    if (!raw) fprintf(stderr, "Failed to inflate PNG image data\n");
+#else
+    unsigned char* raw = NULL;
+    fprintf(stderr, "PNG decoding needs zlib; rebuild with zlib available\n");
+#endif
+    free(idat);
+    if (!raw) return NULL;
+    
+    image_t* img = calloc(1, sizeof(image_t));
+    if (!img) {
+        free(raw);
+        return NULL;
+    }
+    img->width = header.width;
+    img->height = header.height;
+    img->channels = type == 3 ? 1 : 3;
+    img->data = raster_alloc((size_t)img->width * img->height * img->channels);
+    if (type == 3) {
+        img->palette = malloc(palette_size * sizeof(color_t));
+        if (img->palette) memcpy(img->palette, palette, palette_size * sizeof(color_t));
+        img->palette_size = palette_size;
+    }
+    
+    size_t offset = 0;
+    int status = !img->data || (type == 3 && !img->palette);
+    for (int p = 0; p < passes && status == 0; p++) {
+        const int* a = header.interlace ? adam7[p] : progressive;
+        status = decode_pass(raw, &offset, expected, &header, pass_width[p], pass_height[p], img, a[0], a[1], a[2], a[3]);
+    }
+    free(raw);
+    if (status != 0) {
+        fprintf(stderr, "Damaged PNG image data\n");
+        free_image(img);
+        return NULL;
+    }
+    return img;
+}
+
+#ifdef HAVE_ZLIB
+static void write_chunk(FILE* file, const char* type, const unsigned char* body, uint32_t length) {
+    unsigned char header[8] = {length >> 24, length >> 16, length >> 8, length, type[0], type[1], type[2], type[3]};
+    uLong crc = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+    if (length > 0) crc = crc32(crc, body, length);
+    unsigned char trailer[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+    fwrite(header, 1, 8, file);
+    if (length > 0) fwrite(body, 1, length, file);
+    fwrite(trailer, 1, 4, file);
+}
+#endif
+
+// Paletted images are written with their palette, everything else as 8-bit
+// RGB. Rows are stored unfiltered at the fastest compression level: the file
+// is an intermediate that is decoded again straight away.
+int write_png(const image_t* img, const char* filename) {
+#ifdef HAVE_ZLIB
+    bool paletted = img->palette && img->channels == 1;
+    size_t row_bytes = (size_t)img->width * (paletted ? 1 : 3);
+    size_t raw_size = (row_bytes + 1) * img->height;
+    unsigned char* raw = malloc(raw_size);
+    uLongf packed_size = compressBound(raw_size);
+    unsigned char* packed = malloc(packed_size);
+    if (!raw || !packed) {
+        free(raw);
+        free(packed);
+        return 1;
+    }
+    for (int y = 0; y < img->height; y++) {
+        unsigned char* row = raw + (row_bytes + 1) * y;
+        row[0] = 0;
+        memcpy(row + 1, img->data + row_bytes * y, row_bytes);
+    }
+    int status = compress2(packed, &packed_size, raw, raw_size, Z_BEST_SPEED);
+    free(raw);
+    
+    FILE* file = status == Z_OK ? fopen(filename, "wb") : NULL;
+    if (!file) {
+        fprintf(stderr, "Failed to write PNG: %s\n", filename);
+        free(packed);
+        return 1;
+    }
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    unsigned char header[13] = {img->width >> 24, img->width >> 16, img->width >> 8, img->width,
+                                img->height >> 24, img->height >> 16, img->height >> 8, img->height,
+                                8, paletted ? 3 : 2, 0, 0, 0};
+    fwrite(signature, 1, 8, file);
+    write_chunk(file, "IHDR", header, 13);
+    if (paletted) {
+        unsigned char palette[256 * 3];
+        for (int i = 0; i < img->palette_size; i++) {
+            palette[i * 3] = img->palette[i].r;
+            palette[i * 3 + 1] = img->palette[i].g;
+            palette[i * 3 + 2] = img->palette[i].b;
+        }
+        write_chunk(file, "PLTE", palette, img->palette_size * 3);
+    }
+    write_chunk(file, "IDAT", packed, (uint32_t)packed_size);
+    write_chunk(file, "IEND", NULL, 0);
+    free(packed);
+    
+    bool failed = ferror(file) != 0;
+    if (fclose(file) != 0 || failed) {
+        fprintf(stderr, "Failed to write PNG: %s\n", filename);
+        return 1;
+    }
+    return 0;
+#else
+    (void)img;
+    fprintf(stderr, "Writing %s needs zlib; rebuild with zlib available\n", filename);
+    return 1;
+#endif
+}
\ No newline at end of file
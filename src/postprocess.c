@@ -0,0 +1,382 @@
+#include "metrics.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Geometry post-processing on the reentrant GEOS API. Every class is cut into
+// chunks of rings. Worker threads, each holding its own GEOS handle leased
+// from the context, repair and union the chunks, then union each class's
+// partial results: a cascaded union spread over the cores. The result model
+// stores outer boundaries only, as the tracer does, with enclosed regions
+// found as other features' rings, so a class whose union would have interior
+// rings keeps its traced polygons rather than losing the rings.
+
+#define UNION_CHUNK 256     // Rings repaired and unioned per task before the per-class union
+
+#ifdef HAVE_GEOS
+typedef struct {
+    int feature;
+    int first, count;       // Polygon range of the feature handled by this task
+    GEOSGeometry* partial;  // Union of the chunk, NULL when it had no usable ring
+} union_task_t;
+
+typedef struct {
+    wmspal_context_t* context;
+    vectorization_result_t* result;
+    union_task_t* tasks;
+    int task_count;
+    int* first_task;        // First task of each feature; a feature's tasks are contiguous
+    int phase;              // 1 = union chunks, 2 = union each feature's chunks
+    int items, next;
+    int repaired, failed;
+    int kept;               // Classes left as traced because their union has holes
+    wmspal_mutex_t lock;
+} postprocess_job_t;
+
+static int online_cpus(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+static double signed_area(const polygon_t* polygon) {
+    double area = 0;
+    for (int i = 0; i < polygon->count; i++) {
+        int j = (i + 1) % polygon->count;
+        area += polygon->coords[i].x * polygon->coords[j].y - polygon->coords[j].x * polygon->coords[i].y;
+    }
+    return area / 2.0;
+}
+
+// Closed GEOS polygon for a ring, repaired when it is invalid (the tracer's
+// rings touch themselves where a region is joined only through a corner)
+static GEOSGeometry* ring_to_geometry(GEOSContextHandle_t geos, const polygon_t* polygon, int* repaired) {
+    if (polygon->count < 3) return NULL;
+    GEOSCoordSequence* seq = GEOSCoordSeq_create_r(geos, polygon->count + 1, 2);
+    if (!seq) return NULL;
+    for (int k = 0; k <= polygon->count; k++) {
+        const coord_t* c = &polygon->coords[k % polygon->count];
+        GEOSCoordSeq_setXY_r(geos, seq, k, c->x, c->y);
+    }
+    
+    GEOSGeometry* shell = GEOSGeom_createLinearRing_r(geos, seq);
+    GEOSGeometry* geometry = shell ? GEOSGeom_createPolygon_r(geos, shell, NULL, 0) : NULL;
+    if (geometry && GEOSisValid_r(geos, geometry) != 1) {
+        GEOSGeometry* valid = GEOSMakeValid_r(geos, geometry);
+        GEOSGeom_destroy_r(geos, geometry);
+        geometry = valid;
+        (*repaired)++;
+    }
+    return geometry;
+}
+
+// Collection owning `parts`; they are destroyed when it cannot be created
+static GEOSGeometry* make_collection(GEOSContextHandle_t geos, GEOSGeometry** parts, int part_count) {
+    if (part_count == 0) return NULL;
+    GEOSGeometry* collection = GEOSGeom_createCollection_r(geos, GEOS_GEOMETRYCOLLECTION, parts, part_count);
+    if (!collection) {
+        for (int i = 0; i < part_count; i++) GEOSGeom_destroy_r(geos, parts[i]);
+    }
+    return collection;
+}
+
+static GEOSGeometry* union_chunk(GEOSContextHandle_t geos, const geological_feature_t* feature,
+                                 int first, int count, int* repaired) {
+    GEOSGeometry** parts = malloc(count * sizeof(GEOSGeometry*));
+    if (!parts) return NULL;
+    int part_count = 0;
+    for (int p = first; p < first + count; p++) {
+        GEOSGeometry* part = ring_to_geometry(geos, &feature->polygons[p], repaired);
+        if (part) parts[part_count++] = part;
+    }
+    
+    // The collection takes ownership of the parts
+    GEOSGeometry* collection = make_collection(geos, parts, part_count);
+    free(parts);
+    if (!collection) return NULL;
+    GEOSGeometry* merged = GEOSUnaryUnion_r(geos, collection);
+    GEOSGeom_destroy_r(geos, collection);
+    return merged;
+}
+
+static void append_ring(GEOSContextHandle_t geos, const GEOSGeometry* ring, bool clockwise,
+                        polygon_t** polygons, int* count, int* capacity) {
+    const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(geos, ring);
+    unsigned int size = 0;
+    if (!seq || !GEOSCoordSeq_getSize_r(geos, seq, &size) || size < 4) return;
+    
+    if (*count >= *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        *polygons = realloc(*polygons, *capacity * sizeof(polygon_t));
+    }
+    polygon_t* polygon = &(*polygons)[(*count)++];
+    polygon->count = (int)size - 1;  // Rings are stored without the closing vertex
+    polygon->capacity = polygon->count;
+    polygon->coords = malloc(polygon->count * sizeof(coord_t));
+    for (int k = 0; k < polygon->count; k++) {
+        GEOSCoordSeq_getXY_r(geos, seq, k, &polygon->coords[k].x, &polygon->coords[k].y);
+    }
+    
+    // Keep the winding the tracer used
+    if ((signed_area(polygon) < 0) != clockwise) {
+        for (int i = 0, j = polygon->count - 1; i < j; i++, j--) {
+            coord_t t = polygon->coords[i];
+            polygon->coords[i] = polygon->coords[j];
+            polygon->coords[j] = t;
+        }
+    }
+}
+
+// Outer rings of every polygonal part; points and lines left by repair are dropped
+static void collect_shells(GEOSContextHandle_t geos, const GEOSGeometry* geometry, bool clockwise,
+                           polygon_t** polygons, int* count, int* capacity) {
+    int type = GEOSGeomTypeId_r(geos, geometry);
+    if (type == GEOS_POLYGON) {
+        append_ring(geos, GEOSGetExteriorRing_r(geos, geometry), clockwise, polygons, count, capacity);
+    } else if (type == GEOS_MULTIPOLYGON || type == GEOS_GEOMETRYCOLLECTION) {
+        int parts = GEOSGetNumGeometries_r(geos, geometry);
+        for (int i = 0; i < parts; i++) {
+            collect_shells(geos, GEOSGetGeometryN_r(geos, geometry, i), clockwise, polygons, count, capacity);
+        }
+    }
+}
+
+// True when a polygonal part has an interior ring, which the result model cannot hold
+static bool has_interior_rings(GEOSContextHandle_t geos, const GEOSGeometry* geometry) {
+    int type = GEOSGeomTypeId_r(geos, geometry);
+    if (type == GEOS_POLYGON) return GEOSGetNumInteriorRings_r(geos, geometry) > 0;
+    if (type == GEOS_MULTIPOLYGON || type == GEOS_GEOMETRYCOLLECTION) {
+        int parts = GEOSGetNumGeometries_r(geos, geometry);
+        for (int i = 0; i < parts; i++) {
+            if (has_interior_rings(geos, GEOSGetGeometryN_r(geos, geometry, i))) return true;
+        }
+    }
+    return false;
+}
+
+static bool union_feature(GEOSContextHandle_t geos, postprocess_job_t* job, int f) {
+    geological_feature_t* feature = &job->result->features[f];
+    int first = job->first_task[f];
+    int last = f + 1 < job->result->feature_count ? job->first_task[f + 1] : job->task_count;
+    if (first == last) return true;
+    
+    GEOSGeometry* merged = NULL;
+    if (last - first == 1) {
+        merged = job->tasks[first].partial;
+        job->tasks[first].partial = NULL;
+    } else {
+        GEOSGeometry** partials = malloc((last - first) * sizeof(GEOSGeometry*));
+        int partial_count = 0;
+        for (int t = first; partials && t < last; t++) {
+            if (job->tasks[t].partial) partials[partial_count++] = job->tasks[t].partial;
+            job->tasks[t].partial = NULL;
+        }
+        GEOSGeometry* collection = partials ? make_collection(geos, partials, partial_count) : NULL;
+        free(partials);
+        if (collection) {
+            merged = GEOSUnaryUnion_r(geos, collection);
+            GEOSGeom_destroy_r(geos, collection);
+        }
+    }
+    if (!merged) return false;
+    
+    // Fragments that enclose another class would lose the enclosed region and
+    // cover it with their shell; keep them as traced instead
+    if (has_interior_rings(geos, merged)) {
+        GEOSGeom_destroy_r(geos, merged);
+        wmspal_mutex_lock(&job->lock);
+        job->kept++;
+        wmspal_mutex_unlock(&job->lock);
+        return true;
+    }
+    
+    bool clockwise = signed_area(&feature->polygons[0]) < 0;
+    polygon_t* polygons = NULL;
+    int count = 0, capacity = 0;
+    collect_shells(geos, merged, clockwise, &polygons, &count, &capacity);
+    GEOSGeom_destroy_r(geos, merged);
+    if (count == 0) {
+        free(polygons);
+        return false;
+    }
+    
+    for (int p = 0; p < feature->polygon_count; p++) free(feature->polygons[p].coords);
+    free(feature->polygons);
+    feature->polygons = polygons;
+    feature->polygon_count = count;
+    return true;
+}
+
+static void* postprocess_worker(void* arg) {
+    postprocess_job_t* job = arg;
+    GEOSContextHandle_t geos = context_acquire_geos(job->context);
+    int repaired = 0, failed = 0;
+    
+    for (;;) {
+        wmspal_mutex_lock(&job->lock);
+        int item = job->next < job->items ? job->next++ : -1;
+        wmspal_mutex_unlock(&job->lock);
+        if (item < 0) break;
+        
+        if (job->phase == 1) {
+            union_task_t* task = &job->tasks[item];
+            task->partial = union_chunk(geos, &job->result->features[task->feature], task->first, task->count,
+                                        &repaired);
+        } else if (!union_feature(geos, job, item)) {
+            failed++;
+        }
+    }
+    
+    context_release_geos(job->context, geos);
+    wmspal_mutex_lock(&job->lock);
+    job->repaired += repaired;
+    job->failed += failed;
+    wmspal_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static void run_phase(postprocess_job_t* job, int phase, int items, int threads) {
+    job->phase = phase;
+    job->items = items;
+    job->next = 0;
+    if (threads > items) threads = items;
+    if (threads <= 1) {
+        postprocess_worker(job);
+        return;
+    }
+    
+    wmspal_thread_t* workers = malloc(threads * sizeof(wmspal_thread_t));
+    int started = 0;
+    while (workers && started < threads && wmspal_thread_start(&workers[started], postprocess_worker, job) == 0) {
+        started++;
+    }
+    if (started == 0) postprocess_worker(job);
+    for (int i = 0; i < started; i++) wmspal_thread_join(workers[i]);
+    free(workers);
+}
+
+// Each feature is tested once, against the union of its repaired rings (a
+// collection of overlapping parts is not a valid containment target)
+static int check_feature_info_points(wmspal_context_t* context, const vectorization_result_t* result) {
+    GEOSContextHandle_t geos = context_acquire_geos(context);
+    int outside = 0;
+    int repaired = 0;
+    int errors = 0;
+    
+    for (int f = 0; f < result->feature_count; f++) {
+        const geological_feature_t* feature = &result->features[f];
+        if (!feature->feature_info || feature->polygon_count == 0) continue;
+        
+        GEOSGeometry** parts = malloc(feature->polygon_count * sizeof(GEOSGeometry*));
+        int part_count = 0;
+        for (int p = 0; parts && p < feature->polygon_count; p++) {
+            GEOSGeometry* part = ring_to_geometry(geos, &feature->polygons[p], &repaired);
+            if (part) parts[part_count++] = part;
+        }
+        GEOSGeometry* collection = parts ? make_collection(geos, parts, part_count) : NULL;
+        free(parts);
+        if (!collection) continue;
+        GEOSGeometry* geometry = GEOSUnaryUnion_r(geos, collection);
+        GEOSGeom_destroy_r(geos, collection);
+        GEOSGeometry* point = GEOSGeom_createPointFromXY_r(geos, feature->info_point.x, feature->info_point.y);
+        
+        // 2 is a GEOS exception, not an answer
+        char contains = geometry && point ? GEOSContains_r(geos, geometry, point) : 2;
+        if (contains == 2) {
+            errors++;
+        } else if (contains == 0) {
+            fprintf(stderr, "Warning: feature %d was attributed from (%.6f, %.6f), which lies outside it\n",
+                    f, feature->info_point.x, feature->info_point.y);
+            outside++;
+        }
+        if (point) GEOSGeom_destroy_r(geos, point);
+        if (geometry) GEOSGeom_destroy_r(geos, geometry);
+    }
+    
+    context_release_geos(context, geos);
+    if (errors > 0) {
+        fprintf(stderr, "Warning: query point check failed for %d attributed features\n", errors);
+    }
+    return outside;
+}
+#endif
+
+// Repair invalid rings and dissolve touching polygons of the same class, on
+// `threads` workers (0 = one per online CPU). Attributed features are then
+// checked to still contain the point their GetFeatureInfo answer came from.
+int postprocess_result(wmspal_context_t* context, vectorization_result_t* result, int threads) {
+#ifdef HAVE_GEOS
+    double started = metrics_begin();
+    postprocess_job_t job = {0};
+    job.context = context;
+    job.result = result;
+    if (threads <= 0) threads = online_cpus();
+    
+    int polygons_before = 0;
+    for (int f = 0; f < result->feature_count; f++) {
+        int polygon_count = result->features[f].polygon_count;
+        polygons_before += polygon_count;
+        job.task_count += (polygon_count + UNION_CHUNK - 1) / UNION_CHUNK;
+    }
+    job.first_task = malloc((result->feature_count + 1) * sizeof(int));
+    job.tasks = calloc(job.task_count + 1, sizeof(union_task_t));
+    if (!job.first_task || !job.tasks) {
+        free(job.first_task);
+        free(job.tasks);
+        return 1;
+    }
+    
+    int t = 0;
+    for (int f = 0; f < result->feature_count; f++) {
+        job.first_task[f] = t;
+        for (int first = 0; first < result->features[f].polygon_count; first += UNION_CHUNK) {
+            int remaining = result->features[f].polygon_count - first;
+            job.tasks[t++] = (union_task_t){f, first, remaining < UNION_CHUNK ? remaining : UNION_CHUNK, NULL};
+        }
+    }
+    
+    wmspal_mutex_init(&job.lock);
+    run_phase(&job, 1, job.task_count, threads);
+    run_phase(&job, 2, result->feature_count, threads);
+    wmspal_mutex_destroy(&job.lock);
+    
+    // Partials are consumed by phase 2; any left over belong to features that failed
+    GEOSContextHandle_t geos = context_acquire_geos(context);
+    for (int i = 0; i < job.task_count; i++) {
+        if (job.tasks[i].partial) GEOSGeom_destroy_r(geos, job.tasks[i].partial);
+    }
+    context_release_geos(context, geos);
+    free(job.tasks);
+    free(job.first_task);
+    
+    int polygons_after = 0;
+    for (int f = 0; f < result->feature_count; f++) polygons_after += result->features[f].polygon_count;
+    int outside = check_feature_info_points(context, result);
+    metrics_end(METRIC_POSTPROCESS, started);
+    
+    printf("Geometry repair: %d invalid rings fixed, %d polygons dissolved into %d on %d threads\n",
+           job.repaired, polygons_before, polygons_after, threads);
+    if (job.failed > 0) {
+        fprintf(stderr, "Warning: union failed for %d classes; their polygons were left as traced\n", job.failed);
+    }
+    if (job.kept > 0) {
+        printf("%d classes enclose other classes and were left as traced\n", job.kept);
+    }
+    if (outside > 0) {
+        fprintf(stderr, "Warning: %d attributed features no longer contain their query point\n", outside);
+    }
+    return 0;
+#else
+    (void)context;
+    (void)result;
+    (void)threads;
+    fprintf(stderr, "Geometry repair requires GEOS support\n");
+    return 1;
+#endif
+}
\ No newline at end of file
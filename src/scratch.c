@@ -0,0 +1,106 @@
+#include "context.h"
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Raster backing store. Decoded images, class images and filter scratch are
+// the only allocations that grow with the map area; with a scratch directory
+// they are mapped from unlinked files there once they reach
+// SCRATCH_MIN_BYTES, so the kernel can write cold parts back instead of the
+// whole raster having to fit in RAM. Labelling and filtering stream through
+// these buffers row by row, which keeps the resident set to a few rows.
+// Small rasters, and every raster without a scratch directory, use the heap.
+
+#define SCRATCH_MIN_BYTES ((size_t)32 << 20)
+
+typedef struct scratch_mapping_s {
+    void* data;
+    size_t bytes;
+    struct scratch_mapping_s* next;
+} scratch_mapping_t;
+
+static struct {
+    bool enabled;
+    char dir[512];
+    wmspal_mutex_t lock;
+    scratch_mapping_t* mappings;
+} scratch;
+
+void wmspal_scratch_enable(const char* dir) {
+    if (!scratch.enabled) {
+        wmspal_mutex_init(&scratch.lock);
+        scratch.enabled = true;
+    }
+    snprintf(scratch.dir, sizeof(scratch.dir), "%s", dir);
+}
+
+#ifndef _WIN32
+static void* map_scratch_file(size_t bytes) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/wmspal_raster_XXXXXX", scratch.dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create scratch file in %s: %s\n", scratch.dir, strerror(errno));
+        return NULL;
+    }
+    // The mapping keeps the space until it is unmapped; nothing is left behind on a crash
+    unlink(path);
+    
+    void* data = MAP_FAILED;
+    if (ftruncate(fd, (off_t)bytes) == 0) data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %zu bytes of scratch in %s: %s\n", bytes, scratch.dir, strerror(errno));
+        return NULL;
+    }
+    return data;
+}
+#endif
+
+void* raster_alloc(size_t bytes) {
+#ifndef _WIN32
+    if (scratch.enabled && bytes >= SCRATCH_MIN_BYTES) {
+        scratch_mapping_t* mapping = malloc(sizeof(scratch_mapping_t));
+        void* data = mapping ? map_scratch_file(bytes) : NULL;
+        if (data) {
+            mapping->data = data;
+            mapping->bytes = bytes;
+            wmspal_mutex_lock(&scratch.lock);
+            mapping->next = scratch.mappings;
+            scratch.mappings = mapping;
+            wmspal_mutex_unlock(&scratch.lock);
+            return data;
+        }
+        // Fall back to the heap rather than failing the job
+        free(mapping);
+    }
+#endif
+    return malloc(bytes);
+}
+
+void raster_free(void* data) {
+    if (!data) return;
+#ifndef _WIN32
+    if (scratch.enabled) {
+        scratch_mapping_t* mapping = NULL;
+        wmspal_mutex_lock(&scratch.lock);
+        for (scratch_mapping_t** link = &scratch.mappings; *link; link = &(*link)->next) {
+            if ((*link)->data == data) {
+                mapping = *link;
+                *link = mapping->next;
+                break;
+            }
+        }
+        wmspal_mutex_unlock(&scratch.lock);
+        if (mapping) {
+            munmap(mapping->data, mapping->bytes);
+            free(mapping);
+            return;
+        }
+    }
+#endif
+    free(data);
+}
\ No newline at end of file
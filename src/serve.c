@@ -0,0 +1,717 @@
+#include "metrics.h"
+#include <ctype.h>
+
+// Resident daemon: a small HTTP/1.1 API on a local TCP port or Unix socket.
+// Jobs are submitted as JSON, queued and run by a worker pool that shares one
+// wmspal context, so connection pools and the response, SRS and dictionary
+// caches stay warm from one job to the next.
+//
+//   POST /jobs               submit {"layer": ..., "bbox": ..., ...}; 202 with the job id
+//   POST /jobs?wait=1        submit and stream the result back when the job ends
+//   GET  /jobs/ID[?wait=1]   job status, optionally after waiting for it to end
+//   GET  /jobs/ID/result     the job's GeoJSON output
+//
+// Clients never name files: every job writes job<ID>.* in the jobs directory.
+//   GET  /health             queue, worker and cache statistics
+//   GET  /metrics            stage timings and counters in Prometheus text format
+
+#ifdef _WIN32
+
+int run_server(const wms_config_t* config) {
+    (void)config;
+    fprintf(stderr, "Serve mode needs POSIX sockets and is not available in Windows builds\n");
+    return 1;
+}
+
+#else
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#define SERVE_MAX_HEADER 16384
+#define SERVE_MAX_BODY (1024 * 1024)
+#define SERVE_JOB_SLOTS 4096        // Jobs remembered at once; a busy slot rejects new submissions
+#define SERVE_JOB_STRINGS 12
+#define SERVE_HTTP_THREADS 8
+#define DEFAULT_SERVE_WORKERS 4
+
+typedef enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED
+} job_state_t;
+
+static const char* state_names[] = {"queued", "running", "done", "failed"};
+
+typedef struct serve_job_s {
+    int id;
+    job_state_t state;
+    wms_config_t config;                // String fields point at defaults or at strings[]
+    char* strings[SERVE_JOB_STRINGS];
+    int string_count;
+    bool mvt;                           // Vector tiles instead of GeoJSON
+    char result_file[600];
+    int feature_count;
+    double submitted, started, finished;
+    struct serve_job_s* next;           // Run queue link
+} serve_job_t;
+
+typedef struct {
+    wms_config_t defaults;
+    const char* jobs_dir;
+    int listen_fd;
+    bool stopping;
+    wmspal_mutex_t lock;                // Guards everything below
+    wmspal_cond_t work_ready;           // Signalled when a job is queued
+    wmspal_cond_t job_changed;          // Broadcast when a job finishes
+    serve_job_t* slots[SERVE_JOB_SLOTS];
+    serve_job_t* queue_head;
+    serve_job_t* queue_tail;
+    int next_id;
+    int queued, running, completed, failed;
+    int workers;
+    double started;
+} server_t;
+
+static void free_job(serve_job_t* job) {
+    if (!job) return;
+    for (int i = 0; i < job->string_count; i++) free(job->strings[i]);
+    free(job);
+}
+
+static char* job_string(serve_job_t* job, const char* value) {
+    if (job->string_count >= SERVE_JOB_STRINGS) return NULL;
+    return job->strings[job->string_count++] = strdup(value);
+}
+
+static void json_escape(const char* text, char* out, size_t out_size) {
+    size_t n = 0;
+    for (const unsigned char* p = (const unsigned char*)text; *p && n + 7 < out_size; p++) {
+        if (*p == '"' || *p == '\\') {
+            out[n++] = '\\';
+            out[n++] = (char)*p;
+        } else if (*p < 0x20) {
+            n += snprintf(out + n, out_size - n, "\\u%04x", *p);
+        } else {
+            out[n++] = (char)*p;
+        }
+    }
+    out[n] = '\0';
+}
+
+// ---- Job execution -------------------------------------------------------
+
+static int run_job(serve_job_t* job) {
+    wms_config_t* config = &job->config;
+    char georef_file[600];
+    snprintf(georef_file, sizeof(georef_file), "%s_georef.tif", config->output_file);
+    
+    if (download_wms_tile(config) != 0 ||
+        georeference_image(config->context, config->output_file, georef_file, config->bbox, config->srs) != 0) {
+        return 1;
+    }
+    
+    legend_t* legend = context_acquire_legend(config->context, config);
+    if (config->legend && !legend) return 1;
+    vectorization_result_t* result = analyze_geological_colors(georef_file, config->bbox, config->srs,
+                                                               &config->denoise, legend);
+    context_release_legend(config->context, legend);
+    if (!result) return 1;
+    if (attribution_requested(config)) attribute_features(result, config);
+    
+    job->feature_count = result->feature_count;
+    int status = write_vector_output(result, config->output_file, config);
+    free_vectorization_result(result);
+    return status;
+}
+
+static void* job_worker(void* arg) {
+    server_t* server = arg;
+    
+    for (;;) {
+        wmspal_mutex_lock(&server->lock);
+        while (!server->queue_head && !server->stopping) wmspal_cond_wait(&server->work_ready, &server->lock);
+        serve_job_t* job = server->queue_head;
+        if (!job) {
+            // Stopping with an empty queue
+            wmspal_mutex_unlock(&server->lock);
+            break;
+        }
+        server->queue_head = job->next;
+        if (!server->queue_head) server->queue_tail = NULL;
+        server->queued--;
+        server->running++;
+        job->state = JOB_RUNNING;
+        job->started = wmspal_now();
+        wmspal_mutex_unlock(&server->lock);
+        
+        // The job is not freed while running: its slot cannot be reused until it ends
+        int status = run_job(job);
+        
+        wmspal_mutex_lock(&server->lock);
+        job->state = status == 0 ? JOB_DONE : JOB_FAILED;
+        job->finished = wmspal_now();
+        server->running--;
+        if (status == 0) server->completed++; else server->failed++;
+        // Once finished the slot may be reused by the next submission, so report from copies
+        int id = job->id;
+        job_state_t state = job->state;
+        double seconds = job->finished - job->started;
+        wmspal_cond_broadcast(&server->job_changed);
+        wmspal_mutex_unlock(&server->lock);
+        
+        printf("Job %d %s in %.2f s\n", id, state_names[state], seconds);
+    }
+    return NULL;
+}
+
+// Parse a submission; returns NULL with *error set on bad input
+static serve_job_t* parse_job(server_t* server, const char* body, size_t size, const char** error) {
+    serve_job_t* job = calloc(1, sizeof(serve_job_t));
+    if (!job) {
+        *error = "out of memory";
+        return NULL;
+    }
+    job->config = server->defaults;
+    job->config.tile_cols = job->config.tile_rows = 0;
+    job->config.batch_manifest = NULL;
+    job->config.output_file = NULL;
+    job->config.mvt_output = NULL;
+    bool mvt = false;
+    
+    json_reader_t reader;
+    json_reader_init(&reader, body, size);
+    *error = NULL;
+    if (json_next(&reader) != JSON_OBJECT_START) *error = "request body must be a JSON object";
+    
+    while (!*error) {
+        json_token_t token = json_next(&reader);
+        if (token == JSON_OBJECT_END) break;
+        if (token != JSON_KEY) {
+            *error = "malformed JSON";
+            break;
+        }
+        char key[64];
+        snprintf(key, sizeof(key), "%s", reader.text);
+        token = json_next(&reader);
+        
+        if (token == JSON_STRING) {
+            const char* value = reader.text;
+            char** field = NULL;
+            if (strcmp(key, "url") == 0) field = &job->config.url;
+            else if (strcmp(key, "layer") == 0) field = &job->config.layer;
+            else if (strcmp(key, "bbox") == 0) field = &job->config.bbox;
+            else if (strcmp(key, "srs") == 0) field = &job->config.srs;
+            else if (strcmp(key, "format") == 0) field = &job->config.format;
+            else if (strcmp(key, "info_format") == 0) field = &job->config.info_format;
+            else if (strcmp(key, "out_srs") == 0) field = &job->config.out_srs;
+            else if (strcmp(key, "output") == 0 || strcmp(key, "mvt") == 0) {
+                *error = "output paths are chosen by the server; use \"mvt\": true for vector tiles";
+            }
+            if (field) {
+                // Two strings are kept back for the output names
+                *field = job->string_count < SERVE_JOB_STRINGS - 2 ? job_string(job, value) : NULL;
+                if (!*field) *error = "too many string fields";
+            }
+        } else if (token == JSON_NUMBER) {
+            int value = atoi(reader.text);
+            if (strcmp(key, "width") == 0) job->config.width = value;
+            else if (strcmp(key, "height") == 0) job->config.height = value;
+            else if (strcmp(key, "min_zoom") == 0) job->config.min_zoom = value;
+            else if (strcmp(key, "max_zoom") == 0) job->config.max_zoom = value;
+        } else if (token == JSON_TRUE || token == JSON_FALSE) {
+            if (strcmp(key, "attribution") == 0) job->config.attribution = token == JSON_TRUE;
+            else if (strcmp(key, "mvt") == 0) mvt = token == JSON_TRUE;
+        } else if (token == JSON_NULL) {
+            continue;
+        } else if (json_skip(&reader, token) != 0) {
+            *error = "malformed JSON";
+        }
+    }
+    json_reader_free(&reader);
+    
+    if (!*error && (!job->config.url || !job->config.layer || !job->config.bbox)) {
+        *error = "url, layer and bbox are required";
+    }
+    if (!*error && (job->config.width <= 0 || job->config.height <= 0)) {
+        *error = "width and height must be positive";
+    }
+    if (*error) {
+        free_job(job);
+        return NULL;
+    }
+    job->mvt = mvt;
+    return job;
+}
+
+// Queue a parsed job; returns its id, or 0 when every slot holds an unfinished job
+static int submit_job(server_t* server, serve_job_t* job) {
+    wmspal_mutex_lock(&server->lock);
+    int id = server->next_id;
+    serve_job_t** slot = &server->slots[id % SERVE_JOB_SLOTS];
+    if (server->stopping || (*slot && (*slot)->state != JOB_DONE && (*slot)->state != JOB_FAILED)) {
+        wmspal_mutex_unlock(&server->lock);
+        return 0;
+    }
+    free_job(*slot);
+    *slot = job;
+    server->next_id++;
+    
+    job->id = id;
+    job->state = JOB_QUEUED;
+    job->submitted = wmspal_now();
+    char name[600];
+    snprintf(name, sizeof(name), "%s/job%d.png", server->jobs_dir, id);
+    job->config.output_file = job_string(job, name);
+    if (job->mvt) {
+#ifdef HAVE_SQLITE3
+        snprintf(name, sizeof(name), "%s/job%d.mbtiles", server->jobs_dir, id);
+#else
+        snprintf(name, sizeof(name), "%s/job%d_tiles", server->jobs_dir, id);
+#endif
+        job->config.mvt_output = job_string(job, name);
+        snprintf(job->result_file, sizeof(job->result_file), "%s", name);
+    } else {
+        snprintf(job->result_file, sizeof(job->result_file), "%s.geojson", job->config.output_file);
+    }
+    
+    if (server->queue_tail) server->queue_tail->next = job; else server->queue_head = job;
+    server->queue_tail = job;
+    server->queued++;
+    wmspal_cond_signal(&server->work_ready);
+    wmspal_mutex_unlock(&server->lock);
+    return id;
+}
+
+// Status of a job as JSON; caller holds the lock. Returns false for unknown ids.
+static bool job_status_json(server_t* server, int id, char* out, size_t out_size, job_state_t* state,
+                            char* result_file, size_t result_size) {
+    serve_job_t* job = id > 0 ? server->slots[id % SERVE_JOB_SLOTS] : NULL;
+    if (!job || job->id != id) return false;
+    
+    char output[1300];
+    json_escape(job->result_file, output, sizeof(output));
+    double now = wmspal_now();
+    double queued_ms = ((job->state == JOB_QUEUED ? now : job->started) - job->submitted) * 1000.0;
+    double run_ms = job->state == JOB_QUEUED ? 0 :
+                    ((job->state == JOB_RUNNING ? now : job->finished) - job->started) * 1000.0;
+    snprintf(out, out_size,
+             "{\"id\": %d, \"status\": \"%s\", \"features\": %d, \"output\": \"%s\", "
+             "\"queued_ms\": %.1f, \"run_ms\": %.1f}\n",
+             job->id, state_names[job->state], job->feature_count, output, queued_ms, run_ms);
+    if (state) *state = job->state;
+    if (result_file) snprintf(result_file, result_size, "%s", job->result_file);
+    return true;
+}
+
+// Block until the job has finished (or the server stops), then report its status
+static bool wait_for_job(server_t* server, int id, char* out, size_t out_size, job_state_t* state,
+                         char* result_file, size_t result_size) {
+    wmspal_mutex_lock(&server->lock);
+    bool found;
+    for (;;) {
+        found = job_status_json(server, id, out, out_size, state, result_file, result_size);
+        if (!found || *state == JOB_DONE || *state == JOB_FAILED) break;
+        wmspal_cond_wait(&server->job_changed, &server->lock);
+    }
+    wmspal_mutex_unlock(&server->lock);
+    return found;
+}
+
+// ---- HTTP ----------------------------------------------------------------
+
+static int send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        data += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+static void send_response(int fd, int code, const char* reason, const char* content_type,
+                          const char* body, size_t body_size, int job_id) {
+    char header[512];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n", code, reason, content_type,
+                     body_size);
+    if (job_id > 0) n += snprintf(header + n, sizeof(header) - n, "X-Job-Id: %d\r\n", job_id);
+    snprintf(header + n, sizeof(header) - n, "Connection: close\r\n\r\n");
+    if (send_all(fd, header, strlen(header)) == 0 && body_size > 0) send_all(fd, body, body_size);
+}
+
+static void send_error(int fd, int code, const char* reason, const char* message) {
+    char body[512], escaped[400];
+    json_escape(message, escaped, sizeof(escaped));
+    snprintf(body, sizeof(body), "{\"error\": \"%s\"}\n", escaped);
+    send_response(fd, code, reason, "application/json", body, strlen(body), 0);
+}
+
+static void send_file(int fd, const char* path, const char* content_type, int job_id) {
+    FILE* file = fopen(path, "rb");
+    struct stat info;
+    if (!file || fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)) {
+        if (file) fclose(file);
+        send_error(fd, 404, "Not Found", "result is not a single file (vector tile output?) or is missing");
+        return;
+    }
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\nX-Job-Id: %d\r\n"
+                     "Connection: close\r\n\r\n", content_type, (long long)info.st_size, job_id);
+    if (send_all(fd, header, (size_t)n) == 0) {
+        char buffer[65536];
+        size_t read_size;
+        while ((read_size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            if (send_all(fd, buffer, read_size) != 0) break;
+        }
+    }
+    fclose(file);
+}
+
+static void send_job_result(server_t* server, int fd, int id) {
+    char status[2048], result_file[600];
+    job_state_t state;
+    if (!wait_for_job(server, id, status, sizeof(status), &state, result_file, sizeof(result_file))) {
+        send_error(fd, 404, "Not Found", "unknown job");
+    } else if (state == JOB_DONE) {
+        send_file(fd, result_file, "application/geo+json", id);
+    } else {
+        send_response(fd, 500, "Internal Server Error", "application/json", status, strlen(status), id);
+    }
+}
+
+static void send_health(server_t* server, int fd) {
+    int entries, hits, misses;
+    size_t bytes;
+    context_cache_stats(server->defaults.context, &entries, &bytes, &hits, &misses);
+    
+    char body[1024];
+    wmspal_mutex_lock(&server->lock);
+    snprintf(body, sizeof(body),
+             "{\"status\": \"ok\", \"uptime_s\": %.1f, \"workers\": %d, \"queued\": %d, \"running\": %d, "
+             "\"completed\": %d, \"failed\": %d, \"response_cache\": {\"entries\": %d, \"bytes\": %zu, "
+             "\"hits\": %d, \"misses\": %d}}\n",
+             wmspal_now() - server->started, server->workers, server->queued, server->running,
+             server->completed, server->failed, entries, bytes, hits, misses);
+    wmspal_mutex_unlock(&server->lock);
+    send_response(fd, 200, "OK", "application/json", body, strlen(body), 0);
+}
+
+static void route(server_t* server, int fd, const char* method, char* target, const char* body, size_t body_size) {
+    char* query = strchr(target, '?');
+    if (query) *query++ = '\0';
+    bool wait = query && (strstr(query, "wait=1") || strstr(query, "wait=true"));
+    
+    if (strcmp(target, "/health") == 0 && strcmp(method, "GET") == 0) {
+        send_health(server, fd);
+        return;
+    }
+    
+    if (strcmp(target, "/metrics") == 0 && strcmp(method, "GET") == 0) {
+        char* text = NULL;
+        size_t size = 0;
+        FILE* stream = open_memstream(&text, &size);
+        if (!stream) {
+            send_error(fd, 500, "Internal Server Error", "out of memory");
+            return;
+        }
+        metrics_write_prometheus(stream);
+        fclose(stream);
+        send_response(fd, 200, "OK", "text/plain; version=0.0.4", text, size, 0);
+        free(text);
+        return;
+    }
+    
+    if (strcmp(target, "/jobs") == 0) {
+        if (strcmp(method, "POST") != 0) {
+            send_error(fd, 405, "Method Not Allowed", "submit jobs with POST");
+            return;
+        }
+        const char* error;
+        serve_job_t* job = parse_job(server, body, body_size, &error);
+        if (!job) {
+            send_error(fd, 400, "Bad Request", error);
+            return;
+        }
+        int id = submit_job(server, job);
+        if (id == 0) {
+            free_job(job);
+            send_error(fd, 503, "Service Unavailable", "job table is full or the server is stopping");
+            return;
+        }
+        if (wait) {
+            send_job_result(server, fd, id);
+            return;
+        }
+        char status[2048];
+        wmspal_mutex_lock(&server->lock);
+        job_status_json(server, id, status, sizeof(status), NULL, NULL, 0);
+        wmspal_mutex_unlock(&server->lock);
+        send_response(fd, 202, "Accepted", "application/json", status, strlen(status), id);
+        return;
+    }
+    
+    if (strncmp(target, "/jobs/", 6) == 0 && strcmp(method, "GET") == 0) {
+        char* end;
+        long id = strtol(target + 6, &end, 10);
+        if (id <= 0 || id > INT32_MAX) {
+            send_error(fd, 404, "Not Found", "unknown job");
+            return;
+        }
+        if (strcmp(end, "/result") == 0) {
+            send_job_result(server, fd, (int)id);
+            return;
+        }
+        if (*end != '\0') {
+            send_error(fd, 404, "Not Found", "unknown resource");
+            return;
+        }
+        
+        char status[2048];
+        job_state_t state;
+        bool found;
+        if (wait) {
+            found = wait_for_job(server, (int)id, status, sizeof(status), &state, NULL, 0);
+        } else {
+            wmspal_mutex_lock(&server->lock);
+            found = job_status_json(server, (int)id, status, sizeof(status), &state, NULL, 0);
+            wmspal_mutex_unlock(&server->lock);
+        }
+        if (found) {
+            send_response(fd, 200, "OK", "application/json", status, strlen(status), (int)id);
+        } else {
+            send_error(fd, 404, "Not Found", "unknown job");
+        }
+        return;
+    }
+    
+    send_error(fd, 404, "Not Found", "unknown resource");
+}
+
+static void handle_connection(server_t* server, int fd) {
+    char* buffer = malloc(SERVE_MAX_HEADER + 1);
+    if (!buffer) return;
+    size_t size = 0;
+    char* head_end = NULL;
+    
+    while (!head_end && size < SERVE_MAX_HEADER) {
+        ssize_t n = read(fd, buffer + size, SERVE_MAX_HEADER - size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        size += (size_t)n;
+        buffer[size] = '\0';
+        head_end = strstr(buffer, "\r\n\r\n");
+    }
+    if (!head_end) {
+        if (size > 0) send_error(fd, 400, "Bad Request", "incomplete or oversized request header");
+        free(buffer);
+        return;
+    }
+    *head_end = '\0';
+    const char* body_start = head_end + 4;
+    size_t body_have = size - (size_t)(body_start - buffer);
+    
+    char method[16], target[1024];
+    if (sscanf(buffer, "%15s %1023s", method, target) != 2) {
+        send_error(fd, 400, "Bad Request", "malformed request line");
+        free(buffer);
+        return;
+    }
+    
+    size_t content_length = 0;
+    for (char* line = strstr(buffer, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) content_length = strtoul(line + 17, NULL, 10);
+    }
+    if (content_length > SERVE_MAX_BODY) {
+        send_error(fd, 413, "Payload Too Large", "request body is too large");
+        free(buffer);
+        return;
+    }
+    
+    char* body = malloc(content_length + 1);
+    if (!body) {
+        free(buffer);
+        return;
+    }
+    size_t body_size = body_have < content_length ? body_have : content_length;
+    memcpy(body, body_start, body_size);
+    while (body_size < content_length) {
+        ssize_t n = read(fd, body + body_size, content_length - body_size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        body_size += (size_t)n;
+    }
+    body[body_size] = '\0';
+    
+    route(server, fd, method, target, body, body_size);
+    free(body);
+    free(buffer);
+}
+
+static void* http_worker(void* arg) {
+    server_t* server = arg;
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;    // Listening socket shut down
+        }
+        handle_connection(server, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// "unix:/path/to.sock", "host:port" or just "port" (bound to 127.0.0.1)
+static int open_listener(const char* address) {
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Unix socket path is too long: %s\n", address + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, address + 5);
+        unlink(addr.sun_path);
+        
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+            fprintf(stderr, "Failed to listen on %s: %s\n", address, strerror(errno));
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    
+    char host[256] = "127.0.0.1";
+    const char* port = address;
+    const char* colon = strrchr(address, ':');
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        port = colon + 1;
+    }
+    
+    struct addrinfo hints, *results;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(host, port, &hints, &results);
+    if (rc != 0) {
+        fprintf(stderr, "Failed to resolve listen address %s: %s\n", address, gai_strerror(rc));
+        return -1;
+    }
+    
+    int fd = -1;
+    for (struct addrinfo* ai = results; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+    if (fd < 0) fprintf(stderr, "Failed to listen on %s: %s\n", address, strerror(errno));
+    return fd;
+}
+
+int run_server(const wms_config_t* config) {
+    const char* address = config->listen ? config->listen : "127.0.0.1:8080";
+    
+    server_t* server = calloc(1, sizeof(server_t));
+    if (!server) return 1;
+    server->defaults = *config;
+    server->jobs_dir = config->jobs_dir ? config->jobs_dir : ".";
+    server->next_id = 1;
+    server->workers = config->serve_workers > 0 ? config->serve_workers : DEFAULT_SERVE_WORKERS;
+    server->started = wmspal_now();
+    wmspal_mutex_init(&server->lock);
+    wmspal_cond_init(&server->work_ready);
+    wmspal_cond_init(&server->job_changed);
+    
+    // The daemon always collects metrics for GET /metrics
+    wmspal_metrics_enable(false);
+    
+    if (mkdir(server->jobs_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create jobs directory %s: %s\n", server->jobs_dir, strerror(errno));
+        free(server);
+        return 1;
+    }
+    
+    server->listen_fd = open_listener(address);
+    if (server->listen_fd < 0) {
+        free(server);
+        return 1;
+    }
+    
+    // Dead clients must not kill the daemon; SIGINT/SIGTERM are taken by sigwait below
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    
+    int thread_count = server->workers + SERVE_HTTP_THREADS, started = 0;
+    wmspal_thread_t* threads = malloc(thread_count * sizeof(wmspal_thread_t));
+    int http_first = 0;
+    for (int i = 0; threads && i < server->workers; i++) {
+        if (wmspal_thread_start(&threads[started], job_worker, server) == 0) started++;
+    }
+    http_first = started;
+    for (int i = 0; threads && i < SERVE_HTTP_THREADS; i++) {
+        if (wmspal_thread_start(&threads[started], http_worker, server) == 0) started++;
+    }
+    
+    if (threads && http_first > 0 && started > http_first) {
+        printf("Serving on %s with %d job workers (Ctrl-C to stop)\n", address, http_first);
+        fflush(stdout);
+        int signal_number;
+        sigwait(&stop_signals, &signal_number);
+        printf("\nStopping: finishing %d queued and %d running jobs\n", server->queued, server->running);
+    } else {
+        fprintf(stderr, "Failed to start server threads\n");
+    }
+    
+    // Stop accepting, let the workers drain the queue, then release any waiters
+    wmspal_mutex_lock(&server->lock);
+    server->stopping = true;
+    wmspal_cond_broadcast(&server->work_ready);
+    wmspal_mutex_unlock(&server->lock);
+    shutdown(server->listen_fd, SHUT_RDWR);
+    
+    for (int i = 0; i < http_first; i++) wmspal_thread_join(threads[i]);
+    wmspal_mutex_lock(&server->lock);
+    wmspal_cond_broadcast(&server->job_changed);
+    wmspal_mutex_unlock(&server->lock);
+    for (int i = http_first; i < started; i++) wmspal_thread_join(threads[i]);
+    free(threads);
+    
+    close(server->listen_fd);
+    if (strncmp(address, "unix:", 5) == 0) unlink(address + 5);
+    printf("Served %d jobs (%d failed)\n", server->completed + server->failed, server->failed);
+    
+    for (int i = 0; i < SERVE_JOB_SLOTS; i++) free_job(server->slots[i]);
+    wmspal_cond_destroy(&server->job_changed);
+    wmspal_cond_destroy(&server->work_ready);
+    wmspal_mutex_destroy(&server->lock);
+    free(server);
+    return 0;
+}
+
+#endif
\ No newline at end of file
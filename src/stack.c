@@ -0,0 +1,339 @@
+#include "context.h"
+
+// Layer stacks. Bedrock, superficial deposits and the like are often published
+// as separate layers; vectorizing each and intersecting the results afterwards
+// costs an overlay per pair and leaves slivers wherever two renderings differ
+// by a pixel. Here every layer is fetched on the same tile grid, concurrently,
+// and classified on its own. The per-pixel tuple of layer classes becomes one
+// class image, which is labelled and traced once, so each polygon is a region
+// that is constant in every layer and carries attributes from all of them.
+
+#define STACK_MAX_LAYERS 4          // Tuple keys pack 16 bits per layer into 64
+#define STACK_FETCH_THREADS 8
+#define STACK_NAME_SIZE 256
+
+typedef struct {
+    char name[STACK_NAME_SIZE];
+    legend_t* legend;
+    class_image_t* classes;
+    color_t* clustered;     // Class colours when they were not the legend's
+    const color_t* colors;
+    int color_count;
+} stack_layer_t;
+
+typedef struct {
+    wms_config_t config;    // Layer, tile bbox and output file of one GetMap
+    char bbox[256];
+    char file[512];
+} stack_request_t;
+
+typedef struct {
+    stack_request_t* requests;
+    int count;
+    int next;
+    int failed;
+    wmspal_mutex_t lock;
+} stack_fetch_t;
+
+static int parse_stack_layers(const char* list, stack_layer_t* layers) {
+    int count = 0;
+    const char* p = list;
+    while (*p) {
+        const char* end = strchr(p, ',');
+        if (!end) end = p + strlen(p);
+        size_t length = end - p;
+        if (length > 0) {
+            if (count == STACK_MAX_LAYERS || length >= STACK_NAME_SIZE) {
+                fprintf(stderr, "A layer stack takes at most %d layers\n", STACK_MAX_LAYERS);
+                return -1;
+            }
+            memcpy(layers[count].name, p, length);
+            layers[count].name[length] = '\0';
+            count++;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+static void* fetch_requests(void* arg) {
+    stack_fetch_t* fetch = arg;
+    
+    for (;;) {
+        wmspal_mutex_lock(&fetch->lock);
+        int index = fetch->failed == 0 && fetch->next < fetch->count ? fetch->next++ : -1;
+        wmspal_mutex_unlock(&fetch->lock);
+        if (index < 0) break;
+        
+        const stack_request_t* request = &fetch->requests[index];
+        if (download_wms_tile(&request->config) != 0) {
+            fprintf(stderr, "Failed to fetch layer %s, bbox %s\n", request->config.layer, request->bbox);
+            wmspal_mutex_lock(&fetch->lock);
+            fetch->failed++;
+            wmspal_mutex_unlock(&fetch->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int classify_layer(const wms_config_t* config, stack_layer_t* layer, const image_t* img) {
+    wms_config_t layer_config = *config;
+    layer_config.layer = layer->name;
+    layer->legend = context_acquire_legend(config->context, &layer_config);
+    if (config->legend && !layer->legend) return 1;
+    
+    layer->classes = classify_raster(img, layer->legend, &layer->clustered, &layer->color_count);
+    if (!layer->classes || denoise_class_image(layer->classes, &config->denoise) != 0) return 1;
+    layer->colors = layer->clustered ? layer->clustered : layer->legend ? layer->legend->colors : NULL;
+    printf("Layer %s: %d classes\n", layer->name, layer->color_count);
+    return 0;
+}
+
+// Number each distinct tuple of layer classes. A layer that leaves a pixel
+// unclassified contributes CLASS_NONE to its tuple as a value of its own, so a
+// sparse layer (faults, say) does not blank the others; only pixels no layer
+// classifies stay CLASS_NONE. tuples[t] holds the packed classes of tuple t.
+static class_image_t* combine_layers(const stack_layer_t* layers, int layer_count, uint64_t** tuples, int* tuple_count) {
+    int width = layers[0].classes->width, height = layers[0].classes->height;
+    size_t pixels = (size_t)width * height;
+    for (int l = 1; l < layer_count; l++) {
+        if (layers[l].classes->width != width || layers[l].classes->height != height) {
+            fprintf(stderr, "Layer %s is %dx%d, not %dx%d like %s\n", layers[l].name, layers[l].classes->width,
+                    layers[l].classes->height, width, height, layers[0].name);
+            return NULL;
+        }
+    }
+    
+    class_image_t* combined = malloc(sizeof(class_image_t));
+    key_map_t map;
+    if (!combined || key_map_init(&map, 1024) != 0) {
+        free(combined);
+        return NULL;
+    }
+    combined->width = width;
+    combined->height = height;
+    combined->data = raster_alloc(pixels * sizeof(unsigned short));
+    
+    uint64_t* keys = NULL;
+    int count = 0, capacity = 0;
+    uint64_t last_key = 0;
+    int last = -1;
+    for (size_t i = 0; i < pixels && combined->data; i++) {
+        uint64_t key = 0;
+        int unclassified = 0;
+        for (int l = 0; l < layer_count; l++) {
+            unsigned short c = layers[l].classes->data[i];
+            if (c == CLASS_NONE) unclassified++;
+            key |= (uint64_t)c << (16 * l);
+        }
+        if (unclassified == layer_count) {
+            combined->data[i] = CLASS_NONE;
+            continue;
+        }
+        
+        // Neighbouring pixels mostly share a tuple, so the map is only consulted on a change
+        if (last < 0 || key != last_key) {
+            if (!key_map_get(&map, key, &last)) {
+                if (count == CLASS_NONE) {
+                    fprintf(stderr, "Layer stack has more than %d distinct class combinations\n", CLASS_NONE - 1);
+                    raster_free(combined->data);
+                    combined->data = NULL;
+                    break;
+                }
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    keys = realloc(keys, capacity * sizeof(uint64_t));
+                }
+                keys[count] = key;
+                key_map_put(&map, key, count);
+                last = count++;
+            }
+            last_key = key;
+        }
+        combined->data[i] = (unsigned short)last;
+    }
+    key_map_destroy(&map);
+    
+    if (!combined->data) {
+        free(keys);
+        free(combined);
+        return NULL;
+    }
+    *tuples = keys;
+    *tuple_count = count;
+    return combined;
+}
+
+static void add_attribute(geological_feature_t* feature, const char* name, const char* value) {
+    feature->attributes = realloc(feature->attributes, (feature->attribute_count + 1) * sizeof(attribute_t));
+    feature->attributes[feature->attribute_count].name = strdup(name);
+    feature->attributes[feature->attribute_count].value = strdup(value);
+    feature->attribute_count++;
+}
+
+// Each feature gets one attribute per layer, named after it: the legend label
+// where the layer has a legend, the class colour otherwise. Legend attributes
+// follow as "<layer>.<name>". With legends the labels also form the unit name.
+// Layers that leave the region unclassified add nothing.
+static void attribute_stack_features(vectorization_result_t* result, const stack_layer_t* layers, int layer_count,
+                                     const uint64_t* tuples) {
+    for (int i = 0; i < result->feature_count; i++) {
+        geological_feature_t* feature = &result->features[i];
+        uint64_t key = tuples[feature->class_id];
+        char unit[1024] = "";
+        size_t unit_length = 0;
+        
+        for (int l = 0; l < layer_count; l++) {
+            const stack_layer_t* layer = &layers[l];
+            int c = (int)(key >> (16 * l) & 0xFFFF);
+            if (c == CLASS_NONE) continue;
+            if (layer->clustered || !layer->legend) {
+                char hex[8];
+                snprintf(hex, sizeof(hex), "#%02x%02x%02x", layer->colors[c].r, layer->colors[c].g, layer->colors[c].b);
+                add_attribute(feature, layer->name, hex);
+                continue;
+            }
+            
+            const legend_entry_t* entry = &layer->legend->entries[c];
+            add_attribute(feature, layer->name, entry->label);
+            for (int a = 0; a < entry->attribute_count; a++) {
+                size_t size = strlen(layer->name) + strlen(entry->attributes[a].name) + 2;
+                char* name = malloc(size);
+                if (!name) continue;
+                snprintf(name, size, "%s.%s", layer->name, entry->attributes[a].name);
+                add_attribute(feature, name, entry->attributes[a].value);
+                free(name);
+            }
+            if (unit_length < sizeof(unit)) {
+                unit_length += snprintf(unit + unit_length, sizeof(unit) - unit_length, "%s%s",
+                                        unit_length ? " / " : "", entry->label);
+            }
+        }
+        if (unit[0] && !feature->geological_unit) feature->geological_unit = strdup(unit);
+    }
+}
+
+int vectorize_layer_stack(const wms_config_t* config) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
+        fprintf(stderr, "Invalid bbox format\n");
+        return 1;
+    }
+    
+    stack_layer_t layers[STACK_MAX_LAYERS];
+    memset(layers, 0, sizeof(layers));
+    int layer_count = parse_stack_layers(config->stack_layers, layers);
+    if (layer_count < 0) return 1;
+    if (layer_count < 2) {
+        fprintf(stderr, "A layer stack needs at least two layers\n");
+        return 1;
+    }
+    
+    wms_config_t grid = *config;
+    if (grid.tile_cols < 1) grid.tile_cols = 1;
+    if (grid.tile_rows < 1) grid.tile_rows = 1;
+    int tiles = grid.tile_cols * grid.tile_rows;
+    
+    // Every layer is requested on the same grid, so the rasters align pixel for pixel
+    stack_fetch_t fetch = {0};
+    fetch.count = layer_count * tiles;
+    fetch.requests = calloc(fetch.count, sizeof(stack_request_t));
+    if (!fetch.requests) return 1;
+    for (int l = 0; l < layer_count; l++) {
+        for (int t = 0; t < tiles; t++) {
+            stack_request_t* request = &fetch.requests[l * tiles + t];
+            int col = t % grid.tile_cols, row = t / grid.tile_cols;
+            if (tile_bbox(&grid, col, row, request->bbox, sizeof(request->bbox)) != 0) {
+                free(fetch.requests);
+                return 1;
+            }
+            if (tiles == 1) {
+                snprintf(request->file, sizeof(request->file), "%s_layer%d.png", config->output_file, l);
+            } else {
+                snprintf(request->file, sizeof(request->file), "%s_layer%d_r%d_c%d.png", config->output_file, l, row, col);
+            }
+            request->config = grid;
+            request->config.layer = layers[l].name;
+            request->config.bbox = request->bbox;
+            request->config.output_file = request->file;
+        }
+    }
+    
+    printf("Fetching %d layers on a %dx%d tile grid (%d GetMap requests)...\n",
+           layer_count, grid.tile_cols, grid.tile_rows, fetch.count);
+    wmspal_mutex_init(&fetch.lock);
+    int thread_count = fetch.count < STACK_FETCH_THREADS ? fetch.count : STACK_FETCH_THREADS;
+    wmspal_thread_t threads[STACK_FETCH_THREADS];
+    int started_count = 0;
+    for (int t = 0; t < thread_count; t++) {
+        if (wmspal_thread_start(&threads[started_count], fetch_requests, &fetch) == 0) started_count++;
+    }
+    if (started_count == 0) fetch_requests(&fetch);
+    for (int t = 0; t < started_count; t++) wmspal_thread_join(threads[t]);
+    wmspal_mutex_destroy(&fetch.lock);
+    
+    int status = fetch.failed > 0;
+    for (int l = 0; l < layer_count && status == 0; l++) {
+        const char** files = malloc(tiles * sizeof(char*));
+        image_t* img = NULL;
+        if (files) {
+            for (int t = 0; t < tiles; t++) files[t] = fetch.requests[l * tiles + t].file;
+            img = load_grid_raster(files, grid.tile_cols, grid.tile_rows, grid.width, grid.height);
+            free(files);
+        }
+        status = !img || classify_layer(config, &layers[l], img) != 0;
+        free_image(img);
+    }
+    free(fetch.requests);
+    
+    uint64_t* tuples = NULL;
+    int tuple_count = 0;
+    class_image_t* combined = NULL;
+    vectorization_result_t* result = NULL;
+    if (status == 0) {
+        combined = combine_layers(layers, layer_count, &tuples, &tuple_count);
+        status = combined == NULL;
+    }
+    if (status == 0) {
+        printf("Layer stack: %d class combinations\n", tuple_count);
+        
+        // Features are drawn in the colours of the first layer that classifies them
+        color_t* colors = malloc((tuple_count ? tuple_count : 1) * sizeof(color_t));
+        for (int t = 0; colors && t < tuple_count; t++) {
+            int l = 0;
+            while ((tuples[t] >> (16 * l) & 0xFFFF) == CLASS_NONE) l++;
+            colors[t] = layers[l].colors[tuples[t] >> (16 * l) & 0xFFFF];
+        }
+        result = colors ? vectorize_classes(combined, colors, tuple_count, minx, miny, maxx, maxy, config->srs) : NULL;
+        free(colors);
+        if (!result) {
+            fprintf(stderr, "Failed to vectorize the layer stack\n");
+            status = 1;
+        }
+    }
+    if (status == 0) {
+        
+        // Without legends one GetFeatureInfo per feature queries every layer at once
+        if (!config->legend && attribution_requested(config)) {
+            wms_config_t job_config = grid;
+            job_config.layer = config->stack_layers;
+            attribute_features(result, &job_config);
+        }
+        attribute_stack_features(result, layers, layer_count, tuples);
+        status = write_vector_output(result, config->output_file, &grid);
+    }
+    
+    free_vectorization_result(result);
+    free_class_image(combined);
+    free(tuples);
+    for (int l = 0; l < layer_count; l++) {
+        free_class_image(layers[l].classes);
+        free(layers[l].clustered);
+        context_release_legend(config->context, layers[l].legend);
+    }
+    if (status != 0) return 1;
+    
+    printf("Layer stack vectorization complete\n");
+    return 0;
+}
\ No newline at end of file
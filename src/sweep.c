@@ -0,0 +1,612 @@
+#include "context.h"
+#include <ctype.h>
+#include <time.h>
+
+// TIME sweeps. Land-cover and flood-extent series publish one rendering per
+// TIME step, and consecutive steps usually differ in a few percent of their
+// pixels. The steps named by the layer's TIME dimension are fetched
+// concurrently on one fixed grid and processed in order as they arrive: the
+// first step is vectorized in full, every later one is compared with its
+// predecessor and only the bounding box of changed pixels is labelled and
+// traced, with each pixel classed by its (previous, current) transition.
+// All steps land in one output, each feature tagged with its time.
+
+#define SWEEP_MAX_STEPS 1000
+#define SWEEP_MAX_ITERATIONS 10000000     // Interval steps walked while filtering to the range
+#define SWEEP_FETCH_THREADS 8
+#define SWEEP_VALUE_SIZE 64
+
+#ifdef _WIN32
+#define timegm _mkgmtime
+#endif
+
+// An ISO 8601 instant and how many of its fields (year .. second) were written
+typedef struct {
+    struct tm tm;
+    int fields;
+    bool utc;
+} iso_time_t;
+
+typedef struct {
+    int years, months, days, hours, minutes, seconds;
+} iso_period_t;
+
+typedef struct {
+    wms_config_t config;    // TIME, tile bbox and output file of one GetMap
+    char bbox[256];
+    char file[512];
+    int step;
+} sweep_request_t;
+
+typedef struct {
+    sweep_request_t* requests;
+    int count;
+    int next;
+    int failed;
+    int* pending;           // Tiles of each step not yet downloaded
+    wmspal_mutex_t lock;
+    wmspal_cond_t fetched;
+} sweep_fetch_t;
+
+// "2021", "2021-06", "2021-06-01", "2021-06-01T12:00:00.000Z"; offsets other than Z are not accepted
+static bool parse_iso_time(const char* text, iso_time_t* time) {
+    static const char separators[6] = {0, '-', '-', 'T', ':', ':'};
+    int value[6] = {0, 1, 1, 0, 0, 0};
+    const char* p = text;
+    int fields = 0;
+    while (fields < 6) {
+        if (fields > 0) {
+            if (*p != separators[fields]) break;
+            p++;
+        }
+        if (!isdigit((unsigned char)*p)) return false;
+        char* end;
+        value[fields++] = (int)strtol(p, &end, 10);
+        p = end;
+    }
+    if (*p == '.') {
+        p++;
+        while (isdigit((unsigned char)*p)) p++;
+    }
+    time->utc = *p == 'Z';
+    if (time->utc) p++;
+    if (*p) return false;
+    
+    memset(&time->tm, 0, sizeof(time->tm));
+    time->tm.tm_year = value[0] - 1900;
+    time->tm.tm_mon = value[1] - 1;
+    time->tm.tm_mday = value[2];
+    time->tm.tm_hour = value[3];
+    time->tm.tm_min = value[4];
+    time->tm.tm_sec = value[5];
+    time->fields = fields;
+    return true;
+}
+
+// Written with the fields of the instant the interval was given with
+static void format_iso_time(const iso_time_t* format, time_t instant, char* out, size_t out_size) {
+    struct tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &instant);
+#else
+    gmtime_r(&instant, &tm);
+#endif
+    int n = snprintf(out, out_size, "%04d", tm.tm_year + 1900);
+    if (format->fields >= 2) n += snprintf(out + n, out_size - n, "-%02d", tm.tm_mon + 1);
+    if (format->fields >= 3) n += snprintf(out + n, out_size - n, "-%02d", tm.tm_mday);
+    if (format->fields >= 4) n += snprintf(out + n, out_size - n, "T%02d", tm.tm_hour);
+    if (format->fields >= 5) n += snprintf(out + n, out_size - n, ":%02d", tm.tm_min);
+    if (format->fields >= 6) n += snprintf(out + n, out_size - n, ":%02d", tm.tm_sec);
+    if (format->utc) snprintf(out + n, out_size - n, "Z");
+}
+
+// "P1Y2M10DT2H30M", "P2W"; fractions are not accepted
+static bool parse_iso_period(const char* text, iso_period_t* period) {
+    memset(period, 0, sizeof(*period));
+    if (*text++ != 'P') return false;
+    bool in_time = false, any = false;
+    while (*text) {
+        if (*text == 'T' && !in_time) {
+            in_time = true;
+            text++;
+            continue;
+        }
+        char* end;
+        long n = strtol(text, &end, 10);
+        if (end == text || n < 0) return false;
+        switch (*end) {
+            case 'Y': period->years += n; break;
+            case 'M': if (in_time) period->minutes += n; else period->months += n; break;
+            case 'W': period->days += 7 * n; break;
+            case 'D': period->days += n; break;
+            case 'H': period->hours += n; break;
+            case 'S': period->seconds += n; break;
+            default: return false;
+        }
+        any = any || n > 0;
+        text = end + 1;
+    }
+    return any;
+}
+
+static time_t instant_of(const iso_time_t* time) {
+    struct tm tm = time->tm;
+    return timegm(&tm);
+}
+
+// Step k of an interval, computed from the start so month lengths do not accumulate drift
+static time_t interval_step(const iso_time_t* start, const iso_period_t* period, int k) {
+    struct tm tm = start->tm;
+    tm.tm_year += k * period->years;
+    tm.tm_mon += k * period->months;
+    tm.tm_mday += k * period->days;
+    tm.tm_hour += k * period->hours;
+    tm.tm_min += k * period->minutes;
+    tm.tm_sec += k * period->seconds;
+    return timegm(&tm);
+}
+
+// False, adding nothing, once SWEEP_MAX_STEPS values are held
+static bool add_value(char*** values, int* count, const char* value) {
+    if (*count >= SWEEP_MAX_STEPS) return false;
+    if (*count % 64 == 0) *values = realloc(*values, (*count + 64) * sizeof(char*));
+    (*values)[(*count)++] = strdup(value);
+    return true;
+}
+
+static void free_values(char** values, int count) {
+    for (int i = 0; i < count; i++) free(values[i]);
+    free(values);
+}
+
+// Enumerate a TIME extent (comma-separated values and start/end/period
+// intervals) within range, "all" or "START/END" with either end optional.
+// Returns the number of steps, or -1 when the extent cannot be enumerated.
+static int expand_time_extent(const char* extent, const char* range, char*** values) {
+    *values = NULL;
+    int count = 0;
+    bool too_many = false;  // A value remained after SWEEP_MAX_STEPS were taken
+    bool bounded = strcmp(range, "all") != 0;
+    iso_time_t from = {0}, to = {0};
+    if (bounded) {
+        char from_text[SWEEP_VALUE_SIZE] = "", to_text[SWEEP_VALUE_SIZE] = "";
+        const char* slash = strchr(range, '/');
+        if (slash) {
+            snprintf(from_text, sizeof(from_text), "%.*s", (int)(slash - range), range);
+            snprintf(to_text, sizeof(to_text), "%s", slash + 1);
+        }
+        if (!slash || (from_text[0] && !parse_iso_time(from_text, &from)) ||
+            (to_text[0] && !parse_iso_time(to_text, &to))) {
+            fprintf(stderr, "Time sweep range must be \"all\" or START/END in ISO 8601: %s\n", range);
+            return -1;
+        }
+    }
+    // An omitted end leaves its fields at 0, which marks it as open
+    bool has_from = from.fields > 0, has_to = to.fields > 0;
+    time_t first = has_from ? instant_of(&from) : 0, final = has_to ? instant_of(&to) : 0;
+    
+    char* list = strdup(extent);
+    char* saveptr = NULL;
+    for (char* item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        while (isspace((unsigned char)*item)) item++;
+        char* item_end = item + strlen(item);
+        while (item_end > item && isspace((unsigned char)item_end[-1])) *--item_end = '\0';
+        if (!*item) continue;
+        
+        char* first_slash = strchr(item, '/');
+        if (!first_slash) {
+            iso_time_t stamp;
+            bool parsed = parse_iso_time(item, &stamp);
+            time_t instant = parsed ? instant_of(&stamp) : 0;
+            if (parsed && ((has_from && instant < first) || (has_to && instant > final))) continue;
+            if (!parsed && bounded) continue;
+            if (!add_value(values, &count, item)) {
+                too_many = true;
+                break;
+            }
+            continue;
+        }
+        
+        *first_slash = '\0';
+        char* second_slash = strchr(first_slash + 1, '/');
+        iso_time_t start, end;
+        iso_period_t period;
+        if (second_slash) *second_slash = '\0';
+        const char* end_text = first_slash + 1;
+        bool open_end = strcasecmp(end_text, "present") == 0 || strcasecmp(end_text, "current") == 0 ||
+                        strcasecmp(end_text, "now") == 0;
+        if (!second_slash || !parse_iso_time(item, &start) || !parse_iso_period(second_slash + 1, &period) ||
+            (!open_end && !parse_iso_time(end_text, &end))) {
+            fprintf(stderr, "Cannot enumerate TIME interval %s/%s%s%s\n", item, end_text,
+                    second_slash ? "/" : "", second_slash ? second_slash + 1 : "");
+            free(list);
+            free_values(*values, count);
+            *values = NULL;
+            return -1;
+        }
+        time_t last = open_end ? time(NULL) : instant_of(&end);
+        if (has_to && last > final) last = final;
+        for (int k = 0; k < SWEEP_MAX_ITERATIONS && !too_many; k++) {
+            time_t instant = interval_step(&start, &period, k);
+            if (instant > last) break;
+            if (has_from && instant < first) continue;
+            char value[SWEEP_VALUE_SIZE];
+            format_iso_time(&start, instant, value, sizeof(value));
+            if (!add_value(values, &count, value)) too_many = true;
+        }
+        if (too_many) break;
+    }
+    free(list);
+    
+    if (too_many) {
+        fprintf(stderr, "TIME dimension has more than %d steps in range; narrow it with --time-sweep START/END\n",
+                SWEEP_MAX_STEPS);
+        free_values(*values, count);
+        *values = NULL;
+        return -1;
+    }
+    return count;
+}
+
+static void* fetch_steps(void* arg) {
+    sweep_fetch_t* fetch = arg;
+    
+    for (;;) {
+        wmspal_mutex_lock(&fetch->lock);
+        int index = fetch->failed == 0 && fetch->next < fetch->count ? fetch->next++ : -1;
+        wmspal_mutex_unlock(&fetch->lock);
+        if (index < 0) break;
+        
+        const sweep_request_t* request = &fetch->requests[index];
+        int status = download_wms_tile(&request->config);
+        if (status != 0) {
+            fprintf(stderr, "Failed to fetch TIME %s, bbox %s\n", request->config.time, request->bbox);
+        }
+        wmspal_mutex_lock(&fetch->lock);
+        if (status != 0) fetch->failed++;
+        else fetch->pending[request->step]--;
+        wmspal_cond_broadcast(&fetch->fetched);
+        wmspal_mutex_unlock(&fetch->lock);
+        if (status != 0) break;
+    }
+    return NULL;
+}
+
+// Pixels whose class differs from the previous step, cropped to the bounding
+// box of the change (box: x0, y0, x1, y1). Each changed pixel is classed by
+// its transition, pairs[t] = previous << 16 | current; the rest is CLASS_NONE.
+// Returns NULL with *changed == 0 when nothing changed.
+static class_image_t* change_classes(const class_image_t* previous, const class_image_t* current,
+                                     uint32_t** pairs, int* pair_count, int* box, size_t* changed) {
+    int width = current->width, height = current->height;
+    *pairs = NULL;
+    *pair_count = 0;
+    *changed = 0;
+    
+    // Unchanged rows are skipped with one compare each
+    int x0 = width, x1 = 0, y0 = height, y1 = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned short* before = previous->data + (size_t)y * width;
+        const unsigned short* after = current->data + (size_t)y * width;
+        if (memcmp(before, after, width * sizeof(unsigned short)) == 0) continue;
+        int first = 0, last = width - 1;
+        while (before[first] == after[first]) first++;
+        while (before[last] == after[last]) last--;
+        if (first < x0) x0 = first;
+        if (last + 1 > x1) x1 = last + 1;
+        if (y < y0) y0 = y;
+        y1 = y + 1;
+    }
+    if (y1 == 0) return NULL;
+    
+    class_image_t* crop = malloc(sizeof(class_image_t));
+    key_map_t map;
+    if (!crop || key_map_init(&map, 256) != 0) {
+        free(crop);
+        return NULL;
+    }
+    crop->width = x1 - x0;
+    crop->height = y1 - y0;
+    crop->data = raster_alloc((size_t)crop->width * crop->height * sizeof(unsigned short));
+    
+    int capacity = 0;
+    for (int y = y0; y < y1 && crop->data; y++) {
+        const unsigned short* before = previous->data + (size_t)y * width;
+        const unsigned short* after = current->data + (size_t)y * width;
+        unsigned short* out = crop->data + (size_t)(y - y0) * crop->width;
+        for (int x = x0; x < x1; x++) {
+            if (before[x] == after[x]) {
+                out[x - x0] = CLASS_NONE;
+                continue;
+            }
+            (*changed)++;
+            uint32_t pair = (uint32_t)before[x] << 16 | after[x];
+            int transition;
+            if (!key_map_get(&map, pair, &transition)) {
+                if (*pair_count == capacity) {
+                    capacity = capacity ? capacity * 2 : 16;
+                    *pairs = realloc(*pairs, capacity * sizeof(uint32_t));
+                }
+                (*pairs)[*pair_count] = pair;
+                transition = (*pair_count)++;
+                key_map_put(&map, pair, transition);
+            }
+            out[x - x0] = (unsigned short)transition;
+        }
+    }
+    key_map_destroy(&map);
+    if (!crop->data) {
+        free(crop);
+        free(*pairs);
+        *pairs = NULL;
+        return NULL;
+    }
+    box[0] = x0; box[1] = y0; box[2] = x1; box[3] = y1;
+    return crop;
+}
+
+static void class_label(const legend_t* legend, const color_t* colors, unsigned short c, char* out, size_t out_size) {
+    if (c == CLASS_NONE) snprintf(out, out_size, "none");
+    else if (legend && colors == legend->colors) snprintf(out, out_size, "%s", legend->entries[c].label);
+    else snprintf(out, out_size, "#%02x%02x%02x", colors[c].r, colors[c].g, colors[c].b);
+}
+
+static void add_attribute(geological_feature_t* feature, const char* name, const char* value) {
+    feature->attributes = realloc(feature->attributes, (feature->attribute_count + 1) * sizeof(attribute_t));
+    feature->attributes[feature->attribute_count].name = strdup(name);
+    feature->attributes[feature->attribute_count].value = strdup(value);
+    feature->attribute_count++;
+}
+
+// Move the features of step into sweep
+static void append_features(vectorization_result_t* sweep, vectorization_result_t* step) {
+    if (step->feature_count > 0) {
+        sweep->features = realloc(sweep->features,
+                                  (sweep->feature_count + step->feature_count) * sizeof(geological_feature_t));
+        memcpy(sweep->features + sweep->feature_count, step->features,
+               step->feature_count * sizeof(geological_feature_t));
+        sweep->feature_count += step->feature_count;
+        step->feature_count = 0;
+    }
+    free_vectorization_result(step);
+}
+
+// Classify, diff against the previous step and vectorize what changed.
+// Without a legend the features are named by GetFeatureInfo at the step's
+// own TIME (job is the step's tile grid) before the sweep's attributes are
+// added.
+static vectorization_result_t* sweep_step(const wms_config_t* grid, const wms_config_t* job, const legend_t* legend,
+                                          image_t* img, int step, class_image_t** previous, color_t** colors,
+                                          int* color_count, char** values) {
+    double minx, miny, maxx, maxy;
+    sscanf(grid->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy);
+    
+    // Later steps are classed by the first step's colours so that class ids stay comparable
+    class_image_t* classes;
+    if (step == 0 || legend) {
+        color_t* clustered = NULL;
+        classes = classify_raster(img, legend, &clustered, color_count);
+        if (step == 0) *colors = clustered ? clustered : legend ? legend->colors : NULL;
+        else free(clustered);
+    } else {
+        classes = classify_image(img, *colors, *color_count);
+    }
+    if (!classes || denoise_class_image(classes, &grid->denoise) != 0) {
+        free_class_image(classes);
+        return NULL;
+    }
+    
+    vectorization_result_t* result;
+    char label[256];
+    if (step == 0) {
+        result = vectorize_classes(classes, *colors, *color_count, minx, miny, maxx, maxy, grid->srs);
+        if (!result) {
+            free_class_image(classes);
+            return NULL;
+        }
+        if (!legend && attribution_requested(job) && result->feature_count > 0) attribute_features(result, job);
+        for (int i = 0; i < result->feature_count; i++) {
+            geological_feature_t* feature = &result->features[i];
+            add_attribute(feature, "time", values[0]);
+            add_attribute(feature, "change", "initial");
+            class_label(legend, *colors, (unsigned short)feature->class_id, label, sizeof(label));
+            add_attribute(feature, "class", label);
+        }
+        printf("TIME %s: %d features\n", values[0], result->feature_count);
+    } else {
+        // Steps are compared pixel for pixel, so every raster must match the first
+        if (classes->width != (*previous)->width || classes->height != (*previous)->height) {
+            fprintf(stderr, "TIME %s is %dx%d, not %dx%d like TIME %s\n", values[step], classes->width,
+                    classes->height, (*previous)->width, (*previous)->height, values[0]);
+            free_class_image(classes);
+            return NULL;
+        }
+        uint32_t* pairs;
+        int pair_count, box[4];
+        size_t changed;
+        class_image_t* crop = change_classes(*previous, classes, &pairs, &pair_count, box, &changed);
+        if (!crop && changed > 0) {
+            free_class_image(classes);
+            return NULL;
+        }
+        
+        double pixel_width = (maxx - minx) / classes->width, pixel_height = (maxy - miny) / classes->height;
+        result = NULL;
+        if (crop) {
+            // Transitions are drawn in their new class's colour
+            color_t* transition_colors = malloc(pair_count * sizeof(color_t));
+            for (int t = 0; transition_colors && t < pair_count; t++) {
+                unsigned short to = pairs[t] & 0xFFFF;
+                transition_colors[t] = to == CLASS_NONE ? (color_t){0, 0, 0} : (*colors)[to];
+            }
+            if (transition_colors) {
+                result = vectorize_classes(crop, transition_colors, pair_count,
+                                           minx + box[0] * pixel_width, maxy - box[3] * pixel_height,
+                                           minx + box[2] * pixel_width, maxy - box[1] * pixel_height, grid->srs);
+            }
+            free(transition_colors);
+            free_class_image(crop);
+            if (!result) {
+                free(pairs);
+                free_class_image(classes);
+                return NULL;
+            }
+            if (!legend && attribution_requested(job) && result->feature_count > 0) attribute_features(result, job);
+            for (int i = 0; i < result->feature_count; i++) {
+                geological_feature_t* feature = &result->features[i];
+                uint32_t pair = pairs[feature->class_id];
+                add_attribute(feature, "time", values[step]);
+                add_attribute(feature, "change", "changed");
+                class_label(legend, *colors, pair & 0xFFFF, label, sizeof(label));
+                add_attribute(feature, "class", label);
+                add_attribute(feature, "previous_time", values[step - 1]);
+                class_label(legend, *colors, pair >> 16, label, sizeof(label));
+                add_attribute(feature, "previous_class", label);
+            }
+            free(pairs);
+        }
+        size_t pixels = (size_t)classes->width * classes->height;
+        printf("TIME %s: %zu pixels changed (%.2f%%), %d change features\n", values[step], changed,
+               100.0 * changed / pixels, result ? result->feature_count : 0);
+    }
+    
+    free_class_image(*previous);
+    *previous = classes;
+    if (!result) {
+        // Nothing changed: an empty result keeps the caller's bookkeeping uniform
+        result = calloc(1, sizeof(vectorization_result_t));
+        result->crs = strdup(grid->srs);
+    }
+    return result;
+}
+
+int vectorize_time_sweep(const wms_config_t* config) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4) {
+        fprintf(stderr, "Invalid bbox format\n");
+        return 1;
+    }
+    
+    layer_capabilities_t capabilities;
+    if (fetch_layer_capabilities(config, &capabilities) != 0) return 1;
+    if (!capabilities.found || !capabilities.time_values) {
+        fprintf(stderr, "Layer %s advertises no TIME dimension\n", config->layer);
+        free_layer_capabilities(&capabilities);
+        return 1;
+    }
+    char** values;
+    int step_count = expand_time_extent(capabilities.time_values, config->time_sweep, &values);
+    free_layer_capabilities(&capabilities);
+    if (step_count <= 0) {
+        if (step_count == 0) fprintf(stderr, "No TIME steps in range %s\n", config->time_sweep);
+        free_values(values, step_count > 0 ? step_count : 0);
+        return 1;
+    }
+    
+    wms_config_t grid = *config;
+    if (grid.tile_cols < 1) grid.tile_cols = 1;
+    if (grid.tile_rows < 1) grid.tile_rows = 1;
+    int tiles = grid.tile_cols * grid.tile_rows;
+    
+    legend_t* legend = context_acquire_legend(config->context, config);
+    sweep_fetch_t fetch = {0};
+    fetch.count = step_count * tiles;
+    fetch.requests = calloc(fetch.count, sizeof(sweep_request_t));
+    fetch.pending = malloc(step_count * sizeof(int));
+    const char** files = malloc(tiles * sizeof(char*));
+    if ((config->legend && !legend) || !fetch.requests || !fetch.pending || !files) {
+        context_release_legend(config->context, legend);
+        free(fetch.requests); free(fetch.pending); free(files);
+        free_values(values, step_count);
+        return 1;
+    }
+    for (int s = 0; s < step_count; s++) {
+        fetch.pending[s] = tiles;
+        for (int t = 0; t < tiles; t++) {
+            sweep_request_t* request = &fetch.requests[s * tiles + t];
+            int col = t % grid.tile_cols, row = t / grid.tile_cols;
+            if (tile_bbox(&grid, col, row, request->bbox, sizeof(request->bbox)) != 0) {
+                context_release_legend(config->context, legend);
+                free(fetch.requests); free(fetch.pending); free(files);
+                free_values(values, step_count);
+                return 1;
+            }
+            if (tiles == 1) {
+                snprintf(request->file, sizeof(request->file), "%s_t%d.png", config->output_file, s);
+            } else {
+                snprintf(request->file, sizeof(request->file), "%s_t%d_r%d_c%d.png", config->output_file, s, row, col);
+            }
+            request->config = grid;
+            request->config.time = values[s];
+            request->config.bbox = request->bbox;
+            request->config.output_file = request->file;
+            request->step = s;
+        }
+    }
+    
+    printf("Sweeping %d TIME steps on a %dx%d tile grid (%d GetMap requests)...\n",
+           step_count, grid.tile_cols, grid.tile_rows, fetch.count);
+    wmspal_mutex_init(&fetch.lock);
+    wmspal_cond_init(&fetch.fetched);
+    int thread_count = fetch.count < SWEEP_FETCH_THREADS ? fetch.count : SWEEP_FETCH_THREADS;
+    wmspal_thread_t threads[SWEEP_FETCH_THREADS];
+    int started_count = 0;
+    for (int t = 0; t < thread_count; t++) {
+        if (wmspal_thread_start(&threads[started_count], fetch_steps, &fetch) == 0) started_count++;
+    }
+    if (started_count == 0) fetch_steps(&fetch);
+    
+    // Steps are processed in order while later ones are still downloading
+    vectorization_result_t* sweep = calloc(1, sizeof(vectorization_result_t));
+    sweep->minx = minx; sweep->miny = miny;
+    sweep->maxx = maxx; sweep->maxy = maxy;
+    sweep->crs = strdup(config->srs);
+    class_image_t* previous = NULL;
+    color_t* colors = NULL;
+    int color_count = 0;
+    int status = 0;
+    for (int s = 0; s < step_count && status == 0; s++) {
+        wmspal_mutex_lock(&fetch.lock);
+        while (fetch.pending[s] > 0 && fetch.failed == 0) wmspal_cond_wait(&fetch.fetched, &fetch.lock);
+        status = fetch.failed > 0;
+        wmspal_mutex_unlock(&fetch.lock);
+        if (status != 0) break;
+        
+        for (int t = 0; t < tiles; t++) files[t] = fetch.requests[s * tiles + t].file;
+        image_t* img = load_grid_raster(files, grid.tile_cols, grid.tile_rows, grid.width, grid.height);
+        wms_config_t job = grid;
+        job.time = values[s];
+        vectorization_result_t* step = img ? sweep_step(&grid, &job, legend, img, s, &previous, &colors, &color_count,
+                                                        values) : NULL;
+        free_image(img);
+        if (!step) {
+            status = 1;
+            break;
+        }
+        append_features(sweep, step);
+    }
+    
+    if (status != 0) {
+        // Stop the workers before they fetch steps nobody will process
+        wmspal_mutex_lock(&fetch.lock);
+        fetch.failed++;
+        wmspal_mutex_unlock(&fetch.lock);
+    }
+    for (int t = 0; t < started_count; t++) wmspal_thread_join(threads[t]);
+    wmspal_cond_destroy(&fetch.fetched);
+    wmspal_mutex_destroy(&fetch.lock);
+    
+    if (status == 0) status = write_vector_output(sweep, config->output_file, &grid);
+    free_vectorization_result(sweep);
+    free_class_image(previous);
+    if (!legend || colors != legend->colors) free(colors);
+    context_release_legend(config->context, legend);
+    free(fetch.requests);
+    free(fetch.pending);
+    free(files);
+    free_values(values, step_count);
+    if (status != 0) return 1;
+    
+    printf("Time sweep vectorization complete\n");
+    return 0;
+}
\ No newline at end of file
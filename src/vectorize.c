@@ -1,57 +1,75 @@
-#include "../include/wmspal.h"
+#include "metrics.h"
 #include <math.h>
 #include <stdbool.h>
 
-#ifdef HAVE_GEOS
-#include <geos_c.h>
-#endif
+#define MAX_COLORS 50
+#define COLOR_TOLERANCE 30.0    // Max RGB distance for a pixel to join a colour class
+#define MIN_REGION_PIXELS 10    // Smaller components are treated as speckle
 
-// Simple image loading for PNG (basic implementation)
+// Read and decode a PNG file (see png.c)
 image_t* load_png_simple(const char* filename) {
-    // This is a placeholder - in a real implementation you'd use libpng or stb_image
-    image_t* img = malloc(sizeof(image_t));
-    if (!img) return NULL;
-    
+    double started = metrics_begin();
     FILE* file = fopen(filename, "rb");
-    if (!file) {
-        free(img);
+    if (!file) return NULL;
+    
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* data = length > 0 ? malloc(length) : NULL;
+    if (!data || fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        fclose(file);
         return NULL;
     }
-    
-    // For now, create a dummy 256x256 RGB image for testing
-    img->width = 256;
-    img->height = 256;
-    img->channels = 3;
-    img->data = malloc(img->width * img->height * img->channels);
-    
-    // Fill with test pattern (geological-like colors)
-    for (int y = 0; y < img->height; y++) {
-        for (int x = 0; x < img->width; x++) {
-            int idx = (y * img->width + x) * 3;
-            if (x < 128 && y < 128) {
-                // Reddish area (sandstone)
-                img->data[idx] = 180; img->data[idx+1] = 120; img->data[idx+2] = 80;
-            } else if (x >= 128 && y < 128) {
-                // Bluish area (limestone)
-                img->data[idx] = 100; img->data[idx+1] = 150; img->data[idx+2] = 200;
-            } else {
-                // Greenish area (shale)
-                img->data[idx] = 120; img->data[idx+1] = 180; img->data[idx+2] = 100;
-            }
-        }
-    }
-    
     fclose(file);
+    
+    image_t* img = decode_png(data, length);
+    free(data);
+    metrics_end(METRIC_DECODE, started);
     return img;
 }
 
 void free_image(image_t* img) {
     if (img) {
-        if (img->data) free(img->data);
+        raster_free(img->data);
+        free(img->palette);
         free(img);
     }
 }
 
+// Copy a window of an image; the window is clipped to the image bounds
+image_t* crop_image(const image_t* img, int x, int y, int width, int height) {
+    if (!img || !img->data) return NULL;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x + width > img->width) width = img->width - x;
+    if (y + height > img->height) height = img->height - y;
+    if (width <= 0 || height <= 0) return NULL;
+    
+    image_t* crop = calloc(1, sizeof(image_t));
+    if (!crop) return NULL;
+    crop->width = width;
+    crop->height = height;
+    crop->channels = img->channels;
+    crop->data = raster_alloc((size_t)width * height * img->channels);
+    if (img->palette) {
+        crop->palette = malloc(img->palette_size * sizeof(color_t));
+        if (crop->palette) memcpy(crop->palette, img->palette, img->palette_size * sizeof(color_t));
+        crop->palette_size = img->palette_size;
+    }
+    if (!crop->data || (img->palette && !crop->palette)) {
+        free_image(crop);
+        return NULL;
+    }
+    
+    size_t row_bytes = (size_t)width * img->channels;
+    for (int row = 0; row < height; row++) {
+        memcpy(crop->data + row * row_bytes,
+               img->data + ((size_t)(y + row) * img->width + x) * img->channels, row_bytes);
+    }
+    return crop;
+}
+
 // Color analysis functions
 static double color_distance(color_t a, color_t b) {
     double dr = a.r - b.r;
@@ -60,20 +78,26 @@ static double color_distance(color_t a, color_t b) {
     return sqrt(dr*dr + dg*dg + db*db);
 }
 
+// Colour of pixel i, through the palette for indexed images
+static inline color_t pixel_color(const image_t* img, size_t i) {
+    if (img->palette) {
+        unsigned char index = img->data[i];
+        return index < img->palette_size ? img->palette[index] : (color_t){0, 0, 0};
+    }
+    const unsigned char* p = &img->data[i * img->channels];
+    return (color_t){p[0], p[1], p[2]};
+}
+
 color_t* extract_unique_colors(image_t* img, int* color_count) {
     if (!img || !img->data) return NULL;
     
     // Simple color clustering with tolerance
-    const int MAX_COLORS = 50;
-    const double COLOR_TOLERANCE = 30.0;
-    
     color_t* colors = malloc(MAX_COLORS * sizeof(color_t));
     int count = 0;
     
     for (int y = 0; y < img->height; y += 4) {  // Sample every 4th pixel
         for (int x = 0; x < img->width; x += 4) {
-            int idx = (y * img->width + x) * img->channels;
-            color_t pixel = {img->data[idx], img->data[idx+1], img->data[idx+2]};
+            color_t pixel = pixel_color(img, (size_t)y * img->width + x);
             
             // Check if this color is already in our list
             bool found = false;
@@ -95,84 +119,465 @@ color_t* extract_unique_colors(image_t* img, int* color_count) {
     return colors;
 }
 
-// Simple flood fill for color region tracing
-static void flood_fill_region(image_t* img, int start_x, int start_y, color_t target, 
-                             bool* visited, polygon_t* polygon) {
-    if (start_x < 0 || start_x >= img->width || start_y < 0 || start_y >= img->height) return;
-    if (visited[start_y * img->width + start_x]) return;
-    
-    int idx = (start_y * img->width + start_x) * img->channels;
-    color_t pixel = {img->data[idx], img->data[idx+1], img->data[idx+2]};
+// Assign every pixel to its nearest palette colour (CLASS_NONE if none is close)
+class_image_t* classify_image(const image_t* img, const color_t* colors, int color_count) {
+    if (!img || !img->data || !colors) return NULL;
+    
+    class_image_t* classes = malloc(sizeof(class_image_t));
+    if (!classes) return NULL;
+    classes->width = img->width;
+    classes->height = img->height;
+    classes->data = raster_alloc((size_t)img->width * img->height * sizeof(unsigned short));
+    if (!classes->data) {
+        free(classes);
+        return NULL;
+    }
     
-    if (color_distance(pixel, target) > 20.0) return;
+    // Rendered maps are mostly long runs of one colour, so remember the last lookup
+    color_t last = {0, 0, 0};
+    unsigned short last_class = CLASS_NONE;
+    bool have_last = false;
     
-    visited[start_y * img->width + start_x] = true;
+    size_t pixel_count = (size_t)img->width * img->height;
+    for (size_t i = 0; i < pixel_count; i++) {
+        color_t pixel = pixel_color(img, i);
+        
+        if (!have_last || pixel.r != last.r || pixel.g != last.g || pixel.b != last.b) {
+            double best = COLOR_TOLERANCE;
+            last_class = CLASS_NONE;
+            for (int c = 0; c < color_count; c++) {
+                double d = color_distance(pixel, colors[c]);
+                if (d < best) {
+                    best = d;
+                    last_class = (unsigned short)c;
+                }
+            }
+            last = pixel;
+            have_last = true;
+        }
+        classes->data[i] = last_class;
+    }
     
-    // Add point to polygon (simplified boundary tracing)
-    if (polygon->count >= polygon->capacity) {
-        polygon->capacity *= 2;
-        polygon->coords = realloc(polygon->coords, polygon->capacity * sizeof(coord_t));
+    return classes;
+}
+
+// Indexed images: the palette is the class list. Entries in use are grouped
+// into classes most frequent first, the way extract_unique_colors groups
+// sampled pixels, so antialiasing shades join the colour they blend from
+// (with a legend, each entry takes its legend class instead). Pixels then
+// only go through a 256-entry table.
+class_image_t* classify_indexed_image(const image_t* img, const legend_t* legend, color_t** colors, int* color_count) {
+    *colors = NULL;
+    *color_count = 0;
+    if (!img || !img->data || !img->palette) return NULL;
+    
+    size_t pixel_count = (size_t)img->width * img->height;
+    // Four interleaved counts so runs of one index do not serialise on a single counter
+    size_t lanes[4][256] = {{0}};
+    size_t i = 0;
+    for (; i + 4 <= pixel_count; i += 4) {
+        lanes[0][img->data[i]]++;
+        lanes[1][img->data[i + 1]]++;
+        lanes[2][img->data[i + 2]]++;
+        lanes[3][img->data[i + 3]]++;
+    }
+    for (; i < pixel_count; i++) lanes[0][img->data[i]]++;
+    size_t histogram[256];
+    for (int k = 0; k < 256; k++) histogram[k] = lanes[0][k] + lanes[1][k] + lanes[2][k] + lanes[3][k];
+    
+    unsigned short class_of_index[256];
+    for (int k = 0; k < 256; k++) class_of_index[k] = CLASS_NONE;
+    
+    int used[256], used_count = 0;
+    for (int k = 0; k < img->palette_size; k++) {
+        if (histogram[k] == 0) continue;
+        int j = used_count++;
+        while (j > 0 && histogram[used[j - 1]] < histogram[k]) {
+            used[j] = used[j - 1];
+            j--;
+        }
+        used[j] = k;
     }
     
-    polygon->coords[polygon->count].x = start_x;
-    polygon->coords[polygon->count].y = start_y;
-    polygon->count++;
+    if (legend) {
+        for (int u = 0; u < used_count; u++) class_of_index[used[u]] = legend_class_of(legend, img->palette[used[u]]);
+    } else {
+        color_t* list = malloc(MAX_COLORS * sizeof(color_t));
+        if (!list) return NULL;
+        int count = 0;
+        for (int u = 0; u < used_count; u++) {
+            color_t entry = img->palette[used[u]];
+            double best = COLOR_TOLERANCE;
+            for (int c = 0; c < count; c++) {
+                double d = color_distance(entry, list[c]);
+                if (d < best) {
+                    best = d;
+                    class_of_index[used[u]] = (unsigned short)c;
+                }
+            }
+            if (class_of_index[used[u]] == CLASS_NONE && count < MAX_COLORS) {
+                class_of_index[used[u]] = (unsigned short)count;
+                list[count++] = entry;
+            }
+        }
+        *colors = list;
+        *color_count = count;
+        printf("Palette: %d of %d entries in use, grouped into %d colour classes\n",
+               used_count, img->palette_size, count);
+    }
     
-    // Recursively fill neighbors (simplified - real implementation would use queue)
-    if (polygon->count < 1000) {  // Prevent stack overflow
-        flood_fill_region(img, start_x+1, start_y, target, visited, polygon);
-        flood_fill_region(img, start_x-1, start_y, target, visited, polygon);
-        flood_fill_region(img, start_x, start_y+1, target, visited, polygon);
-        flood_fill_region(img, start_x, start_y-1, target, visited, polygon);
+    class_image_t* classes = malloc(sizeof(class_image_t));
+    if (classes) classes->data = raster_alloc(pixel_count * sizeof(unsigned short));
+    if (!classes || !classes->data) {
+        free(classes);
+        free(*colors);
+        *colors = NULL;
+        *color_count = 0;
+        return NULL;
     }
+    classes->width = img->width;
+    classes->height = img->height;
+    for (size_t i = 0; i < pixel_count; i++) classes->data[i] = class_of_index[img->data[i]];
+    return classes;
 }
 
-polygon_t* trace_color_regions(image_t* img, color_t target_color, int* polygon_count) {
-    if (!img || !img->data) return NULL;
-    
-    bool* visited = calloc(img->width * img->height, sizeof(bool));
-    polygon_t* polygons = malloc(10 * sizeof(polygon_t));  // Max 10 regions per color
-    int count = 0;
+void free_class_image(class_image_t* classes) {
+    if (classes) {
+        raster_free(classes->data);
+        free(classes);
+    }
+}
+
+static inline bool class_at(const class_image_t* classes, int x, int y, unsigned short class_id) {
+    if (x < 0 || y < 0 || x >= classes->width || y >= classes->height) return false;
+    return classes->data[(size_t)y * classes->width + x] == class_id;
+}
+
+static void ring_append(polygon_t* ring, double x, double y) {
+    if (ring->count >= ring->capacity) {
+        ring->capacity = ring->capacity ? ring->capacity * 2 : 16;
+        ring->coords = realloc(ring->coords, ring->capacity * sizeof(coord_t));
+    }
+    ring->coords[ring->count].x = x;
+    ring->coords[ring->count].y = y;
+    ring->count++;
+}
+
+// Walk the outer boundary of the 4-connected component whose first pixel in
+// scan order is (sx, sy). Vertices are pixel corners; the ring runs clockwise
+// on screen (interior on the right) and only corners where it turns are kept.
+static void trace_outer_ring(const class_image_t* classes, int sx, int sy, polygon_t* ring) {
+    static const int dx[4] = {1, 0, -1, 0};   // E, S, W, N
+    static const int dy[4] = {0, 1, 0, -1};
+    unsigned short id = classes->data[(size_t)sy * classes->width + sx];
+    
+    ring_append(ring, sx, sy);
+    int x = sx + 1, y = sy, dir = 0;
+    
+    while (x != sx || y != sy) {
+        // Pixels ahead-left and ahead-right of the current corner
+        int alx, aly, arx, ary;
+        switch (dir) {
+            case 0:  alx = x;     aly = y - 1; arx = x;     ary = y;     break;
+            case 1:  alx = x;     aly = y;     arx = x - 1; ary = y;     break;
+            case 2:  alx = x - 1; aly = y;     arx = x - 1; ary = y - 1; break;
+            default: alx = x - 1; aly = y - 1; arx = x;     ary = y - 1; break;
+        }
+        
+        int next;
+        if (class_at(classes, arx, ary, id)) {
+            next = class_at(classes, alx, aly, id) ? (dir + 3) % 4 : dir;
+        } else {
+            next = (dir + 1) % 4;  // Also taken at diagonal pinches (4-connectivity)
+        }
+        
+        if (next != dir) ring_append(ring, x, y);
+        dir = next;
+        x += dx[dir];
+        y += dy[dir];
+    }
+}
+
+static int find_root(int* parent, int run) {
+    while (parent[run] != run) {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+    return run;
+}
+
+// Label 4-connected components on row runs with union-find. Only the current
+// and previous row are read, so the raster is streamed once in memory order
+// and the working set scales with the number of runs rather than pixels.
+int label_class_runs(const unsigned short* data, int width, int height, class_runs_t* labels) {
+    memset(labels, 0, sizeof(*labels));
+    size_t pixel_count = (size_t)width * height;
+    size_t run_capacity = pixel_count < 1024 ? pixel_count : pixel_count / 8;
+    labels->runs = malloc(run_capacity * sizeof(class_run_t));
+    labels->row_first = malloc(((size_t)height + 1) * sizeof(int));
+    if (!labels->runs || !labels->row_first) {
+        free_class_runs(labels);
+        return 1;
+    }
     
-    for (int y = 0; y < img->height && count < 10; y += 8) {
-        for (int x = 0; x < img->width && count < 10; x += 8) {
-            if (!visited[y * img->width + x]) {
-                int idx = (y * img->width + x) * img->channels;
-                color_t pixel = {img->data[idx], img->data[idx+1], img->data[idx+2]};
-                
-                if (color_distance(pixel, target_color) < 20.0) {
-                    polygon_t polygon = {0};
-                    polygon.capacity = 100;
-                    polygon.coords = malloc(polygon.capacity * sizeof(coord_t));
-                    
-                    flood_fill_region(img, x, y, target_color, visited, &polygon);
-                    
-                    if (polygon.count > 10) {  // Only keep significant regions
-                        polygons[count++] = polygon;
-                    } else {
-                        free(polygon.coords);
-                    }
+    size_t run_count = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned short* row = data + (size_t)y * width;
+        labels->row_first[y] = (int)run_count;
+        for (int x = 0; x < width;) {
+            int start = x;
+            unsigned short id = row[x];
+            while (x < width && row[x] == id) x++;
+            if (run_count == run_capacity) {
+                size_t capacity = run_capacity * 2 < pixel_count ? run_capacity * 2 : pixel_count;
+                class_run_t* grown = realloc(labels->runs, capacity * sizeof(class_run_t));
+                if (!grown) {
+                    free_class_runs(labels);
+                    return 1;
                 }
+                labels->runs = grown;
+                run_capacity = capacity;
+            }
+            labels->runs[run_count++] = (class_run_t){start, x, y, id};
+        }
+    }
+    labels->row_first[height] = (int)run_count;
+    labels->count = (int)run_count;
+    
+    const class_run_t* runs = labels->runs;
+    const int* row_first = labels->row_first;
+    int* parent = labels->parent = malloc(run_count * sizeof(int));
+    if (!parent) {
+        free_class_runs(labels);
+        return 1;
+    }
+    for (size_t r = 0; r < run_count; r++) parent[r] = (int)r;
+    
+    // Runs in adjacent rows are walked in step, advancing whichever ends first.
+    // The lower index becomes the root, so roots are first runs in raster order.
+    for (int y = 1; y < height; y++) {
+        for (int a = row_first[y - 1], b = row_first[y]; a < row_first[y] && b < row_first[y + 1];) {
+            if (runs[a].id == runs[b].id && class_run_overlap(&runs[a], &runs[b]) > 0) {
+                int root_a = find_root(parent, a), root_b = find_root(parent, b);
+                if (root_a != root_b) parent[root_a > root_b ? root_a : root_b] = root_a < root_b ? root_a : root_b;
             }
+            if (runs[a].end < runs[b].end) a++;
+            else b++;
+        }
+    }
+    for (size_t r = 0; r < run_count; r++) parent[r] = find_root(parent, (int)r);
+    return 0;
+}
+
+void free_class_runs(class_runs_t* labels) {
+    free(labels->runs);
+    free(labels->row_first);
+    free(labels->parent);
+    memset(labels, 0, sizeof(*labels));
+}
+
+region_t* trace_regions(const class_image_t* classes, int min_pixels, int* region_count) {
+    *region_count = 0;
+    if (!classes || !classes->data) return NULL;
+    
+    int width = classes->width, height = classes->height;
+    class_runs_t labels;
+    if (label_class_runs(classes->data, width, height, &labels) != 0) return NULL;
+    int* pixels = calloc(labels.count, sizeof(int));
+    unsigned char* on_border = calloc(labels.count, 1);
+    int capacity = 64, count = 0;
+    region_t* regions = malloc(capacity * sizeof(region_t));
+    
+    if (!pixels || !on_border || !regions) {
+        free_class_runs(&labels);
+        free(pixels); free(on_border); free(regions);
+        return NULL;
+    }
+    
+    for (int r = 0; r < labels.count; r++) {
+        const class_run_t* run = &labels.runs[r];
+        int root = labels.parent[r];
+        pixels[root] += run->end - run->start;
+        if (run->row == 0 || run->row == height - 1 || run->start == 0 || run->end == width) on_border[root] = 1;
+    }
+    
+    // A root run starts its component's first pixel in scan order, where the ring walk begins
+    for (int r = 0; r < labels.count; r++) {
+        const class_run_t* run = &labels.runs[r];
+        if (labels.parent[r] != r || run->id == CLASS_NONE) continue;
+        
+        // Pieces cut by the raster edge may continue in a neighbouring tile
+        if (pixels[r] < min_pixels && !on_border[r]) continue;
+        
+        if (count >= capacity) {
+            capacity *= 2;
+            regions = realloc(regions, capacity * sizeof(region_t));
         }
+        region_t* region = &regions[count++];
+        region->class_id = run->id;
+        region->pixel_count = pixels[r];
+        memset(&region->ring, 0, sizeof(polygon_t));
+        trace_outer_ring(classes, run->start, run->row, &region->ring);
     }
     
-    free(visited);
-    *polygon_count = count;
+    free_class_runs(&labels);
+    free(pixels);
+    free(on_border);
+    *region_count = count;
+    return regions;
+}
+
+void free_regions(region_t* regions, int region_count) {
+    if (!regions) return;
+    for (int i = 0; i < region_count; i++) {
+        if (regions[i].ring.coords) free(regions[i].ring.coords);
+    }
+    free(regions);
+}
+
+polygon_t* trace_color_regions(image_t* img, color_t target_color, int* polygon_count) {
+    *polygon_count = 0;
+    class_image_t* classes = classify_image(img, &target_color, 1);
+    if (!classes) return NULL;
+    
+    int region_count;
+    region_t* regions = trace_regions(classes, MIN_REGION_PIXELS, &region_count);
+    free_class_image(classes);
+    if (!regions) return NULL;
+    
+    polygon_t* polygons = malloc((region_count > 0 ? region_count : 1) * sizeof(polygon_t));
+    for (int i = 0; i < region_count; i++) {
+        polygons[i] = regions[i].ring;
+    }
+    free(regions);  // Ring storage now belongs to the polygons
+    
+    *polygon_count = region_count;
     return polygons;
 }
 
-// Coordinate transformation from pixel to geographic coordinates
-static coord_t pixel_to_geo(int px, int py, int width, int height, 
+// Coordinate transformation from pixel corners to geographic coordinates
+static coord_t pixel_to_geo(double px, double py, int width, int height, 
                            double minx, double miny, double maxx, double maxy) {
     coord_t geo;
-    geo.x = minx + ((double)px / width) * (maxx - minx);
-    geo.y = maxy - ((double)py / height) * (maxy - miny);  // Flip Y axis
+    geo.x = minx + (px / width) * (maxx - minx);
+    geo.y = maxy - (py / height) * (maxy - miny);  // Flip Y axis
     return geo;
 }
 
+// Label and trace a classified raster into one feature per colour class
+vectorization_result_t* vectorize_classes(const class_image_t* classes, const color_t* colors, int color_count,
+                                          double minx, double miny, double maxx, double maxy, const char* srs) {
+    vectorization_result_t* result = malloc(sizeof(vectorization_result_t));
+    result->minx = minx; result->miny = miny;
+    result->maxx = maxx; result->maxy = maxy;
+    result->crs = strdup(srs);
+    result->feature_count = 0;
+    result->features = NULL;
+    
+    double started = metrics_begin();
+    int region_count;
+    region_t* regions = trace_regions(classes, MIN_REGION_PIXELS, &region_count);
+    metrics_end(METRIC_LABEL, started);
+    if (!regions || color_count <= 0) {
+        free_regions(regions, region_count);
+        return result;
+    }
+    
+    // Count regions per class so each feature's polygon array is sized once
+    int* per_class = calloc(color_count, sizeof(int));
+    for (int i = 0; i < region_count; i++) {
+        per_class[regions[i].class_id]++;
+    }
+    
+    int* feature_of_class = malloc(color_count * sizeof(int));
+    result->features = malloc(color_count * sizeof(geological_feature_t));
+    for (int c = 0; c < color_count; c++) {
+        feature_of_class[c] = -1;
+        if (per_class[c] == 0) continue;
+        
+        geological_feature_t* feature = &result->features[result->feature_count];
+        memset(feature, 0, sizeof(geological_feature_t));
+        feature->dominant_color = colors[c];
+        feature->class_id = c;
+        feature->polygons = malloc(per_class[c] * sizeof(polygon_t));
+        feature_of_class[c] = result->feature_count++;
+    }
+    
+    for (int i = 0; i < region_count; i++) {
+        geological_feature_t* feature = &result->features[feature_of_class[regions[i].class_id]];
+        polygon_t* polygon = &feature->polygons[feature->polygon_count++];
+        
+        // Move the ring over, converting pixel corners to geographic coordinates
+        *polygon = regions[i].ring;
+        regions[i].ring.coords = NULL;
+        for (int k = 0; k < polygon->count; k++) {
+            polygon->coords[k] = pixel_to_geo(polygon->coords[k].x, polygon->coords[k].y,
+                                              classes->width, classes->height, minx, miny, maxx, maxy);
+        }
+    }
+    
+    for (int i = 0; i < result->feature_count; i++) {
+        const geological_feature_t* feature = &result->features[i];
+        printf("Color %d: RGB(%d,%d,%d) -> %d polygons\n", i,
+               feature->dominant_color.r, feature->dominant_color.g, feature->dominant_color.b,
+               feature->polygon_count);
+    }
+    
+    free(feature_of_class);
+    free(per_class);
+    free_regions(regions, region_count);
+    return result;
+}
+
+// Classes come from the legend when there is one, otherwise from the palette
+// of an indexed image or from clustering the image's colours. colors is set
+// to the clustered class colours, or NULL when the legend's colours apply.
+class_image_t* classify_raster(const image_t* img, const legend_t* legend, color_t** colors, int* color_count) {
+    double started = metrics_begin();
+    *colors = NULL;
+    *color_count = legend ? legend->count : 0;
+    class_image_t* classes;
+    if (img->palette) {
+        // Paletted images need no colour extraction; the palette is the class list
+        classes = classify_indexed_image(img, legend, colors, color_count);
+        if (legend) *color_count = legend->count;
+    } else if (legend) {
+        classes = classify_with_legend(img, legend);
+    } else {
+        *colors = extract_unique_colors((image_t*)img, color_count);
+        if (!*colors) return NULL;
+        classes = classify_image(img, *colors, *color_count);
+    }
+    metrics_end(METRIC_CLASSIFY, started);
+    metrics_add(METRIC_PIXELS, (uint64_t)img->width * img->height);
+    if (!classes) {
+        free(*colors);
+        *colors = NULL;
+    }
+    return classes;
+}
+
+vectorization_result_t* vectorize_raster(const image_t* img, double minx, double miny, double maxx, double maxy,
+                                         const char* srs, const denoise_options_t* denoise, const legend_t* legend) {
+    color_t* colors;
+    int color_count;
+    class_image_t* classes = classify_raster(img, legend, &colors, &color_count);
+    if (!classes || denoise_class_image(classes, denoise) != 0) {
+        free_class_image(classes);
+        free(colors);
+        return NULL;
+    }
+    
+    vectorization_result_t* result = vectorize_classes(classes, legend ? legend->colors : colors, color_count,
+                                                       minx, miny, maxx, maxy, srs);
+    free_class_image(classes);
+    free(colors);
+    return result;
+}
+
 // Enhanced geological vectorization
-vectorization_result_t* analyze_geological_colors(const char* image_file, const char* bbox, const char* srs) {
+vectorization_result_t* analyze_geological_colors(const char* image_file, const char* bbox, const char* srs,
+                                                  const denoise_options_t* denoise, const legend_t* legend) {
     printf("Analyzing geological colors in: %s\n", image_file);
     
     // Parse bounding box
@@ -188,58 +593,12 @@ vectorization_result_t* analyze_geological_colors(const char* image_file, const
         return NULL;
     }
     
-    vectorization_result_t* result = malloc(sizeof(vectorization_result_t));
-    result->minx = minx; result->miny = miny;
-    result->maxx = maxx; result->maxy = maxy;
-    result->crs = strdup(srs);
-    result->feature_count = 0;
-    result->features = NULL;
-    
-    // Extract unique colors
-    int color_count;
-    color_t* colors = extract_unique_colors(img, &color_count);
-    
-    if (colors && color_count > 0) {
-        result->features = malloc(color_count * sizeof(geological_feature_t));
-        
-        for (int i = 0; i < color_count; i++) {
-            geological_feature_t* feature = &result->features[result->feature_count];
-            feature->dominant_color = colors[i];
-            feature->feature_info = NULL;
-            feature->geological_unit = NULL;
-            feature->age = NULL;
-            feature->lithology = NULL;
-            
-            // Trace polygons for this color
-            int polygon_count;
-            polygon_t* polygons = trace_color_regions(img, colors[i], &polygon_count);
-            
-            if (polygons && polygon_count > 0) {
-                feature->polygons = malloc(polygon_count * sizeof(polygon_t));
-                feature->polygon_count = polygon_count;
-                
-                // Convert pixel coordinates to geographic coordinates
-                for (int j = 0; j < polygon_count; j++) {
-                    feature->polygons[j] = polygons[j];
-                    for (int k = 0; k < polygons[j].count; k++) {
-                        coord_t geo = pixel_to_geo(
-                            (int)polygons[j].coords[k].x, (int)polygons[j].coords[k].y,
-                            img->width, img->height, minx, miny, maxx, maxy);
-                        feature->polygons[j].coords[k] = geo;
-                    }
-                }
-                
-                result->feature_count++;
-                printf("Color %d: RGB(%d,%d,%d) -> %d polygons\n", 
-                       i, colors[i].r, colors[i].g, colors[i].b, polygon_count);
-            }
-        }
-    }
-    
-    if (colors) free(colors);
+    vectorization_result_t* result = vectorize_raster(img, minx, miny, maxx, maxy, srs, denoise, legend);
     free_image(img);
     
-    printf("Geological analysis complete: %d features found\n", result->feature_count);
+    if (result) {
+        printf("Geological analysis complete: %d features found\n", result->feature_count);
+    }
     return result;
 }
 
@@ -252,6 +611,7 @@ void free_vectorization_result(vectorization_result_t* result) {
         if (feature->geological_unit) free(feature->geological_unit);
         if (feature->age) free(feature->age);
         if (feature->lithology) free(feature->lithology);
+        free_attributes(feature->attributes, feature->attribute_count);
         
         for (int j = 0; j < feature->polygon_count; j++) {
             if (feature->polygons[j].coords) free(feature->polygons[j].coords);
@@ -268,72 +628,33 @@ void free_vectorization_result(vectorization_result_t* result) {
 int vectorize_geological_map(const char* input_file, const char* output_file, const wms_config_t* config) {
     printf("Starting comprehensive geological vectorization...\n");
     
+    legend_t* legend = context_acquire_legend(config->context, config);
+    if (config->legend && !legend) return 1;
+    
     // Analyze colors and create geological features
-    vectorization_result_t* result = analyze_geological_colors(input_file, config->bbox, config->srs);
+    vectorization_result_t* result = analyze_geological_colors(input_file, config->bbox, config->srs,
+                                                               &config->denoise, legend);
+    context_release_legend(config->context, legend);
     if (!result) {
         fprintf(stderr, "Failed to analyze geological features\n");
         return 1;
     }
     
-    // Query GetFeatureInfo for each feature's centroid
-    for (int i = 0; i < result->feature_count; i++) {
-        geological_feature_t* feature = &result->features[i];
-        
-        if (feature->polygon_count > 0 && feature->polygons[0].count > 0) {
-            // Calculate centroid of first polygon
-            double cx = 0, cy = 0;
-            for (int j = 0; j < feature->polygons[0].count; j++) {
-                cx += feature->polygons[0].coords[j].x;
-                cy += feature->polygons[0].coords[j].y;
-            }
-            cx /= feature->polygons[0].count;
-            cy /= feature->polygons[0].count;
-            
-            // Get feature info at centroid
-            char* feature_info = NULL;
-            if (get_feature_info_at_point(config, cx, cy, &feature_info) == 0 && feature_info) {
-                feature->feature_info = feature_info;
-                
-                // Parse feature information (generic approach)
-                if (strstr(feature_info, "sandstone") || strstr(feature_info, "Sandstone")) {
-                    feature->lithology = strdup("Sandstone");
-                } else if (strstr(feature_info, "limestone") || strstr(feature_info, "Limestone")) {
-                    feature->lithology = strdup("Limestone");
-                } else if (strstr(feature_info, "shale") || strstr(feature_info, "Shale")) {
-                    feature->lithology = strdup("Shale");
-                } else if (strstr(feature_info, "water") || strstr(feature_info, "Water")) {
-                    feature->lithology = strdup("Water");
-                } else if (strstr(feature_info, "forest") || strstr(feature_info, "Forest")) {
-                    feature->lithology = strdup("Forest");
-                } else if (strstr(feature_info, "urban") || strstr(feature_info, "Urban")) {
-                    feature->lithology = strdup("Urban");
-                } else if (strstr(feature_info, "agricultural") || strstr(feature_info, "Agricultural")) {
-                    feature->lithology = strdup("Agricultural");
-                }
-                
-                printf("Feature %d: RGB(%d,%d,%d) at (%.6f, %.6f) -> %s\n",
-                       i, feature->dominant_color.r, feature->dominant_color.g, feature->dominant_color.b,
-                       cx, cy, feature->lithology ? feature->lithology : "Unknown");
-            }
-        }
-    }
+    // Query GetFeatureInfo for each feature
+    if (attribution_requested(config)) attribute_features(result, config);
     
-    // Write GeoJSON output
-    char geojson_file[512];
-    snprintf(geojson_file, sizeof(geojson_file), "%s.geojson", output_file);
-    
-    if (write_geojson(result, geojson_file) != 0) {
-        fprintf(stderr, "Failed to write GeoJSON output\n");
+    // Write GeoJSON or vector tile output
+    if (write_vector_output(result, output_file, config) != 0) {
         free_vectorization_result(result);
         return 1;
     }
     
-    printf("Geological vectorization complete: %s\n", geojson_file);
+    printf("Geological vectorization complete\n");
     free_vectorization_result(result);
     return 0;
 }
 
-int vectorize_image(const char* input_file, const char* output_file) {
+int vectorize_image(wmspal_context_t* context, const char* input_file, const char* output_file) {
     printf("Vectorizing image: %s -> %s\n", input_file, output_file);
     
     // For now, create a simple text-based vector format
@@ -348,40 +669,41 @@ int vectorize_image(const char* input_file, const char* output_file) {
     
     fprintf(vec, "# WMSPal Vector Output\n");
     fprintf(vec, "# Format: POLYGON((x1 y1, x2 y2, ...))\n");
-    
+
 #ifdef HAVE_GEOS
     fprintf(vec, "# Built with GEOS support for geometric operations\n");
     
-    // Initialize GEOS
-    initGEOS(NULL, NULL);
+    // Reentrant GEOS handle, leased from the context's pool
+    GEOSContextHandle_t geos = context_acquire_geos(context);
     
     // Create a simple polygon using GEOS
-    GEOSCoordSequence* coords = GEOSCoordSeq_create(5, 2);
-    GEOSCoordSeq_setX(coords, 0, 0.0);
-    GEOSCoordSeq_setY(coords, 0, 0.0);
-    GEOSCoordSeq_setX(coords, 1, 10.0);
-    GEOSCoordSeq_setY(coords, 1, 0.0);
-    GEOSCoordSeq_setX(coords, 2, 10.0);
-    GEOSCoordSeq_setY(coords, 2, 10.0);
-    GEOSCoordSeq_setX(coords, 3, 0.0);
-    GEOSCoordSeq_setY(coords, 3, 10.0);
-    GEOSCoordSeq_setX(coords, 4, 0.0);  // Close the ring
-    GEOSCoordSeq_setY(coords, 4, 0.0);
-    
-    GEOSGeometry* ring = GEOSGeom_createLinearRing(coords);
-    GEOSGeometry* polygon = GEOSGeom_createPolygon(ring, NULL, 0);
-    
-    char* wkt = GEOSGeomToWKT(polygon);
+    GEOSCoordSequence* coords = GEOSCoordSeq_create_r(geos, 5, 2);
+    GEOSCoordSeq_setX_r(geos, coords, 0, 0.0);
+    GEOSCoordSeq_setY_r(geos, coords, 0, 0.0);
+    GEOSCoordSeq_setX_r(geos, coords, 1, 10.0);
+    GEOSCoordSeq_setY_r(geos, coords, 1, 0.0);
+    GEOSCoordSeq_setX_r(geos, coords, 2, 10.0);
+    GEOSCoordSeq_setY_r(geos, coords, 2, 10.0);
+    GEOSCoordSeq_setX_r(geos, coords, 3, 0.0);
+    GEOSCoordSeq_setY_r(geos, coords, 3, 10.0);
+    GEOSCoordSeq_setX_r(geos, coords, 4, 0.0);  // Close the ring
+    GEOSCoordSeq_setY_r(geos, coords, 4, 0.0);
+    
+    GEOSGeometry* ring = GEOSGeom_createLinearRing_r(geos, coords);
+    GEOSGeometry* polygon = GEOSGeom_createPolygon_r(geos, ring, NULL, 0);
+    
+    char* wkt = GEOSGeomToWKT_r(geos, polygon);
     if (wkt) {
         fprintf(vec, "%s\n", wkt);
-        GEOSFree(wkt);
+        GEOSFree_r(geos, wkt);
     }
     
-    GEOSGeom_destroy(polygon);
-    finishGEOS();
+    GEOSGeom_destroy_r(geos, polygon);
+    context_release_geos(context, geos);
     
     printf("Vector file created with GEOS geometry: %s\n", vector_file);
 #else
+    (void)context;
     fprintf(vec, "# Note: Full vectorization requires image processing library\n");
     fprintf(vec, "# This is a placeholder implementation\n");
     
@@ -401,7 +723,82 @@ int vectorize_image(const char* input_file, const char* output_file) {
     return 0;
 }
 
+// GeoJSON, or a vector tile pyramid when one was requested
+static int write_output_file(const vectorization_result_t* result, const char* output_file, const wms_config_t* config) {
+    if (config->mvt_output) {
+        int width = config->width * (config->tile_cols > 0 ? config->tile_cols : 1);
+        int max_zoom = config->max_zoom >= 0 ? config->max_zoom : mvt_auto_max_zoom(result, width);
+        int min_zoom = config->min_zoom >= 0 ? config->min_zoom : 0;
+        if (min_zoom > max_zoom) min_zoom = max_zoom;
+        
+        if (write_mvt_pyramid(result, config->mvt_output, config->layer, min_zoom, max_zoom) != 0) {
+            fprintf(stderr, "Failed to write vector tiles\n");
+            return 1;
+        }
+        return 0;
+    }
+    
+    char geojson_file[512];
+    snprintf(geojson_file, sizeof(geojson_file), "%s.geojson", output_file);
+    if (write_geojson(result, geojson_file) != 0) {
+        fprintf(stderr, "Failed to write GeoJSON output\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Write the result in the requested format. The result is repaired and
+// dissolved in place first when asked to, then reprojected to the output SRS.
+int write_vector_output(vectorization_result_t* result, const char* output_file, const wms_config_t* config) {
+    if (config->make_valid && postprocess_result(config->context, result, config->geometry_threads) != 0) {
+        fprintf(stderr, "Failed to repair output geometry\n");
+        return 1;
+    }
+    if (config->out_srs && reproject_result(config->context, result, config->out_srs) != 0) {
+        fprintf(stderr, "Failed to reproject output to %s\n", config->out_srs);
+        return 1;
+    }
+    
+    if (metrics_active()) {
+        uint64_t vertices = 0;
+        for (int f = 0; f < result->feature_count; f++) {
+            const geological_feature_t* feature = &result->features[f];
+            for (int p = 0; p < feature->polygon_count; p++) vertices += feature->polygons[p].count;
+        }
+        metrics_add(METRIC_FEATURES, result->feature_count);
+        metrics_add(METRIC_VERTICES, vertices);
+    }
+    double started = metrics_begin();
+    int status = write_output_file(result, output_file, config);
+    metrics_end(METRIC_WRITE, started);
+    return status;
+}
+
 // GeoJSON output functions
+static void write_json_string(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++) {
+        if (*p == '"' || *p == '\\') fprintf(file, "\\%c", *p);
+        else if (*p == '\n') fprintf(file, "\\n");
+        else if (*p == '\r') fprintf(file, "\\r");
+        else if (*p == '\t') fprintf(file, "\\t");
+        else if (*p < 0x20) fprintf(file, "\\u%04x", *p);
+        else fputc(*p, file);
+    }
+    fputc('"', file);
+}
+
+// Parsed attribute columns that would shadow a built-in property get an attr_ prefix
+static bool is_reserved_property(const char* name) {
+    static const char* reserved[] = {
+        "feature_id", "dominant_color", "classification", "temporal_info", "unit_name", "wms_info", "polygon_count"
+    };
+    for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+        if (strcmp(name, reserved[i]) == 0) return true;
+    }
+    return false;
+}
+
 int write_geojson(const vectorization_result_t* result, const char* output_file) {
     if (!result || !output_file) return 1;
     
@@ -438,7 +835,9 @@ int write_geojson(const vectorization_result_t* result, const char* output_file)
                 feature->dominant_color.r, feature->dominant_color.g, feature->dominant_color.b);
         
         if (feature->lithology) {
-            fprintf(file, "        \"classification\": \"%s\",\n", feature->lithology);
+            fprintf(file, "        \"classification\": ");
+            write_json_string(file, feature->lithology);
+            fprintf(file, ",\n");
         }
         if (feature->age) {
             fprintf(file, "        \"temporal_info\": \"%s\",\n", feature->age);
@@ -447,15 +846,19 @@ int write_geojson(const vectorization_result_t* result, const char* output_file)
             fprintf(file, "        \"unit_name\": \"%s\",\n", feature->geological_unit);
         }
         if (feature->feature_info) {
-            // Escape quotes in feature info
-            fprintf(file, "        \"wms_info\": \"");
-            for (const char* p = feature->feature_info; *p; p++) {
-                if (*p == '"') fprintf(file, "\\\"");
-                else if (*p == '\n') fprintf(file, "\\n");
-                else if (*p == '\r') fprintf(file, "\\r");
-                else fprintf(file, "%c", *p);
-            }
-            fprintf(file, "\",\n");
+            fprintf(file, "        \"wms_info\": ");
+            write_json_string(file, feature->feature_info);
+            fprintf(file, ",\n");
+        }
+        for (int a = 0; a < feature->attribute_count; a++) {
+            const attribute_t* attribute = &feature->attributes[a];
+            char key[256];
+            snprintf(key, sizeof(key), "%s%s", is_reserved_property(attribute->name) ? "attr_" : "", attribute->name);
+            fprintf(file, "        ");
+            write_json_string(file, key);
+            fprintf(file, ": ");
+            write_json_string(file, attribute->value);
+            fprintf(file, ",\n");
         }
         
         fprintf(file, "        \"polygon_count\": %d\n", feature->polygon_count);
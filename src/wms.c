@@ -1,9 +1,12 @@
-#include "../include/wmspal.h"
-#include <curl/curl.h>
+#include "metrics.h"
+#include <ctype.h>
+#include <time.h>
 
 typedef struct {
     char* data;
     size_t size;
+    double max_age;         // From Cache-Control, -1 when absent
+    double expires_in;      // From Expires, -1 when absent
 } wms_response_t;
 
 static size_t write_callback(void* contents, size_t size, size_t nmemb, wms_response_t* response) {
@@ -23,6 +26,123 @@ static size_t write_callback(void* contents, size_t size, size_t nmemb, wms_resp
     return realsize;
 }
 
+// Cache-Control no-store/no-cache and max-age, and Expires, bound how long the
+// response cache may reuse a response
+static size_t header_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    wms_response_t* response = userdata;
+    size_t length = size * nitems;
+    char line[512];
+    snprintf(line, sizeof(line), "%.*s", (int)length, buffer);
+    for (char* p = line; *p; p++) *p = (char)tolower((unsigned char)*p);
+    
+    if (strncmp(line, "cache-control:", 14) == 0) {
+        const char* max_age = strstr(line, "max-age=");
+        if (strstr(line, "no-store") || strstr(line, "no-cache")) {
+            response->max_age = 0;
+        } else if (max_age) {
+            response->max_age = atof(max_age + 8);
+            if (response->max_age < 0) response->max_age = 0;
+        }
+    } else if (strncmp(line, "expires:", 8) == 0) {
+        // Parsed from the copy, as curl's buffer is not NUL-terminated. An
+        // unparsable or past date means already stale
+        time_t expires = curl_getdate(line + 8, NULL);
+        response->expires_in = expires == -1 ? 0 : difftime(expires, time(NULL));
+        if (response->expires_in < 0) response->expires_in = 0;
+    }
+    return length;
+}
+
+// Request timing split into curl's phases: name lookup, TCP connect, TLS
+// handshake, waiting for the first byte and receiving the body
+static void record_request(CURL* curl, double started, size_t bytes, bool ok) {
+    if (!metrics_active()) return;
+    double seconds = wmspal_now() - started;
+    metrics_span(METRIC_HTTP_REQUEST, started, seconds);
+    metrics_observe_request(seconds);
+    metrics_add(METRIC_REQUESTS, 1);
+    metrics_add(METRIC_BYTES_DOWNLOADED, bytes);
+    if (!ok) metrics_add(METRIC_REQUEST_ERRORS, 1);
+    
+    curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    
+    // Reused connections report zero for the phases they skipped
+    const struct {
+        metric_stage_t stage;
+        curl_off_t from, to;
+    } phases[] = {
+        {METRIC_DNS, 0, dns},
+        {METRIC_CONNECT, dns, connect},
+        {METRIC_TLS, connect, tls},
+        {METRIC_SERVER_WAIT, pretransfer, first_byte},
+        {METRIC_TRANSFER, first_byte, total}
+    };
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+        if (phases[i].to > phases[i].from) {
+            metrics_span(phases[i].stage, started + phases[i].from / 1e6, (phases[i].to - phases[i].from) / 1e6);
+        }
+    }
+}
+
+// GET a WMS URL into memory. Responses are served from and added to the
+// context's response cache, so repeated requests in a long-lived process
+// (daemon jobs, overlapping batch tiles) skip the network, for as long as
+// the response's cache headers and the context's TTL allow.
+int wms_http_get(wmspal_context_t* context, const char* url, char** data, size_t* size) {
+    if (context_cache_get(context, url, data, size)) {
+        metrics_add(METRIC_CACHE_HITS, 1);
+        return 0;
+    }
+    metrics_add(METRIC_CACHE_MISSES, 1);
+    
+    double started = metrics_begin();
+    wms_response_t response = {NULL, 0, -1, -1};
+    CURL* curl = context_acquire_curl(context);
+    if (!curl) {
+        fprintf(stderr, "Failed to initialize curl\n");
+        return 1;
+    }
+    
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+    
+    CURLcode res = curl_easy_perform(curl);
+    record_request(curl, started, response.size, res == CURLE_OK);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        context_release_curl(context, curl);
+        if (response.data) free(response.data);
+        return 1;
+    }
+    
+    long response_code;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    context_release_curl(context, curl);
+    
+    if (response_code != 200) {
+        metrics_add(METRIC_REQUEST_ERRORS, 1);
+        fprintf(stderr, "HTTP error: %ld\n", response_code);
+        if (response.data) free(response.data);
+        return 1;
+    }
+    if (!response.data) response.data = calloc(1, 1);
+    
+    context_cache_put(context, url, response.data, response.size,
+                      response.max_age >= 0 ? response.max_age : response.expires_in);
+    *data = response.data;
+    *size = response.size;
+    return 0;
+}
+
 static void parse_capabilities_simple(const char* xml) {
     printf("\n--- WMS Service Information ---\n");
     
@@ -105,8 +225,6 @@ static void parse_capabilities_simple(const char* xml) {
 }
 
 int get_wms_capabilities(const wms_config_t* config) {
-    CURL* curl;
-    CURLcode res;
     wms_response_t response = {0};
     
     char url[2048];
@@ -114,35 +232,8 @@ int get_wms_capabilities(const wms_config_t* config) {
         "%s?SERVICE=WMS&VERSION=1.3.0&REQUEST=GetCapabilities",
         config->url);
     
-    curl = curl_easy_init();
-    if (!curl) {
-        fprintf(stderr, "Failed to initialize curl\n");
-        return 1;
-    }
-    
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "WMSPal/1.0");
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    
     printf("Fetching capabilities: %s\n", url);
-    res = curl_easy_perform(curl);
-    
-    if (res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        curl_easy_cleanup(curl);
-        if (response.data) free(response.data);
-        return 1;
-    }
-    
-    long response_code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-    
-    if (response_code != 200) {
-        fprintf(stderr, "HTTP error: %ld\n", response_code);
-        curl_easy_cleanup(curl);
-        if (response.data) free(response.data);
+    if (wms_http_get(config->context, url, &response.data, &response.size) != 0) {
         return 1;
     }
     
@@ -153,59 +244,55 @@ int get_wms_capabilities(const wms_config_t* config) {
         parse_capabilities_simple(response.data);
     }
     
-    curl_easy_cleanup(curl);
-    if (response.data) free(response.data);
+    free(response.data);
     
     return 0;
 }
 
+// Percent-encode a query parameter value
+void url_escape(const char* text, char* out, size_t out_size) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t n = 0;
+    for (const unsigned char* p = (const unsigned char*)text; *p && n + 4 < out_size; p++) {
+        if (isalnum(*p) || strchr("-._~/", *p)) {
+            out[n++] = (char)*p;
+        } else {
+            out[n++] = '%';
+            out[n++] = hex[*p >> 4];
+            out[n++] = hex[*p & 15];
+        }
+    }
+    out[n] = '\0';
+}
+
 int download_wms_tile(const wms_config_t* config) {
-    CURL* curl;
-    CURLcode res;
     wms_response_t response = {0};
     
+    // Jobs that did not name a format take the server's preferred one
+    char chosen[128], format[256];
+    if (!config->format) choose_image_format(config, chosen, sizeof(chosen));
+    url_escape(config->format ? config->format : chosen, format, sizeof(format));
+    
     char url[2048];
     snprintf(url, sizeof(url), 
         "%s?SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&LAYERS=%s&STYLES=&BBOX=%s&SRS=%s&WIDTH=%d&HEIGHT=%d&FORMAT=%s",
-        config->url, config->layer, config->bbox, config->srs, config->width, config->height, config->format);
-    
-    curl = curl_easy_init();
-    if (!curl) {
-        fprintf(stderr, "Failed to initialize curl\n");
-        return 1;
+        config->url, config->layer, config->bbox, config->srs, config->width, config->height, format);
+    if (config->time) {
+        char time[256];
+        url_escape(config->time, time, sizeof(time));
+        size_t used = strlen(url);
+        snprintf(url + used, sizeof(url) - used, "&TIME=%s", time);
     }
     
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "WMSPal/1.0");
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    
     printf("Downloading: %s\n", url);
-    res = curl_easy_perform(curl);
-    
-    if (res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        curl_easy_cleanup(curl);
-        if (response.data) free(response.data);
-        return 1;
-    }
-    
-    long response_code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-    
-    if (response_code != 200) {
-        fprintf(stderr, "HTTP error: %ld\n", response_code);
-        curl_easy_cleanup(curl);
-        if (response.data) free(response.data);
+    if (wms_http_get(config->context, url, &response.data, &response.size) != 0) {
         return 1;
     }
     
     FILE* file = fopen(config->output_file, "wb");
     if (!file) {
         fprintf(stderr, "Failed to open output file: %s\n", config->output_file);
-        curl_easy_cleanup(curl);
-        if (response.data) free(response.data);
+        free(response.data);
         return 1;
     }
     
@@ -214,8 +301,7 @@ int download_wms_tile(const wms_config_t* config) {
     
     printf("Downloaded %zu bytes to %s\n", response.size, config->output_file);
     
-    curl_easy_cleanup(curl);
-    if (response.data) free(response.data);
+    free(response.data);
     
     return 0;
 }
\ No newline at end of file
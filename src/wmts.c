@@ -0,0 +1,540 @@
+#include "metrics.h"
+#include <ctype.h>
+#include <math.h>
+
+// WMTS backend. Pre-rendered tiles from a cache come back in milliseconds
+// where a dynamic GetMap render takes hundreds, so for a WMTS endpoint the
+// layer's TileMatrixSet is read from the capabilities, the matrix matching
+// the requested resolution is chosen, and the cached tiles covering the bbox
+// are fetched and decoded concurrently. The mosaic, cropped to the bbox on
+// the matrix's pixel grid, is written where the GetMap image would have gone,
+// so georeferencing and vectorization consume it unchanged.
+
+#define WMTS_FETCH_THREADS 8
+#define WMTS_MAX_TILES 4096
+#define WMTS_MAX_LINKS 16
+#define WMTS_ID_SIZE 128
+#define WMTS_TEMPLATE_SIZE 1024
+
+typedef struct {
+    char id[WMTS_ID_SIZE];
+    double scale;                   // Scale denominator
+    double left, top;               // TopLeftCorner, x then y
+    int tile_width, tile_height;
+    int matrix_width, matrix_height;
+} tile_matrix_t;
+
+typedef struct {
+    char id[WMTS_ID_SIZE];
+    char crs[WMTS_ID_SIZE];         // Normalised to EPSG:n or CRS:84
+    tile_matrix_t* matrices;
+    int matrix_count;
+} tile_matrix_set_t;
+
+typedef struct {
+    bool found;
+    char style[WMTS_ID_SIZE];
+    char format[WMTS_ID_SIZE];      // PNG format to request
+    int format_rank;
+    char template_url[WMTS_TEMPLATE_SIZE];  // RESTful ResourceURL for the format, empty for KVP GetTile
+    char links[WMTS_MAX_LINKS][WMTS_ID_SIZE];   // Matrix sets the layer is published in
+    int link_count;
+    tile_matrix_set_t* sets;
+    int set_count;
+} wmts_capabilities_t;
+
+// Tiles covering the bbox, fetched by a pool of workers
+typedef struct {
+    const wms_config_t* config;
+    const wmts_capabilities_t* capabilities;
+    const tile_matrix_set_t* set;
+    const tile_matrix_t* matrix;
+    int col0, row0, cols, rows;
+    image_t** tiles;
+    wmspal_mutex_t lock;
+    int next;
+    int failed;
+} wmts_fetch_t;
+
+// A URL names WMTS when a path segment is "wmts" (GeoWebCache's
+// /gwc/service/wmts, ArcGIS's /MapServer/WMTS/1.0.0/...) or the query asks for
+// SERVICE=WMTS; a host or layer that merely contains the letters does not
+bool is_wmts_endpoint(const wms_config_t* config) {
+    if (config->wmts) return true;
+    const char* url = config->url;
+    if (!url) return false;
+    const char* scheme = strstr(url, "://");
+    const char* p = scheme ? scheme + 3 : url;
+    p += strcspn(p, "/?#");
+    
+    while (*p == '/') {
+        p++;
+        size_t length = strcspn(p, "/?#");
+        if (length == 4 && strncasecmp(p, "wmts", 4) == 0) return true;
+        p += length;
+    }
+    
+    while (*p == '?' || *p == '&') {
+        p++;
+        size_t length = strcspn(p, "&#");
+        if (length == 12 && strncasecmp(p, "service=wmts", 12) == 0) return true;
+        p += length;
+    }
+    return false;
+}
+
+static void copy_text(char* out, size_t out_size, const char* text, size_t len) {
+    if (len >= out_size) len = out_size - 1;
+    memcpy(out, text, len);
+    out[len] = '\0';
+}
+
+// Value of attribute name inside a start tag [p, gt); false when absent or
+// too long for out, since a cut identifier or URL template would be wrong
+static bool tag_attribute_text(const char* p, const char* gt, const char* name, char* out, size_t out_size) {
+    size_t name_len = strlen(name);
+    for (const char* q = p; q + name_len + 2 < gt; q++) {
+        if (isspace((unsigned char)q[-1]) && strncmp(q, name, name_len) == 0 && q[name_len] == '=') {
+            char quote = q[name_len + 1];
+            const char* value = q + name_len + 2;
+            const char* close = memchr(value, quote, gt - value);
+            if (!close || (size_t)(close - value) >= out_size) return false;
+            copy_text(out, out_size, value, close - value);
+            return true;
+        }
+    }
+    return false;
+}
+
+// "urn:ogc:def:crs:EPSG::3857", "EPSG:900913" -> "EPSG:3857"; OGC CRS84 -> "CRS:84"
+static void normalise_crs(const char* text, size_t len, char* out, size_t out_size) {
+    char crs[WMTS_ID_SIZE];
+    copy_text(crs, sizeof(crs), text, len);
+    const char* code = strrchr(crs, ':');
+    if (strstr(crs, "CRS84")) {
+        snprintf(out, out_size, "CRS:84");
+    } else if (strstr(crs, "EPSG") && code) {
+        snprintf(out, out_size, "EPSG:%s", strcmp(code + 1, "900913") == 0 ? "3857" : code + 1);
+    } else {
+        snprintf(out, out_size, "%s", crs);
+    }
+}
+
+// The requested format, else paletted PNG first as for GetMap; formats that
+// cannot be decoded rank 0
+static int format_rank(const wms_config_t* config, const char* text, size_t len) {
+    bool png = len >= 9 && strncasecmp(text, "image/png", 9) == 0;
+    if (config->format) return png && len == strlen(config->format) && strncasecmp(text, config->format, len) == 0 ? 3 : 0;
+    if (format_is_paletted_png(text, len)) return 2;
+    return png ? 1 : 0;
+}
+
+static void parse_wmts_capabilities(const char* xml, size_t size, const wms_config_t* config,
+                                    wmts_capabilities_t* capabilities) {
+    bool in_layer = false, layer_named = false, target = false;
+    bool in_style = false, default_style = false;
+    bool in_set = false, set_named = false, in_matrix = false;
+    char resource_formats[8][WMTS_ID_SIZE], resource_templates[8][WMTS_TEMPLATE_SIZE];
+    int resource_count = 0;
+    const char* p = xml;
+    const char* end = xml + size;
+    
+    while (p < end) {
+        const char* lt = memchr(p, '<', end - p);
+        if (!lt || lt + 1 >= end) break;
+        p = lt + 1;
+        
+        if (*p == '!' || *p == '?') {
+            const char* close = end - p >= 3 && strncmp(p, "!--", 3) == 0 ? strstr(p, "-->") : memchr(p, '>', end - p);
+            if (!close) break;
+            p = close + 1;
+            continue;
+        }
+        
+        bool closing = *p == '/';
+        if (closing) p++;
+        const char* name = p;
+        while (p < end && !isspace((unsigned char)*p) && *p != '>' && *p != '/') p++;
+        size_t name_len = p - name;
+        const char* gt = memchr(p, '>', end - p);
+        if (!gt) break;
+        bool empty = gt[-1] == '/';
+        tile_matrix_set_t* set = in_set ? &capabilities->sets[capabilities->set_count - 1] : NULL;
+        tile_matrix_t* matrix = in_matrix ? &set->matrices[set->matrix_count - 1] : NULL;
+        size_t len = 0;
+        const char* text = closing || empty ? NULL : xml_element_text(gt, end, &len);
+        
+        if (xml_tag_is(name, name_len, "Layer")) {
+            if (closing && target) capabilities->found = true;
+            in_layer = !closing;
+            layer_named = target = false;
+        } else if (in_layer && xml_tag_is(name, name_len, "Style")) {
+            char value[16] = "";
+            in_style = !closing;
+            default_style = !closing && tag_attribute_text(p, gt, "isDefault", value, sizeof(value)) &&
+                            strcmp(value, "true") == 0;
+        } else if (xml_tag_is(name, name_len, "TileMatrixSet")) {
+            if (in_layer) {
+                // Inside TileMatrixSetLink the element just names a set
+                if (text && target && capabilities->link_count < WMTS_MAX_LINKS) {
+                    copy_text(capabilities->links[capabilities->link_count++], WMTS_ID_SIZE, text, len);
+                }
+            } else if (closing) {
+                in_set = in_matrix = false;
+            } else if (!empty) {
+                capabilities->sets = realloc(capabilities->sets, (capabilities->set_count + 1) * sizeof(tile_matrix_set_t));
+                memset(&capabilities->sets[capabilities->set_count++], 0, sizeof(tile_matrix_set_t));
+                in_set = true;
+                set_named = false;
+            }
+        } else if (in_set && xml_tag_is(name, name_len, "TileMatrix")) {
+            if (closing) {
+                in_matrix = false;
+            } else if (!empty) {
+                set->matrices = realloc(set->matrices, (set->matrix_count + 1) * sizeof(tile_matrix_t));
+                memset(&set->matrices[set->matrix_count++], 0, sizeof(tile_matrix_t));
+                in_matrix = true;
+            }
+        } else if (text && xml_tag_is(name, name_len, "Identifier")) {
+            if (in_layer && !in_style && !layer_named) {
+                layer_named = true;
+                target = len == strlen(config->layer) && strncmp(text, config->layer, len) == 0;
+            } else if (in_layer && in_style && target && (default_style || !capabilities->style[0])) {
+                copy_text(capabilities->style, WMTS_ID_SIZE, text, len);
+            } else if (matrix) {
+                copy_text(matrix->id, WMTS_ID_SIZE, text, len);
+            } else if (set && !set_named) {
+                copy_text(set->id, WMTS_ID_SIZE, text, len);
+                set_named = true;
+            }
+        } else if (text && target && xml_tag_is(name, name_len, "Format")) {
+            int rank = format_rank(config, text, len);
+            if (rank > capabilities->format_rank) {
+                capabilities->format_rank = rank;
+                copy_text(capabilities->format, WMTS_ID_SIZE, text, len);
+            }
+        } else if (!closing && target && xml_tag_is(name, name_len, "ResourceURL") && resource_count < 8) {
+            char type[32];
+            if (tag_attribute_text(p, gt, "resourceType", type, sizeof(type)) && strcmp(type, "tile") == 0 &&
+                tag_attribute_text(p, gt, "format", resource_formats[resource_count], WMTS_ID_SIZE) &&
+                tag_attribute_text(p, gt, "template", resource_templates[resource_count], WMTS_TEMPLATE_SIZE)) {
+                resource_count++;
+            }
+        } else if (text && set && !matrix && xml_tag_is(name, name_len, "SupportedCRS")) {
+            normalise_crs(text, len, set->crs, WMTS_ID_SIZE);
+        } else if (text && matrix) {
+            if (xml_tag_is(name, name_len, "ScaleDenominator")) {
+                matrix->scale = atof(text);
+            } else if (xml_tag_is(name, name_len, "TopLeftCorner")) {
+                sscanf(text, "%lf %lf", &matrix->left, &matrix->top);
+            } else if (xml_tag_is(name, name_len, "TileWidth")) {
+                matrix->tile_width = atoi(text);
+            } else if (xml_tag_is(name, name_len, "TileHeight")) {
+                matrix->tile_height = atoi(text);
+            } else if (xml_tag_is(name, name_len, "MatrixWidth")) {
+                matrix->matrix_width = atoi(text);
+            } else if (xml_tag_is(name, name_len, "MatrixHeight")) {
+                matrix->matrix_height = atoi(text);
+            }
+        }
+        p = gt + 1;
+    }
+    
+    for (int i = 0; i < resource_count; i++) {
+        if (strcasecmp(resource_formats[i], capabilities->format) == 0) {
+            memcpy(capabilities->template_url, resource_templates[i], WMTS_TEMPLATE_SIZE);
+        }
+    }
+    
+    // EPSG geographic CRSs list their corner latitude first
+    for (int s = 0; s < capabilities->set_count; s++) {
+        tile_matrix_set_t* set = &capabilities->sets[s];
+        if (!srs_is_geographic(set->crs) || strcmp(set->crs, "CRS:84") == 0) continue;
+        for (int m = 0; m < set->matrix_count; m++) {
+            double latitude = set->matrices[m].left;
+            set->matrices[m].left = set->matrices[m].top;
+            set->matrices[m].top = latitude;
+        }
+    }
+}
+
+static void free_wmts_capabilities(wmts_capabilities_t* capabilities) {
+    for (int s = 0; s < capabilities->set_count; s++) free(capabilities->sets[s].matrices);
+    free(capabilities->sets);
+}
+
+// The layer's matrix set in the job's SRS
+static const tile_matrix_set_t* find_matrix_set(const wmts_capabilities_t* capabilities, const char* srs) {
+    char wanted[WMTS_ID_SIZE];
+    normalise_crs(srs, strlen(srs), wanted, sizeof(wanted));
+    for (int l = 0; l < capabilities->link_count; l++) {
+        for (int s = 0; s < capabilities->set_count; s++) {
+            const tile_matrix_set_t* set = &capabilities->sets[s];
+            if (strcmp(set->id, capabilities->links[l]) == 0 && strcasecmp(set->crs, wanted) == 0) return set;
+        }
+    }
+    return NULL;
+}
+
+// Coarsest matrix at least as fine as the target resolution, else the finest
+static const tile_matrix_t* choose_matrix(const tile_matrix_set_t* set, double unit, double target) {
+    const tile_matrix_t* best = NULL;
+    const tile_matrix_t* finest = NULL;
+    for (int m = 0; m < set->matrix_count; m++) {
+        const tile_matrix_t* matrix = &set->matrices[m];
+        if (matrix->scale <= 0 || matrix->tile_width <= 0 || matrix->tile_height <= 0) continue;
+        double resolution = matrix->scale * OGC_PIXEL_SIZE / unit;
+        if (resolution <= target * 1.001 && (!best || matrix->scale > best->scale)) best = matrix;
+        if (!finest || matrix->scale < finest->scale) finest = matrix;
+    }
+    return best ? best : finest;
+}
+
+// Replace each {name} in template with its value
+static void expand_template(const char* template, const char* const* names, const char* const* values, int count,
+                           char* out, size_t out_size) {
+    size_t n = 0;
+    for (const char* p = template; *p && n + 1 < out_size; ) {
+        bool replaced = false;
+        for (int i = 0; i < count && *p == '{'; i++) {
+            size_t name_len = strlen(names[i]);
+            if (strncasecmp(p + 1, names[i], name_len) == 0 && p[name_len + 1] == '}') {
+                n += snprintf(out + n, out_size - n, "%s", values[i]);
+                if (n >= out_size) n = out_size - 1;
+                p += name_len + 2;
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced) out[n++] = *p++;
+    }
+    out[n] = '\0';
+}
+
+static void tile_url(const wmts_fetch_t* fetch, int row, int col, char* url, size_t url_size) {
+    const wmts_capabilities_t* capabilities = fetch->capabilities;
+    char row_text[16], col_text[16];
+    snprintf(row_text, sizeof(row_text), "%d", row);
+    snprintf(col_text, sizeof(col_text), "%d", col);
+    if (capabilities->template_url[0]) {
+        const char* names[] = {"TileMatrixSet", "TileMatrix", "TileRow", "TileCol", "Style"};
+        const char* values[] = {fetch->set->id, fetch->matrix->id, row_text, col_text, capabilities->style};
+        expand_template(capabilities->template_url, names, values, 5, url, url_size);
+        return;
+    }
+    
+    char format[256];
+    url_escape(capabilities->format, format, sizeof(format));
+    snprintf(url, url_size,
+        "%s?SERVICE=WMTS&REQUEST=GetTile&VERSION=1.0.0&LAYER=%s&STYLE=%s&TILEMATRIXSET=%s&TILEMATRIX=%s"
+        "&TILEROW=%d&TILECOL=%d&FORMAT=%s",
+        fetch->config->url, fetch->config->layer, capabilities->style, fetch->set->id, fetch->matrix->id,
+        row, col, format);
+}
+
+static void* fetch_tiles(void* arg) {
+    wmts_fetch_t* fetch = arg;
+    int total = fetch->cols * fetch->rows;
+    
+    for (;;) {
+        wmspal_mutex_lock(&fetch->lock);
+        int index = fetch->failed == 0 && fetch->next < total ? fetch->next++ : -1;
+        wmspal_mutex_unlock(&fetch->lock);
+        if (index < 0) break;
+        
+        int row = fetch->row0 + index / fetch->cols;
+        int col = fetch->col0 + index % fetch->cols;
+        char url[2048];
+        tile_url(fetch, row, col, url, sizeof(url));
+        
+        char* data;
+        size_t size;
+        image_t* img = NULL;
+        if (wms_http_get(fetch->config->context, url, &data, &size) == 0) {
+            double started = metrics_begin();
+            img = decode_png((const unsigned char*)data, size);
+            metrics_end(METRIC_DECODE, started);
+            free(data);
+        }
+        if (img && (img->width != fetch->matrix->tile_width || img->height != fetch->matrix->tile_height)) {
+            fprintf(stderr, "WMTS tile row %d, col %d is %dx%d, expected %dx%d\n", row, col,
+                    img->width, img->height, fetch->matrix->tile_width, fetch->matrix->tile_height);
+            free_image(img);
+            img = NULL;
+        }
+        if (!img) {
+            fprintf(stderr, "Failed to fetch WMTS tile row %d, col %d\n", row, col);
+            wmspal_mutex_lock(&fetch->lock);
+            fetch->failed++;
+            wmspal_mutex_unlock(&fetch->lock);
+            break;
+        }
+        fetch->tiles[index] = img;
+    }
+    return NULL;
+}
+
+// Copy the fetched tiles into the crop window [x0, x0 + width) x [y0, y0 + height)
+// of the tile block. The mosaic stays paletted only if every tile has the same palette.
+static image_t* assemble_mosaic(const wmts_fetch_t* fetch, int x0, int y0, int width, int height) {
+    int total = fetch->cols * fetch->rows;
+    const image_t* first = fetch->tiles[0];
+    bool paletted = first->palette != NULL;
+    for (int i = 1; i < total && paletted; i++) {
+        const image_t* tile = fetch->tiles[i];
+        paletted = tile->palette && tile->palette_size == first->palette_size &&
+                   memcmp(tile->palette, first->palette, first->palette_size * sizeof(color_t)) == 0;
+    }
+    
+    image_t* mosaic = calloc(1, sizeof(image_t));
+    if (!mosaic) return NULL;
+    mosaic->width = width;
+    mosaic->height = height;
+    mosaic->channels = paletted ? 1 : 3;
+    mosaic->data = raster_alloc((size_t)width * height * mosaic->channels);
+    if (paletted) {
+        mosaic->palette = malloc(first->palette_size * sizeof(color_t));
+        if (mosaic->palette) memcpy(mosaic->palette, first->palette, first->palette_size * sizeof(color_t));
+        mosaic->palette_size = first->palette_size;
+    }
+    if (!mosaic->data || (paletted && !mosaic->palette)) {
+        free_image(mosaic);
+        return NULL;
+    }
+    
+    int tile_width = fetch->matrix->tile_width, tile_height = fetch->matrix->tile_height;
+    for (int i = 0; i < total; i++) {
+        const image_t* tile = fetch->tiles[i];
+        int ox = (i % fetch->cols) * tile_width - x0;
+        int oy = (i / fetch->cols) * tile_height - y0;
+        int from_x = ox < 0 ? -ox : 0, to_x = ox + tile_width > width ? width - ox : tile_width;
+        int from_y = oy < 0 ? -oy : 0, to_y = oy + tile_height > height ? height - oy : tile_height;
+        
+        for (int y = from_y; y < to_y; y++) {
+            unsigned char* out = mosaic->data + ((size_t)(oy + y) * width + ox + from_x) * mosaic->channels;
+            const unsigned char* in = tile->data + ((size_t)y * tile_width + from_x) * tile->channels;
+            int count = to_x - from_x;
+            if (count <= 0) break;
+            if (tile->channels == mosaic->channels) {
+                memcpy(out, in, (size_t)count * mosaic->channels);
+            } else {
+                // Paletted tile into an RGB mosaic
+                for (int x = 0; x < count; x++) {
+                    color_t c = in[x] < tile->palette_size ? tile->palette[in[x]] : (color_t){0, 0, 0};
+                    out[x * 3] = c.r;
+                    out[x * 3 + 1] = c.g;
+                    out[x * 3 + 2] = c.b;
+                }
+            }
+        }
+    }
+    return mosaic;
+}
+
+int download_wmts_mosaic(wms_config_t* config, char* bbox, size_t bbox_size) {
+    double minx, miny, maxx, maxy;
+    if (sscanf(config->bbox, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4 || maxx <= minx || maxy <= miny) {
+        fprintf(stderr, "Invalid bbox format\n");
+        return 1;
+    }
+    
+    char url[2048];
+    snprintf(url, sizeof(url), "%s?SERVICE=WMTS&REQUEST=GetCapabilities&VERSION=1.0.0", config->url);
+    printf("Fetching WMTS capabilities: %s\n", url);
+    char* xml;
+    size_t size;
+    if (wms_http_get(config->context, url, &xml, &size) != 0) return 1;
+    wmts_capabilities_t capabilities = {0};
+    parse_wmts_capabilities(xml, size, config, &capabilities);
+    free(xml);
+    
+    const tile_matrix_set_t* set = capabilities.found ? find_matrix_set(&capabilities, config->srs) : NULL;
+    double unit = srs_is_geographic(config->srs) ? METRES_PER_DEGREE : 1.0;
+    double target = config->resolution > 0 ? config->resolution : (maxx - minx) / config->width;
+    const tile_matrix_t* matrix = set ? choose_matrix(set, unit, target) : NULL;
+    if (!capabilities.found || !capabilities.format_rank || !matrix) {
+        if (!capabilities.found) fprintf(stderr, "Layer %s is not listed in the WMTS capabilities\n", config->layer);
+        else if (!capabilities.format_rank) fprintf(stderr, "Layer %s offers no PNG tiles%s%s\n", config->layer,
+                                                    config->format ? " as " : "", config->format ? config->format : "");
+        else fprintf(stderr, "Layer %s has no tile matrix set in %s\n", config->layer, config->srs);
+        free_wmts_capabilities(&capabilities);
+        return 1;
+    }
+    
+    // Tiles covering the bbox, clipped to the matrix
+    double resolution = matrix->scale * OGC_PIXEL_SIZE / unit;
+    double span_x = matrix->tile_width * resolution, span_y = matrix->tile_height * resolution;
+    int col0 = (int)floor((minx - matrix->left) / span_x);
+    int col1 = (int)ceil((maxx - matrix->left) / span_x) - 1;
+    int row0 = (int)floor((matrix->top - maxy) / span_y);
+    int row1 = (int)ceil((matrix->top - miny) / span_y) - 1;
+    if (col0 < 0) col0 = 0;
+    if (row0 < 0) row0 = 0;
+    if (matrix->matrix_width > 0 && col1 >= matrix->matrix_width) col1 = matrix->matrix_width - 1;
+    if (matrix->matrix_height > 0 && row1 >= matrix->matrix_height) row1 = matrix->matrix_height - 1;
+    int cols = col1 - col0 + 1, rows = row1 - row0 + 1;
+    if (cols <= 0 || rows <= 0 || (long)cols * rows > WMTS_MAX_TILES) {
+        if (cols <= 0 || rows <= 0) fprintf(stderr, "The bbox lies outside tile matrix %s\n", matrix->id);
+        else fprintf(stderr, "Tile matrix %s needs %dx%d tiles for this bbox, more than %d\n",
+                     matrix->id, cols, rows, WMTS_MAX_TILES);
+        free_wmts_capabilities(&capabilities);
+        return 1;
+    }
+    
+    // Crop window on the matrix pixel grid; the bbox snaps to whole pixels
+    double origin_x = matrix->left + col0 * span_x, origin_y = matrix->top - row0 * span_y;
+    int x0 = (int)lround((minx - origin_x) / resolution), x1 = (int)lround((maxx - origin_x) / resolution);
+    int y0 = (int)lround((origin_y - maxy) / resolution), y1 = (int)lround((origin_y - miny) / resolution);
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > cols * matrix->tile_width) x1 = cols * matrix->tile_width;
+    if (y1 > rows * matrix->tile_height) y1 = rows * matrix->tile_height;
+    if (x1 <= x0 || y1 <= y0) {
+        fprintf(stderr, "The bbox is smaller than a pixel of tile matrix %s\n", matrix->id);
+        free_wmts_capabilities(&capabilities);
+        return 1;
+    }
+    
+    printf("WMTS: %s matrix %s (%g units/pixel), %dx%d tiles of %dx%d, format %s\n", set->id, matrix->id,
+           resolution, cols, rows, matrix->tile_width, matrix->tile_height, capabilities.format);
+    
+    wmts_fetch_t fetch = {
+        .config = config, .capabilities = &capabilities, .set = set, .matrix = matrix,
+        .col0 = col0, .row0 = row0, .cols = cols, .rows = rows
+    };
+    fetch.tiles = calloc((size_t)cols * rows, sizeof(image_t*));
+    wmspal_mutex_init(&fetch.lock);
+    double started = wmspal_now();
+    int thread_count = cols * rows < WMTS_FETCH_THREADS ? cols * rows : WMTS_FETCH_THREADS;
+    wmspal_thread_t threads[WMTS_FETCH_THREADS];
+    int started_count = 0;
+    for (int t = 0; t < thread_count && fetch.tiles; t++) {
+        if (wmspal_thread_start(&threads[started_count], fetch_tiles, &fetch) == 0) started_count++;
+    }
+    if (started_count == 0 && fetch.tiles) fetch_tiles(&fetch);
+    for (int t = 0; t < started_count; t++) wmspal_thread_join(threads[t]);
+    wmspal_mutex_destroy(&fetch.lock);
+    
+    int status = !fetch.tiles || fetch.failed != 0;
+    image_t* mosaic = status == 0 ? assemble_mosaic(&fetch, x0, y0, x1 - x0, y1 - y0) : NULL;
+    if (mosaic) {
+        printf("Fetched %d tiles in %.0f ms, %dx%d mosaic\n", cols * rows, (wmspal_now() - started) * 1000,
+               mosaic->width, mosaic->height);
+        status = write_png(mosaic, config->output_file);
+    } else {
+        status = 1;
+    }
+    free_image(mosaic);
+    for (int i = 0; fetch.tiles && i < cols * rows; i++) free_image(fetch.tiles[i]);
+    free(fetch.tiles);
+    free_wmts_capabilities(&capabilities);
+    if (status != 0) return 1;
+    
+    snprintf(bbox, bbox_size, "%.10f,%.10f,%.10f,%.10f", origin_x + x0 * resolution, origin_y - y1 * resolution,
+             origin_x + x1 * resolution, origin_y - y0 * resolution);
+    config->bbox = bbox;
+    config->width = x1 - x0;
+    config->height = y1 - y0;
+    printf("Wrote %s covering %s\n", config->output_file, bbox);
+    return 0;
+}
\ No newline at end of file